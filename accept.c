@@ -0,0 +1,89 @@
+// LE Filter Accept List management, see accept.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "accept.h"
+#include "hcicmd.h"
+
+static int ns_accept_has(const struct ns_accept *a, const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+    uint32_t i;
+
+    for (i = 0; i < a->count; i++) {
+        if (a->entries[i].bdaddr_type == bdaddr_type && !memcmp(&a->entries[i].bdaddr, bdaddr, sizeof(*bdaddr))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void ns_accept_add(struct ns_accept *a, const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+    if (!ns_accept_has(a, bdaddr, bdaddr_type)) {
+        a->entries[a->count].bdaddr_type = bdaddr_type;
+        bacpy(&a->entries[a->count].bdaddr, bdaddr);
+        a->count++;
+    }
+}
+
+int ns_accept_init(struct ns_accept *a, const struct ns_filter *f)
+{
+    bdaddr_t *addrs;
+    int n, i;
+
+    memset(a, 0, sizeof(*a));
+    n = ns_filter_addresses(f, NULL, 0);
+    if (n <= 0) {
+        return 0;
+    }
+
+    addrs = calloc(n, sizeof(*addrs));
+    a->entries = calloc(2 * n, sizeof(*a->entries));
+    if (!addrs || !a->entries) {
+        free(addrs);
+        ns_accept_free(a);
+        return -1;
+    }
+    ns_filter_addresses(f, addrs, n);
+
+    /* Random static addresses (top bits 11) are also entered as random */
+    for (i = 0; i < n; i++) {
+        ns_accept_add(a, &addrs[i], LE_PUBLIC_ADDRESS);
+        if ((addrs[i].b[5] & 0xC0) == 0xC0) {
+            ns_accept_add(a, &addrs[i], LE_RANDOM_ADDRESS);
+        }
+    }
+
+    free(addrs);
+    return (int)a->count;
+}
+
+void ns_accept_free(struct ns_accept *a)
+{
+    free(a->entries);
+    memset(a, 0, sizeof(*a));
+}
+
+int ns_accept_queue(const struct ns_accept *a, struct ns_hci_queue *q, uint32_t first, uint32_t count,
+                    uint8_t tag, int timeout_ms, uint64_t now_ms)
+{
+    le_add_device_to_white_list_cp cp;
+    uint32_t i;
+
+    if (ns_hci_queue_send(q, OGF_LE_CTL, OCF_LE_CLEAR_WHITE_LIST, NULL, 0, tag, timeout_ms, now_ms) < 0) {
+        return -1;
+    }
+
+    for (i = first; i < first + count && i < a->count; i++) {
+        cp.bdaddr_type = a->entries[i].bdaddr_type;
+        bacpy(&cp.bdaddr, &a->entries[i].bdaddr);
+        if (ns_hci_queue_send(q, OGF_LE_CTL, OCF_LE_ADD_DEVICE_TO_WHITE_LIST, &cp,
+                              LE_ADD_DEVICE_TO_WHITE_LIST_CP_SIZE, tag, timeout_ms, now_ms) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef __NS_ACCEPT_H__
+#define __NS_ACCEPT_H__
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "filter.h"
+#include "hcicmd.h"
+
+/* Filtering in the controller with the LE Filter Accept List.
+ *
+ * When the filter only accepts reports from known addresses (see
+ * ns_filter_addresses()), they are written to the controller's accept
+ * list and scanning uses filter policy 0x01, so other advertisers never
+ * cause an HCI event or a host wakeup. The host filter still runs on
+ * what the controller lets through.
+ *
+ * The filter does not say whether an address is public or random. Only
+ * a random static address has both top bits set, so those are entered
+ * with both types and all other addresses as public.
+ *
+ * Controllers hold few entries, often 8 to 128. A longer list is split
+ * into groups the size of the controller's list that the scanner swaps
+ * in turn, or scanning falls back to accepting everything and filtering
+ * on the host, see ns_accept_policy. */
+
+#define NS_SCAN_FILTER_ACCEPT_ALL       0x00
+#define NS_SCAN_FILTER_ACCEPT_LIST      0x01
+
+#define NS_ACCEPT_ROTATE_MS_DEFAULT     5000
+
+enum ns_accept_policy {
+    NS_ACCEPT_OFF,              /* never use the accept list */
+    NS_ACCEPT_FIT,              /* only when the whole list fits */
+    NS_ACCEPT_ROTATE,           /* swap groups of a list that does not fit */
+};
+
+struct ns_accept_entry {
+    uint8_t bdaddr_type;        /* LE_PUBLIC_ADDRESS or LE_RANDOM_ADDRESS */
+    bdaddr_t bdaddr;
+};
+
+struct ns_accept {
+    struct ns_accept_entry *entries;
+    uint32_t count;
+};
+
+/* Entries for the addresses of filter f. Returns their number, 0 if the
+ * filter accepts any address, -1 if they cannot be allocated. */
+int ns_accept_init(struct ns_accept *a, const struct ns_filter *f);
+void ns_accept_free(struct ns_accept *a);
+
+/* Replace the controller's list with count entries from first, on the
+ * command queue of the adapter: the clear and every add are issued at
+ * once, each completes with tag. Scanning must be disabled. Returns 0, or
+ * -1 with errno set if a command could not be written. */
+int ns_accept_queue(const struct ns_accept *a, struct ns_hci_queue *q, uint32_t first, uint32_t count,
+                    uint8_t tag, int timeout_ms, uint64_t now_ms);
+
+#endif //__NS_ACCEPT_H__
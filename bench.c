@@ -0,0 +1,451 @@
+// Benchmark for the advertising report parsing path.
+//
+// Compile with:
+//   cc -O2 bench.c bleapi.c devtab.c suppress.c output.c extadv.c filter.c metrics.c match.c decode.c sightlog.c rpa.c -pthread -lbluetooth -ldl -o bench
+// Run with:
+//   ./bench [-j] [-t min_ms] [-c case]
+//
+// Every case builds a synthetic LE Meta advertising event and times
+// BTM_CheckAdvData, esp_ble_resolve_adv_data, the single-pass AD index,
+// the full handle_ble_scan path with each output format, __dump_data,
+// device table updates over a population of BENCH_DEVICES addresses and
+// the filter rejecting a report against a watch list of BENCH_WATCH tags
+// and the beacon decoders.
+// Scanner output is written to /dev/null so that only formatting is
+// timed, results go to the original stdout. -j prints one JSON object per line.
+//
+// Allocation counts use glibc's __libc_malloc & co, other libcs report 0.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+#include "devtab.h"
+#include "output.h"
+#include "filter.h"
+#include "decode.h"
+
+#define BENCH_MIN_MS_DEFAULT    200
+#define BENCH_DEVICES           100000  /* population cycled through the device table */
+#define BENCH_WATCH             300     /* addresses in the filter watch list */
+
+struct bench_case {
+    const char *name;
+    int name_len;           /* complete local name, 0 = none */
+    int n_uuid128;          /* entries in the 128-bit UUID list */
+    int mfg_len;            /* manufacturer data bytes after the company ID, -1 = none,
+                               23 = an iBeacon */
+    int n_extra;            /* extra 16-bit service UUID structures */
+    int reports;            /* reports per meta event */
+};
+
+static const struct bench_case bench_cases[] = {
+    { "flags_only",         0, 0, -1, 0, 1 },
+    { "short_name",         3, 0, -1, 0, 1 },
+    { "name8",              8, 0, -1, 0, 1 },
+    { "name8_uuid128",      8, 1, -1, 0, 1 },
+    { "name20_mfg4",       20, 0,  4, 0, 1 },
+    { "mfg24",              0, 0, 24, 0, 1 },
+    { "many_ad",            4, 0,  2, 4, 1 },
+    { "ibeacon",            0, 0, 23, 0, 1 },
+    { "name8_uuid128_x4",   8, 1, -1, 0, 4 },
+    { "name20_mfg4_x4",    20, 0,  4, 0, 4 },
+};
+
+#define BENCH_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/* Allocation counting, see the note at the top */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long long bench_allocs;
+
+void *malloc(size_t size)
+{
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    bench_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t *bench_put_ad(uint8_t *p, uint8_t type, int len, uint8_t fill)
+{
+    *p++ = len + 1;
+    *p++ = type;
+    memset(p, fill, len);
+    return p + len;
+}
+
+/* Build one advertising report payload, returns its length */
+static int bench_build_adv(uint8_t *adv, const struct bench_case *c, int seq)
+{
+    uint8_t *p = adv;
+    int i;
+
+    p = bench_put_ad(p, ESP_BLE_AD_TYPE_FLAG, 1, 0x06);
+    for (i = 0; i < c->n_extra; i++) {
+        p = bench_put_ad(p, ESP_BLE_AD_TYPE_16SRV_PART, 2, 0x10 + i);
+    }
+    if (c->mfg_len >= 0) {
+        p = bench_put_ad(p, ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE, 2 + c->mfg_len, 0xA5);
+        p[-2 - c->mfg_len] = 0x4C; /* company ID */
+        p[-1 - c->mfg_len] = 0x00;
+        if (c->mfg_len == 23) {
+            p[-c->mfg_len] = 0x02;
+            p[1 - c->mfg_len] = 0x15;
+        }
+    }
+    if (c->n_uuid128) {
+        p = bench_put_ad(p, ESP_BLE_AD_TYPE_128SRV_CMPL, 16 * c->n_uuid128, 0x30 + seq);
+    }
+    if (c->name_len) {
+        p = bench_put_ad(p, ESP_BLE_AD_TYPE_NAME_CMPL, c->name_len, 'a' + seq);
+    }
+
+    return p - adv;
+}
+
+/* Build the event as read() returns it on the HCI socket */
+static int bench_build_event(uint8_t *buf, const struct bench_case *c)
+{
+    uint8_t *p = buf;
+    le_advertising_info *info;
+    int i;
+
+    *p++ = HCI_EVENT_PKT;
+    *p++ = EVT_LE_META_EVENT;
+    p++; /* plen, filled below */
+    *p++ = EVT_LE_ADVERTISING_REPORT;
+    *p++ = c->reports;
+
+    for (i = 0; i < c->reports; i++) {
+        info = (le_advertising_info *)p;
+        info->evt_type = 0x00;
+        info->bdaddr_type = 0x01;
+        memset(&info->bdaddr, 0xC0 + i, sizeof(info->bdaddr));
+        info->length = bench_build_adv(info->data, c, i);
+        p = info->data + info->length;
+        *p++ = (uint8_t)-60; /* RSSI */
+    }
+
+    buf[2] = p - buf - 1 - HCI_EVENT_HDR_SIZE;
+    return p - buf;
+}
+
+struct bench_result {
+    uint64_t iters;
+    uint64_t ns;
+    unsigned long long allocs;
+    uint64_t rejected;      /* reports the filter rejected */
+};
+
+enum {
+    BENCH_CHECK_ADV,
+    BENCH_RESOLVE,
+    BENCH_INDEX,
+    BENCH_HANDLE_SCAN_TEXT,
+    BENCH_HANDLE_SCAN_JSON,
+    BENCH_HANDLE_SCAN_BINARY,
+    BENCH_DUMP,
+    BENCH_DEVTAB,
+    BENCH_FILTER,
+    BENCH_DECODE,
+    BENCH_OPS,
+};
+
+static const char *bench_op_names[BENCH_OPS] = {
+    "BTM_CheckAdvData",
+    "esp_ble_resolve_adv_data",
+    "ns_adv_index",
+    "handle_ble_scan/text",
+    "handle_ble_scan/json",
+    "handle_ble_scan/binary",
+    "__dump_data",
+    "ns_devtab_update",
+    "ns_filter_run",
+    "ns_decode_report",
+};
+
+static volatile uintptr_t bench_sink;
+static struct ns_devtab bench_devtab;
+static struct ns_filter bench_filter;
+static struct ns_out bench_out;
+static uint32_t bench_dev_seq;
+static uint64_t bench_rejected;
+
+/* Run op over every report of the event n times */
+static void bench_run_op(int op, uint8_t *buf, int len, int reports, uint64_t n)
+{
+    evt_le_meta_event *meta = (evt_le_meta_event *)(buf + 1 + HCI_EVENT_HDR_SIZE);
+    le_advertising_info *info;
+    ns_adv_report_t rpt;
+    ns_adv_index_t idx;
+    struct ns_decoded dec[NS_DECODE_MAX];
+    uint8_t *offset;
+    uint8_t l1, l2;
+    uint64_t i;
+    int r;
+
+    if (op >= BENCH_HANDLE_SCAN_TEXT && op <= BENCH_HANDLE_SCAN_BINARY) {
+        bench_out.format = NS_OUT_TEXT + (op - BENCH_HANDLE_SCAN_TEXT);
+        for (i = 0; i < n; i++) {
+            handle_ble_scan((const char *)buf, len);
+        }
+        ns_out_flush(&bench_out);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        offset = meta->data + 1;
+        for (r = 0; r < reports; r++) {
+            info = (le_advertising_info *)offset;
+            switch (op) {
+            case BENCH_CHECK_ADV:
+                bench_sink += (uintptr_t)BTM_CheckAdvData(info->data, ESP_BLE_AD_TYPE_NAME_CMPL, &l1);
+                bench_sink += (uintptr_t)BTM_CheckAdvData(info->data, ESP_BLE_AD_TYPE_128SRV_CMPL, &l2);
+                break;
+            case BENCH_RESOLVE:
+                bench_sink += (uintptr_t)esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_NAME_CMPL, &l1);
+                bench_sink += (uintptr_t)esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_128SRV_CMPL, &l2);
+                break;
+            case BENCH_INDEX:
+                ns_adv_index_build(&idx, info->data, info->length);
+                bench_sink += (uintptr_t)ns_adv_index_get(&idx, ESP_BLE_AD_TYPE_NAME_CMPL, &l1);
+                bench_sink += (uintptr_t)ns_adv_index_get(&idx, ESP_BLE_AD_TYPE_128SRV_CMPL, &l2);
+                break;
+            case BENCH_DECODE:
+                ns_adv_index_build(&idx, info->data, info->length);
+                bench_sink += ns_decode_report(&idx, dec, NS_DECODE_MAX);
+                break;
+            case BENCH_DUMP:
+                __dump_data(info->data, info->length, __func__, __LINE__);
+                break;
+            case BENCH_DEVTAB:
+            case BENCH_FILTER:
+                bench_dev_seq = (bench_dev_seq + 1) % BENCH_DEVICES;
+                memcpy(info->bdaddr.b, &bench_dev_seq, 3);
+                memset(&rpt, 0, sizeof(rpt));
+                bacpy(&rpt.bdaddr, &info->bdaddr);
+                rpt.bdaddr_type = info->bdaddr_type;
+                rpt.evt_type = info->evt_type;
+                rpt.rssi = (int8_t)info->data[info->length];
+                rpt.length = info->length;
+                rpt.data = info->data;
+                if (op == BENCH_FILTER) {
+                    bench_rejected += !ns_filter_run(&bench_filter, &rpt);
+                } else {
+                    bench_sink += (uintptr_t)ns_devtab_update(&bench_devtab, &rpt, i);
+                }
+                break;
+            }
+            offset = info->data + info->length + 1;
+        }
+    }
+}
+
+/* Double the iteration count until one run takes at least min_ms */
+static void bench_measure(int op, uint8_t *buf, int len, int reports, int min_ms, struct bench_result *res)
+{
+    uint64_t n = 64;
+    uint64_t t0;
+    unsigned long long a0;
+    uint64_t r0;
+
+    bench_run_op(op, buf, len, reports, 16); /* warm up, and let stdio set up its buffer */
+
+    while (1) {
+        a0 = bench_allocs;
+        r0 = bench_rejected;
+        t0 = bench_now_ns();
+        bench_run_op(op, buf, len, reports, n);
+        res->ns = bench_now_ns() - t0;
+        res->allocs = bench_allocs - a0;
+        res->rejected = bench_rejected - r0;
+        res->iters = n;
+        if (res->ns >= (uint64_t)min_ms * 1000000ULL || n >= (1ULL << 40)) {
+            break;
+        }
+        n *= 2;
+    }
+}
+
+/* A watch list of tags none of the benchmark reports matches:
+ * "addr=<BENCH_WATCH addresses> | name^=Tag- | uuid=<BENCH_WATCH 128-bit
+ * UUIDs> | mfr=<BENCH_WATCH iBeacon prefixes>" */
+static int bench_filter_init(void)
+{
+    static char expr[BENCH_WATCH * (18 + 33 + 42) + 64];
+    char err[256];
+    char *p = expr;
+    int i;
+
+    p += sprintf(p, "addr=");
+    for (i = 0; i < BENCH_WATCH; i++) {
+        p += sprintf(p, "%sC0:FF:EE:%02X:%02X:%02X", i ? "," : "", i >> 16, (i >> 8) & 0xff, i & 0xff);
+    }
+    p += sprintf(p, " | name^=Tag- | uuid=");
+    for (i = 0; i < BENCH_WATCH; i++) {
+        p += sprintf(p, "%sfeedc0de%08x0000000000%06x", i ? "," : "", i * 2654435761u, i);
+    }
+    p += sprintf(p, " | mfr=");
+    for (i = 0; i < BENCH_WATCH; i++) {
+        p += sprintf(p, "%s004c:0215feedc0de%08x0000000000%06x", i ? "," : "", i * 2654435761u, i);
+    }
+
+    if (ns_filter_compile(&bench_filter, expr, err, sizeof(err)) < 0) {
+        fprintf(stderr, "Bad filter: %s\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -j            print results as NDJSON\n");
+    printf("  -t <ms>       minimum run time per measurement (default %d)\n", BENCH_MIN_MS_DEFAULT);
+    printf("  -c <case>     only run the named case\n");
+    printf("  -l            list cases\n");
+    printf("  -h            show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const struct bench_case *c;
+    struct bench_result res;
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    const char *only = NULL;
+    FILE *out;
+    double reports, ns_per_report;
+    char rejected[32];
+    int min_ms = BENCH_MIN_MS_DEFAULT;
+    int json = 0;
+    int len;
+    int opt;
+    size_t i;
+    int op;
+
+    while ((opt = getopt(argc, argv, "jt:c:lh")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 't':
+            min_ms = atoi(optarg);
+            break;
+        case 'c':
+            only = optarg;
+            break;
+        case 'l':
+            for (i = 0; i < BENCH_CASES; i++) {
+                printf("%s\n", bench_cases[i].name);
+            }
+            return 0;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (ns_devtab_init(&bench_devtab, BENCH_DEVICES) < 0) {
+        perror("Failed to allocate device table");
+        return 1;
+    }
+    if (bench_filter_init() < 0) {
+        return 1;
+    }
+
+    /* Keep the real stdout for results, the scanner prints to /dev/null */
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout)) {
+        perror("Failed to redirect stdout");
+        return 1;
+    }
+
+    if (ns_out_init(&bench_out, STDOUT_FILENO, NS_OUT_TEXT) < 0) {
+        perror("Failed to allocate output buffers");
+        return 1;
+    }
+    handle_ble_set_output(&bench_out);
+
+    if (!json) {
+        fprintf(out, "%-20s %-26s %6s %14s %12s %14s %12s\n",
+                "case", "op", "bytes", "reports/s", "ns/report", "allocs/report", "ns/rejected");
+    }
+
+    for (i = 0; i < BENCH_CASES; i++) {
+        c = &bench_cases[i];
+        if (only && strcmp(only, c->name)) {
+            continue;
+        }
+
+        len = bench_build_event(buf, c);
+
+        for (op = 0; op < BENCH_OPS; op++) {
+            bench_measure(op, buf, len, c->reports, min_ms, &res);
+            reports = (double)res.iters * c->reports;
+            ns_per_report = res.ns / reports;
+            /* Only the filter rejects, the time is spent on all reports */
+            if (res.rejected) {
+                snprintf(rejected, sizeof(rejected), json ? ",\"ns_per_rejected\":%.2f" : "%.2f",
+                         (double)res.ns / res.rejected);
+            } else {
+                strcpy(rejected, json ? "" : "-");
+            }
+
+            if (json) {
+                fprintf(out, "{\"case\":\"%s\",\"op\":\"%s\",\"event_bytes\":%d,\"reports_per_event\":%d,"
+                        "\"reports\":%.0f,\"ns\":%llu,\"reports_per_sec\":%.0f,\"ns_per_report\":%.2f,"
+                        "\"allocs_per_report\":%.4f%s}\n",
+                        c->name, bench_op_names[op], len, c->reports, reports,
+                        (unsigned long long)res.ns, reports * 1e9 / res.ns, ns_per_report,
+                        res.allocs / reports, rejected);
+            } else {
+                fprintf(out, "%-20s %-26s %6d %14.0f %12.2f %14.4f %12s\n",
+                        c->name, bench_op_names[op], len, reports * 1e9 / res.ns,
+                        ns_per_report, res.allocs / reports, rejected);
+            }
+            fflush(out);
+        }
+    }
+
+    fclose(out);
+    ns_devtab_free(&bench_devtab);
+    ns_filter_free(&bench_filter);
+    ns_out_free(&bench_out);
+    return 0;
+}
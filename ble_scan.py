@@ -1,25 +1,52 @@
 # LYJ: if can not run try : sudo hciconfig hci0 down && sudo hciconfig hci0 up
-from bluepy.btle import Scanner, DefaultDelegate
+# Needs the blescan extension, see pyblescan.c for how to build it.
+# Run with: python3 ble_scan.py [capture.btsnoop]
+import struct
+import sys
+import time
 
-class ScanDelegate(DefaultDelegate):
-    def __init__(self):
-        DefaultDelegate.__init__(self)
+import blescan
 
-    def handleDiscovery(self, dev, isNewDev, isNewData):
-        #if isNewDev and dev.addrType == 0:
-        # print(f"Discovered device: {dev.addr} ({dev.addrType}), RSSI={dev.rssi} dBm")
-        for (adtype, desc, value) in dev.getScanData():
-            # print(f"desc:{desc}");
-            if desc == "Complete Local Name":
-                print("Name:", value)
-            if desc == "Complete 128b Services":
-                print("UUID128:", value)
-                print(f"Discovered device: {dev.addr} ({dev.addrType}), RSSI={dev.rssi} dBm, connectable={dev.connectable}")
+AD_UUID128_COMPLETE = 0x07
+AD_NAME_COMPLETE = 0x09
+
+def ad_fields(payload):
+    i = 0
+    while i + 1 < len(payload):
+        length = payload[i]
+        if length == 0 or i + 1 + length > len(payload):
+            break
+        yield payload[i + 1], payload[i + 2:i + 1 + length]
+        i += 1 + length
+
+def connectable(evt_type):
+    if evt_type & 0x80:
+        return bool(evt_type & 0x01)
+    return evt_type in (0x00, 0x01)
+
+def handle_batch(batch):
+    payloads = batch.payloads
+    for (ts_ms, bdaddr, addr_type, evt_type, rssi, adapter, tx_power, sid, phy,
+         truncated, payload_len, payload_off) in struct.iter_unpack(blescan.RECORD_FORMAT, batch):
+        addr = ":".join("%02x" % b for b in reversed(bdaddr))
+        for adtype, value in ad_fields(payloads[payload_off:payload_off + payload_len]):
+            if adtype == AD_NAME_COMPLETE:
+                print("Name:", bytes(value).decode("utf-8", "replace"))
+            if adtype == AD_UUID128_COMPLETE:
+                print("UUID128:", ",".join(bytes(value[j:j + 16][::-1]).hex() for j in range(0, len(value) - 15, 16)))
+                print(f"Discovered device: {addr} ({addr_type}), RSSI={rssi} dBm, connectable={connectable(evt_type)}")
 
 def main():
-    scanner = Scanner().withDelegate(ScanDelegate())
+    # Only named devices pass the scanner's default filter, all parsing
+    # and filtering happens in C and reports arrive in batches
+    if len(sys.argv) > 1:
+        handle_batch(blescan.replay(sys.argv[1]))
+        return
     print("Scanning for BLE devices...")
-    scanner.scan(10.0)
+    end = time.monotonic() + 10.0
+    with blescan.Scanner(0) as scanner:
+        while time.monotonic() < end:
+            handle_batch(scanner.read(4096, max(1, int((end - time.monotonic()) * 1000))))
 
 if __name__ == "__main__":
     main()
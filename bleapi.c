@@ -0,0 +1,636 @@
+// Advertising data parsing and LE advertising report handling, see bleapi.h.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+#include "devtab.h"
+#include "suppress.h"
+#include "output.h"
+#include "extadv.h"
+#include "filter.h"
+#include "sched.h"
+#include "metrics.h"
+#include "sightlog.h"
+#include "devshm.h"
+#include "rpa.h"
+
+#define NS_STREAM_TO_UINT8(u8, p)   {u8 = (uint8_t)(*(p)); (p) += 1;}
+
+uint8_t *BTM_CheckAdvData( uint8_t *p_adv, uint8_t type, uint8_t *p_length)
+{
+    uint8_t *p = p_adv;
+    uint8_t length;
+    uint8_t adv_type;
+
+    NS_STREAM_TO_UINT8(length, p);
+
+    while ( length && (p - p_adv < NS_BTM_BLE_CACHE_ADV_DATA_MAX)) {
+        NS_STREAM_TO_UINT8(adv_type, p);
+
+        if ( adv_type == type ) {
+            /* length doesn't include itself */
+            *p_length = length - 1; /* minus the length of type */
+            return p;
+        }
+
+        p += length - 1; /* skip the length of data */
+
+        /* Break loop if advertising data is in an incorrect format,
+           as it may lead to memory overflow */
+        if (p >= p_adv + NS_BTM_BLE_CACHE_ADV_DATA_MAX) {
+            break;
+        }
+
+        NS_STREAM_TO_UINT8(length, p);
+    }
+
+    *p_length = 0;
+    return NULL;
+}
+
+uint8_t *esp_ble_resolve_adv_data( uint8_t *adv_data, uint8_t type, uint8_t *length)
+{
+    if (((type < ESP_BLE_AD_TYPE_FLAG) || (type > ESP_BLE_AD_TYPE_128SERVICE_DATA)) &&
+            (type != ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE)) {
+        printf("the eir type not define, type = %x\n", type);
+        return NULL;
+    }
+
+    if (adv_data == NULL) {
+        printf("Invalid p_eir data.\n");
+        return NULL;
+    }
+
+    return (BTM_CheckAdvData( adv_data, type, length));
+}
+
+/* Walk the AD structures once and record where each type starts, so that
+ * later lookups through ns_adv_index_get() don't rescan the payload.
+ * Returns the number of AD structures seen, or -1 if the payload is
+ * truncated (the structures before the bad one are still indexed). */
+int ns_adv_index_build(ns_adv_index_t *idx, const uint8_t *p_adv, uint16_t adv_len)
+{
+    const uint8_t *p = p_adv;
+    const uint8_t *end = p_adv + adv_len;
+    uint8_t length;
+    uint8_t adv_type;
+    int slot;
+    int count = 0;
+
+    idx->base = p_adv;
+    idx->present = 0;
+
+    while (p < end) {
+        NS_STREAM_TO_UINT8(length, p);
+        if (!length) {
+            break;
+        }
+
+        /* Break loop if advertising data is in an incorrect format,
+           as it may lead to memory overflow */
+        if (length > end - p) {
+            return -1;
+        }
+
+        adv_type = p[0];
+        slot = ns_adv_index_slot(adv_type);
+        if (slot >= 0 && !(idx->present & (1ULL << slot))) {
+            idx->off[slot] = (uint16_t)(p + 1 - p_adv);
+            idx->len[slot] = length - 1; /* minus the length of type */
+            idx->present |= 1ULL << slot;
+        }
+
+        p += length;
+        count++;
+    }
+
+    return count;
+}
+
+void __dump_data(const unsigned char *ptr, int len, const char *func, int line)
+{
+    int i;
+    int _b_len = 0;
+    char _buf[1024 * 4];
+    char *p;
+
+    _b_len = snprintf(_buf, sizeof(_buf), "\n=============================================\n[%s][%d]", func, line);
+    p = _buf + _b_len;
+
+    /* 3 chars per byte plus 6 per line, keep room for the trailer */
+    for (i = 0; i < len && p - _buf < (int)sizeof(_buf) - 64; i++) {
+        if (!(i%16)) {
+            *p++ = '\n';
+            *p++ = ' ';
+            p = ns_hex_encode(p, (uint8_t []){ i >> 8, i & 0xff }, 2);
+        }
+        *p++ = ' ';
+        p = ns_hex_encode(p, &ptr[i], 1);
+    }
+    p += sprintf(p, "\n=============================================\n");
+
+    fwrite(_buf, 1, p - _buf, stdout);
+    putchar('\n');
+
+    return;
+}
+
+void bt_dump_all_ext_type(uint8_t *p_adv)
+{
+    uint8_t *p = p_adv;
+    uint8_t length;
+    uint8_t adv_type;
+
+    NS_STREAM_TO_UINT8(length, p);
+
+    while ( length && (p - p_adv < NS_BTM_BLE_CACHE_ADV_DATA_MAX)) {
+        NS_STREAM_TO_UINT8(adv_type, p);
+
+        // if ( adv_type == type ) {
+        //     /* length doesn't include itself */
+        //     *p_length = length - 1; /* minus the length of type */
+        //     return p;
+        // }
+
+        printf("[%s][%d] LYJ@NS --------> adv_type:%d\n", __func__, __LINE__, adv_type);
+        NS_dump_data(p, length - 1);
+
+        p += length - 1; /* skip the length of data */
+
+        /* Break loop if advertising data is in an incorrect format,
+           as it may lead to memory overflow */
+        if (p >= p_adv + NS_BTM_BLE_CACHE_ADV_DATA_MAX) {
+            break;
+        }
+
+        NS_STREAM_TO_UINT8(length, p);
+    }
+
+    return;
+}
+
+void parse_ext_pdu(uint8_t *data, int length) {
+    uint8_t pdu_type = data[0] & 0x0F;
+    uint8_t pdu_length = (data[0] & 0x10) ? data[1] : 0;
+    char hex[3 * 256 + 1];
+    char *p = hex;
+    int i;
+
+    printf("PDU Type: %d\n", pdu_type);
+    printf("Length: %d\n", pdu_length);
+    for (i = 2; i < length && i < 2 + 256; i++) {
+        p = ns_hex_encode(p, &data[i], 1);
+        *p++ = ' ';
+    }
+    *p = '\0';
+    printf("Data: %s\n", hex);
+}
+
+/* Per thread, so pipeline workers (pipeline.c) each run on their own
+ * device table shard and output buffer without locking. */
+static __thread struct ns_devtab *scan_devtab;
+static __thread struct ns_suppress *scan_suppress;
+static __thread struct ns_out *scan_out;
+static __thread int scan_shard_index;
+static __thread int scan_shard_count;
+static __thread int scan_adapter;
+static __thread struct ns_extadv_pool *scan_extadv;
+static __thread const struct ns_filter *scan_filter;
+static __thread struct ns_sched *scan_sched;
+static __thread struct ns_log *scan_log;
+static __thread struct ns_shm *scan_shm;
+static __thread struct ns_rpa *scan_rpa;
+static __thread const struct ns_irk *const *scan_resolved; /* by handle_ble_resolve(), NULL = use scan_rpa */
+static __thread ns_report_sink scan_sink;
+static __thread void *scan_sink_ctx;
+static __thread uint64_t scan_read_ns;      /* when the current event was read, 0 = unknown */
+
+/* Slots the device table changed on its own, an eviction or age-out */
+static void ns_handle_mirror(const struct ns_devtab *tab, uint32_t slot)
+{
+    ns_shm_publish(scan_shm, scan_shard_index, tab, slot);
+}
+
+static void ns_handle_set_mirror(void)
+{
+    if (scan_devtab) {
+        scan_devtab->mirror = scan_shm ? ns_handle_mirror : NULL;
+    }
+}
+
+void handle_ble_set_devtab(struct ns_devtab *tab)
+{
+    scan_devtab = tab;
+    ns_handle_set_mirror();
+}
+
+void handle_ble_set_suppress(struct ns_suppress *sup)
+{
+    scan_suppress = sup;
+}
+
+void handle_ble_set_output(struct ns_out *out)
+{
+    scan_out = out;
+}
+
+void handle_ble_set_shard(int index, int count)
+{
+    scan_shard_index = index;
+    scan_shard_count = count;
+}
+
+void handle_ble_set_extadv(struct ns_extadv_pool *pool)
+{
+    scan_extadv = pool;
+}
+
+void handle_ble_set_filter(const struct ns_filter *f)
+{
+    scan_filter = f;
+}
+
+void handle_ble_set_sched(struct ns_sched *s)
+{
+    scan_sched = s;
+}
+
+void handle_ble_set_log(struct ns_log *log)
+{
+    scan_log = log;
+}
+
+void handle_ble_set_shm(struct ns_shm *shm)
+{
+    scan_shm = shm;
+    ns_handle_set_mirror();
+}
+
+void handle_ble_set_rpa(struct ns_rpa *rpa)
+{
+    scan_rpa = rpa;
+}
+
+void handle_ble_set_sink(ns_report_sink sink, void *ctx)
+{
+    scan_sink = sink;
+    scan_sink_ctx = ctx;
+}
+
+int handle_ble_adv_rpt_0(evt_le_meta_event * meta_event)
+{
+    le_advertising_info *info = (void *) (meta_event->data + 1);
+    uint8_t *data = info->data;
+    int data_length = info->length;
+
+    //printf("evt_type:%d\n", info->evt_type);
+    //bt_dump_all_ext_type(info->data);
+    uint8_t *adv_name = NULL;
+    uint8_t adv_name_len = 0;
+    char data_buf[256] = {0};
+    adv_name = esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_NAME_CMPL, &adv_name_len);
+    if (adv_name_len + 1 > sizeof(data_buf)) {
+        return -1;
+    }
+
+    memcpy(data_buf, adv_name, adv_name_len);
+
+    if (adv_name_len <= 3) {
+        return -1;
+    }
+
+    #if 0
+    if (strncmp(data_buf, "MI 6", 4) != 0) {
+        return -1;
+    }
+    #endif
+
+    printf("[%s][%d] LYJ@NS -------->adv_name:%s, event_type:%08X\n", __func__, __LINE__, data_buf, info->evt_type);
+    // bt_dump_all_ext_type(info->data);
+
+    uint8_t *uuid = NULL;
+    uint8_t uuid_len = 0;
+    uuid = esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_128SRV_CMPL, &uuid_len);
+    if (uuid && uuid_len) {
+        memset(data_buf, 0, sizeof(data_buf));
+        if (uuid_len + 1 < sizeof(data_buf)) {
+            memcpy(data_buf, uuid, uuid_len);
+            NS_dump_data(data_buf, uuid_len);
+        }
+    }
+
+    return 0;
+}
+
+int handle_ble_adv_rpt_i(const ns_adv_report_t *rpt, uint64_t now_ms)
+{
+    ns_adv_index_t idx;
+    uint8_t *adv_name = NULL;
+    uint8_t adv_name_len = 0;
+
+    ns_adv_index_build(&idx, rpt->data, rpt->length);
+
+    /* Without a filter only devices with a name are of interest */
+    adv_name = ns_adv_index_get(&idx, ESP_BLE_AD_TYPE_NAME_CMPL, &adv_name_len);
+    if (!scan_filter && (!adv_name || adv_name_len <= 3)) {
+        return -1;
+    }
+
+    if (scan_out) {
+        ns_out_report(scan_out, rpt, &idx, now_ms);
+    }
+    if (scan_log) {
+        ns_log_append(scan_log, rpt, now_ms);
+    }
+    if (scan_sink) {
+        scan_sink(rpt, now_ms, scan_sink_ctx);
+    }
+    ns_metrics_count(rpt->adapter, NS_MC_EMITTED);
+    if (scan_read_ns) {
+        ns_metrics_observe(NS_MH_READ_TO_EMIT, ns_metrics_now_ns() - scan_read_ns);
+    }
+
+    return 0;
+}
+
+static uint64_t ns_realtime_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int ns_is_my_shard(const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+    return scan_shard_count <= 1 ||
+           ns_devtab_shard(ns_devtab_key(bdaddr, bdaddr_type), scan_shard_count) == scan_shard_index;
+}
+
+/* Set the address of rpt, report n of its event, to the identity of a
+ * resolved private address when its key has one. Shards go by that
+ * address, so a device stays with one pipeline worker across rotations;
+ * the pipeline's reader resolved the whole event for the workers to find
+ * out. Returns 1 if the report belongs to this thread's shard. */
+static int ns_report_address(ns_adv_report_t *rpt, const bdaddr_t *bdaddr, uint8_t bdaddr_type, int n)
+{
+    const struct ns_irk *irk = NULL;
+
+    if ( scan_resolved ) {
+        irk = n < NS_ADV_EVENT_REPORTS ? scan_resolved[n] : NULL;
+    } else if ( scan_rpa ) {
+        irk = ns_rpa_resolve(scan_rpa, bdaddr, bdaddr_type);
+    }
+
+    rpt->irk = irk;
+    if ( irk && irk->identity_type != NS_IRK_NO_IDENTITY ) {
+        bacpy(&rpt->rpa, bdaddr);
+        bacpy(&rpt->bdaddr, &irk->identity);
+        rpt->bdaddr_type = irk->identity_type;
+    } else {
+        bacpy(&rpt->bdaddr, bdaddr);
+        rpt->bdaddr_type = bdaddr_type;
+    }
+    return ns_is_my_shard(&rpt->bdaddr, rpt->bdaddr_type);
+}
+
+/* Filter, device table, suppression, then output. Reports the filter
+ * rejects leave no trace, not even in the device table. */
+static void ns_handle_report(const ns_adv_report_t *rpt, uint64_t now_ms)
+{
+    struct ns_sched_counters *load = NULL;
+    struct ns_dev *dev;
+
+    ns_metrics_count(rpt->adapter, NS_MC_REPORTS);
+    if ( rpt->irk ) {
+        ns_metrics_count(rpt->adapter, NS_MC_RESOLVED);
+    }
+    if ( scan_sched && rpt->adapter < NS_ADAPTERS_MAX ) {
+        load = &scan_sched->adapters[rpt->adapter];
+        ns_sched_add(&load->reports);
+    }
+    if ( scan_filter && !ns_filter_run(scan_filter, rpt) ) {
+        ns_metrics_count(rpt->adapter, NS_MC_FILTERED);
+        return;
+    }
+    if ( scan_devtab ) {
+        dev = ns_devtab_update(scan_devtab, rpt, now_ms);
+        if ( dev && scan_shm ) {
+            ns_shm_publish(scan_shm, scan_shard_index, scan_devtab, (uint32_t)(dev - scan_devtab->slots));
+        }
+        if ( dev && load ) {
+            if ( dev->count == 1 ) {
+                ns_sched_add(&load->new_devices);
+            }
+            /* Only devices the filter watches are worth an active scan */
+            if ( scan_filter && !(dev->flags & NS_DEV_SCAN_RSP) && ns_adv_is_scannable(rpt->evt_type) ) {
+                ns_sched_add(&load->rsp_wanted);
+            }
+        }
+        if ( dev && scan_suppress && !ns_suppress_check(scan_suppress, dev, rpt, now_ms) ) {
+            ns_metrics_count(rpt->adapter, NS_MC_SUPPRESSED);
+            return;
+        }
+    }
+    handle_ble_adv_rpt_i(rpt, now_ms);
+}
+
+/* len is the size of the meta event (subevent byte included). Reports that
+ * would run past it are dropped, a replayed capture may be truncated. */
+int handle_ble_adv_rpt(evt_le_meta_event * meta_event, int len)
+{
+    uint8_t reports_count = meta_event->data[0];
+    uint8_t *offset = meta_event->data + 1;
+    uint8_t *end = (uint8_t *)meta_event + len;
+    le_advertising_info * info = NULL;
+    ns_adv_report_t rpt;
+    uint64_t now_ms = ns_realtime_ms();
+    int n;
+
+    memset(&rpt, 0, sizeof(rpt));
+    rpt.tx_power = NS_ADV_TX_POWER_NONE;
+    rpt.sid = NS_ADV_SID_NONE;
+    rpt.adapter = (uint8_t)scan_adapter;
+
+    for ( n = 0; n < reports_count; n++ ) {
+        info = (le_advertising_info *)offset;
+        if ( offset + LE_ADVERTISING_INFO_SIZE > end ||
+             info->data + info->length + 1 > end ) {
+            return -1;
+        }
+        offset = info->data + info->length + 1; /* skip the RSSI byte */
+        if ( !ns_report_address(&rpt, &info->bdaddr, info->bdaddr_type, n) ) {
+            continue;
+        }
+        rpt.evt_type = info->evt_type;
+        rpt.rssi = (int8_t)info->data[info->length];
+        rpt.length = info->length;
+        rpt.data = info->data;
+        ns_handle_report(&rpt, now_ms);
+    }
+
+    return 0;
+}
+
+/* Fragments are collected in the thread's ns_extadv_pool; the report is
+ * handled once its chain is complete (or was truncated by the controller,
+ * then whatever arrived is handled with rpt.truncated set). */
+int handle_ble_ext_adv_rpt(evt_le_meta_event * meta_event, int len)
+{
+    uint8_t reports_count = meta_event->data[0];
+    uint8_t *offset = meta_event->data + 1;
+    uint8_t *end = (uint8_t *)meta_event + len;
+    ns_le_ext_advertising_info * info = NULL;
+    ns_adv_report_t rpt;
+    uint64_t now_ms = ns_realtime_ms();
+    uint16_t evt_type;
+    int status;
+    int n;
+
+    memset(&rpt, 0, sizeof(rpt));
+    rpt.adapter = (uint8_t)scan_adapter;
+
+    for ( n = 0; n < reports_count; n++ ) {
+        info = (ns_le_ext_advertising_info *)offset;
+        if ( offset + NS_LE_EXT_ADVERTISING_INFO_SIZE > end ||
+             info->data + info->length > end ) {
+            return -1;
+        }
+        offset = info->data + info->length;
+        if ( !ns_report_address(&rpt, &info->bdaddr, info->bdaddr_type, n) ) {
+            continue;
+        }
+
+        evt_type = btohs(info->evt_type);
+        status = NS_EXT_EVT_STATUS(evt_type);
+        if ( scan_extadv ) {
+            rpt.data = ns_extadv_feed(scan_extadv, ns_extadv_key(&info->bdaddr, info->bdaddr_type, info->sid),
+                                      info->data, info->length, status, now_ms, &rpt.length);
+        } else if ( status == NS_EXT_STATUS_MORE ) {
+            rpt.data = NULL;
+        } else {
+            rpt.data = info->data;
+            rpt.length = info->length;
+        }
+        if ( !rpt.data ) {
+            continue;
+        }
+
+        rpt.evt_type = (evt_type & NS_EXT_EVT_LEGACY) ? ns_ext_legacy_type(evt_type) :
+                       NS_ADV_EVT_EXT | (evt_type & 0x0f);
+        rpt.rssi = info->rssi;
+        rpt.tx_power = info->tx_power;
+        rpt.sid = info->sid;
+        rpt.primary_phy = info->primary_phy;
+        rpt.secondary_phy = info->secondary_phy;
+        rpt.truncated = status == NS_EXT_STATUS_TRUNCATED;
+        ns_handle_report(&rpt, now_ms);
+    }
+
+    return 0;
+}
+
+int handle_ble_scan(const char *buf, int len)
+{
+	evt_le_meta_event * meta_event;
+    uint64_t start_ns = ns_metrics_now_ns();
+
+    /* Every pipeline worker walks every event, shard 0 counts them */
+    if ( scan_shard_index == 0 ) {
+        ns_metrics_count(scan_adapter, NS_MC_EVENTS);
+    }
+    if ( len >= HCI_EVENT_HDR_SIZE + 2 ) {
+        meta_event = (evt_le_meta_event*)(buf + HCI_EVENT_HDR_SIZE+1);
+        // printf("[%s][%d] LYJ@NS -------->event_type:%08X\n", __func__, __LINE__, meta_event->subevent);
+        if ( meta_event->subevent == EVT_LE_ADVERTISING_REPORT && len > HCI_EVENT_HDR_SIZE + 2 ) {
+            handle_ble_adv_rpt(meta_event, len - HCI_EVENT_HDR_SIZE - 1);
+        } else if ( meta_event->subevent == NS_EVT_LE_EXT_ADVERTISING_REPORT && len > HCI_EVENT_HDR_SIZE + 2 ) {
+            handle_ble_ext_adv_rpt(meta_event, len - HCI_EVENT_HDR_SIZE - 1);
+        }
+    }
+    ns_metrics_observe(NS_MH_PARSE, ns_metrics_now_ns() - start_ns);
+    return 0;
+}
+
+int handle_ble_scan_from(int adapter, const char *buf, int len)
+{
+    return handle_ble_scan_at(adapter, ns_metrics_now_ns(), buf, len);
+}
+
+int handle_ble_scan_at(int adapter, uint64_t read_ns, const char *buf, int len)
+{
+    scan_adapter = adapter;
+    scan_read_ns = read_ns;
+    return handle_ble_scan(buf, len);
+}
+
+int handle_ble_scan_resolved(int adapter, uint64_t read_ns, const char *buf, int len,
+                             const struct ns_irk *const *irks)
+{
+    int ret;
+
+    scan_resolved = irks;
+    ret = handle_ble_scan_at(adapter, read_ns, buf, len);
+    scan_resolved = NULL;
+    return ret;
+}
+
+/* Walks the reports as handle_ble_adv_rpt() and handle_ble_ext_adv_rpt()
+ * do and stops where they would, entries past that stay NULL */
+void handle_ble_resolve(struct ns_rpa *rpa, const char *buf, int len, const struct ns_irk **irks)
+{
+    const uint8_t *end = (const uint8_t *)buf + len;
+    const evt_le_meta_event *meta_event;
+    const le_advertising_info *info;
+    const ns_le_ext_advertising_info *ext;
+    const uint8_t *offset;
+    int count;
+    int n = 0;
+
+    if ( len > HCI_EVENT_HDR_SIZE + 2 ) {
+        meta_event = (const evt_le_meta_event *)(buf + HCI_EVENT_HDR_SIZE + 1);
+        count = meta_event->data[0] < NS_ADV_EVENT_REPORTS ? meta_event->data[0] : NS_ADV_EVENT_REPORTS;
+        offset = meta_event->data + 1;
+        if ( meta_event->subevent == EVT_LE_ADVERTISING_REPORT ) {
+            for ( ; n < count; n++ ) {
+                info = (const le_advertising_info *)offset;
+                if ( offset + LE_ADVERTISING_INFO_SIZE > end || info->data + info->length + 1 > end ) {
+                    break;
+                }
+                offset = info->data + info->length + 1;
+                irks[n] = ns_rpa_resolve(rpa, &info->bdaddr, info->bdaddr_type);
+            }
+        } else if ( meta_event->subevent == NS_EVT_LE_EXT_ADVERTISING_REPORT ) {
+            for ( ; n < count; n++ ) {
+                ext = (const ns_le_ext_advertising_info *)offset;
+                if ( offset + NS_LE_EXT_ADVERTISING_INFO_SIZE > end || ext->data + ext->length > end ) {
+                    break;
+                }
+                offset = ext->data + ext->length;
+                irks[n] = ns_rpa_resolve(rpa, &ext->bdaddr, ext->bdaddr_type);
+            }
+        }
+    }
+    for ( ; n < NS_ADV_EVENT_REPORTS; n++ ) {
+        irks[n] = NULL;
+    }
+}
+
+int handle_ble_scan_batch(uint8_t (*bufs)[HCI_MAX_EVENT_SIZE], const int *lens,
+                          const uint8_t *adapters, const uint64_t *read_ns, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        scan_adapter = adapters[i];
+        scan_read_ns = read_ns[i];
+        handle_ble_scan((const char *)bufs[i], lens[i]);
+    }
+    ns_metrics_cycle();
+
+    return count;
+}
@@ -1,6 +1,12 @@
 #ifndef __NS_BLE_API_H__
 #define __NS_BLE_API_H__
 
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#define NS_BTM_BLE_CACHE_ADV_DATA_MAX      62
+
 typedef enum {
     ESP_BLE_AD_TYPE_FLAG                     = 0x01,    /* relate to BTM_BLE_AD_TYPE_FLAG in stack/btm_ble_api.h */
     ESP_BLE_AD_TYPE_16SRV_PART               = 0x02,    /* relate to BTM_BLE_AD_TYPE_16SRV_PART in stack/btm_ble_api.h */
@@ -40,4 +46,152 @@ typedef enum {
     ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE    = 0xFF,    /* relate to BTM_BLE_AD_MANUFACTURER_SPECIFIC_TYPE in stack/btm_ble_api.h */
 } esp_ble_adv_data_type;
 
+/* Per-report AD structure index, filled by one pass over the payload.
+ * Slots are keyed by esp_ble_adv_data_type; 0xFF (manufacturer data) is
+ * folded into the unused slot 0. First occurrence of each type wins, same
+ * as BTM_CheckAdvData. off/len of a slot are only valid when its bit is set
+ * in present, so building the index never has to clear the tables. */
+#define NS_ADV_INDEX_SLOTS      (ESP_BLE_AD_TYPE_CHAN_MAP_UPDATE + 1)
+
+typedef struct {
+    const uint8_t *base;
+    uint64_t present;                   /* bit n set when slot n is filled */
+    uint16_t off[NS_ADV_INDEX_SLOTS];
+    uint8_t  len[NS_ADV_INDEX_SLOTS];
+} ns_adv_index_t;
+
+static inline int ns_adv_index_slot(uint8_t type)
+{
+    if (type == ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE) {
+        return 0;
+    }
+    return (type && type < NS_ADV_INDEX_SLOTS) ? type : -1;
+}
+
+int ns_adv_index_build(ns_adv_index_t *idx, const uint8_t *p_adv, uint16_t adv_len);
+
+static inline uint8_t *ns_adv_index_get(const ns_adv_index_t *idx, uint8_t type, uint8_t *p_length)
+{
+    int slot = ns_adv_index_slot(type);
+
+    if (slot < 0 || !(idx->present & (1ULL << slot))) {
+        *p_length = 0;
+        return NULL;
+    }
+    *p_length = idx->len[slot];
+    return (uint8_t *)idx->base + idx->off[slot];
+}
+
+/* One advertising report, legacy or extended, with its payload in one
+ * piece. data points into the HCI event or a reassembly buffer and is
+ * only valid for the duration of the call it is passed to.
+ *
+ * evt_type keeps the legacy PDU type (0 ADV_IND .. 4 SCAN_RSP) for legacy
+ * advertising, whichever report subevent carried it. Extended advertising
+ * is NS_ADV_EVT_EXT | the NS_ADV_PROP_* bits.
+ *
+ * A resolvable private address that one of the configured IRKs resolves
+ * has irk set; when the key comes with an identity address, bdaddr is
+ * that identity and rpa the address on air. */
+#define NS_ADV_DATA_MAX         1650    /* extended advertising data, reassembled */
+#define NS_ADV_EVT_SCAN_RSP     0x04
+#define NS_ADV_EVT_EXT          0x80
+#define NS_ADV_PROP_CONNECTABLE 0x01
+#define NS_ADV_PROP_SCANNABLE   0x02
+#define NS_ADV_PROP_DIRECTED    0x04
+#define NS_ADV_PROP_SCAN_RSP    0x08
+#define NS_ADV_TX_POWER_NONE    127
+#define NS_ADV_SID_NONE         0xFF
+#define NS_ADV_EVENT_REPORTS    25      /* reports in one advertising report event, at most */
+
+struct ns_irk;
+
+typedef struct {
+    bdaddr_t bdaddr;
+    uint8_t  bdaddr_type;
+    uint8_t  evt_type;
+    int8_t   rssi;                      /* 127 = not available */
+    int8_t   tx_power;                  /* NS_ADV_TX_POWER_NONE for legacy reports */
+    uint8_t  sid;                       /* NS_ADV_SID_NONE for legacy reports */
+    uint8_t  primary_phy;               /* 1 = 1M, 3 = Coded, 0 for legacy reports */
+    uint8_t  secondary_phy;
+    uint8_t  adapter;                   /* hci dev_id the report was read from */
+    uint8_t  truncated;                 /* controller could not receive the whole chain */
+    uint16_t length;
+    const uint8_t *data;
+    const struct ns_irk *irk;           /* key that resolved the address, NULL if none did */
+    bdaddr_t rpa;                       /* address on air when bdaddr is the identity */
+} ns_adv_report_t;
+
+static inline int ns_adv_is_scan_rsp(uint8_t evt_type)
+{
+    if (evt_type & NS_ADV_EVT_EXT) {
+        return !!(evt_type & NS_ADV_PROP_SCAN_RSP);
+    }
+    return evt_type == NS_ADV_EVT_SCAN_RSP;
+}
+
+/* Advertisements a scan response can be requested for */
+static inline int ns_adv_is_scannable(uint8_t evt_type)
+{
+    if (evt_type & NS_ADV_EVT_EXT) {
+        return (evt_type & (NS_ADV_PROP_SCANNABLE | NS_ADV_PROP_SCAN_RSP)) == NS_ADV_PROP_SCANNABLE;
+    }
+    return evt_type == 0x00 || evt_type == 0x02;    /* ADV_IND, ADV_SCAN_IND */
+}
+
+uint8_t *BTM_CheckAdvData( uint8_t *p_adv, uint8_t type, uint8_t *p_length);
+uint8_t *esp_ble_resolve_adv_data( uint8_t *adv_data, uint8_t type, uint8_t *length);
+
+void __dump_data(const unsigned char *ptr, int len, const char *func, int line);
+#define NS_dump_data(ptr, len) __dump_data((unsigned char *)ptr, len, __func__, __LINE__)
+void bt_dump_all_ext_type(uint8_t *p_adv);
+void parse_ext_pdu(uint8_t *data, int length);
+
+/* LE advertising report handling, buf/len as read() from the HCI socket.
+ * The handle_ble_set_* state is per thread.
+ *
+ * Reports are tagged with the adapter (hci dev_id) they were read from, so
+ * the device table can combine what several radios see of one device.
+ * Adapter ids below NS_ADAPTERS_MAX get per-adapter state. */
+#define NS_ADAPTERS_MAX     8
+
+struct ns_devtab;
+struct ns_suppress;
+struct ns_out;
+struct ns_extadv_pool;
+struct ns_filter;
+struct ns_sched;
+struct ns_log;
+struct ns_shm;
+struct ns_rpa;
+void handle_ble_set_devtab(struct ns_devtab *tab);     /* NULL disables device tracking */
+void handle_ble_set_suppress(struct ns_suppress *sup); /* needs the device table, NULL disables */
+void handle_ble_set_output(struct ns_out *out);        /* NULL parses without printing */
+void handle_ble_set_shard(int index, int count);       /* only handle devices of shard index */
+void handle_ble_set_extadv(struct ns_extadv_pool *pool); /* NULL drops fragmented extended reports */
+void handle_ble_set_filter(const struct ns_filter *f);  /* checked first, NULL only drops short names */
+void handle_ble_set_sched(struct ns_sched *s);          /* load counters for the scan schedule */
+void handle_ble_set_log(struct ns_log *log);           /* sighting log of emitted reports, NULL = none */
+void handle_ble_set_shm(struct ns_shm *shm);           /* mirror of the device table shard, NULL = none */
+void handle_ble_set_rpa(struct ns_rpa *rpa);           /* resolves private addresses, NULL = off */
+typedef void (*ns_report_sink)(const ns_adv_report_t *rpt, uint64_t ts_ms, void *ctx);
+void handle_ble_set_sink(ns_report_sink sink, void *ctx); /* gets every emitted report, NULL = none */
+int handle_ble_adv_rpt_i(const ns_adv_report_t *rpt, uint64_t now_ms);
+int handle_ble_adv_rpt(evt_le_meta_event * meta_event, int len);
+int handle_ble_ext_adv_rpt(evt_le_meta_event * meta_event, int len);
+int handle_ble_scan(const char *buf, int len);
+int handle_ble_scan_from(int adapter, const char *buf, int len);
+int handle_ble_scan_at(int adapter, uint64_t read_ns, const char *buf, int len); /* read_ns: ns_metrics_now_ns() at read */
+/* Resolve the private addresses of an advertising report event ahead of
+ * handling it: irks[i] is the key of report i, NULL if none resolved it,
+ * for NS_ADV_EVENT_REPORTS entries at most. Handling the event with
+ * handle_ble_scan_resolved() then takes those instead of the thread's
+ * ns_rpa, so a pipeline resolves every address once, on the reader. */
+void handle_ble_resolve(struct ns_rpa *rpa, const char *buf, int len, const struct ns_irk **irks);
+int handle_ble_scan_resolved(int adapter, uint64_t read_ns, const char *buf, int len,
+                             const struct ns_irk *const *irks);
+int handle_ble_scan_batch(uint8_t (*bufs)[HCI_MAX_EVENT_SIZE], const int *lens,
+                          const uint8_t *adapters, const uint64_t *read_ns, int count);
+
 #endif //__NS_BLE_API_H__
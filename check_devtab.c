@@ -0,0 +1,294 @@
+// Checks for the device table: eviction, aging and deletion.
+//
+// Compile with:
+//   cc -O2 check_devtab.c devtab.c -lbluetooth -o check_devtab
+// Run with:
+//   ./check_devtab [-v]
+//
+// Runs a small table well past its capacity and then ages half of it
+// out, so records are removed from the middle of probe runs. After every
+// update the table is checked whole: each record is found by a lookup
+// from its home slot, holds its own payload, the counts and the chunk
+// slabs agree, and a copy kept up to date only from ns_devtab_update()'s
+// result and the mirror callback equals the table. Exits with 1 if any
+// check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+#include "devtab.h"
+
+#define CHECK_DEVICES       48      /* a 64 slot table */
+#define CHECK_ARRIVALS      2000    /* devices run through the full table */
+#define CHECK_MAX_AGE_MS    1000
+#define CHECK_ROUNDS        8       /* updates of each surviving device once the others aged */
+
+static int verbose;
+static int failed;
+
+/* Slot keys as the mirror callback tells them */
+static uint64_t check_mirror_keys[CHECK_DEVICES * 4 / 3];
+static uint64_t check_mirror_calls;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -v            print every check, not only the failed ones\n");
+    printf("  -h            show this help\n");
+}
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        failed++;
+    }
+    if (!ok || verbose) {
+        printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    }
+}
+
+static void check_mirror(const struct ns_devtab *tab, uint32_t slot)
+{
+    check_mirror_keys[slot] = tab->slots[slot].key;
+    check_mirror_calls++;
+}
+
+/* Device n, its payload is 12 or, for every fifth, 40 bytes made from n.
+ * A full table has more of the long ones than large chunks. */
+static void check_report(ns_adv_report_t *rpt, uint8_t *data, uint32_t n)
+{
+    int i;
+
+    memset(rpt, 0, sizeof(*rpt));
+    rpt->bdaddr.b[0] = (uint8_t)n;
+    rpt->bdaddr.b[1] = (uint8_t)(n >> 8);
+    rpt->bdaddr.b[2] = (uint8_t)(n >> 16);
+    rpt->bdaddr.b[5] = 0xC0;
+    rpt->bdaddr_type = 0x01;
+    rpt->rssi = (int8_t)(-40 - (int)(n % 50));
+    rpt->length = n % 5 ? 12 : 40;
+    for (i = 0; i < rpt->length; i++) {
+        data[i] = (uint8_t)(n * 3 + i);
+    }
+    rpt->data = data;
+}
+
+static uint32_t check_device(const struct ns_dev *dev)
+{
+    return (uint32_t)(dev->key & 0xFFFFFF);
+}
+
+/* The whole table, 0 if anything is off */
+static int check_table(const struct ns_devtab *tab)
+{
+    const struct ns_dev *dev;
+    const uint8_t *payload;
+    uint32_t used = 0;
+    uint32_t large = 0;
+    uint32_t n;
+    uint32_t i;
+    bdaddr_t ba;
+    uint8_t type;
+    int j;
+
+    for (i = 0; i <= tab->mask; i++) {
+        dev = &tab->slots[i];
+        if (check_mirror_keys[i] != dev->key) {
+            return 0;
+        }
+        if (!dev->key) {
+            continue;
+        }
+        used++;
+        ns_devtab_key_addr(dev->key, &ba, &type);
+        if (ns_devtab_lookup(tab, &ba, type) != dev) {
+            return 0;
+        }
+        n = check_device(dev);
+        payload = ns_dev_payload(tab, dev);
+        /* A long payload keeps its first bytes if no large chunk was free */
+        if (ns_dev_payload_len(dev) != (n % 5 ? 12 : 40) &&
+            (n % 5 || ns_dev_payload_len(dev) != NS_DEVTAB_SMALL_MAX)) {
+            return 0;
+        }
+        if (!payload) {
+            return 0;
+        }
+        large += ns_dev_payload_len(dev) > NS_DEVTAB_SMALL_MAX;
+        for (j = 0; j < ns_dev_payload_len(dev); j++) {
+            if (payload[j] != (uint8_t)(n * 3 + j)) {
+                return 0;
+            }
+        }
+    }
+    return used == tab->used && used <= tab->max_used &&
+           tab->small.used + tab->large.used == used && tab->large.used == large;
+}
+
+static struct ns_dev *check_update(struct ns_devtab *tab, uint32_t n, uint64_t now_ms, int *ok)
+{
+    uint8_t data[NS_DEVTAB_PAYLOAD_MAX];
+    ns_adv_report_t rpt;
+    struct ns_dev *dev;
+
+    check_report(&rpt, data, n);
+    dev = ns_devtab_update(tab, &rpt, now_ms);
+    check_mirror_keys[dev - tab->slots] = dev->key;
+    if (*ok && !check_table(tab)) {
+        printf("table inconsistent after the update of device %u at %llu ms\n",
+               n, (unsigned long long)now_ms);
+        *ok = 0;
+    }
+    return dev;
+}
+
+static int check_init(struct ns_devtab *tab, uint64_t max_age_ms)
+{
+    if (ns_devtab_init(tab, CHECK_DEVICES) < 0) {
+        check(0, "cannot allocate the table");
+        return -1;
+    }
+    if (tab->mask + 1 != sizeof(check_mirror_keys) / sizeof(check_mirror_keys[0])) {
+        check(0, "unexpected table capacity");
+        ns_devtab_free(tab);
+        return -1;
+    }
+    memset(check_mirror_keys, 0, sizeof(check_mirror_keys));
+    check_mirror_calls = 0;
+    tab->mirror = check_mirror;
+    tab->max_age_ms = max_age_ms;
+    return 0;
+}
+
+/* A full table takes every new device, making room with cold ones, and
+ * keeps a device that is heard all along */
+static void check_evict(void)
+{
+    struct ns_devtab tab;
+    struct ns_dev *dev;
+    bdaddr_t ba;
+    int ok = 1;
+    uint32_t n;
+
+    if (check_init(&tab, 0) < 0) {
+        return;
+    }
+
+    for (n = 1; n <= CHECK_ARRIVALS; n++) {
+        check_update(&tab, 0, n, &ok);
+        dev = check_update(&tab, n, n, &ok);
+        if (check_device(dev) != n) {
+            ok = 0;
+        }
+    }
+    check(ok, "table stays consistent while evicting");
+    check(tab.used == tab.max_used, "full table stays full");
+    check(tab.evicted == CHECK_ARRIVALS + 1 - tab.max_used, "every device past the capacity evicts one");
+    check(tab.expired == 0, "no device expires without max_age_ms");
+    check(tab.truncated > 0, "long payloads are cut when the large chunks run out");
+    check(check_mirror_calls >= tab.evicted, "mirror hears of every eviction");
+
+    dev = NULL;
+    for (n = 0; n <= tab.mask; n++) {
+        if (tab.slots[n].key && check_device(&tab.slots[n]) == 0) {
+            dev = &tab.slots[n];
+        }
+    }
+    check(dev && dev->count == CHECK_ARRIVALS, "device heard all along is never evicted");
+    for (n = CHECK_ARRIVALS - 3; n <= CHECK_ARRIVALS; n++) {
+        ba.b[0] = (uint8_t)n;
+        ba.b[1] = (uint8_t)(n >> 8);
+        ba.b[2] = 0;
+        ba.b[3] = 0;
+        ba.b[4] = 0;
+        ba.b[5] = 0xC0;
+        if (!ns_devtab_lookup(&tab, &ba, 0x01)) {
+            dev = NULL;
+        }
+    }
+    check(dev != NULL, "latest devices are in the table");
+    ns_devtab_free(&tab);
+}
+
+/* Devices not heard for max_age_ms are removed by the hand, records
+ * after them move back along their probe runs */
+static void check_age(void)
+{
+    struct ns_devtab tab;
+    struct ns_dev *dev;
+    uint32_t kept = 0;
+    uint32_t lost = 0;
+    uint32_t n;
+    int ok = 1;
+    int round;
+
+    if (check_init(&tab, CHECK_MAX_AGE_MS) < 0) {
+        return;
+    }
+
+    for (n = 0; n < CHECK_DEVICES; n++) {
+        check_update(&tab, n, 0, &ok);
+    }
+    for (n = 1; n < CHECK_DEVICES; n += 2) {
+        check_update(&tab, n, CHECK_MAX_AGE_MS / 2, &ok);
+    }
+    /* The even ones are past max_age_ms now, the odd ones are not */
+    for (round = 0; round < CHECK_ROUNDS; round++) {
+        for (n = 1; n < CHECK_DEVICES; n += 2) {
+            check_update(&tab, n, CHECK_MAX_AGE_MS + 100, &ok);
+        }
+    }
+    check(ok, "table stays consistent while aging");
+    check(tab.expired == CHECK_DEVICES / 2, "every device not heard expires");
+    check(tab.evicted == 0, "aging makes room before eviction is needed");
+
+    for (n = 0; n <= tab.mask; n++) {
+        dev = &tab.slots[n];
+        if (!dev->key) {
+            continue;
+        }
+        if (check_device(dev) % 2 && dev->count == 2 + CHECK_ROUNDS) {
+            kept++;
+        } else {
+            lost++;
+        }
+    }
+    check(kept == CHECK_DEVICES / 2 && lost == 0, "devices heard stay, with all their reports");
+    check(tab.small.used + tab.large.used == CHECK_DEVICES / 2, "chunks of expired devices are freed");
+    ns_devtab_free(&tab);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    check_evict();
+    check_age();
+
+    if (failed) {
+        printf("%d checks failed\n", failed);
+        return 1;
+    }
+    printf("All device table checks passed\n");
+    return 0;
+}
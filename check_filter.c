@@ -0,0 +1,247 @@
+// Checks for the report filter: parsing, evaluation and filter files.
+//
+// Compile with:
+//   cc -O2 check_filter.c bleapi.c devtab.c suppress.c output.c extadv.c filter.c metrics.c match.c decode.c sightlog.c rpa.c -pthread -lbluetooth -ldl -o check_filter
+// Run with:
+//   ./check_filter [-v]
+//
+// Every case compiles an expression and runs it against a report built
+// from a few AD structures; expressions that must not compile are
+// checked for the error. Exits with 1 if any case fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+#include "filter.h"
+
+#define CHECK_LONG_VALUES   600     /* names on the long filter file line */
+
+static int verbose;
+static int failed;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -v            print every check, not only the failed ones\n");
+    printf("  -h            show this help\n");
+}
+
+static void check(int ok, const char *what, const char *expr)
+{
+    if (!ok) {
+        failed++;
+    }
+    if (!ok || verbose) {
+        printf("%s: %s: %s\n", ok ? "ok" : "FAILED", what, expr);
+    }
+}
+
+/* A report from 11:22:33:44:55:66 at -60 dBm, data is AD structures */
+static void check_report(ns_adv_report_t *rpt, const uint8_t *data, int len)
+{
+    memset(rpt, 0, sizeof(*rpt));
+    str2ba("11:22:33:44:55:66", &rpt->bdaddr);
+    rpt->rssi = -60;
+    rpt->evt_type = 0x00;
+    rpt->data = data;
+    rpt->length = (uint16_t)len;
+}
+
+static void check_run(const char *expr, const ns_adv_report_t *rpt, int want)
+{
+    struct ns_filter f;
+    char err[128];
+
+    if (ns_filter_compile(&f, expr, err, sizeof(err)) < 0) {
+        check(0, err, expr);
+        return;
+    }
+    check(ns_filter_run(&f, rpt) == want, want ? "should match" : "should not match", expr);
+    ns_filter_free(&f);
+}
+
+static void check_error(const char *expr)
+{
+    struct ns_filter f;
+    char err[128];
+
+    err[0] = '\0';
+    if (ns_filter_compile(&f, expr, err, sizeof(err)) == 0) {
+        ns_filter_free(&f);
+        check(0, "should not compile", expr);
+        return;
+    }
+    check(err[0] != '\0', "error without a message", expr);
+}
+
+static void check_eval(void)
+{
+    /* flags, complete name "Thermo-01", 16 bit UUIDs 180f 181a,
+     * 128 bit UUID, Apple manufacturer data 02 15 .. */
+    static const uint8_t data[] = {
+        0x02, 0x01, 0x06,
+        0x0a, 0x09, 'T', 'h', 'e', 'r', 'm', 'o', '-', '0', '1',
+        0x05, 0x03, 0x0f, 0x18, 0x1a, 0x18,
+        0x11, 0x07, 0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+                    0x00, 0x10, 0x00, 0x00, 0x0d, 0x18, 0x00, 0x00,
+        0x07, 0xff, 0x4c, 0x00, 0x02, 0x15, 0xaa, 0xbb,
+    };
+    /* shortened name only */
+    static const uint8_t shortened[] = {
+        0x06, 0x08, 'T', 'h', 'e', 'r', 'm',
+    };
+    ns_adv_report_t rpt;
+
+    check_report(&rpt, data, sizeof(data));
+
+    check_run("name=Thermo-01", &rpt, 1);
+    check_run("name=Thermo", &rpt, 0);
+    check_run("name=\"Thermo-01\"", &rpt, 1);
+    check_run("name^=Therm", &rpt, 1);
+    check_run("name^=Thermo-01", &rpt, 1);
+    check_run("name^=Thermo-012", &rpt, 0);
+    check_run("name=a,b,Thermo-01", &rpt, 1);
+
+    check_run("uuid=180f", &rpt, 1);
+    check_run("uuid=181a", &rpt, 1);
+    check_run("uuid=1800", &rpt, 0);
+    check_run("uuid=0000180f", &rpt, 0);
+    check_run("uuid=0000180d-0000-1000-8000-00805f9b34fb", &rpt, 1);
+    check_run("uuid=0000180e-0000-1000-8000-00805f9b34fb", &rpt, 0);
+
+    check_run("mfr=004c", &rpt, 1);
+    check_run("mfr=004c:0215", &rpt, 1);
+    check_run("mfr=004c:0216", &rpt, 0);
+    check_run("mfr=0059", &rpt, 0);
+
+    check_run("addr=11:22:33:44:55:66", &rpt, 1);
+    check_run("addr=11:22:33:44:55:67", &rpt, 0);
+    check_run("oui=11:22:33", &rpt, 1);
+    check_run("oui=11:22:34", &rpt, 0);
+
+    check_run("rssi>=-60", &rpt, 1);
+    check_run("rssi>-60", &rpt, 0);
+    check_run("rssi<=-60", &rpt, 1);
+    check_run("rssi<-60", &rpt, 0);
+    check_run("evt=0", &rpt, 1);
+    check_run("evt=4", &rpt, 0);
+
+    check_run("name=x | uuid=180f", &rpt, 1);
+    check_run("name=x or uuid=1800", &rpt, 0);
+    check_run("name=Thermo-01 & rssi>=-50", &rpt, 0);
+    check_run("name=Thermo-01 and rssi>=-70", &rpt, 1);
+    check_run("!name=Thermo-01", &rpt, 0);
+    check_run("not (uuid=1800 | mfr=0059)", &rpt, 1);
+    check_run("(name=x | name=Thermo-01) & (uuid=1800 | uuid=181a)", &rpt, 1);
+    check_run("name=x | name=y | rssi<-90 | uuid=1801", &rpt, 0);
+
+    check_report(&rpt, shortened, sizeof(shortened));
+    check_run("name=Therm", &rpt, 1);
+    check_run("name^=The", &rpt, 1);
+    check_run("uuid=180f", &rpt, 0);
+    check_run("!mfr=004c", &rpt, 1);
+
+    /* No payload at all */
+    check_report(&rpt, NULL, 0);
+    check_run("name^=T", &rpt, 0);
+    check_run("!uuid=180f & rssi<0", &rpt, 1);
+}
+
+static void check_errors(void)
+{
+    check_error("");
+    check_error("name");
+    check_error("name=");
+    check_error("colour=red");
+    check_error("name=x &");
+    check_error("(name=x");
+    check_error("name=x)");
+    check_error("uuid=18");
+    check_error("uuid=xyz0");
+    check_error("addr=11:22:33");
+    check_error("oui=11:22:33:44");
+    check_error("rssi>=loud");
+    check_error("name=\"unterminated");
+    /* An empty name would match every report, or none */
+    check_error("name=\"\"");
+    check_error("name^=\"\"");
+    check_error("name=a,\"\",b");
+}
+
+/* One line of a filter file far longer than any fixed line buffer, it
+ * must be read as one expression rather than cut into pieces */
+static void check_long_line(void)
+{
+    char path[] = "/tmp/check_filterXXXXXX";
+    static const uint8_t far[] = { 0x08, 0x09, 'd', 'e', 'v', '0', '5', '9', '9' };
+    static const uint8_t none[] = { 0x08, 0x09, 'd', 'e', 'v', '0', '6', '0', '0' };
+    struct ns_filter f;
+    ns_adv_report_t rpt;
+    char err[128];
+    FILE *fp;
+    int fd;
+    int i;
+
+    fd = mkstemp(path);
+    if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+        check(0, "cannot create a filter file", path);
+        return;
+    }
+    fprintf(fp, "# watch list\n");
+    for (i = 0; i < CHECK_LONG_VALUES; i++) {
+        fprintf(fp, "%sdev%04d", i ? "," : "name=", i);
+    }
+    fprintf(fp, "\nrssi>=-20\n");
+    fclose(fp);
+
+    if (ns_filter_load(&f, path, err, sizeof(err)) < 0) {
+        check(0, err, "long filter file line");
+        unlink(path);
+        return;
+    }
+    unlink(path);
+
+    check_report(&rpt, far, sizeof(far));
+    check(ns_filter_run(&f, &rpt) == 1, "should match the last name", "long filter file line");
+    check_report(&rpt, none, sizeof(none));
+    check(ns_filter_run(&f, &rpt) == 0, "should not match", "long filter file line");
+    rpt.rssi = -10;
+    check(ns_filter_run(&f, &rpt) == 1, "should match the next line", "long filter file line");
+    ns_filter_free(&f);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    check_eval();
+    check_errors();
+    check_long_line();
+
+    if (failed) {
+        printf("%d checks failed\n", failed);
+        return 1;
+    }
+    printf("All filter checks passed\n");
+    return 0;
+}
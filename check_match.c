@@ -0,0 +1,193 @@
+// Checks for the watch list string sets of match.h.
+//
+// Compile with:
+//   cc -O2 check_match.c match.c -o check_match
+// Run with:
+//   ./check_match [-v]
+//
+// Builds sets of strings of many lengths, empty ones among them, and
+// checks exact and prefix lookups of every string, of its neighbours and
+// of strings that differ only past the 16 byte key. Exits with 1 if any
+// check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "match.h"
+
+#define CHECK_STRINGS       3000    /* in the large set, enough for many buckets per group */
+#define CHECK_LEN_MAX       40
+
+static int verbose;
+static int failed;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -v            print every check, not only the failed ones\n");
+    printf("  -h            show this help\n");
+}
+
+static void check(int ok, const char *what, const char *s)
+{
+    if (!ok) {
+        failed++;
+    }
+    if (!ok || verbose) {
+        printf("%s: %s: \"%s\"\n", ok ? "ok" : "FAILED", what, s);
+    }
+}
+
+/* Appends s as <len><bytes> to vals, returns the new end */
+static uint8_t *check_put(uint8_t *vals, const char *s)
+{
+    size_t len = strlen(s);
+
+    *vals++ = (uint8_t)len;
+    memcpy(vals, s, len);
+    return vals + len;
+}
+
+static int check_exact(const struct ns_match *m, const char *s)
+{
+    return ns_match_exact(m, (const uint8_t *)s, (uint32_t)strlen(s));
+}
+
+static int check_prefix(const struct ns_match *m, const char *s)
+{
+    return ns_match_prefix(m, (const uint8_t *)s, (uint32_t)strlen(s));
+}
+
+/* Empty strings are left out: they must neither break the build nor
+ * make every lookup match */
+static void check_empty(void)
+{
+    static const char *strs[] = { "", "Thermo", "", "0123456789abcdefXYZ", "" };
+    uint8_t vals[64];
+    uint8_t *p = vals;
+    struct ns_match m;
+    size_t i;
+
+    for (i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+        p = check_put(p, strs[i]);
+    }
+    if (ns_match_build(&m, vals, sizeof(strs) / sizeof(strs[0])) < 0) {
+        check(0, "cannot build", "");
+        return;
+    }
+    check(m.ngroups == 2, "empty strings make no group", "");
+    check(!check_exact(&m, ""), "should not match", "");
+    check(!check_prefix(&m, ""), "should not match as a prefix", "");
+    check(!check_prefix(&m, "x"), "should not match as a prefix", "x");
+    check(check_exact(&m, "Thermo"), "should match", "Thermo");
+    check(check_prefix(&m, "Thermo-01"), "should match as a prefix", "Thermo-01");
+    check(check_exact(&m, "0123456789abcdefXYZ"), "should match", "0123456789abcdefXYZ");
+    check(!check_exact(&m, "0123456789abcdefXYW"), "should not match past the key", "0123456789abcdefXYW");
+    ns_match_free(&m);
+
+    /* Nothing but empty strings */
+    vals[0] = 0;
+    vals[1] = 0;
+    if (ns_match_build(&m, vals, 2) < 0) {
+        check(0, "cannot build", "");
+        return;
+    }
+    check(m.ngroups == 0, "only empty strings make no group", "");
+    check(!check_exact(&m, ""), "should not match", "");
+    check(!check_prefix(&m, "abc"), "should not match as a prefix", "abc");
+    ns_match_free(&m);
+}
+
+/* String i of the large set, i < CHECK_STRINGS, 1 to CHECK_LEN_MAX bytes
+ * that only differ from their neighbours in the last ones */
+static void check_string(uint32_t i, char *s)
+{
+    int len = 1 + (int)(i % CHECK_LEN_MAX);
+    int j;
+
+    for (j = 0; j < len; j++) {
+        s[j] = (char)('a' + (j * 7 + (int)i) % 26);
+    }
+    snprintf(s + (len > 4 ? len - 4 : 0), 5, "%04u", i % 10000);
+    s[len] = '\0';
+}
+
+static void check_large(void)
+{
+    uint8_t *vals = malloc((size_t)CHECK_STRINGS * (CHECK_LEN_MAX + 1));
+    uint8_t *p = vals;
+    char s[CHECK_LEN_MAX + 8];
+    char t[CHECK_LEN_MAX + 8];
+    struct ns_match m;
+    uint32_t exact = 0;
+    uint32_t prefix = 0;
+    uint32_t stray = 0;
+    uint32_t i;
+    size_t len;
+
+    if (!vals) {
+        check(0, "out of memory", "");
+        return;
+    }
+    for (i = 0; i < CHECK_STRINGS; i++) {
+        check_string(i, s);
+        p = check_put(p, s);
+    }
+    if (ns_match_build(&m, vals, CHECK_STRINGS) < 0) {
+        check(0, "cannot build", "");
+        free(vals);
+        return;
+    }
+
+    for (i = 0; i < CHECK_STRINGS; i++) {
+        check_string(i, s);
+        len = strlen(s);
+        exact += check_exact(&m, s);
+        /* Longer data starts with the string */
+        snprintf(t, sizeof(t), "%s!?", s);
+        prefix += check_prefix(&m, t);
+        /* Same length, the last byte changed, is in the set only if
+         * another string happens to be it */
+        t[len - 1] = '~';
+        t[len] = '\0';
+        stray += check_exact(&m, t);
+    }
+    check(exact == CHECK_STRINGS, "every string should match", "large set");
+    check(prefix == CHECK_STRINGS, "every string should match as a prefix", "large set");
+    check(stray == 0, "changed strings should not match", "large set");
+
+    ns_match_free(&m);
+    free(vals);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    check_empty();
+    check_large();
+
+    if (failed) {
+        printf("%d checks failed\n", failed);
+        return 1;
+    }
+    printf("All match checks passed (%s)\n", ns_match_impl());
+    return 0;
+}
@@ -0,0 +1,227 @@
+// Checks for resolvable private address resolution.
+//
+// Compile with:
+//   cc -O2 check_rpa.c rpa.c -lbluetooth -o check_rpa
+// Run with:
+//   ./check_rpa [-v]
+//
+// Checks ah() against the sample data of the Core specification (Vol 3,
+// Part H, D.7) and key searches with every implementation the CPU has,
+// the key at each position of the AES-NI lanes and of the tail after
+// them, then the per thread cache. Exits with 1 if any check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <bluetooth/bluetooth.h>
+
+#include "rpa.h"
+
+#define CHECK_KEYS          (2 * NS_RPA_LANES + 5)  /* two full batches and a tail */
+#define CHECK_ADDRESSES     2000                    /* generated RPAs per implementation */
+
+/* Core specification sample data: ah(irk, 708194) = 0dfbaa */
+static const uint8_t check_irk[16] = {
+    0xec, 0x02, 0x34, 0xa3, 0x57, 0xc8, 0xad, 0x05,
+    0x34, 0x10, 0x10, 0xa6, 0x0a, 0x39, 0x7d, 0x9b,
+};
+static const uint8_t check_prand[3] = { 0x70, 0x81, 0x94 };
+static const uint8_t check_hash[3] = { 0x0d, 0xfb, 0xaa };
+
+static int verbose;
+static int failed;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  -v            print every check, not only the failed ones\n");
+    printf("  -h            show this help\n");
+}
+
+static void check(int ok, const char *what, const char *impl)
+{
+    if (!ok) {
+        failed++;
+    }
+    if (!ok || verbose) {
+        printf("%s: %s (%s)\n", ok ? "ok" : "FAILED", what, impl);
+    }
+}
+
+/* The RPA prand || ah(key, prand), bdaddr_t holds it least significant byte first */
+static void check_rpa(const uint8_t key[16], const uint8_t prand[3], bdaddr_t *ba)
+{
+    uint8_t hash[3];
+    int i;
+
+    ns_rpa_ah(key, prand, hash);
+    for (i = 0; i < 3; i++) {
+        ba->b[5 - i] = prand[i];
+        ba->b[2 - i] = hash[i];
+    }
+}
+
+/* Key i of the list, the spec key at position at */
+static void check_key(int i, int at, uint8_t key[16])
+{
+    int j;
+
+    memcpy(key, check_irk, 16);
+    if (i != at) {
+        for (j = 0; j < 16; j++) {
+            key[j] ^= (uint8_t)(0x5a + i * 31 + j);
+        }
+    }
+}
+
+static void check_ah(void)
+{
+    uint8_t hash[3];
+    bdaddr_t ba;
+    char s[18];
+
+    ns_rpa_ah(check_irk, check_prand, hash);
+    check(!memcmp(hash, check_hash, 3), "ah() of the sample data is 0dfbaa", "table");
+
+    check_rpa(check_irk, check_prand, &ba);
+    ba2str(&ba, s);
+    check(!strcmp(s, "70:81:94:0D:FB:AA"), "sample RPA is 70:81:94:0D:FB:AA", "table");
+    check(ns_rpa_is_resolvable(&ba, 0x01), "sample RPA is resolvable", "table");
+    check(!ns_rpa_is_resolvable(&ba, 0x00), "public address is not resolvable", "table");
+}
+
+static void check_search(const char *impl)
+{
+    struct ns_irk_list l;
+    uint8_t key[16];
+    uint8_t prand[3];
+    bdaddr_t ba;
+    char what[64];
+    int found;
+    int at;
+    int i;
+
+    if (ns_rpa_use(impl) < 0) {
+        printf("skipped: %s not supported by this CPU\n", impl);
+        return;
+    }
+
+    /* The sample address against lists with the key at every position */
+    for (at = 0; at < CHECK_KEYS; at++) {
+        memset(&l, 0, sizeof(l));
+        for (i = 0; i < CHECK_KEYS; i++) {
+            check_key(i, at, key);
+            if (ns_irk_add(&l, key, NULL, 0, NULL) < 0) {
+                check(0, "out of memory", impl);
+                ns_irk_free(&l);
+                return;
+            }
+        }
+        check_rpa(check_irk, check_prand, &ba);
+        found = ns_irk_search(&l, &ba);
+        snprintf(what, sizeof(what), "sample RPA resolves with key %d of %d", at, CHECK_KEYS);
+        check(found == at, what, impl);
+        /* One bit of the hash off */
+        ba.b[0] ^= 0x01;
+        check(ns_irk_search(&l, &ba) == -1, "changed hash resolves with no key", impl);
+        ns_irk_free(&l);
+    }
+
+    /* A single key, shorter than one batch */
+    memset(&l, 0, sizeof(l));
+    ns_irk_add(&l, check_irk, NULL, 0, NULL);
+    check_rpa(check_irk, check_prand, &ba);
+    check(ns_irk_search(&l, &ba) == 0, "sample RPA resolves with the only key", impl);
+    ns_irk_free(&l);
+
+    /* Generated addresses of every key in the list */
+    memset(&l, 0, sizeof(l));
+    for (i = 0; i < CHECK_KEYS; i++) {
+        check_key(i, -1, key);
+        ns_irk_add(&l, key, NULL, 0, NULL);
+    }
+    found = 0;
+    for (i = 0; i < CHECK_ADDRESSES; i++) {
+        prand[0] = (uint8_t)(0x40 | (i * 13 & 0x3f));
+        prand[1] = (uint8_t)(i * 7);
+        prand[2] = (uint8_t)(i >> 3);
+        check_key(i % CHECK_KEYS, -1, key);
+        check_rpa(key, prand, &ba);
+        found += ns_irk_search(&l, &ba) == i % CHECK_KEYS;
+    }
+    check(found == CHECK_ADDRESSES, "generated RPAs resolve with their keys", impl);
+    ns_irk_free(&l);
+}
+
+static void check_cache(void)
+{
+    const struct ns_irk *irk;
+    struct ns_irk_list l;
+    struct ns_rpa r;
+    bdaddr_t identity;
+    uint8_t key[16];
+    bdaddr_t ba;
+    int i;
+
+    memset(&l, 0, sizeof(l));
+    str2ba("00:11:22:33:44:55", &identity);
+    for (i = 0; i < CHECK_KEYS; i++) {
+        check_key(i, 3, key);
+        ns_irk_add(&l, key, i == 3 ? &identity : NULL, 0, i == 3 ? "sample" : NULL);
+    }
+    if (ns_rpa_init(&r, &l, 64) < 0) {
+        check(0, "out of memory", ns_rpa_impl());
+        ns_irk_free(&l);
+        return;
+    }
+
+    check_rpa(check_irk, check_prand, &ba);
+    irk = ns_rpa_resolve(&r, &ba, 0x01);
+    check(irk && irk->index == 3 && !strcmp(irk->label, "sample") && !bacmp(&irk->identity, &identity),
+          "sample RPA resolves with its key and identity", ns_rpa_impl());
+    irk = ns_rpa_resolve(&r, &ba, 0x01);
+    check(irk && irk->index == 3 && r.hits == 1 && r.computed == 1,
+          "second lookup is a cache hit", ns_rpa_impl());
+    check(!ns_rpa_resolve(&r, &ba, 0x00), "public address is not resolved", ns_rpa_impl());
+
+    ba.b[0] ^= 0x01;
+    check(!ns_rpa_resolve(&r, &ba, 0x01) && !ns_rpa_resolve(&r, &ba, 0x01) &&
+          r.negative_hits == 1 && r.computed == 2,
+          "unknown RPA is cached as resolving with no key", ns_rpa_impl());
+
+    ns_rpa_free(&r);
+    ns_irk_free(&l);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    check_ah();
+    check_search("table");
+    check_search("aesni");
+    check_cache();
+
+    if (failed) {
+        printf("%d checks failed\n", failed);
+        return 1;
+    }
+    printf("All RPA checks passed\n");
+    return 0;
+}
@@ -0,0 +1,188 @@
+// Beacon payload decoders, see decode.h.
+
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <dlfcn.h>
+
+#include "decode.h"
+
+struct ns_decoder {
+    uint16_t key;
+    ns_decode_fn fn;
+};
+
+struct ns_decode_slot {
+    uint8_t count;
+    struct ns_decoder decoders[NS_DECODE_PER_TYPE];
+};
+
+static inline uint16_t ns_get_be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t ns_get_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* 4c 00 02 15 <uuid 16> <major be16> <minor be16> <tx> */
+static int ns_decode_ibeacon(const uint8_t *data, uint8_t len, struct ns_decoded *out)
+{
+    struct ns_ibeacon *b = &out->u.ibeacon;
+
+    if (len < 25 || data[2] != 0x02 || data[3] != 0x15) {
+        return -1;
+    }
+    memcpy(b->uuid, data + 4, sizeof(b->uuid));
+    b->major = htole16(ns_get_be16(data + 20));
+    b->minor = htole16(ns_get_be16(data + 22));
+    b->tx_power = (int8_t)data[24];
+    out->kind = NS_DEC_IBEACON;
+    out->len = sizeof(*b);
+    return 0;
+}
+
+/* aa fe <frame type> <frame> */
+static int ns_decode_eddystone(const uint8_t *data, uint8_t len, struct ns_decoded *out)
+{
+    const uint8_t *f = data + 3;
+
+    if (len < 4) {
+        return -1;
+    }
+    len -= 3;
+
+    switch (data[2]) {
+    case 0x00:                          /* UID: tx, nid[10], bid[6], 2 RFU */
+        if (len < 17) {
+            return -1;
+        }
+        out->u.uid.tx_power = (int8_t)f[0];
+        memcpy(out->u.uid.nid, f + 1, sizeof(out->u.uid.nid));
+        memcpy(out->u.uid.bid, f + 11, sizeof(out->u.uid.bid));
+        out->kind = NS_DEC_EDDYSTONE_UID;
+        out->len = sizeof(out->u.uid);
+        return 0;
+
+    case 0x10:                          /* URL: tx, scheme, encoded url */
+        if (len < 2 || len - 2 > NS_EDDYSTONE_URL_MAX || f[1] > 3) {
+            return -1;
+        }
+        out->u.url.tx_power = (int8_t)f[0];
+        out->u.url.scheme = f[1];
+        out->u.url.url_len = len - 2;
+        memcpy(out->u.url.url, f + 2, len - 2);
+        out->kind = NS_DEC_EDDYSTONE_URL;
+        out->len = sizeof(out->u.url);
+        return 0;
+
+    case 0x20:                          /* TLM: version, vbatt, temp, adv_cnt, sec_cnt */
+        if (len < 13 || f[0] != 0x00) {
+            return -1;
+        }
+        out->u.tlm.version = f[0];
+        out->u.tlm.vbatt_mv = htole16(ns_get_be16(f + 1));
+        out->u.tlm.temp = (int16_t)htole16(ns_get_be16(f + 3));
+        out->u.tlm.adv_cnt = htole32(ns_get_be32(f + 5));
+        out->u.tlm.sec_cnt = htole32(ns_get_be32(f + 9));
+        out->kind = NS_DEC_EDDYSTONE_TLM;
+        out->len = sizeof(out->u.tlm);
+        return 0;
+    }
+    return -1;
+}
+
+/* Indexed by ns_adv_index_slot(), manufacturer data is slot 0 */
+static struct ns_decode_slot ns_decode_table[NS_ADV_INDEX_SLOTS] = {
+    [0] = { 1, { { NS_COMPANY_APPLE, ns_decode_ibeacon } } },
+    [ESP_BLE_AD_TYPE_SERVICE_DATA] = { 1, { { NS_UUID_EDDYSTONE, ns_decode_eddystone } } },
+};
+
+/* Slots with at least one decoder, and slots dispatched by key */
+static uint64_t ns_decode_mask = 1ULL << 0 | 1ULL << ESP_BLE_AD_TYPE_SERVICE_DATA;
+static const uint64_t ns_decode_keyed = 1ULL << 0 | 1ULL << ESP_BLE_AD_TYPE_SERVICE_DATA;
+
+int ns_decode_register(uint8_t ad_type, uint16_t key, ns_decode_fn fn)
+{
+    int slot = ns_adv_index_slot(ad_type);
+    struct ns_decode_slot *s;
+
+    if (slot < 0 || !fn) {
+        return -1;
+    }
+    s = &ns_decode_table[slot];
+    if (s->count == NS_DECODE_PER_TYPE) {
+        return -1;
+    }
+    s->decoders[s->count].key = (ns_decode_keyed & (1ULL << slot)) ? key : 0;
+    s->decoders[s->count].fn = fn;
+    s->count++;
+    ns_decode_mask |= 1ULL << slot;
+    return 0;
+}
+
+int ns_decode_load(const char *path)
+{
+    int (*init)(int (*)(uint8_t, uint16_t, ns_decode_fn));
+    void *handle;
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "Can not load decoder plugin: %s\n", dlerror());
+        return -1;
+    }
+    *(void **)&init = dlsym(handle, NS_DECODE_PLUGIN_INIT);
+    if (!init) {
+        fprintf(stderr, "Decoder plugin %s has no %s\n", path, NS_DECODE_PLUGIN_INIT);
+        dlclose(handle);
+        return -1;
+    }
+    if (init(ns_decode_register) < 0) {
+        fprintf(stderr, "Decoder plugin %s failed to register\n", path);
+        return -1;
+    }
+    /* The plugin stays loaded, its decoders are in the table */
+    return 0;
+}
+
+int ns_decode_report(const ns_adv_index_t *idx, struct ns_decoded *out, int max)
+{
+    uint64_t todo = idx->present & ns_decode_mask;
+    const struct ns_decode_slot *s;
+    const uint8_t *data;
+    uint16_t key;
+    uint8_t len;
+    int slot, i;
+    int n = 0;
+
+    while (todo && n < max) {
+        slot = __builtin_ctzll(todo);
+        todo &= todo - 1;
+
+        s = &ns_decode_table[slot];
+        data = idx->base + idx->off[slot];
+        len = idx->len[slot];
+        key = 0;
+        if (ns_decode_keyed & (1ULL << slot)) {
+            if (len < 2) {
+                continue;
+            }
+            key = (uint16_t)(data[0] | data[1] << 8);
+        }
+
+        for (i = 0; i < s->count; i++) {
+            if (s->decoders[i].key == key && s->decoders[i].fn(data, len, &out[n]) == 0) {
+                out[n].key = key;
+                out[n].ad_type = slot ? slot : ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE;
+                if (out[n].len > sizeof(out[n].u)) {
+                    out[n].len = sizeof(out[n].u);
+                }
+                n++;
+                break;
+            }
+        }
+    }
+    return n;
+}
@@ -0,0 +1,111 @@
+#ifndef __NS_DECODE_H__
+#define __NS_DECODE_H__
+
+#include <stdint.h>
+
+#include "bleapi.h"
+
+/* Payload decoders for known beacon formats.
+ *
+ * Decoders are dispatched on the AD structures of a report through a
+ * table indexed like ns_adv_index_t (esp_ble_adv_data_type, manufacturer
+ * data in slot 0), so a report whose AD types have no decoder costs one
+ * AND against the index. Within a slot, manufacturer data is keyed by
+ * company ID and 16-bit service data by service UUID, both read little
+ * endian from the first two bytes; other AD types are not keyed.
+ *
+ * A decoder fills a fixed-layout struct and formats nothing; output.c
+ * turns the structs into text or JSON, the binary format carries them
+ * as they are. Multi-byte fields are little endian, as in the binary
+ * output, whatever byte order the beacon format uses on air.
+ *
+ * Built in: iBeacon (Apple 0x004C, type 0x02 0x15) and Eddystone UID,
+ * URL and TLM (service data 0xFEAA). More decoders, for our own sensor
+ * formats, come in through ns_decode_register(), directly or from a
+ * plugin loaded with ns_decode_load(). Registration is not thread safe,
+ * it has to happen before the scan starts. */
+
+#define NS_DECODE_MAX               4       /* decoded structures per report */
+#define NS_DECODE_PER_TYPE          8       /* decoders per AD type */
+#define NS_DECODE_RAW_MAX           32      /* bytes a plugin decoder may fill */
+
+#define NS_COMPANY_APPLE            0x004C
+#define NS_UUID_EDDYSTONE           0xFEAA
+
+enum ns_decode_kind {
+    NS_DEC_IBEACON = 1,
+    NS_DEC_EDDYSTONE_UID,
+    NS_DEC_EDDYSTONE_URL,
+    NS_DEC_EDDYSTONE_TLM,
+    NS_DEC_USER = 0x100,                    /* first kind for registered decoders */
+};
+
+struct ns_ibeacon {
+    uint8_t uuid[16];
+    uint16_t major;
+    uint16_t minor;
+    int8_t tx_power;                        /* measured RSSI at 1 m */
+} __attribute__((packed));
+
+struct ns_eddystone_uid {
+    int8_t tx_power;                        /* at 0 m */
+    uint8_t nid[10];                        /* namespace */
+    uint8_t bid[6];                         /* instance */
+} __attribute__((packed));
+
+#define NS_EDDYSTONE_URL_MAX        17
+
+struct ns_eddystone_url {
+    int8_t tx_power;                        /* at 0 m */
+    uint8_t scheme;                         /* 0 http://www. 1 https://www. 2 http:// 3 https:// */
+    uint8_t url_len;
+    uint8_t url[NS_EDDYSTONE_URL_MAX];      /* still encoded, codes 0x00..0x0d not expanded */
+} __attribute__((packed));
+
+#define NS_EDDYSTONE_TEMP_NONE      ((int16_t)0x8000)
+
+struct ns_eddystone_tlm {
+    uint8_t version;                        /* 0, encrypted TLM is not decoded */
+    uint16_t vbatt_mv;                      /* 0 = not supported */
+    int16_t temp;                           /* degrees C, signed 8.8 fixed point */
+    uint32_t adv_cnt;                       /* advertisements since power on */
+    uint32_t sec_cnt;                       /* 0.1 s units since power on */
+} __attribute__((packed));
+
+struct ns_decoded {
+    uint16_t kind;                          /* enum ns_decode_kind */
+    uint16_t key;                           /* company ID or service UUID, 0 if not keyed */
+    uint8_t ad_type;                        /* esp_ble_adv_data_type it was decoded from */
+    uint8_t len;                            /* bytes of u filled */
+    union {
+        struct ns_ibeacon ibeacon;
+        struct ns_eddystone_uid uid;
+        struct ns_eddystone_url url;
+        struct ns_eddystone_tlm tlm;
+        uint8_t raw[NS_DECODE_RAW_MAX];
+    } u;
+};
+
+/* data/len is the AD structure after its type byte, key included. Fills
+ * out->kind, out->len and out->u, returns 0, or -1 if data is not in the
+ * decoder's format. */
+typedef int (*ns_decode_fn)(const uint8_t *data, uint8_t len, struct ns_decoded *out);
+
+/* Add fn for ad_type, keyed by key for manufacturer and 16-bit service
+ * data (ignored otherwise). Decoders of a type are tried in the order
+ * they were added, the built-in ones first. Returns 0, or -1 if the type
+ * is not indexed or has NS_DECODE_PER_TYPE decoders already. */
+int ns_decode_register(uint8_t ad_type, uint16_t key, ns_decode_fn fn);
+
+/* Load a shared object and call its
+ *   int ns_decode_plugin_init(int (*reg)(uint8_t, uint16_t, ns_decode_fn));
+ * which registers its decoders through reg. Returns 0, or -1 with the
+ * reason printed to stderr. */
+#define NS_DECODE_PLUGIN_INIT       "ns_decode_plugin_init"
+int ns_decode_load(const char *path);
+
+/* Decode the AD structures of idx into out, at most max of them, one
+ * per AD type. Returns the number filled. */
+int ns_decode_report(const ns_adv_index_t *idx, struct ns_decoded *out, int max);
+
+#endif //__NS_DECODE_H__
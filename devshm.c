@@ -0,0 +1,156 @@
+// Device state in shared memory, see devshm.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "devshm.h"
+
+static size_t ns_shm_entries_off(void)
+{
+    return (sizeof(struct ns_shm_hdr) + sizeof(struct ns_shm_dev) - 1) / sizeof(struct ns_shm_dev) *
+           sizeof(struct ns_shm_dev);
+}
+
+int ns_shm_create(struct ns_shm *shm, const char *name, uint32_t shards, uint32_t slots)
+{
+    struct ns_shm_hdr *h;
+    struct timespec ts;
+    int fd;
+
+    memset(shm, 0, sizeof(*shm));
+    if (strlen(name) >= sizeof(shm->name) || !shards || !slots || (slots & (slots - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(shm->name, name);
+    shm->size = ns_shm_entries_off() + (size_t)shards * slots * sizeof(struct ns_shm_dev);
+
+    /* A fresh object, readers of an earlier run keep their old mapping */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, shm->size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    shm->hdr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->hdr == MAP_FAILED) {
+        shm->hdr = NULL;
+        shm_unlink(name);
+        return -1;
+    }
+
+    h = shm->hdr;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h->version = NS_SHM_VERSION;
+    h->entry_size = sizeof(struct ns_shm_dev);
+    h->shards = shards;
+    h->slots = slots;
+    h->entries_off = ns_shm_entries_off();
+    h->pid = getpid();
+    h->started_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    atomic_store(&h->state, NS_SHM_LIVE);
+    /* Readers check the magic last */
+    atomic_thread_fence(memory_order_release);
+    memcpy(h->magic, NS_SHM_MAGIC, sizeof(h->magic));
+    shm->owner = 1;
+    return 0;
+}
+
+void ns_shm_close(struct ns_shm *shm)
+{
+    if (!shm->hdr) {
+        return;
+    }
+    if (shm->owner) {
+        atomic_store(&shm->hdr->state, NS_SHM_CLOSED);
+        shm_unlink(shm->name);
+    }
+    munmap(shm->hdr, shm->size);
+    shm->hdr = NULL;
+}
+
+int ns_shm_attach(struct ns_shm *shm, const char *name)
+{
+    const struct ns_shm_hdr *h;
+    struct stat st;
+    int fd;
+
+    memset(shm, 0, sizeof(*shm));
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    shm->size = st.st_size;
+    shm->hdr = mmap(NULL, shm->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->hdr == MAP_FAILED) {
+        shm->hdr = NULL;
+        return -1;
+    }
+
+    h = shm->hdr;
+    if (memcmp(h->magic, NS_SHM_MAGIC, sizeof(h->magic)) || h->version != NS_SHM_VERSION ||
+        h->entry_size != sizeof(struct ns_shm_dev) || !h->slots || (h->slots & (h->slots - 1)) ||
+        h->entries_off + (uint64_t)h->shards * h->slots * h->entry_size > shm->size) {
+        ns_shm_detach(shm);
+        errno = EPROTO;
+        return -1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return 0;
+}
+
+void ns_shm_detach(struct ns_shm *shm)
+{
+    if (shm->hdr) {
+        munmap(shm->hdr, shm->size);
+        shm->hdr = NULL;
+    }
+}
+
+/* The probe of ns_devtab_lookup() on the shard's mirror. Every slot
+ * the table fills or empties is published, so an empty entry ends the
+ * probe as it would in the table. An entry that cannot be read is
+ * passed over. */
+int ns_shm_find(const struct ns_shm *shm, const bdaddr_t *bdaddr, uint8_t bdaddr_type, struct ns_shm_dev *out)
+{
+    uint64_t key = ns_devtab_key(bdaddr, bdaddr_type);
+    uint32_t shards = shm->hdr->shards;
+    uint32_t mask = shm->hdr->slots - 1;
+    uint32_t shard = shards > 1 ? (uint32_t)ns_devtab_shard(key, shards) : 0;
+    uint32_t i = (uint32_t)ns_devtab_hash(key) & mask;
+    uint32_t n;
+    int r;
+
+    for (n = 0; n <= mask; n++) {
+        r = ns_shm_read(ns_shm_entry(shm, shard, i), out);
+        if (!r) {
+            return 0;
+        }
+        if (r > 0 && out->key == key) {
+            return 1;
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+#ifndef __NS_DEVSHM_H__
+#define __NS_DEVSHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <bluetooth/bluetooth.h>
+
+#include "devtab.h"
+
+/* Live device state in POSIX shared memory, for other processes.
+ *
+ * The segment mirrors the device table: one region per shard (pipeline
+ * worker), one entry per table slot, so an update writes the entry of the
+ * slot ns_devtab_update() returned, and the slots an eviction or age-out
+ * emptied or moved records into are written as well (see devtab.h).
+ * Readers look devices up with the table's own hash and probe sequence
+ * (ns_shm_find()); a lookup that races with a removal in the same
+ * cluster may miss a device that is there a moment later.
+ *
+ * Every entry is a seqlock: the writer makes seq odd, stores the fields
+ * and makes it even again. Readers copy the entry and retry if seq was
+ * odd or changed meanwhile (ns_shm_read()), for NS_SHM_READ_TRIES at
+ * most, so an entry a killed scanner left half written is reported as
+ * such rather than hanging the reader. The writer never waits for
+ * readers, readers take no locks and make no syscalls once attached.
+ *
+ * Readers include this header and link devshm.c, or map the segment
+ * themselves: the layout below is all there is, in host byte order. */
+
+#define NS_SHM_MAGIC                "NSDEVSHM"
+#define NS_SHM_VERSION              2
+#define NS_SHM_NAME_DEFAULT         "/ble-scanner"
+#define NS_SHM_READ_TRIES           4096        /* an odd seq this long is a dead writer */
+
+enum ns_shm_state {
+    NS_SHM_LIVE = 1,
+    NS_SHM_CLOSED,                  /* the scanner exited, entries are final */
+};
+
+struct ns_shm_dev {
+    _Atomic uint32_t seq;           /* odd while being written, 0 = never used */
+    uint32_t count;                 /* reports seen */
+    uint64_t key;                   /* ns_devtab_key(), 0 = empty slot */
+    uint64_t first_seen_ms;         /* CLOCK_REALTIME, whole seconds */
+    uint64_t last_seen_ms;
+    int8_t rssi_last;
+    int8_t rssi_avg;
+    int8_t rssi_min;
+    int8_t rssi_max;
+    uint8_t evt_type;               /* of the latest report */
+    uint8_t adapter;                /* of the latest report */
+    uint8_t adapter_mask;
+    uint8_t flags;                  /* NS_DEV_* */
+    int8_t adapter_rssi[NS_ADAPTERS_MAX];
+    uint8_t payload_len;
+    uint8_t payload[NS_DEVTAB_PAYLOAD_MAX];
+} __attribute__((aligned(128)));
+
+struct ns_shm_hdr {
+    char magic[8];                  /* NS_SHM_MAGIC */
+    uint32_t version;
+    uint32_t entry_size;            /* sizeof(struct ns_shm_dev) */
+    uint32_t shards;
+    uint32_t slots;                 /* per shard, a power of two */
+    uint64_t entries_off;           /* shard s slot i at entries_off + (s * slots + i) * entry_size */
+    int32_t pid;                    /* of the scanner */
+    _Atomic uint32_t state;         /* enum ns_shm_state */
+    uint64_t started_ms;
+    _Atomic uint64_t updated_ms;    /* last update of any entry */
+} __attribute__((aligned(64)));
+
+struct ns_shm {
+    struct ns_shm_hdr *hdr;
+    size_t size;
+    char name[64];
+    int owner;                      /* created it, unlinks it on close */
+};
+
+/* Writer */
+
+/* Create (or replace) the segment name for shards tables of slots
+ * entries each. Returns 0, or -1 with errno set. */
+int ns_shm_create(struct ns_shm *shm, const char *name, uint32_t shards, uint32_t slots);
+
+/* Writer side close: marks the segment closed and unlinks it, readers
+ * that have it mapped keep the last state */
+void ns_shm_close(struct ns_shm *shm);
+
+static inline struct ns_shm_dev *ns_shm_entry(const struct ns_shm *shm, uint32_t shard, uint32_t slot)
+{
+    return (struct ns_shm_dev *)((uint8_t *)shm->hdr + shm->hdr->entries_off) +
+           (size_t)shard * shm->hdr->slots + slot;
+}
+
+/* Copy the record in slot of the shard's table to its entry, an empty
+ * slot clears the entry */
+static inline void ns_shm_publish(struct ns_shm *shm, uint32_t shard, const struct ns_devtab *tab, uint32_t slot)
+{
+    const struct ns_dev *dev = &tab->slots[slot];
+    struct ns_shm_dev *e = ns_shm_entry(shm, shard, slot);
+    uint32_t seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    int len = ns_dev_payload_len(dev);
+
+    atomic_store_explicit(&e->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    e->count = dev->count;
+    e->key = dev->key;
+    e->first_seen_ms = (uint64_t)dev->first_seen_s * 1000;
+    e->last_seen_ms = dev->last_seen_ms;
+    e->rssi_last = dev->rssi_last;
+    e->rssi_avg = (int8_t)ns_dev_rssi_avg(dev);
+    e->rssi_min = dev->rssi_min;
+    e->rssi_max = dev->rssi_max;
+    e->evt_type = dev->evt_type;
+    e->adapter = dev->adapter;
+    e->adapter_mask = dev->adapter_mask;
+    e->flags = dev->flags;
+    memcpy(e->adapter_rssi, dev->adapter_rssi, sizeof(e->adapter_rssi));
+    e->payload_len = len;
+    if (len) {
+        memcpy(e->payload, ns_dev_payload(tab, dev), len);
+    }
+
+    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+    if (dev->key) {
+        atomic_store_explicit(&shm->hdr->updated_ms, dev->last_seen_ms, memory_order_relaxed);
+    }
+}
+
+/* Reader */
+
+/* Map the segment name read-only. Returns 0, or -1 with errno set
+ * (EPROTO if it is not a device segment of this version). */
+int ns_shm_attach(struct ns_shm *shm, const char *name);
+void ns_shm_detach(struct ns_shm *shm);
+
+/* Consistent copy of an entry. Returns 1, 0 if the slot is empty, or
+ * -1 if no consistent copy could be taken (out is then undefined). */
+static inline int ns_shm_read(const struct ns_shm_dev *e, struct ns_shm_dev *out)
+{
+    uint32_t s1, s2;
+    int tries;
+
+    for (tries = 0; tries < NS_SHM_READ_TRIES; tries++) {
+        s1 = atomic_load_explicit(&((struct ns_shm_dev *)e)->seq, memory_order_acquire);
+        if (!s1) {
+            return 0;
+        }
+        if (s1 & 1) {
+            continue;
+        }
+        memcpy((uint8_t *)out + sizeof(out->seq), (const uint8_t *)e + sizeof(e->seq),
+               sizeof(*out) - sizeof(out->seq));
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(&((struct ns_shm_dev *)e)->seq, memory_order_relaxed);
+        if (s1 == s2) {
+            atomic_store_explicit(&out->seq, s1, memory_order_relaxed);
+            return out->key != 0;
+        }
+    }
+    return -1;
+}
+
+/* Consistent copy of one device's entry. Returns 1, or 0 if the
+ * scanner has not seen it. */
+int ns_shm_find(const struct ns_shm *shm, const bdaddr_t *bdaddr, uint8_t bdaddr_type, struct ns_shm_dev *out);
+
+#endif //__NS_DEVSHM_H__
@@ -0,0 +1,342 @@
+// Per-device state table, see devtab.h.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "devtab.h"
+
+/* Slots for max_devices at a load factor of at most 3/4, 0 if too many */
+static uint64_t ns_devtab_capacity(uint32_t max_devices)
+{
+    uint64_t cap = 16;
+
+    while (cap * 3 / 4 < max_devices) {
+        cap <<= 1;
+    }
+    return cap * 3 / 4 <= NS_DEVTAB_DEVICES_MAX ? cap : 0;
+}
+
+uint64_t ns_devtab_size(uint32_t max_devices)
+{
+    uint64_t cap = ns_devtab_capacity(max_devices);
+    uint64_t used = cap * 3 / 4;
+
+    return cap * sizeof(struct ns_dev) + used * 32 + (used / NS_DEVTAB_LARGE_SHARE) * 64;
+}
+
+uint32_t ns_devtab_fit(uint64_t bytes)
+{
+    uint32_t devices = 12;
+
+    if (ns_devtab_size(devices) > bytes) {
+        return 0;
+    }
+    while (devices * 2 <= NS_DEVTAB_DEVICES_MAX && ns_devtab_size(devices * 2) <= bytes) {
+        devices *= 2;
+    }
+    return devices;
+}
+
+static int ns_devtab_slab_init(struct ns_devtab_slab *s, uint32_t size, uint32_t count)
+{
+    memset(s, 0, sizeof(*s));
+    s->chunks = aligned_alloc(64, (size_t)size * (count ? count : 1));
+    if (!s->chunks) {
+        return -1;
+    }
+    s->size = size;
+    s->count = count;
+    return 0;
+}
+
+/* Number of a free chunk, 0 if there is none */
+static uint32_t ns_devtab_slab_get(struct ns_devtab_slab *s)
+{
+    uint32_t n = s->free;
+
+    if (n) {
+        memcpy(&s->free, s->chunks + (size_t)(n - 1) * s->size, sizeof(s->free));
+    } else if (s->fresh < s->count) {
+        n = ++s->fresh;
+    } else {
+        return 0;
+    }
+    s->used++;
+    return n;
+}
+
+static void ns_devtab_slab_put(struct ns_devtab_slab *s, uint32_t n)
+{
+    memcpy(s->chunks + (size_t)(n - 1) * s->size, &s->free, sizeof(s->free));
+    s->free = n;
+    s->used--;
+}
+
+int ns_devtab_init(struct ns_devtab *tab, uint32_t max_devices)
+{
+    uint64_t cap = ns_devtab_capacity(max_devices);
+
+    memset(tab, 0, sizeof(*tab));
+    if (!cap) {
+        return -1;
+    }
+
+    tab->slots = aligned_alloc(64, cap * sizeof(struct ns_dev));
+    if (!tab->slots) {
+        return -1;
+    }
+    memset(tab->slots, 0, cap * sizeof(struct ns_dev));
+
+    tab->mask = (uint32_t)(cap - 1);
+    tab->max_used = (uint32_t)(cap * 3 / 4);
+
+    /* Every device can hold a small chunk, so those never run out */
+    if (ns_devtab_slab_init(&tab->small, 32, tab->max_used) < 0 ||
+        ns_devtab_slab_init(&tab->large, 64, tab->max_used / NS_DEVTAB_LARGE_SHARE) < 0) {
+        ns_devtab_free(tab);
+        return -1;
+    }
+    return 0;
+}
+
+void ns_devtab_free(struct ns_devtab *tab)
+{
+    free(tab->slots);
+    free(tab->small.chunks);
+    free(tab->large.chunks);
+    memset(tab, 0, sizeof(*tab));
+}
+
+struct ns_dev *ns_devtab_lookup(const struct ns_devtab *tab, const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+    uint64_t key = ns_devtab_key(bdaddr, bdaddr_type);
+    uint32_t i = (uint32_t)ns_devtab_hash(key) & tab->mask;
+
+    while (tab->slots[i].key) {
+        if (tab->slots[i].key == key) {
+            return &tab->slots[i];
+        }
+        i = (i + 1) & tab->mask;
+    }
+
+    return NULL;
+}
+
+static inline struct ns_devtab_slab *ns_devtab_slab_of(struct ns_devtab *tab, int len)
+{
+    return len > NS_DEVTAB_SMALL_MAX ? &tab->large : &tab->small;
+}
+
+/* Keep the payload in a chunk of its size class. A device holds on to
+ * its chunk, a small one is always there for it. */
+static void ns_devtab_set_payload(struct ns_devtab *tab, struct ns_dev *dev, const uint8_t *data, int len)
+{
+    struct ns_devtab_slab *old = ns_devtab_slab_of(tab, ns_dev_payload_len(dev));
+    struct ns_devtab_slab *s;
+    uint32_t n = dev->payload >> 8;
+
+    if (len > NS_DEVTAB_PAYLOAD_MAX) {
+        len = NS_DEVTAB_PAYLOAD_MAX;
+    }
+    if (len > NS_DEVTAB_SMALL_MAX && old != &tab->large && tab->large.used == tab->large.count) {
+        tab->truncated++;
+        len = NS_DEVTAB_SMALL_MAX;
+    }
+    s = ns_devtab_slab_of(tab, len);
+    if (n && s != old) {
+        ns_devtab_slab_put(old, n);
+        n = 0;
+    }
+    if (!n) {
+        n = ns_devtab_slab_get(s);
+    }
+
+    memcpy(s->chunks + (size_t)(n - 1) * s->size, data, len);
+    dev->payload = n << 8 | (uint32_t)len;
+}
+
+/* Empty slot i. The records after it in its cluster move back when
+ * their probe would no longer reach them, so lookups stop at the first
+ * empty slot as before. */
+static void ns_devtab_remove(struct ns_devtab *tab, uint32_t i)
+{
+    struct ns_dev *dev = &tab->slots[i];
+    uint32_t j = i;
+    uint32_t k;
+
+    if (dev->payload) {
+        ns_devtab_slab_put(ns_devtab_slab_of(tab, ns_dev_payload_len(dev)), dev->payload >> 8);
+    }
+    tab->used--;
+
+    while (1) {
+        j = (j + 1) & tab->mask;
+        if (!tab->slots[j].key) {
+            break;
+        }
+        /* Stays if its home slot lies cyclically in (i, j] */
+        k = (uint32_t)ns_devtab_hash(tab->slots[j].key) & tab->mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        tab->slots[i] = tab->slots[j];
+        if (tab->mirror) {
+            tab->mirror(tab, i);
+        }
+        i = j;
+    }
+
+    memset(&tab->slots[i], 0, sizeof(struct ns_dev));
+    if (tab->mirror) {
+        tab->mirror(tab, i);
+    }
+}
+
+/* Move the hand over n slots: devices not heard for max_age_ms go, the
+ * others lose their mark. A removal refills the slot under the hand,
+ * it is looked at again. */
+static void ns_devtab_sweep(struct ns_devtab *tab, uint32_t n, uint64_t now_ms)
+{
+    struct ns_dev *dev;
+
+    while (n--) {
+        dev = &tab->slots[tab->hand];
+        if (dev->key) {
+            if (tab->max_age_ms && now_ms >= dev->last_seen_ms + tab->max_age_ms) {
+                tab->expired++;
+                ns_devtab_remove(tab, tab->hand);
+                continue;
+            }
+            dev->flags &= ~NS_DEV_REFERENCED;
+        }
+        tab->hand = (tab->hand + 1) & tab->mask;
+    }
+}
+
+/* Make room in a full table: the first device the hand finds without a
+ * mark goes, or the least recently heard of the NS_DEVTAB_CLOCK_MAX
+ * slots it passed if all of them were marked. */
+static void ns_devtab_evict(struct ns_devtab *tab)
+{
+    struct ns_dev *dev;
+    uint32_t victim = tab->hand;
+    uint32_t n;
+
+    /* A full table has a device within a few slots, take one at any rate */
+    for (n = 0; n < NS_DEVTAB_CLOCK_MAX || !tab->slots[victim].key; n++) {
+        dev = &tab->slots[tab->hand];
+        if (dev->key) {
+            if (!(dev->flags & NS_DEV_REFERENCED)) {
+                victim = tab->hand;
+                break;
+            }
+            dev->flags &= ~NS_DEV_REFERENCED;
+            if (!tab->slots[victim].key || dev->last_seen_ms < tab->slots[victim].last_seen_ms) {
+                victim = tab->hand;
+            }
+        }
+        tab->hand = (tab->hand + 1) & tab->mask;
+    }
+
+    tab->evicted++;
+    ns_devtab_remove(tab, victim);
+}
+
+struct ns_dev *ns_devtab_update(struct ns_devtab *tab, const ns_adv_report_t *rpt, uint64_t now_ms)
+{
+    uint64_t key = ns_devtab_key(&rpt->bdaddr, rpt->bdaddr_type);
+    uint32_t home = (uint32_t)ns_devtab_hash(key) & tab->mask;
+    uint32_t i = home;
+    int8_t rssi = rpt->rssi;
+    int adapter = rpt->adapter;
+    struct ns_dev *dev;
+
+    /* The hand only runs when there is something to age or evict */
+    if ((tab->max_age_ms || tab->used >= tab->max_used) && ++tab->ticks >= NS_DEVTAB_CLOCK_EVERY) {
+        tab->ticks = 0;
+        ns_devtab_sweep(tab, NS_DEVTAB_CLOCK_STEP, now_ms);
+    }
+
+    while (tab->slots[i].key && tab->slots[i].key != key) {
+        i = (i + 1) & tab->mask;
+    }
+    dev = &tab->slots[i];
+
+    if (!dev->key) {
+        if (tab->used >= tab->max_used) {
+            /* Records may have moved into the probe path */
+            ns_devtab_evict(tab);
+            for (i = home; tab->slots[i].key; i = (i + 1) & tab->mask)
+                ;
+            dev = &tab->slots[i];
+        }
+        tab->used++;
+        dev->key = key;
+        dev->first_seen_s = (uint32_t)(now_ms / 1000);
+        dev->rssi_avg_q4 = rssi * 16;
+        dev->rssi_min = rssi;
+        dev->rssi_max = rssi;
+    }
+
+    dev->last_seen_ms = now_ms;
+    dev->count++;
+    dev->evt_type = rpt->evt_type;
+    dev->adapter = rpt->adapter;
+    dev->flags |= NS_DEV_REFERENCED;
+    if (ns_adv_is_scan_rsp(rpt->evt_type)) {
+        dev->flags |= NS_DEV_SCAN_RSP;
+    }
+    ns_devtab_set_payload(tab, dev, rpt->data, rpt->length);
+
+    if (rssi == NS_RSSI_UNAVAILABLE) {
+        return dev;
+    }
+
+    dev->rssi_last = rssi;
+    if (adapter < NS_ADAPTERS_MAX) {
+        dev->adapter_mask |= 1U << adapter;
+        dev->adapter_rssi[adapter] = rssi;
+    }
+    dev->rssi_avg_q4 += (rssi * 16 - dev->rssi_avg_q4) >> NS_DEVTAB_RSSI_SHIFT;
+    if (rssi < dev->rssi_min) {
+        dev->rssi_min = rssi;
+    }
+    if (rssi > dev->rssi_max) {
+        dev->rssi_max = rssi;
+    }
+
+    return dev;
+}
+
+void ns_devtab_dump(const struct ns_devtab *tab, FILE *fp)
+{
+    const struct ns_dev *dev;
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type;
+    char addr[18];
+    uint32_t i;
+    int a;
+
+    fprintf(fp, "devices:%u evicted:%llu expired:%llu payloads:%u+%u truncated:%llu\n", tab->used,
+            (unsigned long long)tab->evicted, (unsigned long long)tab->expired, tab->small.used,
+            tab->large.used, (unsigned long long)tab->truncated);
+
+    for (i = 0; i <= tab->mask; i++) {
+        dev = &tab->slots[i];
+        if (!dev->key) {
+            continue;
+        }
+        ns_devtab_key_addr(dev->key, &bdaddr, &bdaddr_type);
+        ba2str(&bdaddr, addr);
+        fprintf(fp, "%s type:%u count:%u rssi:%d avg:%d min:%d max:%d last_seen:%llu payload_len:%u hci:%u",
+                addr, bdaddr_type, dev->count, dev->rssi_last, ns_dev_rssi_avg(dev),
+                dev->rssi_min, dev->rssi_max, (unsigned long long)dev->last_seen_ms, ns_dev_payload_len(dev),
+                dev->adapter);
+        for (a = 0; a < NS_ADAPTERS_MAX; a++) {
+            if (dev->adapter_mask & (1U << a)) {
+                fprintf(fp, " hci%d:%d", a, dev->adapter_rssi[a]);
+            }
+        }
+        fputc('\n', fp);
+    }
+}
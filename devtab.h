@@ -0,0 +1,174 @@
+#ifndef __NS_DEVTAB_H__
+#define __NS_DEVTAB_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+
+/* Per-device state, keyed by bdaddr + address type.
+ *
+ * Flat open-addressing table (linear probing) with the records stored
+ * inline, one cache line each, so an update is one hash and, in the
+ * common case, one or two cache lines. Payloads are kept in chunks of
+ * two slabs: 31 bytes, a legacy advertisement or scan response, for
+ * every device, and 62 bytes for one in NS_DEVTAB_LARGE_SHARE devices;
+ * a longer payload that finds no large chunk free keeps its first 31
+ * bytes. Everything is allocated by ns_devtab_init(), memory is fixed
+ * by the number of devices however many come and go.
+ *
+ * A new device always gets a record. When the table is full it takes
+ * the place of a cold one, found by a CLOCK hand over the slots: a
+ * device heard since the hand last passed loses its mark and gets a
+ * second chance, the first one without is evicted. With max_age_ms set
+ * the hand also moves a little every NS_DEVTAB_CLOCK_EVERY updates and
+ * removes devices not heard for that long. Removal moves the records
+ * after it back to where a lookup finds them (no tombstones), so a
+ * record may change slots; the mirror callback hears of every slot
+ * that changed besides the one ns_devtab_update() returns.
+ *
+ * A device heard by several adapters has one record: count and the RSSI
+ * statistics cover all of them, adapter_mask and adapter_rssi tell which
+ * radios hear it and how well. */
+
+#define NS_DEVTAB_PAYLOAD_MAX       NS_BTM_BLE_CACHE_ADV_DATA_MAX
+#define NS_DEVTAB_SMALL_MAX         31      /* payloads up to this fit a small chunk */
+#define NS_DEVTAB_LARGE_SHARE       4       /* devices per large chunk */
+#define NS_DEVTAB_DEVICES_MAX       (3U << 22)  /* chunk numbers have 24 bits */
+#define NS_DEVTAB_CLOCK_EVERY       64      /* updates between steps of the hand while aging */
+#define NS_DEVTAB_CLOCK_STEP        64      /* slots per step, about one per update */
+#define NS_DEVTAB_CLOCK_MAX         256     /* slots an eviction looks at, then takes the oldest */
+#define NS_DEVTAB_RSSI_SHIFT        3       /* EWMA weight 1/8 */
+#define NS_RSSI_UNAVAILABLE         127
+
+#define NS_DEV_SCAN_RSP             0x01    /* a scan response was seen */
+#define NS_DEV_REFERENCED           0x02    /* heard since the CLOCK hand passed */
+
+struct ns_dev {
+    uint64_t key;                   /* see ns_devtab_key(), 0 = empty slot */
+    uint64_t last_seen_ms;          /* CLOCK_REALTIME */
+    uint32_t first_seen_s;          /* CLOCK_REALTIME, seconds keep the record in one line */
+    uint32_t count;                 /* reports seen */
+    uint32_t payload;               /* chunk number << 8 | length, see ns_dev_payload() */
+    int16_t rssi_avg_q4;            /* smoothed RSSI in 1/16 dBm */
+    int8_t rssi_last;
+    int8_t rssi_min;
+    int8_t rssi_max;
+    uint8_t evt_type;               /* of the latest report */
+    uint8_t adapter;                /* of the latest report */
+    uint8_t adapter_mask;           /* bit n: heard by adapter n */
+    uint8_t flags;                  /* NS_DEV_* */
+    int8_t adapter_rssi[NS_ADAPTERS_MAX]; /* last RSSI per adapter */
+    /* last emitted report, maintained by suppress.c */
+    int8_t emit_rssi;
+    uint32_t emit_hash[2];          /* advertising / scan response payload */
+    uint64_t emit_ms;
+} __attribute__((aligned(64)));
+
+/* Fixed size chunks, handed out from the never used end first and then
+ * from the free list, which is kept in the free chunks themselves */
+struct ns_devtab_slab {
+    uint8_t *chunks;
+    uint32_t size;                  /* bytes per chunk */
+    uint32_t count;
+    uint32_t fresh;                 /* chunks from here on were never handed out */
+    uint32_t free;                  /* number of the first free chunk, 0 = none */
+    uint32_t used;
+};
+
+struct ns_devtab {
+    struct ns_dev *slots;
+    uint32_t mask;                  /* capacity - 1, capacity is a power of two */
+    uint32_t used;
+    uint32_t max_used;              /* keeps the load factor <= 3/4 */
+    uint32_t hand;                  /* CLOCK hand, a slot */
+    uint32_t ticks;                 /* updates since the hand last moved */
+    uint64_t max_age_ms;            /* devices not heard this long are removed, 0 = never */
+    struct ns_devtab_slab small;
+    struct ns_devtab_slab large;
+    void (*mirror)(const struct ns_devtab *tab, uint32_t slot);
+    uint64_t evicted;               /* cold devices that made room for new ones */
+    uint64_t expired;               /* devices removed after max_age_ms */
+    uint64_t truncated;             /* payloads cut to NS_DEVTAB_SMALL_MAX, no large chunk free */
+};
+
+static inline uint64_t ns_devtab_key(const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+    const uint8_t *b = bdaddr->b;
+
+    return (uint64_t)b[0] | ((uint64_t)b[1] << 8) | ((uint64_t)b[2] << 16) |
+           ((uint64_t)b[3] << 24) | ((uint64_t)b[4] << 32) | ((uint64_t)b[5] << 40) |
+           ((uint64_t)bdaddr_type << 48) | (1ULL << 56);
+}
+
+static inline uint64_t ns_devtab_hash(uint64_t key)
+{
+    /* murmur3 fmix64 */
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/* Shard of a device when state is split over n tables. Uses the upper
+ * half of the hash, the table slot comes from the lower half. */
+static inline int ns_devtab_shard(uint64_t key, int n)
+{
+    return (int)(((ns_devtab_hash(key) >> 32) * (uint64_t)n) >> 32);
+}
+
+static inline void ns_devtab_key_addr(uint64_t key, bdaddr_t *bdaddr, uint8_t *bdaddr_type)
+{
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        bdaddr->b[i] = (uint8_t)(key >> (8 * i));
+    }
+    *bdaddr_type = (uint8_t)(key >> 48);
+}
+
+static inline int ns_dev_rssi_avg(const struct ns_dev *dev)
+{
+    return dev->rssi_avg_q4 / 16;
+}
+
+static inline int ns_dev_payload_len(const struct ns_dev *dev)
+{
+    return dev->payload & 0xFF;
+}
+
+/* The latest payload of dev, ns_dev_payload_len() bytes */
+static inline const uint8_t *ns_dev_payload(const struct ns_devtab *tab, const struct ns_dev *dev)
+{
+    const struct ns_devtab_slab *s = ns_dev_payload_len(dev) > NS_DEVTAB_SMALL_MAX ? &tab->large : &tab->small;
+    uint32_t n = dev->payload >> 8;
+
+    return n ? s->chunks + (size_t)(n - 1) * s->size : NULL;
+}
+
+/* max_devices is rounded up so the table stays at most 3/4 full.
+ * Returns 0 on success, -1 if the slots cannot be allocated or there
+ * are more than NS_DEVTAB_DEVICES_MAX. */
+int ns_devtab_init(struct ns_devtab *tab, uint32_t max_devices);
+void ns_devtab_free(struct ns_devtab *tab);
+
+/* Bytes a table for max_devices takes */
+uint64_t ns_devtab_size(uint32_t max_devices);
+
+/* The most devices a table of at most bytes holds, 0 if none fits */
+uint32_t ns_devtab_fit(uint64_t bytes);
+
+struct ns_dev *ns_devtab_lookup(const struct ns_devtab *tab, const bdaddr_t *bdaddr, uint8_t bdaddr_type);
+
+/* Record one report, returns the device record. A new device in a full
+ * table evicts a cold one. Only the first NS_DEVTAB_PAYLOAD_MAX bytes
+ * of the payload are kept. */
+struct ns_dev *ns_devtab_update(struct ns_devtab *tab, const ns_adv_report_t *rpt, uint64_t now_ms);
+
+void ns_devtab_dump(const struct ns_devtab *tab, FILE *fp);
+
+#endif //__NS_DEVTAB_H__
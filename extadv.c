@@ -0,0 +1,128 @@
+// Extended advertising reassembly, see extadv.h.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "extadv.h"
+
+/* Buffers start on a cache line */
+#define NS_EXTADV_BUF_STRIDE    ((NS_ADV_DATA_MAX + 63) & ~63)
+
+int ns_extadv_init(struct ns_extadv_pool *pool, uint32_t chains)
+{
+    uint32_t i;
+
+    memset(pool, 0, sizeof(*pool));
+    if (!chains) {
+        return -1;
+    }
+
+    pool->chains = calloc(chains, sizeof(*pool->chains));
+    pool->arena = aligned_alloc(64, (size_t)chains * NS_EXTADV_BUF_STRIDE);
+    if (!pool->chains || !pool->arena) {
+        ns_extadv_free(pool);
+        return -1;
+    }
+
+    for (i = 0; i < chains; i++) {
+        pool->chains[i].buf = pool->arena + (size_t)i * NS_EXTADV_BUF_STRIDE;
+    }
+    pool->count = chains;
+    return 0;
+}
+
+void ns_extadv_free(struct ns_extadv_pool *pool)
+{
+    free(pool->chains);
+    free(pool->arena);
+    memset(pool, 0, sizeof(*pool));
+}
+
+static struct ns_extadv_chain *ns_extadv_find(struct ns_extadv_pool *pool, uint64_t key)
+{
+    uint32_t i;
+
+    for (i = 0; i < pool->count; i++) {
+        if (pool->chains[i].key == key) {
+            return &pool->chains[i];
+        }
+    }
+    return NULL;
+}
+
+static void ns_extadv_release(struct ns_extadv_pool *pool, struct ns_extadv_chain *c)
+{
+    c->key = 0;
+    pool->active--;
+}
+
+/* A free buffer, else one whose chain went quiet, else the oldest chain */
+static struct ns_extadv_chain *ns_extadv_alloc(struct ns_extadv_pool *pool, uint64_t key, uint64_t now_ms)
+{
+    struct ns_extadv_chain *oldest = NULL;
+    struct ns_extadv_chain *c;
+    uint32_t i;
+
+    for (i = 0; i < pool->count; i++) {
+        c = &pool->chains[i];
+        if (!c->key) {
+            break;
+        }
+        if (now_ms - c->last_ms > NS_EXTADV_TIMEOUT_MS) {
+            ns_extadv_release(pool, c);
+            pool->evicted++;
+            break;
+        }
+        if (!oldest || c->last_ms < oldest->last_ms) {
+            oldest = c;
+        }
+    }
+    if (i == pool->count) {
+        c = oldest;
+        ns_extadv_release(pool, c);
+        pool->evicted++;
+    }
+
+    c->key = key;
+    c->len = 0;
+    pool->active++;
+    return c;
+}
+
+const uint8_t *ns_extadv_feed(struct ns_extadv_pool *pool, uint64_t key, const uint8_t *data,
+                              uint8_t data_len, int status, uint64_t now_ms, uint16_t *len)
+{
+    struct ns_extadv_chain *c = pool->active ? ns_extadv_find(pool, key) : NULL;
+
+    if (!c) {
+        if (status != NS_EXT_STATUS_MORE) {
+            pool->truncated += status == NS_EXT_STATUS_TRUNCATED;
+            *len = data_len;
+            return data;
+        }
+        c = ns_extadv_alloc(pool, key, now_ms);
+    }
+
+    if (c->len + data_len > NS_ADV_DATA_MAX) {
+        ns_extadv_release(pool, c);
+        pool->overflow++;
+        return NULL;
+    }
+    memcpy(c->buf + c->len, data, data_len);
+    c->len += data_len;
+    c->last_ms = now_ms;
+
+    if (status == NS_EXT_STATUS_MORE) {
+        return NULL;
+    }
+
+    /* The buffer keeps its data until the chain slot is handed out again */
+    ns_extadv_release(pool, c);
+    if (status == NS_EXT_STATUS_TRUNCATED) {
+        pool->truncated++;
+    } else {
+        pool->completed++;
+    }
+    *len = c->len;
+    return c->buf;
+}
@@ -0,0 +1,145 @@
+#ifndef __NS_EXTADV_H__
+#define __NS_EXTADV_H__
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+
+/* LE extended advertising (Core 5.x).
+ *
+ * HCI definitions libbluetooth does not carry, and reassembly of
+ * extended advertising data that the controller delivers in fragments.
+ *
+ * An advertisement longer than one HCI event arrives as a chain of LE
+ * Extended Advertising Reports with data status "incomplete, more to
+ * come", ending with one that is "complete" or "truncated". Fragments of
+ * other advertisers may arrive between them. Chains are collected per
+ * advertiser and SID in a pool of buffers allocated up front. A report
+ * that is not fragmented never touches the pool and is handed on straight
+ * from the HCI event. */
+
+#define NS_EVT_LE_EXT_ADVERTISING_REPORT        0x0D
+#define NS_OCF_LE_SET_EXT_SCAN_PARAMETERS       0x0041
+#define NS_OCF_LE_SET_EXT_SCAN_ENABLE           0x0042
+
+/* LE feature bits, LE Read Local Supported Features */
+#define NS_LE_FEATURE_CODED_PHY                 11
+#define NS_LE_FEATURE_EXT_ADV                   12
+
+#define NS_LE_SCAN_PHY_1M                       0x01
+#define NS_LE_SCAN_PHY_CODED                    0x04
+
+/* Event_Type of an extended report, the low four bits are NS_ADV_PROP_* */
+#define NS_EXT_EVT_LEGACY                       0x0010
+#define NS_EXT_EVT_STATUS(evt)                  (((evt) >> 5) & 0x03)
+#define NS_EXT_STATUS_COMPLETE                  0
+#define NS_EXT_STATUS_MORE                      1
+#define NS_EXT_STATUS_TRUNCATED                 2
+
+#define NS_EXTADV_CHAINS_DEFAULT                32
+#define NS_EXTADV_TIMEOUT_MS                    500     /* chain given up when no fragment follows */
+
+typedef struct {
+    uint16_t evt_type;
+    uint8_t  bdaddr_type;
+    bdaddr_t bdaddr;
+    uint8_t  primary_phy;
+    uint8_t  secondary_phy;
+    uint8_t  sid;
+    int8_t   tx_power;
+    int8_t   rssi;
+    uint16_t periodic_interval;
+    uint8_t  direct_bdaddr_type;
+    bdaddr_t direct_bdaddr;
+    uint8_t  length;
+    uint8_t  data[0];
+} __attribute__((packed)) ns_le_ext_advertising_info;
+#define NS_LE_EXT_ADVERTISING_INFO_SIZE         24
+
+typedef struct {
+    uint8_t  type;
+    uint16_t interval;
+    uint16_t window;
+} __attribute__((packed)) ns_le_ext_scan_phy_cp;
+
+typedef struct {
+    uint8_t  own_bdaddr_type;
+    uint8_t  filter;
+    uint8_t  phys;
+    ns_le_ext_scan_phy_cp phy[2];       /* one per bit set in phys */
+} __attribute__((packed)) ns_le_set_ext_scan_parameters_cp;
+#define NS_LE_SET_EXT_SCAN_PARAMETERS_CP_SIZE(nphys)  (3 + 5 * (nphys))
+
+typedef struct {
+    uint8_t  enable;
+    uint8_t  filter_dup;
+    uint16_t duration;
+    uint16_t period;
+} __attribute__((packed)) ns_le_set_ext_scan_enable_cp;
+#define NS_LE_SET_EXT_SCAN_ENABLE_CP_SIZE       6
+
+static inline int ns_le_feature(const uint8_t *features, int bit)
+{
+    return !!(features[bit / 8] & (1 << (bit % 8)));
+}
+
+/* Legacy PDU type (0 ADV_IND .. 4 SCAN_RSP) of a legacy advertisement
+ * reported through an extended report */
+static inline uint8_t ns_ext_legacy_type(uint16_t evt_type)
+{
+    if (evt_type & NS_ADV_PROP_SCAN_RSP) {
+        return NS_ADV_EVT_SCAN_RSP;
+    }
+    if (evt_type & NS_ADV_PROP_DIRECTED) {
+        return 0x01;
+    }
+    if (evt_type & NS_ADV_PROP_CONNECTABLE) {
+        return 0x00;
+    }
+    if (evt_type & NS_ADV_PROP_SCANNABLE) {
+        return 0x02;
+    }
+    return 0x03;
+}
+
+struct ns_extadv_chain {
+    uint64_t key;                       /* see ns_extadv_key(), 0 = free */
+    uint64_t last_ms;                   /* when the latest fragment arrived */
+    uint16_t len;
+    uint8_t *buf;                       /* NS_ADV_DATA_MAX bytes of the pool arena */
+};
+
+struct ns_extadv_pool {
+    struct ns_extadv_chain *chains;
+    uint8_t *arena;
+    uint32_t count;
+    uint32_t active;
+    uint64_t completed;                 /* chains reassembled */
+    uint64_t truncated;                 /* chains cut short by the controller */
+    uint64_t evicted;                   /* chains given up to make room or timed out */
+    uint64_t overflow;                  /* chains longer than NS_ADV_DATA_MAX */
+};
+
+static inline uint64_t ns_extadv_key(const bdaddr_t *bdaddr, uint8_t bdaddr_type, uint8_t sid)
+{
+    const uint8_t *b = bdaddr->b;
+
+    return (uint64_t)b[0] | ((uint64_t)b[1] << 8) | ((uint64_t)b[2] << 16) |
+           ((uint64_t)b[3] << 24) | ((uint64_t)b[4] << 32) | ((uint64_t)b[5] << 40) |
+           ((uint64_t)bdaddr_type << 48) | ((uint64_t)(sid & 0x7f) << 56) | (1ULL << 63);
+}
+
+/* Returns 0 on success, -1 if the buffers cannot be allocated */
+int ns_extadv_init(struct ns_extadv_pool *pool, uint32_t chains);
+void ns_extadv_free(struct ns_extadv_pool *pool);
+
+/* Add one fragment with its data status. Returns the whole advertising
+ * data once the chain ends (*len set), NULL while more fragments are
+ * expected or when the chain had to be dropped. An unfragmented report
+ * is returned as is. The result is valid until the next call. */
+const uint8_t *ns_extadv_feed(struct ns_extadv_pool *pool, uint64_t key, const uint8_t *data,
+                              uint8_t data_len, int status, uint64_t now_ms, uint16_t *len);
+
+#endif //__NS_EXTADV_H__
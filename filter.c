@@ -0,0 +1,973 @@
+// Report filter compiler and evaluator, see filter.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#include "filter.h"
+#include "devtab.h"
+
+#define NS_FILTER_INSNS_MAX     0xFFF0
+#define NS_FILTER_VALUE_MAX     255
+#define NS_FILTER_ADS_MAX       8       /* structures of one kind per report */
+
+enum {
+    NS_FAD_NAME,
+    NS_FAD_UUID,
+    NS_FAD_MFR,
+    NS_FAD_KINDS,
+};
+
+struct ns_filter_ad {
+    const uint8_t *data;
+    uint8_t len;
+    uint8_t width;                  /* of a UUID in the list */
+};
+
+/* The AD structures a report's name, UUID and manufacturer predicates
+ * read, sorted by kind in one pass over the payload when the first of
+ * them runs and shared by the rest */
+struct ns_filter_ads {
+    int collected;
+    int overflow;                   /* more than NS_FILTER_ADS_MAX of a kind, walk per instruction */
+    uint8_t count[NS_FAD_KINDS];
+    struct ns_filter_ad ad[NS_FAD_KINDS][NS_FILTER_ADS_MAX];
+};
+
+enum {
+    NS_FNODE_LEAF,
+    NS_FNODE_AND,
+    NS_FNODE_OR,
+    NS_FNODE_NOT,
+};
+
+struct ns_fnode {
+    int kind;
+    int a, b;                       /* children */
+    uint8_t op;
+    int32_t arg;
+    uint8_t *vals;                  /* <len><bytes> per value */
+    size_t vals_len;
+    uint32_t nvals;
+};
+
+struct ns_fparse {
+    const char *start;
+    const char *p;
+    struct ns_fnode *nodes;
+    int count;
+    int cap;
+    char *err;
+    size_t err_len;
+    int failed;
+};
+
+static void ns_fparse_error(struct ns_fparse *ps, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (ps->failed) {
+        return;
+    }
+    ps->failed = 1;
+    n = snprintf(ps->err, ps->err_len, "column %d: ", (int)(ps->p - ps->start) + 1);
+    if (n < 0 || (size_t)n >= ps->err_len) {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(ps->err + n, ps->err_len - n, fmt, ap);
+    va_end(ap);
+}
+
+static int ns_fnode_new(struct ns_fparse *ps, int kind, int a, int b)
+{
+    struct ns_fnode *nodes;
+
+    if (ps->count == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 64;
+        nodes = realloc(ps->nodes, ps->cap * sizeof(*nodes));
+        if (!nodes) {
+            ns_fparse_error(ps, "out of memory");
+            return -1;
+        }
+        ps->nodes = nodes;
+    }
+    memset(&ps->nodes[ps->count], 0, sizeof(*ps->nodes));
+    ps->nodes[ps->count].kind = kind;
+    ps->nodes[ps->count].a = a;
+    ps->nodes[ps->count].b = b;
+    return ps->count++;
+}
+
+static int ns_fnode_add_value(struct ns_fparse *ps, int n, const uint8_t *val, size_t len)
+{
+    struct ns_fnode *node = &ps->nodes[n];
+    uint8_t *vals;
+
+    if (len > NS_FILTER_VALUE_MAX) {
+        ns_fparse_error(ps, "value longer than %d bytes", NS_FILTER_VALUE_MAX);
+        return -1;
+    }
+    vals = realloc(node->vals, node->vals_len + 1 + len);
+    if (!vals) {
+        ns_fparse_error(ps, "out of memory");
+        return -1;
+    }
+    vals[node->vals_len] = (uint8_t)len;
+    memcpy(vals + node->vals_len + 1, val, len);
+    node->vals = vals;
+    node->vals_len += 1 + len;
+    node->nvals++;
+    return 0;
+}
+
+static void ns_fparse_skip_space(struct ns_fparse *ps)
+{
+    while (isspace((unsigned char)*ps->p)) {
+        ps->p++;
+    }
+}
+
+/* Keyword or operator character, doubled operators (&&, ||) are accepted */
+static int ns_fparse_accept(struct ns_fparse *ps, char c, const char *word)
+{
+    size_t n = strlen(word);
+
+    ns_fparse_skip_space(ps);
+    if (*ps->p == c) {
+        ps->p += (c == '&' || c == '|') && ps->p[1] == c ? 2 : 1;
+        return 1;
+    }
+    if (!strncmp(ps->p, word, n) && !isalnum((unsigned char)ps->p[n])) {
+        ps->p += n;
+        return 1;
+    }
+    return 0;
+}
+
+static int ns_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Hex string (':' and '-' separators ignored) into out, returns bytes or -1 */
+static int ns_hex_decode(const char *s, size_t len, uint8_t *out, size_t out_max)
+{
+    size_t n = 0;
+    int hi = -1;
+    int d;
+
+    for (; len; s++, len--) {
+        if (*s == ':' || *s == '-') {
+            continue;
+        }
+        d = ns_hex_digit(*s);
+        if (d < 0) {
+            return -1;
+        }
+        if (hi < 0) {
+            hi = d;
+        } else {
+            if (n == out_max) {
+                return -1;
+            }
+            out[n++] = (uint8_t)(hi << 4 | d);
+            hi = -1;
+        }
+    }
+    return hi < 0 ? (int)n : -1;
+}
+
+static void ns_reverse(uint8_t *p, int len)
+{
+    uint8_t t;
+    int i;
+
+    for (i = 0; i < len / 2; i++) {
+        t = p[i];
+        p[i] = p[len - 1 - i];
+        p[len - 1 - i] = t;
+    }
+}
+
+/* One value of a list, quoted or bare. Returns its length, -1 on error. */
+static int ns_fparse_item(struct ns_fparse *ps, char *buf, size_t buf_len)
+{
+    size_t n = 0;
+
+    if (*ps->p == '"') {
+        ps->p++;
+        while (*ps->p && *ps->p != '"') {
+            if (*ps->p == '\\' && ps->p[1]) {
+                ps->p++;
+            }
+            if (n == buf_len) {
+                ns_fparse_error(ps, "value too long");
+                return -1;
+            }
+            buf[n++] = *ps->p++;
+        }
+        if (*ps->p != '"') {
+            ns_fparse_error(ps, "unterminated string");
+            return -1;
+        }
+        ps->p++;
+        return (int)n;
+    }
+
+    while (*ps->p && !isspace((unsigned char)*ps->p) && !strchr(",()&|", *ps->p)) {
+        if (n == buf_len) {
+            ns_fparse_error(ps, "value too long");
+            return -1;
+        }
+        buf[n++] = *ps->p++;
+    }
+    if (!n) {
+        ns_fparse_error(ps, "missing value");
+    }
+    return n ? (int)n : -1;
+}
+
+/* Convert one value of the leaf's kind into its match form */
+static int ns_fparse_value(struct ns_fparse *ps, int leaf, const char *s, int len)
+{
+    struct ns_fnode *node = &ps->nodes[leaf];
+    uint8_t val[2 + NS_FILTER_VALUE_MAX];
+    const char *colon;
+    char num[16];
+    char *end;
+    long v;
+    int n;
+
+    switch (node->op) {
+    case NS_FOP_NAME:
+    case NS_FOP_NAME_PREFIX:
+        if (!len) {
+            ns_fparse_error(ps, "empty name");
+            return -1;
+        }
+        return ns_fnode_add_value(ps, leaf, (const uint8_t *)s, len);
+
+    case NS_FOP_UUID:
+        n = ns_hex_decode(s, len, val, 16);
+        if (n != 2 && n != 4 && n != 16) {
+            ns_fparse_error(ps, "UUID must have 4, 8 or 32 hex digits");
+            return -1;
+        }
+        ns_reverse(val, n);             /* AD lists are little endian */
+        return ns_fnode_add_value(ps, leaf, val, n);
+
+    case NS_FOP_MFR:
+        if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+            s += 2;
+            len -= 2;
+        }
+        colon = memchr(s, ':', len);
+        n = ns_hex_decode(s, colon ? colon - s : len, val, 2);
+        if (n < 1) {
+            ns_fparse_error(ps, "manufacturer must be <company id>[:<hex data>]");
+            return -1;
+        }
+        if (n == 1) {
+            val[1] = 0;
+        } else {
+            ns_reverse(val, 2);
+        }
+        n = 2;
+        if (colon) {
+            n = ns_hex_decode(colon + 1, len - (colon + 1 - s), val + 2, NS_FILTER_VALUE_MAX - 2);
+            if (n < 0) {
+                ns_fparse_error(ps, "bad manufacturer data prefix");
+                return -1;
+            }
+            n += 2;
+        }
+        return ns_fnode_add_value(ps, leaf, val, n);
+
+    case NS_FOP_ADDR:
+    case NS_FOP_OUI:
+        n = node->op == NS_FOP_ADDR ? 6 : 3;
+        if (len != 3 * n - 1 || ns_hex_decode(s, len, val, n) != n) {
+            ns_fparse_error(ps, node->op == NS_FOP_ADDR ? "address must be AA:BB:CC:DD:EE:FF" :
+                                                          "OUI must be AA:BB:CC");
+            return -1;
+        }
+        ns_reverse(val, n);             /* bdaddr_t byte order */
+        return ns_fnode_add_value(ps, leaf, val, n);
+
+    case NS_FOP_RSSI_GE:
+    case NS_FOP_RSSI_LE:
+    case NS_FOP_EVT:
+        if (len >= (int)sizeof(num)) {
+            len = sizeof(num) - 1;
+        }
+        memcpy(num, s, len);
+        num[len] = '\0';
+        v = strtol(num, &end, 0);
+        if (end == num || *end) {
+            ns_fparse_error(ps, "bad number %s", num);
+            return -1;
+        }
+        if (node->op == NS_FOP_EVT) {
+            if (v < 0 || v > 255) {
+                ns_fparse_error(ps, "event type must be 0..255");
+                return -1;
+            }
+            val[0] = (uint8_t)v;
+            return ns_fnode_add_value(ps, leaf, val, 1);
+        }
+        if (node->nvals) {
+            ns_fparse_error(ps, "RSSI takes one value");
+            return -1;
+        }
+        node->arg += (int32_t)v;
+        node->nvals = 1;
+        return 0;
+    }
+
+    return -1;
+}
+
+static const struct {
+    const char *key;
+    const char *op;
+    uint8_t fop;
+    int32_t adjust;                 /* added to the RSSI bound */
+} ns_filter_preds[] = {
+    { "name", "^=", NS_FOP_NAME_PREFIX, 0 },
+    { "name", "=", NS_FOP_NAME, 0 },
+    { "uuid", "=", NS_FOP_UUID, 0 },
+    { "mfr", "=", NS_FOP_MFR, 0 },
+    { "addr", "=", NS_FOP_ADDR, 0 },
+    { "oui", "=", NS_FOP_OUI, 0 },
+    { "rssi", ">=", NS_FOP_RSSI_GE, 0 },
+    { "rssi", ">", NS_FOP_RSSI_GE, 1 },
+    { "rssi", "<=", NS_FOP_RSSI_LE, 0 },
+    { "rssi", "<", NS_FOP_RSSI_LE, -1 },
+    { "evt", "=", NS_FOP_EVT, 0 },
+};
+
+static int ns_fparse_pred(struct ns_fparse *ps)
+{
+    char item[4 * NS_FILTER_VALUE_MAX];
+    const char *key = ps->p;
+    size_t key_len;
+    size_t i;
+    int leaf;
+    int n;
+
+    while (isalnum((unsigned char)*ps->p)) {
+        ps->p++;
+    }
+    key_len = ps->p - key;
+    if (!key_len) {
+        ns_fparse_error(ps, "expected a predicate");
+        return -1;
+    }
+    ns_fparse_skip_space(ps);
+
+    for (i = 0; i < sizeof(ns_filter_preds) / sizeof(ns_filter_preds[0]); i++) {
+        if (strlen(ns_filter_preds[i].key) == key_len &&
+            !strncmp(ns_filter_preds[i].key, key, key_len) &&
+            !strncmp(ns_filter_preds[i].op, ps->p, strlen(ns_filter_preds[i].op))) {
+            break;
+        }
+    }
+    if (i == sizeof(ns_filter_preds) / sizeof(ns_filter_preds[0])) {
+        ps->p = key;
+        ns_fparse_error(ps, "unknown predicate %.*s", (int)key_len, key);
+        return -1;
+    }
+    ps->p += strlen(ns_filter_preds[i].op);
+    ns_fparse_skip_space(ps);
+
+    leaf = ns_fnode_new(ps, NS_FNODE_LEAF, -1, -1);
+    if (leaf < 0) {
+        return -1;
+    }
+    ps->nodes[leaf].op = ns_filter_preds[i].fop;
+    ps->nodes[leaf].arg = ns_filter_preds[i].adjust;
+
+    while (1) {
+        n = ns_fparse_item(ps, item, sizeof(item));
+        if (n < 0 || ns_fparse_value(ps, leaf, item, n) < 0) {
+            return -1;
+        }
+        if (*ps->p != ',') {
+            return leaf;
+        }
+        ps->p++;
+    }
+}
+
+static int ns_fparse_expr(struct ns_fparse *ps);
+
+static int ns_fparse_fact(struct ns_fparse *ps)
+{
+    int n;
+
+    if (ns_fparse_accept(ps, '!', "not")) {
+        n = ns_fparse_fact(ps);
+        return n < 0 ? -1 : ns_fnode_new(ps, NS_FNODE_NOT, n, -1);
+    }
+    if (ns_fparse_accept(ps, '(', "(")) {
+        n = ns_fparse_expr(ps);
+        if (n < 0) {
+            return -1;
+        }
+        if (!ns_fparse_accept(ps, ')', ")")) {
+            ns_fparse_error(ps, "expected )");
+            return -1;
+        }
+        return n;
+    }
+    return ns_fparse_pred(ps);
+}
+
+static int ns_fparse_term(struct ns_fparse *ps)
+{
+    int a = ns_fparse_fact(ps);
+    int b;
+
+    while (a >= 0 && ns_fparse_accept(ps, '&', "and")) {
+        b = ns_fparse_fact(ps);
+        a = b < 0 ? -1 : ns_fnode_new(ps, NS_FNODE_AND, a, b);
+    }
+    return a;
+}
+
+/* a | b of two value lists of the same kind is one list */
+static int ns_fnode_mergeable(const struct ns_fnode *a, const struct ns_fnode *b)
+{
+    return a->kind == NS_FNODE_LEAF && b->kind == NS_FNODE_LEAF && a->op == b->op &&
+           a->op != NS_FOP_RSSI_GE && a->op != NS_FOP_RSSI_LE;
+}
+
+static int ns_fparse_expr(struct ns_fparse *ps)
+{
+    struct ns_fnode *na, *nb;
+    uint8_t *vals;
+    int a = ns_fparse_term(ps);
+    int b;
+
+    while (a >= 0 && ns_fparse_accept(ps, '|', "or")) {
+        b = ns_fparse_term(ps);
+        if (b < 0) {
+            return -1;
+        }
+        na = &ps->nodes[a];
+        nb = &ps->nodes[b];
+        if (!ns_fnode_mergeable(na, nb)) {
+            a = ns_fnode_new(ps, NS_FNODE_OR, a, b);
+            continue;
+        }
+        vals = realloc(na->vals, na->vals_len + nb->vals_len);
+        if (!vals) {
+            ns_fparse_error(ps, "out of memory");
+            return -1;
+        }
+        memcpy(vals + na->vals_len, nb->vals, nb->vals_len);
+        na->vals = vals;
+        na->vals_len += nb->vals_len;
+        na->nvals += nb->nvals;
+        free(nb->vals);
+        nb->vals = NULL;
+    }
+    return a;
+}
+
+/* Key of an address or OUI value in an instruction's hash set */
+static inline uint64_t ns_filter_set_key(const uint8_t *b, int len)
+{
+    uint64_t key = 1ULL << 63;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        key |= (uint64_t)b[i] << (8 * i);
+    }
+    return key;
+}
+
+static int ns_filter_set_has(const struct ns_filter_insn *in, uint64_t key)
+{
+    uint32_t i = (uint32_t)ns_devtab_hash(key) & in->set_mask;
+
+    while (in->set[i]) {
+        if (in->set[i] == key) {
+            return 1;
+        }
+        i = (i + 1) & in->set_mask;
+    }
+    return 0;
+}
+
+static uint32_t ns_filter_set_size(uint32_t nvals)
+{
+    uint32_t cap = 8;
+
+    while (cap < nvals * 2) {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+struct ns_fgen {
+    struct ns_fparse *ps;
+    struct ns_filter *f;
+    uint8_t *pool_pos;
+};
+
+/* Emit node so that it continues at t when true and f when false.
+ * Returns the index of its first instruction. Children are emitted
+ * before their parent, the program is reversed afterwards. */
+static int ns_filter_emit(struct ns_fgen *g, int n, int t, int f)
+{
+    struct ns_fnode *node = &g->ps->nodes[n];
+    struct ns_filter_insn *in;
+    const uint8_t *v;
+    uint64_t *set;
+    uint64_t key;
+    uint32_t cap, i, k;
+    int e;
+
+    switch (node->kind) {
+    case NS_FNODE_AND:
+        e = ns_filter_emit(g, node->b, t, f);
+        return e < 0 ? -1 : ns_filter_emit(g, node->a, e, f);
+    case NS_FNODE_OR:
+        e = ns_filter_emit(g, node->b, t, f);
+        return e < 0 ? -1 : ns_filter_emit(g, node->a, t, e);
+    case NS_FNODE_NOT:
+        return ns_filter_emit(g, node->a, f, t);
+    }
+
+    if (g->f->len == NS_FILTER_INSNS_MAX) {
+        ns_fparse_error(g->ps, "expression too large");
+        return -1;
+    }
+    in = &g->f->prog[g->f->len];
+    memset(in, 0, sizeof(*in));
+    in->op = node->op;
+    in->on_true = (uint16_t)t;
+    in->on_false = (uint16_t)f;
+    in->arg = node->arg;
+    in->nvals = node->nvals;
+
+    if (node->op == NS_FOP_ADDR || node->op == NS_FOP_OUI) {
+        cap = ns_filter_set_size(node->nvals);
+        set = (uint64_t *)g->pool_pos;
+        g->pool_pos += cap * sizeof(*set);
+        for (v = node->vals, k = 0; k < node->nvals; k++, v += 1 + v[0]) {
+            key = ns_filter_set_key(v + 1, v[0]);
+            i = (uint32_t)ns_devtab_hash(key) & (cap - 1);
+            while (set[i] && set[i] != key) {
+                i = (i + 1) & (cap - 1);
+            }
+            set[i] = key;
+        }
+        in->set = set;
+        in->set_mask = cap - 1;
+    } else if (node->op == NS_FOP_EVT) {
+        memcpy(g->pool_pos, node->vals, node->vals_len);
+        in->vals = g->pool_pos;
+        g->pool_pos += (node->vals_len + 7) & ~7;
+    } else if (node->op != NS_FOP_RSSI_GE && node->op != NS_FOP_RSSI_LE) {
+        /* Names, UUIDs and manufacturer data */
+        for (v = node->vals, k = 0; node->op == NS_FOP_UUID && k < node->nvals; k++, v += 1 + v[0]) {
+            in->widths |= 1u << v[0];
+        }
+        if (ns_match_build(&in->match, node->vals, node->nvals) < 0) {
+            ns_fparse_error(g->ps, "out of memory");
+            return -1;
+        }
+    }
+
+    return (int)g->f->len++;
+}
+
+static uint16_t ns_filter_remap(uint16_t target, uint32_t len)
+{
+    return target >= NS_FILTER_REJECT ? target : (uint16_t)(len - 1 - target);
+}
+
+int ns_filter_compile(struct ns_filter *f, const char *expr, char *err, size_t err_len)
+{
+    struct ns_fparse ps;
+    struct ns_filter_insn tmp;
+    struct ns_fgen g;
+    size_t pool_size = 0;
+    int leaves = 0;
+    int root;
+    int ret = -1;
+    int i;
+
+    memset(f, 0, sizeof(*f));
+    memset(&ps, 0, sizeof(ps));
+    ps.start = expr;
+    ps.p = expr;
+    ps.err = err;
+    ps.err_len = err_len;
+
+    root = ns_fparse_expr(&ps);
+    ns_fparse_skip_space(&ps);
+    if (root >= 0 && *ps.p) {
+        ns_fparse_error(&ps, "unexpected %c", *ps.p);
+        root = -1;
+    }
+    if (root < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < ps.count; i++) {
+        if (ps.nodes[i].kind != NS_FNODE_LEAF) {
+            continue;
+        }
+        leaves++;
+        if (ps.nodes[i].op == NS_FOP_ADDR || ps.nodes[i].op == NS_FOP_OUI) {
+            pool_size += ns_filter_set_size(ps.nodes[i].nvals) * sizeof(uint64_t);
+        } else if (ps.nodes[i].op == NS_FOP_EVT) {
+            pool_size += (ps.nodes[i].vals_len + 7) & ~7;
+        }
+    }
+
+    /* Merged leaves are still counted, so this is an upper bound */
+    f->prog = calloc(leaves, sizeof(*f->prog));
+    f->pool = calloc(1, pool_size + 8);
+    if (!f->prog || !f->pool) {
+        snprintf(err, err_len, "out of memory");
+        goto out;
+    }
+
+    g.ps = &ps;
+    g.f = f;
+    g.pool_pos = f->pool;
+    f->entry = ns_filter_emit(&g, root, NS_FILTER_ACCEPT, NS_FILTER_REJECT);
+    if ((int)f->entry < 0) {
+        goto out;
+    }
+
+    /* Emitted back to front, reverse so evaluation runs forward */
+    for (i = 0; i < (int)f->len; i++) {
+        f->prog[i].on_true = ns_filter_remap(f->prog[i].on_true, f->len);
+        f->prog[i].on_false = ns_filter_remap(f->prog[i].on_false, f->len);
+    }
+    for (i = 0; i < (int)f->len / 2; i++) {
+        tmp = f->prog[i];
+        f->prog[i] = f->prog[f->len - 1 - i];
+        f->prog[f->len - 1 - i] = tmp;
+    }
+    f->entry = f->len - 1 - f->entry;
+    ret = 0;
+
+out:
+    for (i = 0; i < ps.count; i++) {
+        free(ps.nodes[i].vals);
+    }
+    free(ps.nodes);
+    if (ret < 0) {
+        ns_filter_free(f);
+    }
+    return ret;
+}
+
+/* Lines of any length are OR-ed, '#' outside quotes starts a comment */
+int ns_filter_load(struct ns_filter *f, const char *path, char *err, size_t err_len)
+{
+    char *line = NULL;
+    size_t line_cap = 0;
+    char *expr = NULL;
+    size_t len = 0;
+    size_t n;
+    char *tmp;
+    FILE *fp;
+    int quoted;
+    int ret;
+    char *p;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        snprintf(err, err_len, "cannot open %s", path);
+        return -1;
+    }
+
+    while (getline(&line, &line_cap, fp) >= 0) {
+        for (p = line, quoted = 0; *p && (quoted || *p != '#'); p++) {
+            quoted ^= *p == '"';
+        }
+        while (p > line && isspace((unsigned char)p[-1])) {
+            p--;
+        }
+        *p = '\0';
+        for (p = line; isspace((unsigned char)*p); p++)
+            ;
+        if (!*p) {
+            continue;
+        }
+
+        n = strlen(p);
+        tmp = realloc(expr, len + n + 6);
+        if (!tmp) {
+            free(expr);
+            free(line);
+            fclose(fp);
+            snprintf(err, err_len, "out of memory");
+            return -1;
+        }
+        expr = tmp;
+        len += sprintf(expr + len, "%s(%s)", len ? " | " : "", p);
+    }
+    free(line);
+    fclose(fp);
+
+    if (!expr) {
+        snprintf(err, err_len, "%s holds no expression", path);
+        return -1;
+    }
+
+    ret = ns_filter_compile(f, expr, err, err_len);
+    free(expr);
+    return ret;
+}
+
+void ns_filter_free(struct ns_filter *f)
+{
+    uint32_t i;
+
+    for (i = 0; f->prog && i < f->len; i++) {
+        ns_match_free(&f->prog[i].match);
+    }
+    free(f->prog);
+    free(f->pool);
+    memset(f, 0, sizeof(*f));
+}
+
+static int ns_filter_match_uuids(const struct ns_filter_insn *in, const uint8_t *list, int len, int width)
+{
+    int i;
+
+    if (!(in->widths & 1u << width)) {
+        return 0;
+    }
+    for (i = 0; i + width <= len; i += width) {
+        if (ns_match_exact(&in->match, list + i, width)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Kind and UUID width of an AD type, -1 if no predicate reads it */
+static inline int ns_filter_ad_kind(uint8_t type, uint8_t *width)
+{
+    switch (type) {
+    case ESP_BLE_AD_TYPE_NAME_CMPL:
+    case ESP_BLE_AD_TYPE_NAME_SHORT:
+        return NS_FAD_NAME;
+    case ESP_BLE_AD_TYPE_16SRV_PART:
+    case ESP_BLE_AD_TYPE_16SRV_CMPL:
+        *width = 2;
+        return NS_FAD_UUID;
+    case ESP_BLE_AD_TYPE_32SRV_PART:
+    case ESP_BLE_AD_TYPE_32SRV_CMPL:
+        *width = 4;
+        return NS_FAD_UUID;
+    case ESP_BLE_AD_TYPE_128SRV_PART:
+    case ESP_BLE_AD_TYPE_128SRV_CMPL:
+        *width = 16;
+        return NS_FAD_UUID;
+    case ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE:
+        return NS_FAD_MFR;
+    }
+    return -1;
+}
+
+static inline int ns_filter_op_kind(uint8_t op)
+{
+    switch (op) {
+    case NS_FOP_NAME:
+    case NS_FOP_NAME_PREFIX:
+        return NS_FAD_NAME;
+    case NS_FOP_UUID:
+        return NS_FAD_UUID;
+    }
+    return NS_FAD_MFR;
+}
+
+/* One AD structure of the instruction's kind */
+static inline int ns_filter_eval_ad(const struct ns_filter_insn *in, const struct ns_filter_ad *ad)
+{
+    switch (in->op) {
+    case NS_FOP_NAME:
+        return ns_match_exact(&in->match, ad->data, ad->len);
+    case NS_FOP_UUID:
+        return ns_filter_match_uuids(in, ad->data, ad->len, ad->width);
+    default:
+        return ns_match_prefix(&in->match, ad->data, ad->len);
+    }
+}
+
+/* Walk the raw payload once, no index is built. Without in the
+ * structures are sorted into ads, with it every structure of in's kind
+ * is evaluated right away. */
+static int ns_filter_walk_ad(const struct ns_filter_insn *in, struct ns_filter_ads *ads,
+                             const ns_adv_report_t *rpt)
+{
+    const uint8_t *p = rpt->data;
+    const uint8_t *end = rpt->data + rpt->length;
+    struct ns_filter_ad ad;
+    int kind;
+    int len;
+
+    while (end - p >= 2 && p[0]) {
+        len = p[0] - 1;
+        if (len >= end - p - 1) {
+            break;
+        }
+        kind = ns_filter_ad_kind(p[1], &ad.width);
+        ad.data = p + 2;
+        ad.len = (uint8_t)len;
+        p += 2 + len;
+        if (kind < 0) {
+            continue;
+        }
+
+        if (in) {
+            if (kind == ns_filter_op_kind(in->op) && ns_filter_eval_ad(in, &ad)) {
+                return 1;
+            }
+        } else if (ads->count[kind] == NS_FILTER_ADS_MAX) {
+            ads->overflow = 1;
+            return 0;
+        } else {
+            ads->ad[kind][ads->count[kind]++] = ad;
+        }
+    }
+    return 0;
+}
+
+static int ns_filter_eval(const struct ns_filter_insn *in, struct ns_filter_ads *ads,
+                          const ns_adv_report_t *rpt)
+{
+    const struct ns_filter_ad *ad;
+    uint32_t k;
+    int kind;
+    int i;
+
+    switch (in->op) {
+    case NS_FOP_ADDR:
+        return ns_filter_set_has(in, ns_filter_set_key(rpt->bdaddr.b, 6));
+    case NS_FOP_OUI:
+        return ns_filter_set_has(in, ns_filter_set_key(rpt->bdaddr.b + 3, 3));
+    case NS_FOP_RSSI_GE:
+        return rpt->rssi != NS_RSSI_UNAVAILABLE && rpt->rssi >= in->arg;
+    case NS_FOP_RSSI_LE:
+        return rpt->rssi != NS_RSSI_UNAVAILABLE && rpt->rssi <= in->arg;
+    case NS_FOP_EVT:
+        for (k = 0; k < in->nvals; k++) {
+            if (in->vals[2 * k + 1] == rpt->evt_type) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (!ads->collected) {
+        ads->collected = 1;
+        ns_filter_walk_ad(NULL, ads, rpt);
+    }
+    if (ads->overflow) {
+        return ns_filter_walk_ad(in, NULL, rpt);
+    }
+    kind = ns_filter_op_kind(in->op);
+    for (i = 0, ad = ads->ad[kind]; i < ads->count[kind]; i++, ad++) {
+        if (ns_filter_eval_ad(in, ad)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int ns_filter_run(const struct ns_filter *f, const ns_adv_report_t *rpt)
+{
+    struct ns_filter_ads ads;
+    uint32_t pc = f->entry;
+
+    ads.collected = 0;
+    ads.overflow = 0;
+    memset(ads.count, 0, sizeof(ads.count));
+    while (pc < NS_FILTER_REJECT) {
+        pc = ns_filter_eval(&f->prog[pc], &ads, rpt) ? f->prog[pc].on_true : f->prog[pc].on_false;
+    }
+    return pc == NS_FILTER_ACCEPT;
+}
+
+/* A report reaches NS_FILTER_ACCEPT only through the true branch of an
+ * address instruction when every path from the entry that avoids those
+ * branches ends in NS_FILTER_REJECT. Targets always lie after the
+ * instruction, so one backward pass settles it for all of them. */
+int ns_filter_addresses(const struct ns_filter *f, bdaddr_t *out, int max)
+{
+    const struct ns_filter_insn *in;
+    uint8_t *limited;
+    uint8_t *reached;
+    uint8_t type;
+    uint32_t pc, i;
+    int count = 0;
+    int ok;
+
+    if (!f->prog || !f->len) {
+        return -1;
+    }
+    limited = calloc(2, f->len);
+    if (!limited) {
+        return -1;
+    }
+    reached = limited + f->len;
+
+#define NS_LIMITED(t)   ((t) == NS_FILTER_REJECT || ((t) != NS_FILTER_ACCEPT && limited[t]))
+    for (pc = f->len; pc-- > 0; ) {
+        in = &f->prog[pc];
+        limited[pc] = NS_LIMITED(in->on_false) && (in->op == NS_FOP_ADDR || NS_LIMITED(in->on_true));
+    }
+    ok = limited[f->entry];
+#undef NS_LIMITED
+
+    reached[f->entry] = 1;
+    for (pc = f->entry; ok && pc < f->len; pc++) {
+        in = &f->prog[pc];
+        if (!reached[pc]) {
+            continue;
+        }
+        if (in->on_true < NS_FILTER_REJECT) {
+            reached[in->on_true] = 1;
+        }
+        if (in->on_false < NS_FILTER_REJECT) {
+            reached[in->on_false] = 1;
+        }
+        if (in->op != NS_FOP_ADDR || in->on_true == NS_FILTER_REJECT) {
+            continue;
+        }
+        for (i = 0; i <= in->set_mask; i++) {
+            if (!in->set[i]) {
+                continue;
+            }
+            if (count < max) {
+                ns_devtab_key_addr(in->set[i], &out[count], &type);
+            }
+            count++;
+        }
+    }
+
+    free(limited);
+    return ok ? count : -1;
+}
@@ -0,0 +1,93 @@
+#ifndef __NS_FILTER_H__
+#define __NS_FILTER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bleapi.h"
+#include "match.h"
+
+/* Report filter.
+ *
+ * An expression is compiled once into a flat branch program: every
+ * instruction tests one predicate on the raw report and names the next
+ * instruction for either outcome, so evaluation is a loop without a
+ * stack and stops at the first predicate that decides the result.
+ * Name, UUID and manufacturer predicates share one pass over the AD
+ * structures, made when the first of them runs, so a report the address
+ * and RSSI tests decide is never parsed.
+ * Predicates of the same kind that are OR-ed together are merged into
+ * one instruction; addresses and OUIs go into a hash set, names, UUIDs
+ * and manufacturer data into a vectorized one (see match.h), so a watch
+ * list of thousands of tags is still one lookup.
+ *
+ * Syntax:
+ *   expr := term { ('|' | "or") term }
+ *   term := fact { ('&' | "and") fact }
+ *   fact := ('!' | "not") fact | '(' expr ')' | pred
+ *   pred := key op value { ',' value }      any value matches
+ *
+ *   name=<s>        complete or shortened local name is s
+ *   name^=<s>       local name starts with s
+ *   uuid=<hex>      service UUID, 4, 8 or 32 hex digits ('-' ignored)
+ *                   for 16, 32 or 128 bit UUIDs, in any service list
+ *   mfr=<cid>[:<hex>]  manufacturer data of company cid (hex, as
+ *                   written in the assigned numbers), starting with hex
+ *   addr=<AA:BB:CC:DD:EE:FF>
+ *   oui=<AA:BB:CC>  first three bytes of the address
+ *   rssi>=<dBm>     also >, <=, <
+ *   evt=<n>         evt_type of the report (see ns_adv_report_t)
+ *
+ * Values with spaces or operator characters are written in double
+ * quotes. A filter file holds one expression per line, lines are OR-ed,
+ * '#' starts a comment. */
+
+#define NS_FILTER_ACCEPT    0xFFFF
+#define NS_FILTER_REJECT    0xFFFE
+
+enum ns_filter_op {
+    NS_FOP_NAME,
+    NS_FOP_NAME_PREFIX,
+    NS_FOP_UUID,
+    NS_FOP_MFR,
+    NS_FOP_ADDR,
+    NS_FOP_OUI,
+    NS_FOP_RSSI_GE,
+    NS_FOP_RSSI_LE,
+    NS_FOP_EVT,
+};
+
+struct ns_filter_insn {
+    uint8_t op;                     /* enum ns_filter_op */
+    uint16_t on_true;               /* next instruction, or NS_FILTER_ACCEPT/REJECT */
+    uint16_t on_false;
+    int32_t arg;                    /* RSSI bound */
+    uint32_t nvals;                 /* values, as <len><bytes> from vals (NS_FOP_EVT) */
+    const uint8_t *vals;
+    const uint64_t *set;            /* NS_FOP_ADDR/OUI, open addressing */
+    uint32_t set_mask;
+    uint32_t widths;                /* NS_FOP_UUID, bit n set for n byte UUIDs */
+    struct ns_match match;          /* NS_FOP_NAME*, NS_FOP_UUID, NS_FOP_MFR */
+};
+
+struct ns_filter {
+    struct ns_filter_insn *prog;
+    uint32_t len;
+    uint32_t entry;
+    uint8_t *pool;                  /* values and sets of all instructions */
+};
+
+/* Returns 0, or -1 with a message in err */
+int ns_filter_compile(struct ns_filter *f, const char *expr, char *err, size_t err_len);
+int ns_filter_load(struct ns_filter *f, const char *path, char *err, size_t err_len);
+void ns_filter_free(struct ns_filter *f);
+
+/* 1 if the report matches. Read only, can be shared between threads. */
+int ns_filter_run(const struct ns_filter *f, const ns_adv_report_t *rpt);
+
+/* The addresses a report must come from to be accepted, for filtering
+ * in the controller. Writes up to max of them to out and returns how
+ * many there are, or -1 if the filter can accept other addresses too. */
+int ns_filter_addresses(const struct ns_filter *f, bdaddr_t *out, int max);
+
+#endif //__NS_FILTER_H__
@@ -0,0 +1,353 @@
+// HCI commands on raw and virtual controller sockets, see hcicmd.h.
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "hcicmd.h"
+
+int ns_hci_is_raw(int dd)
+{
+    int domain = 0;
+    socklen_t len = sizeof(domain);
+
+    if (getsockopt(dd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0) {
+        return 0;
+    }
+    return domain == AF_BLUETOOTH;
+}
+
+int ns_hci_set_filter(int dd, const struct hci_filter *f)
+{
+    if (!ns_hci_is_raw(dd)) {
+        return 0;
+    }
+    return setsockopt(dd, SOL_HCI, HCI_FILTER, f, sizeof(*f));
+}
+
+static int64_t ns_hci_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Read events until the one completing opcode. Returns 0, or -1 with errno set. */
+static int ns_hci_wait(int dd, struct hci_request *rq, uint16_t opcode, int timeout_ms)
+{
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    const hci_event_hdr *hdr = (const hci_event_hdr *)(buf + 1);
+    const uint8_t *params = buf + 1 + HCI_EVENT_HDR_SIZE;
+    const evt_cmd_complete *cc;
+    const evt_cmd_status *cs;
+    struct pollfd pfd;
+    int64_t deadline = timeout_ms > 0 ? ns_hci_now_ms() + timeout_ms : 0;
+    int wait = -1;
+    int len;
+    int plen;
+
+    pfd.fd = dd;
+    pfd.events = POLLIN;
+    while (1) {
+        if (deadline) {
+            wait = (int)(deadline - ns_hci_now_ms());
+            if (wait <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        if (poll(&pfd, 1, wait) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (!pfd.revents) {
+            continue;
+        }
+
+        len = read(dd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        if (len == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT) {
+            continue;
+        }
+        plen = len - 1 - HCI_EVENT_HDR_SIZE;
+
+        switch (hdr->evt) {
+        case EVT_CMD_STATUS:
+            cs = (const evt_cmd_status *)params;
+            if (plen < EVT_CMD_STATUS_SIZE || cs->opcode != opcode) {
+                break;
+            }
+            if (rq->event != EVT_CMD_STATUS) {
+                if (cs->status) {
+                    errno = EIO;
+                    return -1;
+                }
+                break;
+            }
+            memcpy(rq->rparam, cs, rq->rlen < plen ? rq->rlen : plen);
+            rq->rlen = rq->rlen < plen ? rq->rlen : plen;
+            return 0;
+        case EVT_CMD_COMPLETE:
+            cc = (const evt_cmd_complete *)params;
+            if (plen < EVT_CMD_COMPLETE_SIZE || cc->opcode != opcode) {
+                break;
+            }
+            plen -= EVT_CMD_COMPLETE_SIZE;
+            if (rq->rlen > plen) {
+                rq->rlen = plen;
+            }
+            memcpy(rq->rparam, params + EVT_CMD_COMPLETE_SIZE, rq->rlen);
+            return 0;
+        }
+    }
+}
+
+int ns_hci_send_req(int dd, struct hci_request *rq, int timeout_ms)
+{
+    uint16_t opcode = htobs(cmd_opcode_pack(rq->ogf, rq->ocf));
+    uint8_t type = HCI_COMMAND_PKT;
+    hci_command_hdr hdr;
+    struct hci_filter of, nf;
+    socklen_t olen = sizeof(of);
+    struct iovec iov[3];
+    int raw = ns_hci_is_raw(dd);
+    int ret;
+    int err;
+
+    if (raw) {
+        if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
+            return -1;
+        }
+        hci_filter_clear(&nf);
+        hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+        hci_filter_set_event(EVT_CMD_STATUS, &nf);
+        hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
+        hci_filter_set_opcode(opcode, &nf);
+        if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+            return -1;
+        }
+    }
+
+    hdr.opcode = opcode;
+    hdr.plen = rq->clen;
+    iov[0].iov_base = &type;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = &hdr;
+    iov[1].iov_len = HCI_COMMAND_HDR_SIZE;
+    iov[2].iov_base = rq->cparam;
+    iov[2].iov_len = rq->clen;
+
+    while ((ret = writev(dd, iov, rq->clen ? 3 : 2)) < 0 && (errno == EINTR || errno == EAGAIN))
+        ;
+    if (ret >= 0) {
+        ret = ns_hci_wait(dd, rq, opcode, timeout_ms);
+    }
+
+    if (raw) {
+        err = errno;
+        setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+        errno = err;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+int ns_hci_queue_init(struct ns_hci_queue *q, int fd)
+{
+    struct hci_filter nf;
+
+    memset(q, 0, sizeof(*q));
+    q->fd = fd;
+
+    hci_filter_clear(&nf);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+    hci_filter_set_event(EVT_CMD_STATUS, &nf);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
+    hci_filter_set_event(EVT_HARDWARE_ERROR, &nf);
+    return ns_hci_set_filter(fd, &nf);
+}
+
+/* Drop completed commands off the front, the next oldest starts its clock */
+static void ns_hci_queue_advance(struct ns_hci_queue *q, uint64_t now_ms)
+{
+    struct ns_hci_inflight *c;
+
+    while (q->head != q->tail && !q->cmds[q->head % NS_HCI_INFLIGHT_MAX].opcode) {
+        q->head++;
+    }
+    if (q->head != q->tail) {
+        c = &q->cmds[q->head % NS_HCI_INFLIGHT_MAX];
+        if (c->deadline_ms < now_ms + c->timeout_ms) {
+            c->deadline_ms = now_ms + c->timeout_ms;
+        }
+    }
+}
+
+int ns_hci_queue_send(struct ns_hci_queue *q, uint16_t ogf, uint16_t ocf, const void *params,
+                      uint8_t plen, uint8_t tag, int timeout_ms, uint64_t now_ms)
+{
+    uint8_t buf[1 + HCI_COMMAND_HDR_SIZE + 255];
+    uint16_t opcode = cmd_opcode_pack(ogf, ocf);
+    struct ns_hci_inflight *c;
+    int ret;
+
+    if (q->tail - q->head == NS_HCI_INFLIGHT_MAX) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    buf[0] = HCI_COMMAND_PKT;
+    buf[1] = opcode & 0xFF;
+    buf[2] = opcode >> 8;
+    buf[3] = plen;
+    if (plen) {
+        memcpy(buf + 1 + HCI_COMMAND_HDR_SIZE, params, plen);
+    }
+    while ((ret = write(q->fd, buf, 1 + HCI_COMMAND_HDR_SIZE + plen)) < 0 && errno == EINTR)
+        ;
+    if (ret < 0) {
+        return -1;
+    }
+
+    c = &q->cmds[q->tail++ % NS_HCI_INFLIGHT_MAX];
+    c->opcode = opcode;
+    c->tag = tag;
+    c->timeout_ms = timeout_ms;
+    c->deadline_ms = now_ms + timeout_ms;
+    if (tag != NS_HCI_TAG_NONE) {
+        q->busy++;
+    }
+    return 0;
+}
+
+/* The oldest command in flight with opcode, NULL if none */
+static struct ns_hci_inflight *ns_hci_queue_find(struct ns_hci_queue *q, uint16_t opcode)
+{
+    uint32_t i;
+
+    for (i = q->head; i != q->tail; i++) {
+        if (q->cmds[i % NS_HCI_INFLIGHT_MAX].opcode == opcode) {
+            return &q->cmds[i % NS_HCI_INFLIGHT_MAX];
+        }
+    }
+    return NULL;
+}
+
+int ns_hci_queue_event(struct ns_hci_queue *q, const uint8_t *buf, int len, uint64_t now_ms,
+                       struct ns_hci_result *r)
+{
+    const hci_event_hdr *hdr = (const hci_event_hdr *)(buf + 1);
+    const uint8_t *params = buf + 1 + HCI_EVENT_HDR_SIZE;
+    struct ns_hci_inflight *c;
+    int plen = len - 1 - HCI_EVENT_HDR_SIZE;
+    const uint8_t *ret;
+    int ret_len;
+
+    if (plen < 1 || buf[0] != HCI_EVENT_PKT) {
+        return NS_HCI_EV_NONE;
+    }
+    memset(r, 0, sizeof(*r));
+
+    switch (hdr->evt) {
+    case EVT_HARDWARE_ERROR:
+        r->status = params[0];
+        return NS_HCI_EV_HW_ERROR;
+    case EVT_CMD_COMPLETE:
+        if (plen < EVT_CMD_COMPLETE_SIZE + 1) {
+            return NS_HCI_EV_NONE;
+        }
+        r->opcode = btohs(((const evt_cmd_complete *)params)->opcode);
+        ret = params + EVT_CMD_COMPLETE_SIZE;
+        ret_len = plen - EVT_CMD_COMPLETE_SIZE;
+        break;
+    case EVT_CMD_STATUS:
+        if (plen < EVT_CMD_STATUS_SIZE) {
+            return NS_HCI_EV_NONE;
+        }
+        r->opcode = btohs(((const evt_cmd_status *)params)->opcode);
+        ret = params;
+        ret_len = 1;
+        break;
+    default:
+        return NS_HCI_EV_NONE;
+    }
+    if (!r->opcode) {
+        return NS_HCI_EV_NONE;      /* a credit update */
+    }
+
+    r->status = ret[0];
+    r->len = ret_len - 1 < NS_HCI_RET_MAX ? ret_len - 1 : NS_HCI_RET_MAX;
+    memcpy(r->ret, ret + 1, r->len);
+
+    c = ns_hci_queue_find(q, r->opcode);
+    if (!c) {
+        return NS_HCI_EV_OTHER;
+    }
+    r->tag = c->tag;
+    c->opcode = 0;
+    if (c->tag != NS_HCI_TAG_NONE) {
+        q->busy--;
+    }
+    ns_hci_queue_advance(q, now_ms);
+    return r->tag != NS_HCI_TAG_NONE ? NS_HCI_EV_DONE : NS_HCI_EV_NONE;
+}
+
+int ns_hci_queue_expire(struct ns_hci_queue *q, uint64_t now_ms, struct ns_hci_result *r)
+{
+    struct ns_hci_inflight *c;
+
+    if (q->head == q->tail) {
+        return 0;
+    }
+    c = &q->cmds[q->head % NS_HCI_INFLIGHT_MAX];
+    if (now_ms < c->deadline_ms) {
+        return 0;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->opcode = c->opcode;
+    r->tag = c->tag;
+    r->status = NS_HCI_STATUS_TIMEOUT;
+    c->opcode = 0;
+    if (c->tag != NS_HCI_TAG_NONE) {
+        q->busy--;
+    }
+    ns_hci_queue_advance(q, now_ms);
+    return 1;
+}
+
+uint64_t ns_hci_queue_deadline(const struct ns_hci_queue *q)
+{
+    return q->head != q->tail ? q->cmds[q->head % NS_HCI_INFLIGHT_MAX].deadline_ms : 0;
+}
+
+void ns_hci_queue_abandon(struct ns_hci_queue *q)
+{
+    uint32_t i;
+
+    for (i = q->head; i != q->tail; i++) {
+        q->cmds[i % NS_HCI_INFLIGHT_MAX].tag = NS_HCI_TAG_NONE;
+    }
+    q->busy = 0;
+}
+
+void ns_hci_queue_flush(struct ns_hci_queue *q)
+{
+    q->head = q->tail;
+    q->busy = 0;
+}
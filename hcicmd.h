@@ -0,0 +1,115 @@
+#ifndef __NS_HCICMD_H__
+#define __NS_HCICMD_H__
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+/* HCI commands on any socket that carries H4 packets.
+ *
+ * libbluetooth's hci_send_req only works on a raw HCI socket: it swaps
+ * the socket's filter for one that lets the command's Command Complete
+ * through. ns_hci_send_req takes the same request and does the same on
+ * a raw HCI socket; on any other packet socket, such as a connection to
+ * a virtual controller (see vhci.h), there is no filter and it only
+ * writes the command and reads until the matching Command Complete or
+ * Command Status arrives. As with hci_send_req, other events read in the
+ * meantime are dropped, so it should not run on a socket another thread
+ * reads from. */
+
+/* 1 if dd is a raw HCI socket, 0 for any other socket */
+int ns_hci_is_raw(int dd);
+
+/* Send rq and wait up to timeout_ms (<= 0 waits for ever) for its
+ * completion. rq->rparam receives the return parameters of the Command
+ * Complete, or the Command Status event when rq->event is
+ * EVT_CMD_STATUS. Returns 0, or -1 with errno set (ETIMEDOUT, EIO for a
+ * failed Command Status, EPIPE if the controller went away). */
+int ns_hci_send_req(int dd, struct hci_request *rq, int timeout_ms);
+
+/* HCI_FILTER on a raw HCI socket, nothing on another socket */
+int ns_hci_set_filter(int dd, const struct hci_filter *f);
+
+/* Asynchronous commands.
+ *
+ * A queue writes commands as soon as they are issued and keeps them in
+ * flight, in order, until an event completes them: a Command Complete
+ * or Command Status with the same opcode, or the deadline of the oldest
+ * one passes. The kernel hands commands of a raw socket to the
+ * controller as its Num_HCI_Command_Packets allows, so a whole sequence
+ * can be issued at once and costs one round trip per command in the
+ * controller, not one per command through the caller. The owner polls
+ * the socket and hands every event it reads to ns_hci_queue_event();
+ * nothing blocks, so one thread drives any number of controllers.
+ *
+ * Commands given up on (ns_hci_queue_abandon()) stay in flight without
+ * a tag until their completion arrives or times out, so a late answer
+ * is never taken for a newer command with the same opcode. A controller
+ * that is reset answers nothing sent before, ns_hci_queue_flush() drops
+ * those commands altogether. */
+
+#define NS_HCI_INFLIGHT_MAX         320     /* a full accept list and then some */
+#define NS_HCI_RET_MAX              32
+#define NS_HCI_TAG_NONE             0
+
+/* status of a command the controller never answered */
+#define NS_HCI_STATUS_TIMEOUT       0xFF
+
+enum {
+    NS_HCI_EV_NONE,                 /* nothing for the owner */
+    NS_HCI_EV_DONE,                 /* a tagged command completed, see the result */
+    NS_HCI_EV_OTHER,                /* a command this queue did not send completed */
+    NS_HCI_EV_HW_ERROR,             /* Hardware Error, result status holds its code */
+};
+
+struct ns_hci_inflight {
+    uint16_t opcode;                /* 0 once completed */
+    uint8_t tag;
+    int timeout_ms;
+    uint64_t deadline_ms;           /* counted from when it became the oldest */
+};
+
+struct ns_hci_queue {
+    int fd;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t busy;                  /* tagged commands in flight */
+    struct ns_hci_inflight cmds[NS_HCI_INFLIGHT_MAX];
+};
+
+struct ns_hci_result {
+    uint16_t opcode;
+    uint8_t tag;
+    uint8_t status;
+    uint8_t len;                    /* return parameters after the status */
+    uint8_t ret[NS_HCI_RET_MAX];
+};
+
+/* Sets a filter for the command events and Hardware Error on a raw HCI
+ * socket, which should be used for nothing else. fd should be non-blocking. */
+int ns_hci_queue_init(struct ns_hci_queue *q, int fd);
+
+/* Write a command, tag (not NS_HCI_TAG_NONE) comes back with its result.
+ * Returns 0, or -1 with errno set (ENOBUFS with too many in flight). */
+int ns_hci_queue_send(struct ns_hci_queue *q, uint16_t ogf, uint16_t ocf, const void *params,
+                      uint8_t plen, uint8_t tag, int timeout_ms, uint64_t now_ms);
+
+/* One event read from the socket, NS_HCI_EV_* */
+int ns_hci_queue_event(struct ns_hci_queue *q, const uint8_t *buf, int len, uint64_t now_ms,
+                       struct ns_hci_result *r);
+
+/* 1 if the oldest command timed out, it is dropped and r filled with
+ * NS_HCI_STATUS_TIMEOUT when it had a tag. Call until it returns 0. */
+int ns_hci_queue_expire(struct ns_hci_queue *q, uint64_t now_ms, struct ns_hci_result *r);
+
+/* Earliest deadline in flight, 0 for none */
+uint64_t ns_hci_queue_deadline(const struct ns_hci_queue *q);
+
+/* Forget the results of everything in flight */
+void ns_hci_queue_abandon(struct ns_hci_queue *q);
+
+/* Forget everything in flight, for a controller that will answer none
+ * of it: before a Reset or after the adapter went down */
+void ns_hci_queue_flush(struct ns_hci_queue *q);
+
+#endif //__NS_HCICMD_H__
@@ -0,0 +1,170 @@
+// Reader for the sighting log the scanner writes with -L.
+//
+// Compile with:
+//   cc -O2 logread.c sightlog.c bleapi.c devtab.c suppress.c output.c extadv.c filter.c sched.c metrics.c match.c decode.c rpa.c -pthread -lbluetooth -ldl -o logread
+// Run with:
+//   ./logread [-s from] [-e to] [-a addr[-addr]] [-f text|json|binary] [-c] <logdir>
+//
+// Prints the sightings of all writers in the log directory merged in time
+// order, in the scanner's output formats. -s and -e take ms since the
+// epoch, or -<ms> for a time before now; -a one address or an inclusive
+// range (00:00:00:00:00:00-FF:FF:FF:FF:FF:FF). -c only counts. The log can
+// be read while the scanner is appending to it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <bluetooth/bluetooth.h>
+
+#include "bleapi.h"
+#include "output.h"
+#include "sightlog.h"
+
+static struct ns_out logread_out;
+
+static int logread_print(const struct ns_log_record *r, const uint8_t *payload, void *ctx)
+{
+    ns_adv_report_t rpt;
+    ns_adv_index_t idx;
+
+    (void)ctx;
+    memcpy(rpt.bdaddr.b, r->bdaddr, sizeof(r->bdaddr));
+    rpt.bdaddr_type = r->bdaddr_type;
+    rpt.evt_type = r->evt_type;
+    rpt.rssi = r->rssi;
+    rpt.tx_power = r->tx_power;
+    rpt.sid = r->sid;
+    rpt.primary_phy = r->phy >> 4;
+    rpt.secondary_phy = r->phy & 0x0f;
+    rpt.adapter = r->adapter;
+    rpt.truncated = r->truncated;
+    rpt.length = r->payload_len;
+    rpt.data = payload;
+    rpt.irk = NULL;
+
+    ns_adv_index_build(&idx, rpt.data, rpt.length);
+    ns_out_report(&logread_out, &rpt, &idx, r->ts_ms);
+    return 0;
+}
+
+static int logread_count(const struct ns_log_record *r, const uint8_t *payload, void *ctx)
+{
+    (void)r;
+    (void)payload;
+    (void)ctx;
+    return 0;
+}
+
+static int logread_parse_time(const char *s, uint64_t *ms)
+{
+    struct timespec ts;
+    char *end;
+    long long v = strtoll(s, &end, 10);
+
+    if (*end || end == s) {
+        return -1;
+    }
+    if (v < 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        v += (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        if (v < 0) {
+            v = 0;
+        }
+    }
+    *ms = (uint64_t)v;
+    return 0;
+}
+
+static int logread_parse_addr(const char *s, uint64_t *key)
+{
+    bdaddr_t ba;
+
+    if (strlen(s) != 17 || str2ba(s, &ba) < 0) {
+        return -1;
+    }
+    *key = ns_log_addr_key(ba.b);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] <logdir>\n", prog);
+    printf("  -s <ms>       first sighting time, ms since the epoch or -<ms> before now\n");
+    printf("  -e <ms>       last sighting time, same\n");
+    printf("  -a <addr>[-<addr>]  one device or an inclusive address range\n");
+    printf("  -f <format>   output format: text (default), json or binary\n");
+    printf("  -c            only print the number of matching sightings\n");
+    printf("  -h            show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct ns_log_query q = { 0, UINT64_MAX, 0, 0xFFFFFFFFFFFFULL };
+    enum ns_out_format format = NS_OUT_TEXT;
+    int count_only = 0;
+    char *dash;
+    long n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:e:a:f:ch")) != -1) {
+        switch (opt) {
+        case 's':
+        case 'e':
+            if (logread_parse_time(optarg, opt == 's' ? &q.from_ms : &q.to_ms) < 0) {
+                fprintf(stderr, "Time must be ms since the epoch or -<ms>\n");
+                return 1;
+            }
+            break;
+        case 'a':
+            dash = strchr(optarg, '-');
+            if (dash) {
+                *dash++ = '\0';
+            }
+            if (logread_parse_addr(optarg, &q.addr_lo) < 0 ||
+                logread_parse_addr(dash ? dash : optarg, &q.addr_hi) < 0) {
+                fprintf(stderr, "Address must be XX:XX:XX:XX:XX:XX[-XX:XX:XX:XX:XX:XX]\n");
+                return 1;
+            }
+            break;
+        case 'f':
+            if (ns_out_parse_format(optarg, &format) < 0) {
+                fprintf(stderr, "Output format must be text, json or binary\n");
+                return 1;
+            }
+            break;
+        case 'c':
+            count_only = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!count_only && ns_out_init(&logread_out, STDOUT_FILENO, format) < 0) {
+        fprintf(stderr, "Failed to allocate output buffers\n");
+        return 1;
+    }
+
+    n = ns_log_scan(argv[optind], &q, count_only ? logread_count : logread_print, NULL);
+    if (n < 0) {
+        perror("Failed to read the log");
+        return 1;
+    }
+    if (count_only) {
+        printf("%ld\n", n);
+    } else {
+        ns_out_flush(&logread_out);
+    }
+    return 0;
+}
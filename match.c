@@ -0,0 +1,234 @@
+// Watch list matching, see match.h.
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NS_MATCH_X86
+#endif
+
+#include "match.h"
+#include "devtab.h"
+
+/* Bit w set if way w of the bucket holds key */
+typedef uint32_t (*ns_match_cmp_fn)(const struct ns_match_bucket *b, const uint8_t *key);
+
+static uint32_t ns_match_cmp_scalar(const struct ns_match_bucket *b, const uint8_t *key)
+{
+    uint32_t hits = 0;
+    int w;
+
+    for (w = 0; w < NS_MATCH_WAYS; w++) {
+        hits |= (uint32_t)!memcmp(b->keys[w], key, NS_MATCH_KEY) << w;
+    }
+    return hits;
+}
+
+#ifdef NS_MATCH_X86
+__attribute__((target("sse2")))
+static uint32_t ns_match_cmp_sse2(const struct ns_match_bucket *b, const uint8_t *key)
+{
+    __m128i k = _mm_load_si128((const __m128i *)key);
+    uint32_t hits = 0;
+    int w;
+
+    for (w = 0; w < NS_MATCH_WAYS; w++) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_load_si128((const __m128i *)b->keys[w]), k);
+        hits |= (uint32_t)(_mm_movemask_epi8(eq) == 0xFFFF) << w;
+    }
+    return hits;
+}
+
+/* Two keys per compare, the bucket is two 32 byte halves */
+__attribute__((target("avx2")))
+static uint32_t ns_match_cmp_avx2(const struct ns_match_bucket *b, const uint8_t *key)
+{
+    __m256i k = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)key));
+    uint32_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)b->keys[0]), k));
+    uint32_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)b->keys[2]), k));
+
+    return (uint32_t)((lo & 0xFFFF) == 0xFFFF) | (uint32_t)((lo >> 16) == 0xFFFF) << 1 |
+           (uint32_t)((hi & 0xFFFF) == 0xFFFF) << 2 | (uint32_t)((hi >> 16) == 0xFFFF) << 3;
+}
+#endif
+
+static ns_match_cmp_fn ns_match_cmp = ns_match_cmp_scalar;
+static const char *ns_match_cmp_name = "scalar";
+
+__attribute__((constructor))
+static void ns_match_select(void)
+{
+#ifdef NS_MATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ns_match_cmp = ns_match_cmp_avx2;
+        ns_match_cmp_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        ns_match_cmp = ns_match_cmp_sse2;
+        ns_match_cmp_name = "sse2";
+    }
+#endif
+}
+
+const char *ns_match_impl(void)
+{
+    return ns_match_cmp_name;
+}
+
+static uint32_t ns_match_hash(const uint8_t *key)
+{
+    uint64_t lo, hi;
+
+    memcpy(&lo, key, 8);
+    memcpy(&hi, key + 8, 8);
+    return (uint32_t)ns_devtab_hash(lo ^ ns_devtab_hash(hi));
+}
+
+static void ns_match_key(uint8_t *key, const uint8_t *data, uint32_t len)
+{
+    memset(key, 0, NS_MATCH_KEY);
+    memcpy(key, data, len < NS_MATCH_KEY ? len : NS_MATCH_KEY);
+}
+
+/* Keys fill the ways of a bucket in order and spill into the next
+ * bucket, so a bucket with a free way ends every probe through it */
+static void ns_match_insert(struct ns_match_group *g, const uint8_t *data, uint32_t index)
+{
+    uint8_t key[NS_MATCH_KEY];
+    uint32_t i, w;
+
+    ns_match_key(key, data, g->len);
+    i = ns_match_hash(key) & g->mask;
+    while (1) {
+        for (w = 0; w < NS_MATCH_WAYS; w++) {
+            if (!g->entries[i * NS_MATCH_WAYS + w]) {
+                memcpy(g->buckets[i].keys[w], key, NS_MATCH_KEY);
+                g->entries[i * NS_MATCH_WAYS + w] = index + 1;
+                if (g->len > NS_MATCH_KEY) {
+                    memcpy(g->tails + (size_t)index * (g->len - NS_MATCH_KEY), data + NS_MATCH_KEY,
+                           g->len - NS_MATCH_KEY);
+                }
+                return;
+            }
+        }
+        i = (i + 1) & g->mask;
+    }
+}
+
+static int ns_match_group_has(const struct ns_match_group *g, const uint8_t *data)
+{
+    uint8_t key[NS_MATCH_KEY] __attribute__((aligned(16)));
+    const uint32_t *e;
+    uint32_t tail = g->len > NS_MATCH_KEY ? g->len - NS_MATCH_KEY : 0;
+    uint32_t i, w, hits;
+
+    ns_match_key(key, data, g->len);
+    i = ns_match_hash(key) & g->mask;
+    while (1) {
+        hits = ns_match_cmp(&g->buckets[i], key);
+        e = &g->entries[i * NS_MATCH_WAYS];
+        for (w = 0; hits; w++, hits >>= 1) {
+            /* An empty way matches an all zero key */
+            if ((hits & 1) && e[w] &&
+                (!tail || !memcmp(g->tails + (size_t)(e[w] - 1) * tail, data + NS_MATCH_KEY, tail))) {
+                return 1;
+            }
+        }
+        if (!e[NS_MATCH_WAYS - 1]) {
+            return 0;
+        }
+        i = (i + 1) & g->mask;
+    }
+}
+
+int ns_match_build(struct ns_match *m, const uint8_t *vals, uint32_t nvals)
+{
+    uint32_t counts[256] = { 0 };
+    uint32_t slot[256];
+    struct ns_match_group *g;
+    const uint8_t *v;
+    uint32_t buckets;
+    uint32_t k, len;
+
+    memset(m, 0, sizeof(*m));
+    /* Empty strings match nothing and get no group */
+    for (v = vals, k = 0; k < nvals; k++, v += 1 + v[0]) {
+        if (v[0] && !counts[v[0]]++) {
+            m->ngroups++;
+        }
+    }
+
+    m->groups = calloc(m->ngroups ? m->ngroups : 1, sizeof(*m->groups));
+    if (!m->groups) {
+        return -1;
+    }
+
+    for (g = m->groups, len = 1; len < 256; len++) {
+        if (!counts[len]) {
+            continue;
+        }
+        /* At most half the ways in use */
+        for (buckets = 1; buckets * NS_MATCH_WAYS < counts[len] * 2; buckets <<= 1)
+            ;
+        g->len = len;
+        g->mask = buckets - 1;
+        g->buckets = aligned_alloc(64, buckets * sizeof(*g->buckets));
+        g->entries = calloc(buckets * NS_MATCH_WAYS, sizeof(*g->entries));
+        if (len > NS_MATCH_KEY) {
+            g->tails = malloc((size_t)counts[len] * (len - NS_MATCH_KEY));
+        }
+        if (!g->buckets || !g->entries || (len > NS_MATCH_KEY && !g->tails)) {
+            ns_match_free(m);
+            return -1;
+        }
+        memset(g->buckets, 0, buckets * sizeof(*g->buckets));
+        slot[len] = (uint32_t)(g - m->groups);
+        counts[len] = 0;                /* now the next string index */
+        g++;
+    }
+
+    for (v = vals, k = 0; k < nvals; k++, v += 1 + v[0]) {
+        if (v[0]) {
+            ns_match_insert(&m->groups[slot[v[0]]], v + 1, counts[v[0]]++);
+        }
+    }
+    return 0;
+}
+
+void ns_match_free(struct ns_match *m)
+{
+    uint32_t i;
+
+    for (i = 0; m->groups && i < m->ngroups; i++) {
+        free(m->groups[i].buckets);
+        free(m->groups[i].entries);
+        free(m->groups[i].tails);
+    }
+    free(m->groups);
+    memset(m, 0, sizeof(*m));
+}
+
+int ns_match_exact(const struct ns_match *m, const uint8_t *data, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->ngroups && m->groups[i].len <= len; i++) {
+        if (m->groups[i].len == len) {
+            return ns_match_group_has(&m->groups[i], data);
+        }
+    }
+    return 0;
+}
+
+int ns_match_prefix(const struct ns_match *m, const uint8_t *data, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->ngroups && m->groups[i].len <= len; i++) {
+        if (ns_match_group_has(&m->groups[i], data)) {
+            return 1;
+        }
+    }
+    return 0;
+}
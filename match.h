@@ -0,0 +1,55 @@
+#ifndef __NS_MATCH_H__
+#define __NS_MATCH_H__
+
+#include <stdint.h>
+
+/* Watch list matching of byte strings: service UUIDs, manufacturer data
+ * prefixes and names.
+ *
+ * Strings are grouped by length. Each group is a hash set of 16 byte
+ * keys (a string's first 16 bytes, zero padded) kept in buckets of
+ * NS_MATCH_WAYS keys that fill one cache line. A lookup hashes the probe
+ * once and compares it against a whole bucket: two 32 byte compares with
+ * AVX2, one 16 byte compare per key with SSE2, memcmp elsewhere. The
+ * variant is picked at startup from what the CPU supports. Bytes past the
+ * 16th are compared after a key matched, so a 20 byte iBeacon prefix
+ * costs one vector compare and one short memcmp.
+ *
+ * A lookup costs one probe per distinct length in the set, whatever the
+ * size of the watch list. */
+
+#define NS_MATCH_KEY            16
+#define NS_MATCH_WAYS           4
+
+struct ns_match_bucket {
+    uint8_t keys[NS_MATCH_WAYS][NS_MATCH_KEY];
+} __attribute__((aligned(64)));
+
+struct ns_match_group {
+    uint32_t len;                   /* of every string in the group */
+    uint32_t mask;                  /* buckets - 1 */
+    struct ns_match_bucket *buckets;
+    uint32_t *entries;              /* per key: 0 = empty, else 1 + string index */
+    uint8_t *tails;                 /* len - NS_MATCH_KEY bytes per string */
+};
+
+struct ns_match {
+    struct ns_match_group *groups;  /* shortest strings first */
+    uint32_t ngroups;
+};
+
+/* vals holds nvals strings as <len><bytes>, len 0..255, empty strings
+ * are left out. Returns 0, or -1 if the set cannot be allocated. */
+int ns_match_build(struct ns_match *m, const uint8_t *vals, uint32_t nvals);
+void ns_match_free(struct ns_match *m);
+
+/* 1 if data is one of the strings */
+int ns_match_exact(const struct ns_match *m, const uint8_t *data, uint32_t len);
+
+/* 1 if one of the strings is a prefix of data */
+int ns_match_prefix(const struct ns_match *m, const uint8_t *data, uint32_t len);
+
+/* "avx2", "sse2" or "scalar" */
+const char *ns_match_impl(void);
+
+#endif //__NS_MATCH_H__
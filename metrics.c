@@ -0,0 +1,265 @@
+// Runtime metrics, see metrics.h.
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <linux/sock_diag.h>
+
+#include "metrics.h"
+
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
+
+__thread struct ns_metrics_shard *ns_metrics_local;
+
+static struct ns_metrics_shard *ns_metrics_shards[NS_METRICS_SHARDS_MAX];
+static _Atomic int ns_metrics_nshards;
+static struct ns_metrics_shard *ns_metrics_free[NS_METRICS_SHARDS_MAX];    /* of exited threads */
+static int ns_metrics_nfree;
+static struct ns_metrics_shard ns_metrics_overflow = { .shared = 1 };
+static pthread_mutex_t ns_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ns_metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ns_metrics_key;
+static int ns_metrics_keyed;
+static int ns_metrics_sockets[NS_ADAPTERS_MAX] = { [0 ... NS_ADAPTERS_MAX - 1] = -1 };
+
+static int ns_metrics_listen_fd = -1;
+static int ns_metrics_signal_fd = -1;
+
+static const char *ns_metrics_counter_names[NS_MC_COUNT][2] = {
+    { "ble_scanner_events_total", "HCI events read" },
+    { "ble_scanner_reports_total", "Advertising reports parsed" },
+    { "ble_scanner_filtered_total", "Reports rejected by the filter" },
+    { "ble_scanner_suppressed_total", "Reports suppressed as redundant" },
+    { "ble_scanner_emitted_total", "Reports handed to the output" },
+    { "ble_scanner_rpa_resolved_total", "Reports whose private address an IRK resolved" },
+    { "ble_scanner_adapter_recoveries_total", "Stalled or failed adapters re-armed, reset or power cycled" },
+};
+
+static const char *ns_metrics_hist_names[NS_MH_COUNT][2] = {
+    { "ble_scanner_parse_seconds", "Time handle_ble_scan spends on one HCI event" },
+    { "ble_scanner_read_to_emit_seconds", "Time from reading an HCI event to formatting its record" },
+};
+
+/* Thread exit, the shard keeps its counts for the next thread */
+static void ns_metrics_release(void *arg)
+{
+    pthread_mutex_lock(&ns_metrics_lock);
+    ns_metrics_free[ns_metrics_nfree++] = arg;
+    pthread_mutex_unlock(&ns_metrics_lock);
+    ns_metrics_local = NULL;
+}
+
+static void ns_metrics_key_init(void)
+{
+    ns_metrics_keyed = pthread_key_create(&ns_metrics_key, ns_metrics_release) == 0;
+}
+
+/* A free shard, a new one, or the overflow shard once
+ * NS_METRICS_SHARDS_MAX threads hold one */
+struct ns_metrics_shard *ns_metrics_register(void)
+{
+    struct ns_metrics_shard *s = NULL;
+    int n;
+
+    pthread_once(&ns_metrics_once, ns_metrics_key_init);
+
+    pthread_mutex_lock(&ns_metrics_lock);
+    if (ns_metrics_nfree) {
+        s = ns_metrics_free[--ns_metrics_nfree];
+    } else if ((n = atomic_load(&ns_metrics_nshards)) < NS_METRICS_SHARDS_MAX) {
+        s = aligned_alloc(64, sizeof(*s));
+        if (s) {
+            memset(s, 0, sizeof(*s));
+            ns_metrics_shards[n] = s;
+            atomic_store(&ns_metrics_nshards, n + 1);
+        }
+    }
+    /* Without the key the shard could not be handed back */
+    if (s && (!ns_metrics_keyed || pthread_setspecific(ns_metrics_key, s) != 0)) {
+        ns_metrics_free[ns_metrics_nfree++] = s;
+        s = NULL;
+    }
+    pthread_mutex_unlock(&ns_metrics_lock);
+
+    ns_metrics_local = s ? s : &ns_metrics_overflow;
+    return ns_metrics_local;
+}
+
+void ns_metrics_watch_socket(int adapter, int fd)
+{
+    if (adapter >= 0 && adapter < NS_ADAPTERS_MAX) {
+        ns_metrics_sockets[adapter] = fd;
+    }
+}
+
+static uint64_t ns_metrics_sum(size_t offset)
+{
+    int n = atomic_load(&ns_metrics_nshards);
+    uint64_t total = atomic_load_explicit((_Atomic uint64_t *)((char *)&ns_metrics_overflow + offset),
+                                          memory_order_relaxed);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        total += atomic_load_explicit((_Atomic uint64_t *)((char *)ns_metrics_shards[i] + offset),
+                                      memory_order_relaxed);
+    }
+    return total;
+}
+
+#define NS_METRICS_SUM(field)   ns_metrics_sum(offsetof(struct ns_metrics_shard, field))
+
+uint64_t ns_metrics_total(int adapter, enum ns_metrics_counter c)
+{
+    return adapter < NS_ADAPTERS_MAX ? NS_METRICS_SUM(counters[adapter][c]) : 0;
+}
+
+void ns_metrics_dump(FILE *fp)
+{
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len;
+    uint64_t v, cum;
+    int a, c, h, b;
+
+    for (c = 0; c < NS_MC_COUNT; c++) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", ns_metrics_counter_names[c][0],
+                ns_metrics_counter_names[c][1], ns_metrics_counter_names[c][0]);
+        for (a = 0; a < NS_ADAPTERS_MAX; a++) {
+            v = NS_METRICS_SUM(counters[a][c]);
+            if (v || ns_metrics_sockets[a] >= 0) {
+                fprintf(fp, "%s{adapter=\"hci%d\"} %llu\n", ns_metrics_counter_names[c][0], a,
+                        (unsigned long long)v);
+            }
+        }
+    }
+
+    fprintf(fp, "# HELP ble_scanner_read_cycles_total Batches of HCI events handled\n"
+                "# TYPE ble_scanner_read_cycles_total counter\n"
+                "ble_scanner_read_cycles_total %llu\n", (unsigned long long)NS_METRICS_SUM(cycles));
+
+    for (h = 0; h < NS_MH_COUNT; h++) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", ns_metrics_hist_names[h][0],
+                ns_metrics_hist_names[h][1], ns_metrics_hist_names[h][0]);
+        for (cum = 0, b = 0; b < NS_METRICS_BUCKETS; b++) {
+            cum += NS_METRICS_SUM(buckets[h][b]);
+            fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", ns_metrics_hist_names[h][0],
+                    (double)(1ULL << b) / 1e6, (unsigned long long)cum);
+        }
+        cum += NS_METRICS_SUM(buckets[h][NS_METRICS_BUCKETS]);
+        fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                ns_metrics_hist_names[h][0], (unsigned long long)cum,
+                ns_metrics_hist_names[h][0], NS_METRICS_SUM(sum_ns[h]) / 1e9,
+                ns_metrics_hist_names[h][0], (unsigned long long)cum);
+    }
+
+    /* Events the kernel dropped because the socket's receive queue was full */
+    fprintf(fp, "# HELP ble_scanner_socket_drops_total HCI events dropped by the kernel, receive queue full\n"
+                "# TYPE ble_scanner_socket_drops_total counter\n");
+    for (a = 0; a < NS_ADAPTERS_MAX; a++) {
+        len = sizeof(meminfo);
+        if (ns_metrics_sockets[a] >= 0 &&
+            getsockopt(ns_metrics_sockets[a], SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0) {
+            fprintf(fp, "ble_scanner_socket_drops_total{adapter=\"hci%d\"} %u\n", a, meminfo[SK_MEMINFO_DROPS]);
+        }
+    }
+    fprintf(fp, "# HELP ble_scanner_socket_queued_bytes Bytes waiting in the HCI socket's receive queue\n"
+                "# TYPE ble_scanner_socket_queued_bytes gauge\n");
+    for (a = 0; a < NS_ADAPTERS_MAX; a++) {
+        len = sizeof(meminfo);
+        if (ns_metrics_sockets[a] >= 0 &&
+            getsockopt(ns_metrics_sockets[a], SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0) {
+            fprintf(fp, "ble_scanner_socket_queued_bytes{adapter=\"hci%d\"} %u\n", a, meminfo[SK_MEMINFO_RMEM_ALLOC]);
+        }
+    }
+}
+
+static void *ns_metrics_thread(void *arg)
+{
+    struct signalfd_siginfo si;
+    struct pollfd fds[2];
+    FILE *fp;
+    int conn;
+    int n = 0;
+
+    (void)arg;
+    if (ns_metrics_listen_fd >= 0) {
+        fds[n].fd = ns_metrics_listen_fd;
+        fds[n++].events = POLLIN;
+    }
+    if (ns_metrics_signal_fd >= 0) {
+        fds[n].fd = ns_metrics_signal_fd;
+        fds[n++].events = POLLIN;
+    }
+
+    while (1) {
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Metrics poll failed");
+            return NULL;
+        }
+        if (ns_metrics_listen_fd >= 0 && (fds[0].revents & POLLIN)) {
+            conn = accept(ns_metrics_listen_fd, NULL, NULL);
+            fp = conn >= 0 ? fdopen(conn, "w") : NULL;
+            if (fp) {
+                ns_metrics_dump(fp);
+                fclose(fp);
+            } else if (conn >= 0) {
+                close(conn);
+            }
+        }
+        if (ns_metrics_signal_fd >= 0 && (fds[n - 1].revents & POLLIN) &&
+            read(ns_metrics_signal_fd, &si, sizeof(si)) == sizeof(si)) {
+            ns_metrics_dump(stderr);
+        }
+    }
+}
+
+int ns_metrics_start(const char *path, int signal_fd)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    pthread_t thread;
+
+    if (path) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        /* A socket left behind by an earlier run */
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+
+        ns_metrics_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (ns_metrics_listen_fd < 0) {
+            return -1;
+        }
+        if (bind(ns_metrics_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(ns_metrics_listen_fd, 4) < 0) {
+            close(ns_metrics_listen_fd);
+            ns_metrics_listen_fd = -1;
+            return -1;
+        }
+    }
+    ns_metrics_signal_fd = signal_fd;
+
+    if (pthread_create(&thread, NULL, ns_metrics_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,123 @@
+#ifndef __NS_METRICS_H__
+#define __NS_METRICS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "bleapi.h"
+
+/* Runtime metrics in the Prometheus text format.
+ *
+ * Every thread that counts gets its own shard on first use, so the hot
+ * path is a thread local pointer and a plain add: a shard has a single
+ * writer, the relaxed atomics only keep the exporter from reading torn
+ * values. A thread's shard goes back to a free list when it exits and
+ * the next new thread carries on counting in it, so totals survive
+ * pipeline workers and short lived callers such as Python threads.
+ * Threads beyond NS_METRICS_SHARDS_MAX live at once share an overflow
+ * shard that is added to atomically. The exporter sums all shards when
+ * asked for a snapshot, through the Unix socket given to
+ * ns_metrics_start() or SIGUSR2 (printed to stderr).
+ *
+ * Latencies go into histograms with power of two buckets from 1 us to
+ * NS_METRICS_BUCKETS - 1 doublings above it, in nanoseconds. */
+
+#define NS_METRICS_SHARDS_MAX   64
+#define NS_METRICS_BUCKETS      22      /* le 1us .. 2^21 us (~2 s), then +Inf */
+
+enum ns_metrics_counter {
+    NS_MC_EVENTS,                       /* HCI events */
+    NS_MC_REPORTS,                      /* advertising reports parsed */
+    NS_MC_FILTERED,                     /* rejected by the filter */
+    NS_MC_SUPPRESSED,                   /* redundant, not printed again */
+    NS_MC_EMITTED,                      /* handed to the output */
+    NS_MC_RESOLVED,                     /* private addresses resolved with an IRK */
+    NS_MC_RECOVERIES,                   /* adapter re-armed, reset or power cycled */
+    NS_MC_COUNT,
+};
+
+enum ns_metrics_hist {
+    NS_MH_PARSE,                        /* handle_ble_scan per event */
+    NS_MH_READ_TO_EMIT,                 /* socket read to formatted record */
+    NS_MH_COUNT,
+};
+
+struct ns_metrics_shard {
+    _Atomic uint64_t counters[NS_ADAPTERS_MAX][NS_MC_COUNT];
+    _Atomic uint64_t cycles;            /* read cycles (batches) handled */
+    _Atomic uint64_t buckets[NS_MH_COUNT][NS_METRICS_BUCKETS + 1];
+    _Atomic uint64_t sum_ns[NS_MH_COUNT];
+    int shared;                         /* the overflow shard, several writers */
+} __attribute__((aligned(64)));
+
+extern __thread struct ns_metrics_shard *ns_metrics_local;
+/* Never NULL */
+struct ns_metrics_shard *ns_metrics_register(void);
+
+static inline struct ns_metrics_shard *ns_metrics_shard(void)
+{
+    return ns_metrics_local ? ns_metrics_local : ns_metrics_register();
+}
+
+static inline void ns_metrics_add(const struct ns_metrics_shard *s, _Atomic uint64_t *v, uint64_t n)
+{
+    if (__builtin_expect(s->shared, 0)) {
+        atomic_fetch_add_explicit(v, n, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
+static inline void ns_metrics_count(int adapter, enum ns_metrics_counter c)
+{
+    struct ns_metrics_shard *s = ns_metrics_shard();
+
+    if (adapter < NS_ADAPTERS_MAX) {
+        ns_metrics_add(s, &s->counters[adapter][c], 1);
+    }
+}
+
+/* One read cycle (a batch of events) handled */
+static inline void ns_metrics_cycle(void)
+{
+    struct ns_metrics_shard *s = ns_metrics_shard();
+
+    ns_metrics_add(s, &s->cycles, 1);
+}
+
+static inline uint64_t ns_metrics_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void ns_metrics_observe(enum ns_metrics_hist h, uint64_t ns)
+{
+    struct ns_metrics_shard *s = ns_metrics_shard();
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    ns_metrics_add(s, &s->buckets[h][b < NS_METRICS_BUCKETS ? b : NS_METRICS_BUCKETS], 1);
+    ns_metrics_add(s, &s->sum_ns[h], ns);
+}
+
+/* The HCI socket of an adapter, for the kernel's receive queue drops */
+void ns_metrics_watch_socket(int adapter, int fd);
+
+/* Sum of counter c of adapter over all shards */
+uint64_t ns_metrics_total(int adapter, enum ns_metrics_counter c);
+
+/* Snapshot of all shards */
+void ns_metrics_dump(FILE *fp);
+
+/* Serve ns_metrics_dump() on a Unix stream socket at path (NULL for
+ * none) to every client that connects, and print it to stderr whenever
+ * signal_fd (a signalfd, -1 for none) is readable. Returns 0, or -1 if
+ * the socket or the thread can not be set up. */
+int ns_metrics_start(const char *path, int signal_fd);
+
+#endif //__NS_METRICS_H__
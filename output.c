@@ -0,0 +1,587 @@
+// Buffered sighting writer, see output.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "output.h"
+#include "rpa.h"
+#include "decode.h"
+
+#define NS_HEX_ROW(h) \
+    {h, '0'}, {h, '1'}, {h, '2'}, {h, '3'}, {h, '4'}, {h, '5'}, {h, '6'}, {h, '7'}, \
+    {h, '8'}, {h, '9'}, {h, 'a'}, {h, 'b'}, {h, 'c'}, {h, 'd'}, {h, 'e'}, {h, 'f'}
+
+const char ns_hex_pairs[256][2] = {
+    NS_HEX_ROW('0'), NS_HEX_ROW('1'), NS_HEX_ROW('2'), NS_HEX_ROW('3'),
+    NS_HEX_ROW('4'), NS_HEX_ROW('5'), NS_HEX_ROW('6'), NS_HEX_ROW('7'),
+    NS_HEX_ROW('8'), NS_HEX_ROW('9'), NS_HEX_ROW('a'), NS_HEX_ROW('b'),
+    NS_HEX_ROW('c'), NS_HEX_ROW('d'), NS_HEX_ROW('e'), NS_HEX_ROW('f'),
+};
+
+static const char ns_hex_upper[16] = "0123456789ABCDEF";
+
+static uint64_t ns_out_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline char *ns_put_str(char *p, const char *s, size_t len)
+{
+    memcpy(p, s, len);
+    return p + len;
+}
+
+#define NS_PUT_LIT(p, lit)  ns_put_str(p, lit, sizeof(lit) - 1)
+
+static char *ns_put_u64(char *p, uint64_t v)
+{
+    char tmp[20];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    while (n) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+static char *ns_put_int(char *p, int v)
+{
+    if (v < 0) {
+        *p++ = '-';
+        return ns_put_u64(p, (uint64_t)-(int64_t)v);
+    }
+    return ns_put_u64(p, v);
+}
+
+/* Same layout as ba2str() */
+static char *ns_put_bdaddr(char *p, const bdaddr_t *ba)
+{
+    int i;
+
+    for (i = 5; i >= 0; i--) {
+        *p++ = ns_hex_upper[ba->b[i] >> 4];
+        *p++ = ns_hex_upper[ba->b[i] & 0x0f];
+        if (i) {
+            *p++ = ':';
+        }
+    }
+    return p;
+}
+
+static char *ns_put_text_name(char *p, const uint8_t *name, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        *p++ = (name[i] >= 0x20 && name[i] < 0x7f) ? name[i] : '.';
+    }
+    return p;
+}
+
+/* Bytes outside printable ASCII are escaped as \u00XX, so the output is
+ * always valid JSON whatever the device put in its name. */
+static char *ns_put_json_name(char *p, const uint8_t *name, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (name[i] >= 0x20 && name[i] < 0x7f && name[i] != '"' && name[i] != '\\') {
+            *p++ = name[i];
+        } else {
+            p = NS_PUT_LIT(p, "\\u00");
+            p[0] = ns_hex_pairs[name[i]][0];
+            p[1] = ns_hex_pairs[name[i]][1];
+            p += 2;
+        }
+    }
+    return p;
+}
+
+/* Eddystone URL scheme prefixes and expansion codes 0x00..0x0d */
+static const char *ns_url_schemes[4] = { "http://www.", "https://www.", "http://", "https://" };
+static const char *ns_url_codes[14] = {
+    ".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+    ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov",
+};
+
+static char *ns_put_url(char *p, const struct ns_eddystone_url *u, int json)
+{
+    int i;
+
+    p = ns_put_str(p, ns_url_schemes[u->scheme & 3], strlen(ns_url_schemes[u->scheme & 3]));
+    for (i = 0; i < u->url_len && i < NS_EDDYSTONE_URL_MAX; i++) {
+        if (u->url[i] < 14) {
+            p = ns_put_str(p, ns_url_codes[u->url[i]], strlen(ns_url_codes[u->url[i]]));
+        } else if (json) {
+            p = ns_put_json_name(p, &u->url[i], 1);
+        } else {
+            p = ns_put_text_name(p, &u->url[i], 1);
+        }
+    }
+    return p;
+}
+
+/* Signed 8.8 fixed point as a decimal with two places */
+static char *ns_put_fixed88(char *p, int16_t v)
+{
+    int32_t c = (int32_t)v * 100 / 256;
+
+    if (c < 0) {
+        *p++ = '-';
+        c = -c;
+    }
+    p = ns_put_u64(p, c / 100);
+    *p++ = '.';
+    *p++ = '0' + c / 10 % 10;
+    *p++ = '0' + c % 10;
+    return p;
+}
+
+static char *ns_put_decoded_text(char *p, const struct ns_decoded *d)
+{
+    switch (d->kind) {
+    case NS_DEC_IBEACON:
+        p = NS_PUT_LIT(p, " ibeacon:");
+        p = ns_hex_encode(p, d->u.ibeacon.uuid, sizeof(d->u.ibeacon.uuid));
+        *p++ = ',';
+        p = ns_put_u64(p, le16toh(d->u.ibeacon.major));
+        *p++ = ',';
+        p = ns_put_u64(p, le16toh(d->u.ibeacon.minor));
+        *p++ = ',';
+        p = ns_put_int(p, d->u.ibeacon.tx_power);
+        break;
+    case NS_DEC_EDDYSTONE_UID:
+        p = NS_PUT_LIT(p, " eddystone_uid:");
+        p = ns_put_int(p, d->u.uid.tx_power);
+        *p++ = ',';
+        p = ns_hex_encode(p, d->u.uid.nid, sizeof(d->u.uid.nid));
+        *p++ = ',';
+        p = ns_hex_encode(p, d->u.uid.bid, sizeof(d->u.uid.bid));
+        break;
+    case NS_DEC_EDDYSTONE_URL:
+        p = NS_PUT_LIT(p, " eddystone_url:");
+        p = ns_put_int(p, d->u.url.tx_power);
+        *p++ = ',';
+        p = ns_put_url(p, &d->u.url, 0);
+        break;
+    case NS_DEC_EDDYSTONE_TLM:
+        p = NS_PUT_LIT(p, " eddystone_tlm:");
+        p = ns_put_u64(p, le16toh(d->u.tlm.vbatt_mv));
+        *p++ = ',';
+        if ((int16_t)le16toh(d->u.tlm.temp) != NS_EDDYSTONE_TEMP_NONE) {
+            p = ns_put_fixed88(p, (int16_t)le16toh(d->u.tlm.temp));
+        }
+        *p++ = ',';
+        p = ns_put_u64(p, le32toh(d->u.tlm.adv_cnt));
+        *p++ = ',';
+        p = ns_put_u64(p, le32toh(d->u.tlm.sec_cnt));
+        break;
+    default:
+        p = NS_PUT_LIT(p, " decoded:");
+        p = ns_put_u64(p, d->kind);
+        *p++ = ',';
+        p = ns_hex_encode(p, d->u.raw, d->len);
+        break;
+    }
+    return p;
+}
+
+static char *ns_put_decoded_json(char *p, const struct ns_decoded *d)
+{
+    switch (d->kind) {
+    case NS_DEC_IBEACON:
+        p = NS_PUT_LIT(p, ",\"ibeacon\":{\"uuid\":\"");
+        p = ns_hex_encode(p, d->u.ibeacon.uuid, sizeof(d->u.ibeacon.uuid));
+        p = NS_PUT_LIT(p, "\",\"major\":");
+        p = ns_put_u64(p, le16toh(d->u.ibeacon.major));
+        p = NS_PUT_LIT(p, ",\"minor\":");
+        p = ns_put_u64(p, le16toh(d->u.ibeacon.minor));
+        p = NS_PUT_LIT(p, ",\"tx\":");
+        p = ns_put_int(p, d->u.ibeacon.tx_power);
+        *p++ = '}';
+        break;
+    case NS_DEC_EDDYSTONE_UID:
+        p = NS_PUT_LIT(p, ",\"eddystone_uid\":{\"tx\":");
+        p = ns_put_int(p, d->u.uid.tx_power);
+        p = NS_PUT_LIT(p, ",\"nid\":\"");
+        p = ns_hex_encode(p, d->u.uid.nid, sizeof(d->u.uid.nid));
+        p = NS_PUT_LIT(p, "\",\"bid\":\"");
+        p = ns_hex_encode(p, d->u.uid.bid, sizeof(d->u.uid.bid));
+        p = NS_PUT_LIT(p, "\"}");
+        break;
+    case NS_DEC_EDDYSTONE_URL:
+        p = NS_PUT_LIT(p, ",\"eddystone_url\":{\"tx\":");
+        p = ns_put_int(p, d->u.url.tx_power);
+        p = NS_PUT_LIT(p, ",\"url\":\"");
+        p = ns_put_url(p, &d->u.url, 1);
+        p = NS_PUT_LIT(p, "\"}");
+        break;
+    case NS_DEC_EDDYSTONE_TLM:
+        p = NS_PUT_LIT(p, ",\"eddystone_tlm\":{\"vbatt\":");
+        p = ns_put_u64(p, le16toh(d->u.tlm.vbatt_mv));
+        if ((int16_t)le16toh(d->u.tlm.temp) != NS_EDDYSTONE_TEMP_NONE) {
+            p = NS_PUT_LIT(p, ",\"temp\":");
+            p = ns_put_fixed88(p, (int16_t)le16toh(d->u.tlm.temp));
+        }
+        p = NS_PUT_LIT(p, ",\"adv_cnt\":");
+        p = ns_put_u64(p, le32toh(d->u.tlm.adv_cnt));
+        p = NS_PUT_LIT(p, ",\"sec_cnt\":");
+        p = ns_put_u64(p, le32toh(d->u.tlm.sec_cnt));
+        *p++ = '}';
+        break;
+    default:
+        p = NS_PUT_LIT(p, ",\"decoded_");
+        p = ns_put_u64(p, d->kind);
+        p = NS_PUT_LIT(p, "\":\"");
+        p = ns_hex_encode(p, d->u.raw, d->len);
+        *p++ = '"';
+        break;
+    }
+    return p;
+}
+
+int ns_out_parse_format(const char *name, enum ns_out_format *format)
+{
+    if (!strcmp(name, "text")) {
+        *format = NS_OUT_TEXT;
+    } else if (!strcmp(name, "json")) {
+        *format = NS_OUT_JSON;
+    } else if (!strcmp(name, "binary")) {
+        *format = NS_OUT_BINARY;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int ns_out_init(struct ns_out *o, int fd, enum ns_out_format format)
+{
+    int i;
+
+    memset(o, 0, sizeof(*o));
+    o->fd = fd;
+    o->format = format;
+    o->flush_bytes = NS_OUT_FLUSH_BYTES_DEFAULT;
+    o->flush_ms = NS_OUT_FLUSH_MS_DEFAULT;
+
+    for (i = 0; i < NS_OUT_CHUNKS; i++) {
+        o->chunks[i] = malloc(NS_OUT_CHUNK_SIZE);
+        if (!o->chunks[i]) {
+            ns_out_free(o);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void ns_out_free(struct ns_out *o)
+{
+    int i;
+
+    for (i = 0; i < NS_OUT_CHUNKS; i++) {
+        free(o->chunks[i]);
+        o->chunks[i] = NULL;
+    }
+}
+
+int ns_out_flush(struct ns_out *o)
+{
+    struct iovec iov[NS_OUT_CHUNKS];
+    struct iovec *v = iov;
+    int failed = 0;
+    int cnt = 0;
+    ssize_t ret;
+    int i;
+
+    if (!o->pending) {
+        return 0;
+    }
+
+    for (i = 0; i <= o->cur; i++) {
+        if (o->used[i]) {
+            iov[cnt].iov_base = o->chunks[i];
+            iov[cnt].iov_len = o->used[i];
+            cnt++;
+        }
+    }
+
+    if (o->sink) {
+        failed = o->sink(o, iov, cnt) < 0;
+        cnt = 0;
+    }
+
+    while (cnt) {
+        ret = writev(o->fd, v, cnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Drop what is pending rather than stall the scanner */
+            failed = 1;
+            break;
+        }
+        o->bytes += ret;
+        while (cnt && (size_t)ret >= v->iov_len) {
+            ret -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt) {
+            v->iov_base = (char *)v->iov_base + ret;
+            v->iov_len -= ret;
+        }
+    }
+
+    if (failed) {
+        o->errors++;
+        o->dropped += o->pending_records;
+    }
+
+    for (i = 0; i <= o->cur; i++) {
+        o->used[i] = 0;
+    }
+    o->cur = 0;
+    o->pending = 0;
+    o->pending_records = 0;
+    o->flushes++;
+
+    return failed ? -1 : 0;
+}
+
+/* Space for one record of at most NS_OUT_RECORD_MAX bytes */
+static char *ns_out_reserve(struct ns_out *o)
+{
+    if (NS_OUT_CHUNK_SIZE - o->used[o->cur] < NS_OUT_RECORD_MAX) {
+        if (o->cur == NS_OUT_CHUNKS - 1) {
+            ns_out_flush(o);
+        } else {
+            o->cur++;
+        }
+    }
+
+    if (!o->pending) {
+        o->first_ms = ns_out_now_ms();
+    }
+
+    return o->chunks[o->cur] + o->used[o->cur];
+}
+
+static void ns_out_commit(struct ns_out *o, const char *end)
+{
+    size_t len = end - (o->chunks[o->cur] + o->used[o->cur]);
+
+    o->used[o->cur] += len;
+    o->pending += len;
+    o->pending_records++;
+    o->records++;
+
+    if (o->pending >= o->flush_bytes) {
+        ns_out_flush(o);
+    }
+}
+
+void ns_out_write(struct ns_out *o, const void *data, size_t len)
+{
+    char *p = ns_out_reserve(o);
+
+    if (len > NS_OUT_RECORD_MAX) {
+        len = NS_OUT_RECORD_MAX;
+    }
+    ns_out_commit(o, ns_put_str(p, data, len));
+}
+
+void ns_out_report(struct ns_out *o, const ns_adv_report_t *rpt,
+                   const ns_adv_index_t *idx, uint64_t ts_ms)
+{
+    struct ns_out_bin_hdr hdr;
+    struct ns_out_bin_dec bdec;
+    struct ns_decoded dec[NS_DECODE_MAX];
+    int ndec, i, dec_bytes = 0;
+    int ext = rpt->evt_type & NS_ADV_EVT_EXT;
+    uint8_t *name, *uuid;
+    uint8_t name_len, uuid_len;
+    char *p = ns_out_reserve(o);
+
+    name = ns_adv_index_get(idx, ESP_BLE_AD_TYPE_NAME_CMPL, &name_len);
+    uuid = ns_adv_index_get(idx, ESP_BLE_AD_TYPE_128SRV_CMPL, &uuid_len);
+    ndec = ns_decode_report(idx, dec, NS_DECODE_MAX);
+
+    switch (o->format) {
+    case NS_OUT_TEXT:
+        p = ns_put_u64(p, ts_ms);
+        *p++ = ' ';
+        p = ns_put_bdaddr(p, &rpt->bdaddr);
+        p = NS_PUT_LIT(p, " type:");
+        p = ns_put_u64(p, rpt->bdaddr_type);
+        p = NS_PUT_LIT(p, " evt:");
+        p = ns_put_u64(p, rpt->evt_type);
+        p = NS_PUT_LIT(p, " rssi:");
+        p = ns_put_int(p, rpt->rssi);
+        p = NS_PUT_LIT(p, " hci:");
+        p = ns_put_u64(p, rpt->adapter);
+        if (ext) {
+            p = NS_PUT_LIT(p, " sid:");
+            p = ns_put_u64(p, rpt->sid);
+            p = NS_PUT_LIT(p, " phy:");
+            p = ns_put_u64(p, rpt->primary_phy);
+            *p++ = ',';
+            p = ns_put_u64(p, rpt->secondary_phy);
+            p = NS_PUT_LIT(p, " tx:");
+            p = ns_put_int(p, rpt->tx_power);
+            if (rpt->truncated) {
+                p = NS_PUT_LIT(p, " truncated");
+            }
+        }
+        if (rpt->irk) {
+            p = NS_PUT_LIT(p, " irk:");
+            p = ns_put_text_name(p, (const uint8_t *)rpt->irk->label, strlen(rpt->irk->label));
+            if (rpt->irk->identity_type != NS_IRK_NO_IDENTITY) {
+                p = NS_PUT_LIT(p, " rpa:");
+                p = ns_put_bdaddr(p, &rpt->rpa);
+            }
+        }
+        if (name) {
+            p = NS_PUT_LIT(p, " name:");
+            p = ns_put_text_name(p, name, name_len);
+        }
+        if (uuid && uuid_len) {
+            p = NS_PUT_LIT(p, " uuid128:");
+            p = ns_hex_encode(p, uuid, uuid_len);
+        }
+        for (i = 0; i < ndec; i++) {
+            p = ns_put_decoded_text(p, &dec[i]);
+        }
+        p = NS_PUT_LIT(p, " data:");
+        p = ns_hex_encode(p, rpt->data, rpt->length);
+        *p++ = '\n';
+        break;
+
+    case NS_OUT_JSON:
+        p = NS_PUT_LIT(p, "{\"ts\":");
+        p = ns_put_u64(p, ts_ms);
+        p = NS_PUT_LIT(p, ",\"addr\":\"");
+        p = ns_put_bdaddr(p, &rpt->bdaddr);
+        p = NS_PUT_LIT(p, "\",\"type\":");
+        p = ns_put_u64(p, rpt->bdaddr_type);
+        p = NS_PUT_LIT(p, ",\"evt\":");
+        p = ns_put_u64(p, rpt->evt_type);
+        p = NS_PUT_LIT(p, ",\"rssi\":");
+        p = ns_put_int(p, rpt->rssi);
+        p = NS_PUT_LIT(p, ",\"hci\":");
+        p = ns_put_u64(p, rpt->adapter);
+        if (ext) {
+            p = NS_PUT_LIT(p, ",\"sid\":");
+            p = ns_put_u64(p, rpt->sid);
+            p = NS_PUT_LIT(p, ",\"phy\":[");
+            p = ns_put_u64(p, rpt->primary_phy);
+            *p++ = ',';
+            p = ns_put_u64(p, rpt->secondary_phy);
+            p = NS_PUT_LIT(p, "],\"tx\":");
+            p = ns_put_int(p, rpt->tx_power);
+            if (rpt->truncated) {
+                p = NS_PUT_LIT(p, ",\"truncated\":true");
+            }
+        }
+        if (rpt->irk) {
+            p = NS_PUT_LIT(p, ",\"irk\":\"");
+            p = ns_put_json_name(p, (const uint8_t *)rpt->irk->label, strlen(rpt->irk->label));
+            if (rpt->irk->identity_type != NS_IRK_NO_IDENTITY) {
+                p = NS_PUT_LIT(p, "\",\"rpa\":\"");
+                p = ns_put_bdaddr(p, &rpt->rpa);
+            }
+            *p++ = '"';
+        }
+        if (name) {
+            p = NS_PUT_LIT(p, ",\"name\":\"");
+            p = ns_put_json_name(p, name, name_len);
+            *p++ = '"';
+        }
+        if (uuid && uuid_len) {
+            p = NS_PUT_LIT(p, ",\"uuid128\":\"");
+            p = ns_hex_encode(p, uuid, uuid_len);
+            *p++ = '"';
+        }
+        for (i = 0; i < ndec; i++) {
+            p = ns_put_decoded_json(p, &dec[i]);
+        }
+        p = NS_PUT_LIT(p, ",\"data\":\"");
+        p = ns_hex_encode(p, rpt->data, rpt->length);
+        p = NS_PUT_LIT(p, "\"}\n");
+        break;
+
+    case NS_OUT_BINARY:
+        for (i = 0; i < ndec; i++) {
+            dec_bytes += sizeof(bdec) + dec[i].len;
+        }
+        if (rpt->irk) {
+            dec_bytes += sizeof(bdec) + sizeof(rpt->rpa);
+        }
+        hdr.len = htole16(sizeof(hdr) - sizeof(hdr.len) + rpt->length + dec_bytes);
+        hdr.ts_ms = htole64(ts_ms);
+        memcpy(hdr.bdaddr, rpt->bdaddr.b, sizeof(hdr.bdaddr));
+        hdr.bdaddr_type = rpt->bdaddr_type;
+        hdr.evt_type = rpt->evt_type;
+        hdr.rssi = rpt->rssi;
+        hdr.adapter = rpt->adapter;
+        hdr.tx_power = rpt->tx_power;
+        hdr.sid = rpt->sid;
+        hdr.phy = (rpt->primary_phy << 4) | (rpt->secondary_phy & 0x0f);
+        hdr.truncated = rpt->truncated;
+        hdr.payload_len = htole16(rpt->length);
+        p = ns_put_str(p, (const char *)&hdr, sizeof(hdr));
+        p = ns_put_str(p, (const char *)rpt->data, rpt->length);
+        for (i = 0; i < ndec; i++) {
+            bdec.kind = htole16(dec[i].kind);
+            bdec.key = htole16(dec[i].key);
+            bdec.ad_type = dec[i].ad_type;
+            bdec.len = dec[i].len;
+            p = ns_put_str(p, (const char *)&bdec, sizeof(bdec));
+            p = ns_put_str(p, (const char *)&dec[i].u, dec[i].len);
+        }
+        if (rpt->irk) {
+            bdec.kind = htole16(NS_OUT_BIN_RPA);
+            bdec.key = htole16(rpt->irk->index);
+            bdec.ad_type = 0;
+            bdec.len = sizeof(rpt->rpa);
+            p = ns_put_str(p, (const char *)&bdec, sizeof(bdec));
+            if (rpt->irk->identity_type != NS_IRK_NO_IDENTITY) {
+                p = ns_put_str(p, (const char *)rpt->rpa.b, sizeof(rpt->rpa));
+            } else {
+                p = ns_put_str(p, (const char *)rpt->bdaddr.b, sizeof(rpt->bdaddr));
+            }
+        }
+        break;
+    }
+
+    ns_out_commit(o, p);
+}
+
+int ns_out_poll(struct ns_out *o)
+{
+    uint64_t age;
+
+    if (!o->pending) {
+        return -1;
+    }
+
+    age = ns_out_now_ms() - o->first_ms;
+    if (age >= o->flush_ms) {
+        ns_out_flush(o);
+        return -1;
+    }
+
+    return (int)(o->flush_ms - age);
+}
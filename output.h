@@ -0,0 +1,130 @@
+#ifndef __NS_OUTPUT_H__
+#define __NS_OUTPUT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+
+/* Buffered sighting writer.
+ *
+ * Records are formatted straight into a set of fixed-size chunks and
+ * written with one writev() once flush_bytes are pending or the oldest
+ * pending record is flush_ms old. No stdio is involved. When a sink is
+ * set the chunks are handed to it instead of being written to fd.
+ *
+ * Formats:
+ *  NS_OUT_TEXT     one line per report,
+ *                  "<ts_ms> <addr> type:<t> evt:<e> rssi:<r> hci:<n>
+ *                   [sid:<s> phy:<p>,<p2> tx:<dBm> [truncated]]
+ *                   [irk:<label> [rpa:<addr>]] [name:<name>]
+ *                   [uuid128:<hex>] data:<hex>"
+ *                  the bracketed sid group for extended advertising only,
+ *                  irk for a resolved private address, rpa when addr is
+ *                  the key's identity
+ *  NS_OUT_JSON     one JSON object per line (NDJSON), same fields
+ *  NS_OUT_BINARY   struct ns_out_bin_hdr followed by the raw payload,
+ *                  then a struct ns_out_bin_dec and its struct per
+ *                  decoded payload and per resolved address, all
+ *                  little endian */
+
+#define NS_OUT_CHUNK_SIZE           (64 * 1024)
+#define NS_OUT_CHUNKS               16
+#define NS_OUT_FLUSH_BYTES_DEFAULT  (256 * 1024)
+#define NS_OUT_FLUSH_MS_DEFAULT     100
+#define NS_OUT_RECORD_MAX           8192    /* worst case size of one formatted record */
+
+enum ns_out_format {
+    NS_OUT_TEXT,
+    NS_OUT_JSON,
+    NS_OUT_BINARY,
+};
+
+struct ns_out_bin_hdr {
+    uint16_t len;                   /* bytes after this field */
+    uint64_t ts_ms;
+    uint8_t bdaddr[6];
+    uint8_t bdaddr_type;
+    uint8_t evt_type;
+    int8_t rssi;
+    uint8_t adapter;                /* hci dev_id the report was read from */
+    int8_t tx_power;                /* see ns_adv_report_t */
+    uint8_t sid;
+    uint8_t phy;                    /* primary << 4 | secondary */
+    uint8_t truncated;
+    uint16_t payload_len;
+} __attribute__((packed));
+
+/* Trailer kind of a resolved address: key is the IRK index, the 6 bytes
+ * the address on air */
+#define NS_OUT_BIN_RPA              0xFFFF
+
+struct ns_out_bin_dec {
+    uint16_t kind;                  /* enum ns_decode_kind or NS_OUT_BIN_RPA */
+    uint16_t key;                   /* company ID or service UUID */
+    uint8_t ad_type;
+    uint8_t len;                    /* bytes of the struct that follows */
+} __attribute__((packed));
+
+struct ns_out;
+
+/* Takes the pending chunks, returns 0 or -1 if they had to be dropped */
+typedef int (*ns_out_sink)(struct ns_out *o, const struct iovec *iov, int cnt);
+
+struct ns_out {
+    int fd;
+    ns_out_sink sink;
+    void *sink_ctx;
+    enum ns_out_format format;
+    size_t flush_bytes;
+    uint32_t flush_ms;
+    uint64_t first_ms;              /* CLOCK_MONOTONIC of the oldest pending record */
+    char *chunks[NS_OUT_CHUNKS];
+    size_t used[NS_OUT_CHUNKS];
+    int cur;                        /* chunk being filled */
+    size_t pending;
+    uint32_t pending_records;
+    uint64_t records;
+    uint64_t dropped;               /* records lost to write errors or a full sink */
+    uint64_t bytes;                 /* written to fd */
+    uint64_t flushes;
+    uint64_t errors;
+};
+
+extern const char ns_hex_pairs[256][2];
+
+/* Lower-case hex of len bytes into dst (2 * len chars, not terminated) */
+static inline char *ns_hex_encode(char *dst, const uint8_t *src, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        dst[0] = ns_hex_pairs[src[i]][0];
+        dst[1] = ns_hex_pairs[src[i]][1];
+        dst += 2;
+    }
+    return dst;
+}
+
+int ns_out_parse_format(const char *name, enum ns_out_format *format);
+
+int ns_out_init(struct ns_out *o, int fd, enum ns_out_format format);
+void ns_out_free(struct ns_out *o);
+
+/* Format one report. idx must be built over rpt->data. */
+void ns_out_report(struct ns_out *o, const ns_adv_report_t *rpt,
+                   const ns_adv_index_t *idx, uint64_t ts_ms);
+
+/* Append preformatted bytes (at most NS_OUT_RECORD_MAX) */
+void ns_out_write(struct ns_out *o, const void *data, size_t len);
+
+int ns_out_flush(struct ns_out *o);
+
+/* Flush if the time threshold passed. Returns the ms until the next
+ * deadline, or -1 when nothing is pending (usable as an epoll timeout). */
+int ns_out_poll(struct ns_out *o);
+
+#endif //__NS_OUTPUT_H__
@@ -0,0 +1,629 @@
+// Multi-threaded scan pipeline, see pipeline.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "bleapi.h"
+#include "devtab.h"
+#include "extadv.h"
+#include "pipeline.h"
+#include "metrics.h"
+
+#define NS_CACHELINE            64
+#define NS_PIPE_RELEASE_EVERY   64      /* events between cursor updates */
+
+struct ns_pipe_cursor {
+    _Atomic uint32_t pos;
+} __attribute__((aligned(NS_CACHELINE)));
+
+struct ns_pipe_worker {
+    struct ns_pipeline *p;
+    int index;
+    pthread_t thread;
+    struct ns_devtab devtab;
+    struct ns_suppress suppress;
+    struct ns_extadv_pool extadv;
+    struct ns_out out;
+    struct ns_log log;
+    uint32_t dump_seen;
+    uint64_t events;
+
+    /* worker -> output thread, byte counters wrap at 2^32 */
+    uint8_t *ring;
+    uint32_t ring_size;
+    _Atomic uint32_t ring_head __attribute__((aligned(NS_CACHELINE)));
+    _Atomic uint32_t ring_tail __attribute__((aligned(NS_CACHELINE)));
+    _Atomic int done;
+};
+
+struct ns_pipeline {
+    struct ns_pipeline_cfg cfg;
+    uint32_t mask;
+    int *lens;
+    uint8_t *adapters;
+    uint64_t *read_ns;              /* when each event was read, for the latency metrics */
+    uint8_t (*bufs)[HCI_MAX_EVENT_SIZE];
+    const struct ns_irk *(*resolved)[NS_ADV_EVENT_REPORTS]; /* keys of each event's reports, NULL = off */
+    struct ns_rpa rpa;              /* reader side, every address is resolved once */
+
+    /* reader side, also the futex word workers sleep on */
+    _Atomic uint32_t head __attribute__((aligned(NS_CACHELINE)));
+    _Atomic uint32_t head_waiters;
+    uint64_t events;
+    uint64_t dropped_events;
+
+    struct ns_pipe_cursor tails[NS_PIPE_WORKERS_MAX];
+
+    _Atomic uint32_t out_seq __attribute__((aligned(NS_CACHELINE)));
+    _Atomic uint32_t out_waiters;
+    _Atomic uint32_t space_seq __attribute__((aligned(NS_CACHELINE)));
+    _Atomic uint32_t space_waiters;
+    _Atomic uint32_t dump_seq;
+    _Atomic int stop;
+    uint64_t out_bytes;
+    struct ns_shm shm;
+
+    pthread_t out_thread;
+    struct ns_pipe_worker workers[NS_PIPE_WORKERS_MAX];
+};
+
+static void ns_futex_wake(_Atomic uint32_t *word)
+{
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Sleep while *word == old, for at most timeout_ms (< 0 = no limit) */
+static void ns_futex_wait(_Atomic uint32_t *word, _Atomic uint32_t *waiters, uint32_t old, int timeout_ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    atomic_fetch_add(waiters, 1);
+    if (atomic_load(word) == old) {
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, old, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+    }
+    atomic_fetch_sub(waiters, 1);
+}
+
+/* Bump a sequence word and wake whoever sleeps on it */
+static void ns_futex_signal(_Atomic uint32_t *word, _Atomic uint32_t *waiters)
+{
+    atomic_fetch_add(word, 1);
+    if (atomic_load(waiters)) {
+        ns_futex_wake(word);
+    }
+}
+
+static uint32_t ns_pipe_min_tail(struct ns_pipeline *p, uint32_t head)
+{
+    uint32_t min_used = 0;
+    uint32_t used;
+    int i;
+
+    /* Compare distances to head, the counters wrap */
+    for (i = 0; i < p->cfg.workers; i++) {
+        used = head - atomic_load_explicit(&p->tails[i].pos, memory_order_acquire);
+        if (used > min_used) {
+            min_used = used;
+        }
+    }
+    return head - min_used;
+}
+
+static int ns_pipe_full(struct ns_pipeline *p, uint32_t head)
+{
+    return head - ns_pipe_min_tail(p, head) > p->mask;
+}
+
+static void ns_pipe_publish(struct ns_pipeline *p, uint32_t head)
+{
+    uint32_t i = head & p->mask;
+
+    if (p->resolved) {
+        handle_ble_resolve(&p->rpa, (const char *)p->bufs[i], p->lens[i], p->resolved[i]);
+    }
+    atomic_store_explicit(&p->head, head + 1, memory_order_release);
+    p->events++;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&p->head_waiters, memory_order_relaxed)) {
+        ns_futex_wake(&p->head);
+    }
+}
+
+int ns_pipeline_push(struct ns_pipeline *p, int adapter, const void *buf, int len, int wait)
+{
+    uint32_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    struct timespec ts = { 0, 50000 };
+
+    while (ns_pipe_full(p, head)) {
+        if (!wait) {
+            p->dropped_events++;
+            return -1;
+        }
+        nanosleep(&ts, NULL);
+    }
+
+    if (len > HCI_MAX_EVENT_SIZE) {
+        len = HCI_MAX_EVENT_SIZE;
+    }
+    memcpy(p->bufs[head & p->mask], buf, len);
+    p->lens[head & p->mask] = len;
+    p->adapters[head & p->mask] = (uint8_t)adapter;
+    p->read_ns[head & p->mask] = ns_metrics_now_ns();
+    ns_pipe_publish(p, head);
+    return 0;
+}
+
+/* Read one event from device into the next slot, 0 if the loop goes on */
+static int ns_pipe_read_one(struct ns_pipeline *p, int device, int adapter)
+{
+    uint8_t scratch[HCI_MAX_EVENT_SIZE];
+    uint32_t head;
+    uint8_t *dst;
+    int full;
+    int len;
+
+    head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    full = ns_pipe_full(p, head);
+    dst = full ? scratch : p->bufs[head & p->mask];
+
+    len = read(device, dst, HCI_MAX_EVENT_SIZE);
+    if (len < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+        perror("Failed to read HCI event");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "HCI socket closed\n");
+        return -1;
+    }
+    if (len < HCI_EVENT_HDR_SIZE) {
+        return 0;
+    }
+
+    /* Keep draining the socket even when the workers fall behind */
+    if (full) {
+        p->dropped_events++;
+        return 0;
+    }
+
+    p->lens[head & p->mask] = len;
+    p->adapters[head & p->mask] = (uint8_t)adapter;
+    p->read_ns[head & p->mask] = ns_metrics_now_ns();
+    ns_pipe_publish(p, head);
+    return 0;
+}
+
+int ns_pipeline_read_loop(struct ns_pipeline *p, const int *devices, const int *adapters, int n)
+{
+    struct pollfd fds[NS_ADAPTERS_MAX];
+    int i;
+
+    if (n < 1 || n > NS_ADAPTERS_MAX) {
+        return -1;
+    }
+
+    /* A single socket is read blocking, no need to poll */
+    if (n == 1) {
+        while (1) {
+            if (ns_pipe_read_one(p, devices[0], adapters[0]) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        fds[i].fd = devices[i];
+        fds[i].events = POLLIN;
+    }
+
+    /* One event per ready socket and round, so a busy adapter can not
+     * starve the others */
+    while (1) {
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                fprintf(stderr, "HCI socket of hci%d failed\n", adapters[i]);
+                return -1;
+            }
+            if ((fds[i].revents & POLLIN) && ns_pipe_read_one(p, devices[i], adapters[i]) < 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+/* ns_out sink of a worker: copy one flush into its byte ring */
+static int ns_pipe_sink(struct ns_out *o, const struct iovec *iov, int cnt)
+{
+    struct ns_pipe_worker *w = o->sink_ctx;
+    struct ns_pipeline *p = w->p;
+    uint32_t head, tail, seq, off, n;
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total > w->ring_size) {
+        return -1;
+    }
+
+    head = atomic_load_explicit(&w->ring_head, memory_order_relaxed);
+    while (1) {
+        seq = atomic_load(&p->space_seq);
+        tail = atomic_load_explicit(&w->ring_tail, memory_order_acquire);
+        if (w->ring_size - (head - tail) >= total) {
+            break;
+        }
+        if (p->cfg.policy == NS_BP_DROP) {
+            return -1;
+        }
+        ns_futex_wait(&p->space_seq, &p->space_waiters, seq, 100);
+    }
+
+    for (i = 0; i < cnt; i++) {
+        const uint8_t *src = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+
+        while (left) {
+            off = head & (w->ring_size - 1);
+            n = w->ring_size - off < left ? w->ring_size - off : left;
+            memcpy(w->ring + off, src, n);
+            src += n;
+            left -= n;
+            head += n;
+        }
+    }
+
+    atomic_store_explicit(&w->ring_head, head, memory_order_release);
+    ns_futex_signal(&p->out_seq, &p->out_waiters);
+    return 0;
+}
+
+static void ns_pipe_worker_dump(struct ns_pipe_worker *w)
+{
+    uint32_t seq = atomic_load(&w->p->dump_seq);
+
+    if (seq != w->dump_seen) {
+        w->dump_seen = seq;
+        if (w->devtab.slots) {
+            fprintf(stderr, "worker %d ", w->index);
+            ns_devtab_dump(&w->devtab, stderr);
+        }
+    }
+}
+
+static void *ns_pipe_worker_main(void *arg)
+{
+    struct ns_pipe_worker *w = arg;
+    struct ns_pipeline *p = w->p;
+    _Atomic uint32_t *cursor = &p->tails[w->index].pos;
+    uint32_t tail = atomic_load(cursor);
+    uint32_t head;
+    uint32_t i;
+    int timeout;
+
+    handle_ble_set_devtab(w->devtab.slots ? &w->devtab : NULL);
+    handle_ble_set_suppress(p->cfg.suppress && w->devtab.slots ? &w->suppress : NULL);
+    handle_ble_set_output(&w->out);
+    handle_ble_set_shard(w->index, p->cfg.workers);
+    handle_ble_set_extadv(&w->extadv);
+    handle_ble_set_filter(p->cfg.filter);
+    handle_ble_set_sched(p->cfg.sched);
+    handle_ble_set_log(p->cfg.log_dir ? &w->log : NULL);
+    handle_ble_set_shm(p->shm.hdr && w->devtab.slots ? &p->shm : NULL);
+
+    while (1) {
+        head = atomic_load_explicit(&p->head, memory_order_acquire);
+        if (head == tail) {
+            /* stop is set after the last push, so head is final here */
+            if (atomic_load(&p->stop) && atomic_load(&p->head) == tail) {
+                break;
+            }
+            ns_pipe_worker_dump(w);
+            timeout = ns_out_poll(&w->out);
+            ns_futex_wait(&p->head, &p->head_waiters, head, timeout);
+            continue;
+        }
+
+        while (tail != head) {
+            i = tail & p->mask;
+            if (p->resolved) {
+                handle_ble_scan_resolved(p->adapters[i], p->read_ns[i], (const char *)p->bufs[i], p->lens[i],
+                                         p->resolved[i]);
+            } else {
+                handle_ble_scan_at(p->adapters[i], p->read_ns[i], (const char *)p->bufs[i], p->lens[i]);
+            }
+            tail++;
+            w->events++;
+            if (!(tail % NS_PIPE_RELEASE_EVERY)) {
+                atomic_store_explicit(cursor, tail, memory_order_release);
+            }
+        }
+        atomic_store_explicit(cursor, tail, memory_order_release);
+        if (w->index == 0) {
+            ns_metrics_cycle();
+        }
+        ns_out_poll(&w->out);
+    }
+
+    ns_out_flush(&w->out);
+    ns_pipe_worker_dump(w);
+    atomic_store(&w->done, 1);
+    ns_futex_signal(&p->out_seq, &p->out_waiters);
+    return NULL;
+}
+
+static void *ns_pipe_output_main(void *arg)
+{
+    struct ns_pipeline *p = arg;
+    struct iovec iov[NS_PIPE_WORKERS_MAX * 2];
+    uint32_t avail[NS_PIPE_WORKERS_MAX];
+    struct ns_pipe_worker *w;
+    uint32_t head, tail, off, seq, adv;
+    int all_done;
+    ssize_t ret;
+    int cnt;
+    int i;
+
+    while (1) {
+        seq = atomic_load(&p->out_seq);
+
+        /* Checked before looking at the rings: a worker flushes before it
+         * sets done, so if all are done now the rings hold everything. */
+        all_done = 1;
+        for (i = 0; i < p->cfg.workers; i++) {
+            all_done &= atomic_load(&p->workers[i].done);
+        }
+
+        cnt = 0;
+        for (i = 0; i < p->cfg.workers; i++) {
+            w = &p->workers[i];
+            head = atomic_load_explicit(&w->ring_head, memory_order_acquire);
+            tail = atomic_load_explicit(&w->ring_tail, memory_order_relaxed);
+            avail[i] = head - tail;
+            if (!avail[i]) {
+                continue;
+            }
+            off = tail & (w->ring_size - 1);
+            iov[cnt].iov_base = w->ring + off;
+            iov[cnt].iov_len = w->ring_size - off < avail[i] ? w->ring_size - off : avail[i];
+            cnt++;
+            if (iov[cnt - 1].iov_len < avail[i]) {
+                iov[cnt].iov_base = w->ring;
+                iov[cnt].iov_len = avail[i] - iov[cnt - 1].iov_len;
+                cnt++;
+            }
+        }
+
+        if (!cnt) {
+            if (all_done) {
+                break;
+            }
+            ns_futex_wait(&p->out_seq, &p->out_waiters, seq, -1);
+            continue;
+        }
+
+        ret = writev(p->cfg.out_fd, iov, cnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to write output");
+            /* Throw the pending output away and carry on */
+            ret = 0;
+            for (i = 0; i < p->cfg.workers; i++) {
+                ret += avail[i];
+            }
+        } else {
+            p->out_bytes += ret;
+        }
+
+        /* Rings are consumed in iov order, a partial write resumes at the
+         * same ring next round, so records from two workers never mix. */
+        for (i = 0; i < p->cfg.workers && ret > 0; i++) {
+            adv = (size_t)ret < avail[i] ? (uint32_t)ret : avail[i];
+            w = &p->workers[i];
+            atomic_store_explicit(&w->ring_tail,
+                                  atomic_load_explicit(&w->ring_tail, memory_order_relaxed) + adv,
+                                  memory_order_release);
+            ret -= adv;
+        }
+        ns_futex_signal(&p->space_seq, &p->space_waiters);
+    }
+
+    return NULL;
+}
+
+static void ns_pipe_free(struct ns_pipeline *p)
+{
+    int i;
+
+    for (i = 0; i < NS_PIPE_WORKERS_MAX; i++) {
+        ns_devtab_free(&p->workers[i].devtab);
+        ns_extadv_free(&p->workers[i].extadv);
+        ns_out_free(&p->workers[i].out);
+        ns_log_close(&p->workers[i].log);
+        free(p->workers[i].ring);
+    }
+    free(p->bufs);
+    free(p->lens);
+    free(p->read_ns);
+    free(p->adapters);
+    free(p->resolved);
+    ns_rpa_free(&p->rpa);
+    ns_shm_close(&p->shm);
+    free(p);
+}
+
+struct ns_pipeline *ns_pipeline_start(const struct ns_pipeline_cfg *cfg)
+{
+    struct ns_pipeline *p;
+    struct ns_pipe_worker *w;
+    uint32_t slots = 2;
+    int started = 0;
+    int i;
+
+    if (cfg->workers < 1 || cfg->workers > NS_PIPE_WORKERS_MAX) {
+        return NULL;
+    }
+
+    while (slots < cfg->slots && slots < (1U << 20)) {
+        slots <<= 1;
+    }
+
+    p = calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    p->cfg = *cfg;
+    p->mask = slots - 1;
+    p->bufs = malloc(slots * sizeof(*p->bufs));
+    p->lens = malloc(slots * sizeof(*p->lens));
+    p->adapters = malloc(slots * sizeof(*p->adapters));
+    p->read_ns = malloc(slots * sizeof(*p->read_ns));
+    if (!p->bufs || !p->lens || !p->adapters || !p->read_ns) {
+        goto fail;
+    }
+    if (cfg->irks) {
+        p->resolved = malloc(slots * sizeof(*p->resolved));
+        if (!p->resolved || ns_rpa_init(&p->rpa, cfg->irks, NS_RPA_CACHE_DEFAULT) < 0) {
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < cfg->workers; i++) {
+        w = &p->workers[i];
+        w->p = p;
+        w->index = i;
+        w->ring_size = NS_PIPE_OUT_RING_SIZE;
+        w->ring = malloc(w->ring_size);
+        if (!w->ring) {
+            goto fail;
+        }
+        if (cfg->max_devices) {
+            if (ns_devtab_init(&w->devtab, (cfg->max_devices + cfg->workers - 1) / cfg->workers) < 0) {
+                goto fail;
+            }
+            w->devtab.max_age_ms = cfg->max_age_ms;
+        }
+        if (ns_extadv_init(&w->extadv, NS_EXTADV_CHAINS_DEFAULT) < 0) {
+            goto fail;
+        }
+        if (cfg->suppress) {
+            w->suppress = *cfg->suppress;
+            w->suppress.emitted = 0;
+            w->suppress.suppressed = 0;
+        }
+        if (ns_out_init(&w->out, -1, cfg->format) < 0) {
+            goto fail;
+        }
+        w->out.sink = ns_pipe_sink;
+        w->out.sink_ctx = w;
+        w->out.flush_ms = cfg->flush_ms;
+        /* A flush has to fit into the ring with room to spare */
+        w->out.flush_bytes = cfg->flush_bytes < w->ring_size / 4 ? cfg->flush_bytes : w->ring_size / 4;
+        if (cfg->log_dir && ns_log_open(&w->log, cfg->log_dir, i, cfg->log_seg_size, cfg->log_segments) < 0) {
+            goto fail;
+        }
+    }
+
+    /* Every shard table has the same capacity */
+    if (cfg->shm_name && cfg->max_devices &&
+        ns_shm_create(&p->shm, cfg->shm_name, cfg->workers, p->workers[0].devtab.mask + 1) < 0) {
+        goto fail;
+    }
+
+    if (pthread_create(&p->out_thread, NULL, ns_pipe_output_main, p)) {
+        goto fail;
+    }
+    for (i = 0; i < cfg->workers; i++) {
+        if (pthread_create(&p->workers[i].thread, NULL, ns_pipe_worker_main, &p->workers[i])) {
+            break;
+        }
+        started++;
+    }
+    if (started < cfg->workers) {
+        /* Let the started ones exit, the others count as done */
+        for (i = started; i < cfg->workers; i++) {
+            atomic_store(&p->workers[i].done, 1);
+        }
+        atomic_store(&p->stop, 1);
+        ns_futex_wake(&p->head);
+        for (i = 0; i < started; i++) {
+            pthread_join(p->workers[i].thread, NULL);
+        }
+        ns_futex_signal(&p->out_seq, &p->out_waiters);
+        pthread_join(p->out_thread, NULL);
+        goto fail;
+    }
+
+    return p;
+
+fail:
+    ns_pipe_free(p);
+    return NULL;
+}
+
+void ns_pipeline_request_dump(struct ns_pipeline *p)
+{
+    atomic_fetch_add(&p->dump_seq, 1);
+    ns_futex_wake(&p->head);
+}
+
+void ns_pipeline_stop(struct ns_pipeline *p, struct ns_pipeline_stats *stats)
+{
+    struct ns_pipe_worker *w;
+    int i;
+
+    atomic_store(&p->stop, 1);
+    ns_futex_wake(&p->head);
+    for (i = 0; i < p->cfg.workers; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+    }
+    pthread_join(p->out_thread, NULL);
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->events = p->events;
+        stats->dropped_events = p->dropped_events;
+        stats->bytes = p->out_bytes;
+        for (i = 0; i < p->cfg.workers; i++) {
+            w = &p->workers[i];
+            stats->records += w->out.records;
+            stats->dropped_records += w->out.dropped;
+            stats->suppressed += w->suppress.suppressed;
+            stats->logged += w->log.records;
+            stats->log_deduped += w->log.deduped;
+            stats->log_errors += w->log.errors;
+        }
+        stats->rpa_hits = p->rpa.hits + p->rpa.negative_hits;
+        stats->rpa_negative = p->rpa.negative_hits;
+        stats->rpa_computed = p->rpa.computed;
+    }
+
+    ns_pipe_free(p);
+}
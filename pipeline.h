@@ -0,0 +1,105 @@
+#ifndef __NS_PIPELINE_H__
+#define __NS_PIPELINE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "suppress.h"
+#include "output.h"
+#include "filter.h"
+#include "sched.h"
+#include "sightlog.h"
+#include "devshm.h"
+#include "rpa.h"
+
+/* Multi-threaded scan pipeline.
+ *
+ *   reader ──> event ring ──> worker 0..N-1 ──> byte ring per worker ──> output thread
+ *
+ * The reader (the thread calling ns_pipeline_read_loop or ns_pipeline_push)
+ * reads HCI events of all adapters straight into preallocated ring slots. The ring has a
+ * single producer and one cursor per worker; every worker walks all events
+ * but only handles the devices of its shard (bdaddr hash), so device
+ * state needs no locking. A slot is reused once every worker passed it.
+ *
+ * Workers format their records through their own ns_out, whose flushes go
+ * to a byte ring read by the single output thread, which writes whole
+ * flushes to out_fd so records never interleave. With a sighting log each
+ * worker appends to its own segments, as writer <worker index>, and
+ * publishes its device table shard as shard <worker index> of the
+ * shared memory segment. Private addresses are resolved by the reader as
+ * it queues an event, through one cache, so every address costs AES once
+ * per rotation however many workers there are; the workers find the keys
+ * next to the event and shard by the identity address.
+ *
+ * The reader never waits: when the event ring is full the event is read
+ * anyway and dropped. When the output is stalled the backpressure policy
+ * decides what the workers do:
+ *  NS_BP_DROP   drop the records, keep parsing and updating device state
+ *  NS_BP_BLOCK  wait for the output, so the event ring fills and the
+ *               reader drops events instead */
+
+#define NS_PIPE_WORKERS_MAX         16
+#define NS_PIPE_SLOTS_DEFAULT       4096
+#define NS_PIPE_OUT_RING_SIZE       (1 << 20)   /* per worker */
+
+enum ns_backpressure {
+    NS_BP_DROP,
+    NS_BP_BLOCK,
+};
+
+struct ns_pipeline_cfg {
+    int workers;
+    uint32_t slots;                 /* rounded up to a power of two */
+    enum ns_backpressure policy;
+    uint32_t max_devices;           /* split across the workers, 0 = no device table */
+    uint64_t max_age_ms;            /* devices not heard this long leave the tables, 0 = never */
+    const struct ns_suppress *suppress; /* settings copied per worker, NULL = off */
+    const struct ns_filter *filter;     /* shared by the workers, NULL = off */
+    struct ns_sched *sched;             /* load counters, shared, NULL = off */
+    int out_fd;
+    enum ns_out_format format;
+    size_t flush_bytes;
+    uint32_t flush_ms;
+    const char *log_dir;            /* sighting log, NULL = none */
+    uint64_t log_seg_size;
+    uint32_t log_segments;          /* per worker */
+    const char *shm_name;           /* publish the device tables, NULL = no */
+    const struct ns_irk_list *irks; /* resolve private addresses, shared, NULL = off */
+};
+
+struct ns_pipeline_stats {
+    uint64_t events;                /* queued to the workers */
+    uint64_t dropped_events;        /* event ring full */
+    uint64_t records;               /* formatted by the workers */
+    uint64_t dropped_records;       /* output stalled (NS_BP_DROP) */
+    uint64_t bytes;                 /* written to out_fd */
+    uint64_t suppressed;
+    uint64_t logged;                /* records appended to the sighting log */
+    uint64_t log_deduped;           /* of those, payloads stored once already */
+    uint64_t log_errors;
+    uint64_t rpa_hits;              /* private addresses found in the reader's cache */
+    uint64_t rpa_negative;          /* of those, resolved by no key */
+    uint64_t rpa_computed;          /* cache misses that ran AES */
+};
+
+struct ns_pipeline;
+
+struct ns_pipeline *ns_pipeline_start(const struct ns_pipeline_cfg *cfg);
+
+/* Queue one event (as read() from the HCI socket of adapter). With wait
+ * set the caller sleeps while the ring is full, otherwise the event is
+ * dropped. Returns 0 if queued, -1 if dropped. Single producer only. */
+int ns_pipeline_push(struct ns_pipeline *p, int adapter, const void *buf, int len, int wait);
+
+/* Blocking read loop over the HCI sockets devices[0..n-1], events of
+ * devices[i] are tagged with adapters[i]. Returns on a fatal socket error. */
+int ns_pipeline_read_loop(struct ns_pipeline *p, const int *devices, const int *adapters, int n);
+
+/* Have every worker print its device table shard, async-signal-safe */
+void ns_pipeline_request_dump(struct ns_pipeline *p);
+
+/* Drain what is queued, stop all threads and free the pipeline */
+void ns_pipeline_stop(struct ns_pipeline *p, struct ns_pipeline_stats *stats);
+
+#endif //__NS_PIPELINE_H__
@@ -0,0 +1,829 @@
+// Python extension module blescan: the scanner's parsing path for Python.
+//
+// Compile with:
+//   cc -O2 -shared -fPIC $(python3-config --includes) pyblescan.c bleapi.c devtab.c suppress.c output.c extadv.c filter.c sched.c metrics.c match.c decode.c sightlog.c devshm.c replay.c rpa.c -pthread -lbluetooth -ldl -lrt -o blescan$(python3-config --extension-suffix)
+// Use with:
+//   import blescan
+//   with blescan.Scanner(0, filter="rssi>=-70") as s:
+//       batch = s.read(4096, 1000)
+//       for ts_ms, addr, addr_type, *rest in struct.iter_unpack(blescan.RECORD_FORMAT, batch): ...
+//       records = numpy.frombuffer(batch, numpy.dtype(blescan.RECORD_DTYPE))
+//   batch = blescan.replay("capture.btsnoop", filter="rssi>=-127")
+//
+// Reports are handed over in batches. A Batch is one contiguous array of
+// struct ns_log_record, exported through the buffer protocol with the
+// struct format blescan.RECORD_FORMAT, and one payload area
+// (Batch.payloads) that the records' payload_off point into. Filtering,
+// extended advertising reassembly, the device table and duplicate
+// suppression all run in C with the GIL released, so Python only sees
+// the reports that pass them, a batch at a time.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "bleapi.h"
+#include "devtab.h"
+#include "suppress.h"
+#include "extadv.h"
+#include "filter.h"
+#include "replay.h"
+#include "sched.h"
+#include "sightlog.h"
+
+#define NS_PY_DEVICES_DEFAULT       16384
+#define NS_PY_BATCH_DEFAULT         4096    /* records per read() */
+#define NS_PY_PAYLOAD_INITIAL       (64 * 1024)
+
+/* struct ns_log_record, little endian hosts only like the log itself */
+#define NS_PY_RECORD_FORMAT         "<Q6sBBbBbBBBHI4x"
+
+/* Batch */
+
+typedef struct {
+    PyObject_HEAD
+    struct ns_log_record *recs;
+    Py_ssize_t count;
+    Py_ssize_t cap;
+    uint8_t *pay;
+    Py_ssize_t pay_len;
+    Py_ssize_t pay_cap;
+    Py_ssize_t stride;              /* sizeof(struct ns_log_record), for the buffer view */
+    int failed;                     /* out of memory while collecting */
+} ns_py_batch;
+
+typedef struct {
+    PyObject_HEAD
+    ns_py_batch *batch;
+} ns_py_payloads;
+
+static PyTypeObject ns_py_batch_type;
+static PyTypeObject ns_py_payloads_type;
+
+static ns_py_batch *ns_py_batch_new(void)
+{
+    ns_py_batch *b = PyObject_New(ns_py_batch, &ns_py_batch_type);
+
+    if (!b) {
+        return NULL;
+    }
+    b->recs = NULL;
+    b->count = b->cap = 0;
+    b->pay = NULL;
+    b->pay_len = b->pay_cap = 0;
+    b->stride = sizeof(struct ns_log_record);
+    b->failed = 0;
+    return b;
+}
+
+static void ns_py_batch_dealloc(ns_py_batch *b)
+{
+    free(b->recs);
+    free(b->pay);
+    PyObject_Free(b);
+}
+
+/* The report sink, runs without the GIL and touches only the batch.
+ * Takes every report it is given: the device table and suppression have
+ * already seen them, one left out would never come again. */
+static void ns_py_collect(const ns_adv_report_t *rpt, uint64_t ts_ms, void *ctx)
+{
+    ns_py_batch *b = ctx;
+    struct ns_log_record *r;
+    Py_ssize_t n;
+    void *p;
+
+    if (b->failed) {
+        return;
+    }
+    if (b->count == b->cap) {
+        n = b->cap ? b->cap * 2 : 256;
+        p = realloc(b->recs, n * sizeof(*b->recs));
+        if (!p) {
+            b->failed = 1;
+            return;
+        }
+        b->recs = p;
+        b->cap = n;
+    }
+    if (b->pay_len + rpt->length > b->pay_cap) {
+        n = b->pay_cap ? b->pay_cap : NS_PY_PAYLOAD_INITIAL;
+        while (n < b->pay_len + rpt->length) {
+            n *= 2;
+        }
+        p = realloc(b->pay, n);
+        if (!p) {
+            b->failed = 1;
+            return;
+        }
+        b->pay = p;
+        b->pay_cap = n;
+    }
+
+    r = &b->recs[b->count++];
+    r->ts_ms = ts_ms;
+    memcpy(r->bdaddr, rpt->bdaddr.b, sizeof(r->bdaddr));
+    r->bdaddr_type = rpt->bdaddr_type;
+    r->evt_type = (uint8_t)rpt->evt_type;
+    r->rssi = rpt->rssi;
+    r->adapter = (uint8_t)rpt->adapter;
+    r->tx_power = rpt->tx_power;
+    r->sid = rpt->sid;
+    r->phy = (uint8_t)(rpt->primary_phy << 4 | (rpt->secondary_phy & 0x0f));
+    r->truncated = rpt->truncated;
+    r->payload_len = rpt->length;
+    r->payload_off = (uint32_t)b->pay_len;
+    memset(r->reserved, 0, sizeof(r->reserved));
+    memcpy(b->pay + b->pay_len, rpt->data, rpt->length);
+    b->pay_len += rpt->length;
+}
+
+static int ns_py_batch_getbuffer(ns_py_batch *b, Py_buffer *view, int flags)
+{
+    static struct ns_log_record empty;
+
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "Batch is read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->buf = b->recs ? (void *)b->recs : (void *)&empty;
+    view->obj = (PyObject *)b;
+    Py_INCREF(b);
+    view->len = b->count * b->stride;
+    view->readonly = 1;
+    view->itemsize = b->stride;
+    view->format = (flags & PyBUF_FORMAT) ? NS_PY_RECORD_FORMAT : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &b->count : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &b->stride : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static Py_ssize_t ns_py_batch_len(ns_py_batch *b)
+{
+    return b->count;
+}
+
+static PyObject *ns_py_batch_payload(ns_py_batch *b, PyObject *arg)
+{
+    Py_ssize_t i = PyNumber_AsSsize_t(arg, PyExc_IndexError);
+
+    if (i == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (i < 0) {
+        i += b->count;
+    }
+    if (i < 0 || i >= b->count) {
+        PyErr_SetString(PyExc_IndexError, "record index out of range");
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((const char *)b->pay + b->recs[i].payload_off, b->recs[i].payload_len);
+}
+
+static PyObject *ns_py_batch_get_payloads(ns_py_batch *b, void *closure)
+{
+    ns_py_payloads *p;
+    PyObject *view;
+
+    (void)closure;
+    p = PyObject_New(ns_py_payloads, &ns_py_payloads_type);
+    if (!p) {
+        return NULL;
+    }
+    Py_INCREF(b);
+    p->batch = b;
+    view = PyMemoryView_FromObject((PyObject *)p);
+    Py_DECREF(p);
+    return view;
+}
+
+static PyObject *ns_py_batch_get_dropped(ns_py_batch *b, void *closure)
+{
+    (void)closure;
+    return PyBool_FromLong(b->failed);
+}
+
+static PyMethodDef ns_py_batch_methods[] = {
+    { "payload", (PyCFunction)ns_py_batch_payload, METH_O,
+      "payload(i) -> bytes, advertising data of record i" },
+    { NULL }
+};
+
+static PyGetSetDef ns_py_batch_getset[] = {
+    { "payloads", (getter)ns_py_batch_get_payloads, NULL,
+      "memoryview of the payload area, payload_off of the records index it", NULL },
+    { "dropped", (getter)ns_py_batch_get_dropped, NULL,
+      "True if reports were lost because memory ran out", NULL },
+    { NULL }
+};
+
+static PySequenceMethods ns_py_batch_as_sequence = {
+    .sq_length = (lenfunc)ns_py_batch_len,
+};
+
+static PyBufferProcs ns_py_batch_as_buffer = {
+    .bf_getbuffer = (getbufferproc)ns_py_batch_getbuffer,
+};
+
+static PyTypeObject ns_py_batch_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "blescan.Batch",
+    .tp_basicsize = sizeof(ns_py_batch),
+    .tp_dealloc = (destructor)ns_py_batch_dealloc,
+    .tp_as_sequence = &ns_py_batch_as_sequence,
+    .tp_as_buffer = &ns_py_batch_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Reports as an array of RECORD_FORMAT records, see the buffer protocol",
+    .tp_methods = ns_py_batch_methods,
+    .tp_getset = ns_py_batch_getset,
+};
+
+static void ns_py_payloads_dealloc(ns_py_payloads *p)
+{
+    Py_DECREF(p->batch);
+    PyObject_Free(p);
+}
+
+static int ns_py_payloads_getbuffer(ns_py_payloads *p, Py_buffer *view, int flags)
+{
+    static uint8_t empty;
+    ns_py_batch *b = p->batch;
+
+    return PyBuffer_FillInfo(view, (PyObject *)p, b->pay ? b->pay : &empty, b->pay_len, 1, flags);
+}
+
+static PyBufferProcs ns_py_payloads_as_buffer = {
+    .bf_getbuffer = (getbufferproc)ns_py_payloads_getbuffer,
+};
+
+static PyTypeObject ns_py_payloads_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "blescan._Payloads",
+    .tp_basicsize = sizeof(ns_py_payloads),
+    .tp_dealloc = (destructor)ns_py_payloads_dealloc,
+    .tp_as_buffer = &ns_py_payloads_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+/* Parsing state shared by Scanner and replay() */
+
+struct ns_py_state {
+    struct ns_filter filter;
+    struct ns_devtab devtab;
+    struct ns_suppress suppress;
+    struct ns_extadv_pool extadv;
+    int has_filter;
+    int has_devtab;
+    int has_suppress;
+};
+
+static void ns_py_state_free(struct ns_py_state *st)
+{
+    if (st->has_filter) {
+        ns_filter_free(&st->filter);
+    }
+    if (st->has_devtab) {
+        ns_devtab_free(&st->devtab);
+    }
+    ns_extadv_free(&st->extadv);
+    memset(st, 0, sizeof(*st));
+}
+
+/* suppress is None, True for the defaults or (rssi_delta, heartbeat_ms).
+ * Returns 0, or -1 with a Python exception set. */
+static int ns_py_state_init(struct ns_py_state *st, const char *filter, long devices, PyObject *suppress)
+{
+    char err[128];
+
+    memset(st, 0, sizeof(*st));
+    if (devices < 0) {
+        PyErr_SetString(PyExc_ValueError, "devices must be 0 or more");
+        return -1;
+    }
+    if (suppress && suppress != Py_None && suppress != Py_False) {
+        st->suppress.rssi_delta = NS_SUPPRESS_RSSI_DELTA_DEFAULT;
+        st->suppress.heartbeat_ms = NS_SUPPRESS_HEARTBEAT_DEFAULT;
+        if (suppress != Py_True &&
+            !PyArg_ParseTuple(suppress, "iI;suppress must be True or (rssi_delta, heartbeat_ms)",
+                              &st->suppress.rssi_delta, &st->suppress.heartbeat_ms)) {
+            return -1;
+        }
+        if (!devices) {
+            PyErr_SetString(PyExc_ValueError, "suppression needs the device table, devices must not be 0");
+            return -1;
+        }
+        st->has_suppress = 1;
+    }
+
+    if (filter) {
+        if (ns_filter_compile(&st->filter, filter, err, sizeof(err)) < 0) {
+            PyErr_Format(PyExc_ValueError, "bad filter: %s", err);
+            return -1;
+        }
+        st->has_filter = 1;
+    }
+    if (ns_extadv_init(&st->extadv, NS_EXTADV_CHAINS_DEFAULT) < 0) {
+        ns_py_state_free(st);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (devices) {
+        if (ns_devtab_init(&st->devtab, (uint32_t)devices) < 0) {
+            ns_py_state_free(st);
+            PyErr_NoMemory();
+            return -1;
+        }
+        st->has_devtab = 1;
+    }
+    return 0;
+}
+
+/* The handle_ble_set_* state is per thread and Python may call from any
+ * thread, so it is set up around every call into the parser */
+static void ns_py_state_bind(struct ns_py_state *st, ns_py_batch *b)
+{
+    handle_ble_set_output(NULL);
+    handle_ble_set_filter(st->has_filter ? &st->filter : NULL);
+    handle_ble_set_devtab(st->has_devtab ? &st->devtab : NULL);
+    handle_ble_set_suppress(st->has_suppress ? &st->suppress : NULL);
+    handle_ble_set_extadv(&st->extadv);
+    handle_ble_set_sink(ns_py_collect, b);
+}
+
+static void ns_py_state_unbind(void)
+{
+    handle_ble_set_sink(NULL, NULL);
+    handle_ble_set_extadv(NULL);
+    handle_ble_set_suppress(NULL);
+    handle_ble_set_devtab(NULL);
+    handle_ble_set_filter(NULL);
+}
+
+/* Scanner */
+
+enum {
+    NS_PY_MODE_AUTO,
+    NS_PY_MODE_LEGACY,
+    NS_PY_MODE_EXT,
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct ns_py_state st;
+    int fd;
+    int dev_id;
+    int ext;
+    int busy;                       /* a read() is running without the GIL */
+} ns_py_scanner;
+
+static struct hci_request ns_py_hci_request(uint16_t ocf, int clen, void *status, void *cparam)
+{
+    struct hci_request rq;
+
+    memset(&rq, 0, sizeof(rq));
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = ocf;
+    rq.cparam = cparam;
+    rq.clen = clen;
+    rq.rparam = status;
+    rq.rlen = 1;
+    return rq;
+}
+
+static int ns_py_scan_enable(int fd, int ext, int enable)
+{
+    le_set_scan_enable_cp cp;
+    ns_le_set_ext_scan_enable_cp ext_cp;
+    struct hci_request rq;
+    uint8_t status = 0;
+
+    if (ext) {
+        memset(&ext_cp, 0, sizeof(ext_cp));
+        ext_cp.enable = enable;
+        rq = ns_py_hci_request(NS_OCF_LE_SET_EXT_SCAN_ENABLE, NS_LE_SET_EXT_SCAN_ENABLE_CP_SIZE, &status, &ext_cp);
+    } else {
+        memset(&cp, 0, sizeof(cp));
+        cp.enable = enable;
+        rq = ns_py_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &cp);
+    }
+    return hci_send_req(fd, &rq, 1000) < 0 ? -1 : status;
+}
+
+/* The scanner's bring-up without the accept list and the schedule: the
+ * full duty cycle of level 0, extended scanning when mode allows and the controller
+ * has it. Sets *ext. Returns 0, or -1 with errno set. */
+static int ns_py_scan_start(int fd, int mode, int active, int *ext)
+{
+    const struct ns_scan_timing *timing = &ns_sched_levels[0];
+    le_read_local_supported_features_rp feat;
+    le_set_scan_parameters_cp cp;
+    ns_le_set_ext_scan_parameters_cp ext_cp;
+    le_set_event_mask_cp mask_cp;
+    struct hci_request rq;
+    struct hci_filter nf;
+    uint8_t status = 0;
+    int coded = 0, nphys = 1, flags;
+
+    *ext = 0;
+    if (mode != NS_PY_MODE_LEGACY) {
+        memset(&rq, 0, sizeof(rq));
+        rq.ogf = OGF_LE_CTL;
+        rq.ocf = OCF_LE_READ_LOCAL_SUPPORTED_FEATURES;
+        rq.rparam = &feat;
+        rq.rlen = LE_READ_LOCAL_SUPPORTED_FEATURES_RP_SIZE;
+        if (hci_send_req(fd, &rq, 1000) == 0 && !feat.status) {
+            *ext = ns_le_feature(feat.features, NS_LE_FEATURE_EXT_ADV);
+            coded = ns_le_feature(feat.features, NS_LE_FEATURE_CODED_PHY);
+        }
+        if (!*ext && mode == NS_PY_MODE_EXT) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+
+    if (*ext) {
+        memset(&ext_cp, 0, sizeof(ext_cp));
+        ext_cp.phys = NS_LE_SCAN_PHY_1M;
+        ext_cp.phy[0].type = active;
+        ext_cp.phy[0].interval = htobs(timing->interval);
+        ext_cp.phy[0].window = htobs(timing->window);
+        if (coded) {
+            ext_cp.phys |= NS_LE_SCAN_PHY_CODED;
+            ext_cp.phy[1] = ext_cp.phy[0];
+            nphys = 2;
+        }
+        rq = ns_py_hci_request(NS_OCF_LE_SET_EXT_SCAN_PARAMETERS, NS_LE_SET_EXT_SCAN_PARAMETERS_CP_SIZE(nphys),
+                               &status, &ext_cp);
+    } else {
+        memset(&cp, 0, sizeof(cp));
+        cp.type = active;
+        cp.interval = htobs(timing->interval);
+        cp.window = htobs(timing->window);
+        rq = ns_py_hci_request(OCF_LE_SET_SCAN_PARAMETERS, LE_SET_SCAN_PARAMETERS_CP_SIZE, &status, &cp);
+    }
+    if (hci_send_req(fd, &rq, 1000) < 0) {
+        return -1;
+    }
+
+    memset(&mask_cp, 0xff, sizeof(mask_cp));
+    rq = ns_py_hci_request(OCF_LE_SET_EVENT_MASK, LE_SET_EVENT_MASK_CP_SIZE, &status, &mask_cp);
+    if (hci_send_req(fd, &rq, 1000) < 0) {
+        return -1;
+    }
+
+    if (ns_py_scan_enable(fd, *ext, 0x01) < 0) {
+        return -1;
+    }
+
+    hci_filter_clear(&nf);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+    hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+    if (setsockopt(fd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+        return -1;
+    }
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void ns_py_scanner_stop(ns_py_scanner *s)
+{
+    if (s->fd < 0) {
+        return;
+    }
+    ns_py_scan_enable(s->fd, s->ext, 0x00);
+    hci_close_dev(s->fd);
+    s->fd = -1;
+}
+
+static int ns_py_scanner_init(ns_py_scanner *s, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "adapter", "filter", "mode", "active", "devices", "suppress", NULL };
+    const char *filter = NULL, *mode_str = "auto";
+    PyObject *suppress = Py_None;
+    long devices = NS_PY_DEVICES_DEFAULT;
+    int adapter = 0, active = 0, mode, ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|izspl$O", kwlist, &adapter, &filter, &mode_str, &active,
+                                     &devices, &suppress)) {
+        return -1;
+    }
+    if (!strcmp(mode_str, "auto")) {
+        mode = NS_PY_MODE_AUTO;
+    } else if (!strcmp(mode_str, "legacy")) {
+        mode = NS_PY_MODE_LEGACY;
+    } else if (!strcmp(mode_str, "ext")) {
+        mode = NS_PY_MODE_EXT;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "mode must be auto, legacy or ext");
+        return -1;
+    }
+    if (s->fd >= 0 || s->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Scanner already initialized");
+        return -1;
+    }
+
+    if (ns_py_state_init(&s->st, filter, devices, suppress) < 0) {
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    s->fd = hci_open_dev(adapter);
+    ret = s->fd < 0 ? -1 : ns_py_scan_start(s->fd, mode, active ? 0x01 : 0x00, &s->ext);
+    Py_END_ALLOW_THREADS
+    if (ret < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        if (s->fd >= 0) {
+            hci_close_dev(s->fd);
+            s->fd = -1;
+        }
+        ns_py_state_free(&s->st);
+        return -1;
+    }
+    s->dev_id = adapter;
+    return 0;
+}
+
+static PyObject *ns_py_scanner_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    ns_py_scanner *s = (ns_py_scanner *)type->tp_alloc(type, 0);
+
+    (void)args;
+    (void)kwds;
+    if (s) {
+        s->fd = -1;
+    }
+    return (PyObject *)s;
+}
+
+static void ns_py_scanner_dealloc(ns_py_scanner *s)
+{
+    ns_py_scanner_stop(s);
+    ns_py_state_free(&s->st);
+    Py_TYPE(s)->tp_free((PyObject *)s);
+}
+
+/* read(max_records=4096, timeout_ms=1000): wait up to timeout_ms for the
+ * first event, then take whatever else is queued until there are
+ * max_records reports. An event is never split, so the batch may exceed
+ * max_records by the rest of the last one. Returns a Batch, empty on
+ * timeout. */
+static PyObject *ns_py_scanner_read(ns_py_scanner *s, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "max_records", "timeout_ms", NULL };
+    Py_ssize_t max = NS_PY_BATCH_DEFAULT;
+    int timeout_ms = 1000, ret = 0, err = 0;
+    char buf[HCI_MAX_EVENT_SIZE];
+    struct pollfd pfd;
+    ns_py_batch *b;
+    ssize_t len;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ni", kwlist, &max, &timeout_ms)) {
+        return NULL;
+    }
+    if (s->fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "Scanner is closed");
+        return NULL;
+    }
+    if (s->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "read() already running in another thread");
+        return NULL;
+    }
+    if (max <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_records must be positive");
+        return NULL;
+    }
+    b = ns_py_batch_new();
+    if (!b) {
+        return NULL;
+    }
+
+    s->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    ns_py_state_bind(&s->st, b);
+    pfd.fd = s->fd;
+    pfd.events = POLLIN;
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0) {
+        err = errno;
+    }
+    while (ret > 0 && b->count < max) {
+        len = read(s->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                err = errno;
+            }
+            break;
+        }
+        handle_ble_scan_from(s->dev_id, buf, (int)len);
+    }
+    ns_py_state_unbind();
+    Py_END_ALLOW_THREADS
+    s->busy = 0;
+
+    if (err && err != EINTR) {
+        Py_DECREF(b);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (err == EINTR && PyErr_CheckSignals() < 0) {
+        Py_DECREF(b);
+        return NULL;
+    }
+    return (PyObject *)b;
+}
+
+static PyObject *ns_py_scanner_close(ns_py_scanner *s, PyObject *unused)
+{
+    (void)unused;
+    if (s->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "read() running in another thread");
+        return NULL;
+    }
+    ns_py_scanner_stop(s);
+    Py_RETURN_NONE;
+}
+
+static PyObject *ns_py_scanner_fileno(ns_py_scanner *s, PyObject *unused)
+{
+    (void)unused;
+    return PyLong_FromLong(s->fd);
+}
+
+static PyObject *ns_py_scanner_enter(ns_py_scanner *s, PyObject *unused)
+{
+    (void)unused;
+    Py_INCREF(s);
+    return (PyObject *)s;
+}
+
+static PyObject *ns_py_scanner_exit(ns_py_scanner *s, PyObject *args)
+{
+    (void)args;
+    return ns_py_scanner_close(s, NULL);
+}
+
+static PyObject *ns_py_scanner_get_devices(ns_py_scanner *s, void *closure)
+{
+    (void)closure;
+    return PyLong_FromUnsignedLong(s->st.has_devtab ? s->st.devtab.used : 0);
+}
+
+static PyMethodDef ns_py_scanner_methods[] = {
+    { "read", (PyCFunction)(void (*)(void))ns_py_scanner_read, METH_VARARGS | METH_KEYWORDS,
+      "read(max_records=4096, timeout_ms=1000) -> Batch of the reports that passed the filter,\n"
+      "about max_records at most: the reports of the last event read are all kept" },
+    { "close", (PyCFunction)ns_py_scanner_close, METH_NOARGS, "stop scanning and close the adapter" },
+    { "fileno", (PyCFunction)ns_py_scanner_fileno, METH_NOARGS, "the HCI socket, for select()" },
+    { "__enter__", (PyCFunction)ns_py_scanner_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)ns_py_scanner_exit, METH_VARARGS, NULL },
+    { NULL }
+};
+
+static PyMemberDef ns_py_scanner_members[] = {
+    { "adapter", T_INT, offsetof(ns_py_scanner, dev_id), READONLY, "hci device number" },
+    { "ext", T_BOOL, offsetof(ns_py_scanner, ext), READONLY, "extended scanning in use" },
+    { NULL }
+};
+
+static PyGetSetDef ns_py_scanner_getset[] = {
+    { "devices", (getter)ns_py_scanner_get_devices, NULL, "devices in the device table", NULL },
+    { NULL }
+};
+
+static PyTypeObject ns_py_scanner_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "blescan.Scanner",
+    .tp_basicsize = sizeof(ns_py_scanner),
+    .tp_dealloc = (destructor)ns_py_scanner_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Scanner(adapter=0, filter=None, mode='auto', active=False, *, devices=16384, suppress=None)\n\n"
+              "Scans on hciN. filter is a scanner -m expression; without one only named\n"
+              "devices pass, as in the scanner. suppress is True or (rssi_delta, heartbeat_ms).",
+    .tp_methods = ns_py_scanner_methods,
+    .tp_members = ns_py_scanner_members,
+    .tp_getset = ns_py_scanner_getset,
+    .tp_init = (initproc)ns_py_scanner_init,
+    .tp_new = ns_py_scanner_new,
+};
+
+/* replay() */
+
+static int ns_py_replay_event(int adapter, const char *buf, int len)
+{
+    return handle_ble_scan_from(adapter, buf, len);
+}
+
+static PyObject *ns_py_replay(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "path", "filter", "devices", "suppress", NULL };
+    const char *filter = NULL;
+    PyObject *path, *suppress = Py_None;
+    long devices = NS_PY_DEVICES_DEFAULT;
+    struct ns_replay_stats stats;
+    struct ns_py_state st;
+    ns_py_batch *b;
+    int ret;
+
+    (void)self;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|z$lO", kwlist, PyUnicode_FSConverter, &path, &filter,
+                                     &devices, &suppress)) {
+        return NULL;
+    }
+    if (ns_py_state_init(&st, filter, devices, suppress) < 0) {
+        Py_DECREF(path);
+        return NULL;
+    }
+    b = ns_py_batch_new();
+    if (!b) {
+        ns_py_state_free(&st);
+        Py_DECREF(path);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ns_py_state_bind(&st, b);
+    ret = ns_replay_file(PyBytes_AS_STRING(path), 0, ns_py_replay_event, &stats);
+    ns_py_state_unbind();
+    Py_END_ALLOW_THREADS
+
+    ns_py_state_free(&st);
+    if (ret < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        Py_DECREF(path);
+        Py_DECREF(b);
+        return NULL;
+    }
+    Py_DECREF(path);
+    if (b->failed) {
+        Py_DECREF(b);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)b;
+}
+
+static PyMethodDef ns_py_methods[] = {
+    { "replay", (PyCFunction)(void (*)(void))ns_py_replay, METH_VARARGS | METH_KEYWORDS,
+      "replay(path, filter=None, *, devices=16384, suppress=None) -> Batch of a btsnoop or raw capture" },
+    { NULL }
+};
+
+static struct PyModuleDef ns_py_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "blescan",
+    .m_doc = "BLE scanning with C-level filtering, reports in batches of fixed-layout records",
+    .m_size = -1,
+    .m_methods = ns_py_methods,
+};
+
+/* numpy.dtype(RECORD_DTYPE) views a Batch without copying */
+static PyObject *ns_py_record_dtype(void)
+{
+    return Py_BuildValue("[(ss)(ss(i))(ss)(ss)(ss)(ss)(ss)(ss)(ss)(ss)(ss)(ss)(ss)]",
+                         "ts_ms", "<u8", "bdaddr", "u1", 6, "bdaddr_type", "u1", "evt_type", "u1",
+                         "rssi", "i1", "adapter", "u1", "tx_power", "i1", "sid", "u1", "phy", "u1",
+                         "truncated", "u1", "payload_len", "<u2", "payload_off", "<u4", "reserved", "V4");
+}
+
+PyMODINIT_FUNC PyInit_blescan(void)
+{
+    PyObject *m, *dtype;
+
+    if (PyType_Ready(&ns_py_batch_type) < 0 || PyType_Ready(&ns_py_payloads_type) < 0 ||
+        PyType_Ready(&ns_py_scanner_type) < 0) {
+        return NULL;
+    }
+    m = PyModule_Create(&ns_py_module);
+    if (!m) {
+        return NULL;
+    }
+    Py_INCREF(&ns_py_batch_type);
+    Py_INCREF(&ns_py_scanner_type);
+    dtype = ns_py_record_dtype();
+    if (PyModule_AddObject(m, "Batch", (PyObject *)&ns_py_batch_type) < 0 ||
+        PyModule_AddObject(m, "Scanner", (PyObject *)&ns_py_scanner_type) < 0 ||
+        !dtype || PyModule_AddObject(m, "RECORD_DTYPE", dtype) < 0 ||
+        PyModule_AddStringConstant(m, "RECORD_FORMAT", NS_PY_RECORD_FORMAT) < 0 ||
+        PyModule_AddIntConstant(m, "RECORD_SIZE", sizeof(struct ns_log_record)) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
@@ -0,0 +1,246 @@
+// Offline replay of btsnoop / raw HCI captures, see replay.h.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "replay.h"
+
+#define BTSNOOP_MAGIC               "btsnoop\0"
+#define BTSNOOP_HDR_SIZE            16
+#define BTSNOOP_REC_HDR_SIZE        24
+#define BTSNOOP_DL_H4               1001
+#define BTSNOOP_DL_HCI              1002
+#define BTSNOOP_DL_MONITOR          2001
+#define BTSNOOP_FLAG_RECV           0x01
+#define BTSNOOP_FLAG_CMD_EVT        0x02
+#define BTSNOOP_MON_EVENT_PKT       3
+
+#define RAW_REC_HDR_SIZE            10
+
+struct ns_replay_clock {
+    double rate;
+    int started;
+    uint64_t ts0_us;
+    uint64_t t0_ns;
+};
+
+static uint32_t ns_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t ns_be64(const uint8_t *p)
+{
+    return ((uint64_t)ns_be32(p) << 32) | ns_be32(p + 4);
+}
+
+static uint16_t ns_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint64_t ns_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t ns_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleep until the capture timestamp ts_us is due, scaled by clk->rate. */
+static void ns_replay_pace(struct ns_replay_clock *clk, uint64_t ts_us)
+{
+    struct timespec ts;
+    uint64_t target;
+
+    if (clk->rate <= 0) {
+        return;
+    }
+
+    if (!clk->started) {
+        clk->started = 1;
+        clk->ts0_us = ts_us;
+        clk->t0_ns = ns_now_ns();
+        return;
+    }
+
+    if (ts_us <= clk->ts0_us) {
+        return;
+    }
+
+    target = clk->t0_ns + (uint64_t)((double)(ts_us - clk->ts0_us) * 1000.0 / clk->rate);
+    ts.tv_sec = target / 1000000000ULL;
+    ts.tv_nsec = target % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* evt points at the HCI event code. The callback expects the read() layout
+ * with the packet type byte in front; handle_ble_scan never looks at that
+ * byte, so evt - 1 is passed as is even when the capture format has no
+ * type byte there (it is then the last byte of the record header). */
+static void ns_replay_event(int adapter, const uint8_t *evt, uint32_t len, uint64_t ts_us,
+                            struct ns_replay_clock *clk, ns_hci_event_cb cb,
+                            struct ns_replay_stats *stats)
+{
+    if (len < HCI_EVENT_HDR_SIZE + 1 || evt[0] != EVT_LE_META_EVENT) {
+        return;
+    }
+
+    /* Truncated capture (snaplen), don't let the parser run past it */
+    if ((uint32_t)evt[1] + HCI_EVENT_HDR_SIZE > len) {
+        return;
+    }
+
+    ns_replay_pace(clk, ts_us);
+    cb(adapter, (const char *)evt - 1, len + 1);
+    stats->events++;
+    stats->bytes += len + 1;
+}
+
+static int ns_replay_btsnoop(const uint8_t *map, size_t size, struct ns_replay_clock *clk,
+                             ns_hci_event_cb cb, struct ns_replay_stats *stats)
+{
+    const uint8_t *p = map + BTSNOOP_HDR_SIZE;
+    const uint8_t *end = map + size;
+    const uint8_t *data;
+    uint32_t datalink = ns_be32(map + 12);
+    uint32_t incl_len;
+    uint32_t flags;
+    uint64_t ts_us;
+
+    if (datalink != BTSNOOP_DL_H4 && datalink != BTSNOOP_DL_HCI && datalink != BTSNOOP_DL_MONITOR) {
+        fprintf(stderr, "Unsupported btsnoop datalink %u\n", datalink);
+        return -1;
+    }
+
+    while (end - p >= BTSNOOP_REC_HDR_SIZE) {
+        incl_len = ns_be32(p + 4);
+        flags = ns_be32(p + 8);
+        ts_us = ns_be64(p + 16);
+        data = p + BTSNOOP_REC_HDR_SIZE;
+
+        if (incl_len > (size_t)(end - data)) {
+            fprintf(stderr, "Truncated btsnoop record at offset %zu\n", (size_t)(p - map));
+            break;
+        }
+        p = data + incl_len;
+        stats->records++;
+
+        switch (datalink) {
+        case BTSNOOP_DL_H4:
+            if (incl_len && data[0] == HCI_EVENT_PKT) {
+                ns_replay_event(0, data + 1, incl_len - 1, ts_us, clk, cb, stats);
+            }
+            break;
+        case BTSNOOP_DL_HCI:
+            if ((flags & (BTSNOOP_FLAG_RECV | BTSNOOP_FLAG_CMD_EVT)) == (BTSNOOP_FLAG_RECV | BTSNOOP_FLAG_CMD_EVT)) {
+                ns_replay_event(0, data, incl_len, ts_us, clk, cb, stats);
+            }
+            break;
+        case BTSNOOP_DL_MONITOR:
+            /* flags carry the controller index in the upper half */
+            if ((flags & 0xffff) == BTSNOOP_MON_EVENT_PKT) {
+                ns_replay_event(flags >> 16, data, incl_len, ts_us, clk, cb, stats);
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int ns_replay_raw(const uint8_t *map, size_t size, struct ns_replay_clock *clk,
+                         ns_hci_event_cb cb, struct ns_replay_stats *stats)
+{
+    const uint8_t *p = map;
+    const uint8_t *end = map + size;
+    const uint8_t *data;
+    uint16_t len;
+
+    while (end - p >= RAW_REC_HDR_SIZE) {
+        len = ns_le16(p);
+        data = p + RAW_REC_HDR_SIZE;
+
+        if (len > end - data) {
+            fprintf(stderr, "Truncated raw record at offset %zu\n", (size_t)(p - map));
+            break;
+        }
+        stats->records++;
+
+        if (len && data[0] == HCI_EVENT_PKT) {
+            ns_replay_event(0, data + 1, len - 1, ns_le64(p + 2), clk, cb, stats);
+        }
+        p = data + len;
+    }
+
+    return 0;
+}
+
+int ns_replay_file(const char *path, double rate, ns_hci_event_cb cb, struct ns_replay_stats *stats)
+{
+    struct ns_replay_clock clk;
+    struct stat st;
+    uint8_t *map;
+    uint64_t start;
+    int ret;
+    int fd;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&clk, 0, sizeof(clk));
+    clk.rate = rate;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to open capture file");
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        perror("Failed to stat capture file");
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map capture file");
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    start = ns_now_ns();
+    if (st.st_size >= BTSNOOP_HDR_SIZE && !memcmp(map, BTSNOOP_MAGIC, 8)) {
+        ret = ns_replay_btsnoop(map, st.st_size, &clk, cb, stats);
+    } else {
+        ret = ns_replay_raw(map, st.st_size, &clk, cb, stats);
+    }
+    stats->elapsed_ns = ns_now_ns() - start;
+
+    munmap(map, st.st_size);
+    return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef __NS_REPLAY_H__
+#define __NS_REPLAY_H__
+
+#include <stdint.h>
+
+/* Offline replay of recorded HCI event streams.
+ *
+ * Two capture formats are accepted, picked by looking at the file header:
+ *  - btsnoop (datalink 1001 H4, 1002 HCI or 2001 Linux monitor), as
+ *    written by btmon -w, hcidump -w or Android's snoop log;
+ *  - raw dump: header-less sequence of records
+ *        uint16_t len;     little endian, bytes that follow the timestamp
+ *        uint64_t ts_us;   little endian, any epoch
+ *        uint8_t  data[];  the event as read() from the HCI socket,
+ *                          starting with the 0x04 packet type byte
+ *
+ * The file is mmap'ed and events are handed to the callback in place, in
+ * the same layout read() returns on a live HCI socket, along with the
+ * adapter they came from. Only monitor captures record that (the index
+ * field); events of the other formats are reported as adapter 0. */
+
+typedef int (*ns_hci_event_cb)(int adapter, const char *buf, int len);
+
+struct ns_replay_stats {
+    uint64_t records;       /* records in the capture */
+    uint64_t events;        /* LE meta events handed to the callback */
+    uint64_t bytes;
+    uint64_t elapsed_ns;
+};
+
+/* rate == 0 replays as fast as possible, rate == 1.0 keeps the captured
+ * timing, other values scale it (2.0 plays twice as fast).
+ * Returns 0 on success, -1 if the file cannot be read or is malformed. */
+int ns_replay_file(const char *path, double rate, ns_hci_event_cb cb, struct ns_replay_stats *stats);
+
+#endif //__NS_REPLAY_H__
@@ -0,0 +1,467 @@
+// Resolvable private address resolution, see rpa.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NS_RPA_X86
+#endif
+
+#include "rpa.h"
+#include "devtab.h"
+
+static const uint8_t ns_aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+/* SubBytes, ShiftRows and MixColumns of one byte per table, columns as
+ * big endian words; filled at startup from the S-box */
+static uint32_t ns_aes_te[4][256];
+
+static inline uint32_t ns_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void ns_put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void ns_aes_tables(void)
+{
+    uint32_t s, s2, w;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        s = ns_aes_sbox[i];
+        s2 = (s << 1) ^ ((s & 0x80) ? 0x11b : 0);
+        w = s2 << 24 | s << 16 | s << 8 | (s2 ^ s);
+        ns_aes_te[0][i] = w;
+        ns_aes_te[1][i] = w >> 8 | w << 24;
+        ns_aes_te[2][i] = w >> 16 | w << 16;
+        ns_aes_te[3][i] = w >> 24 | w << 8;
+    }
+}
+
+static void ns_aes_expand(const uint8_t key[16], uint8_t rk[11][16])
+{
+    uint32_t w[44], t, rcon = 0x01;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        w[i] = ns_be32(key + 4 * i);
+    }
+    for (i = 4; i < 44; i++) {
+        t = w[i - 1];
+        if (i % 4 == 0) {
+            t = ((uint32_t)ns_aes_sbox[(t >> 16) & 0xff] << 24 | (uint32_t)ns_aes_sbox[(t >> 8) & 0xff] << 16 |
+                 (uint32_t)ns_aes_sbox[t & 0xff] << 8 | ns_aes_sbox[t >> 24]) ^ (rcon << 24);
+            rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x11b : 0);
+        }
+        w[i] = w[i - 4] ^ t;
+    }
+    for (i = 0; i < 44; i++) {
+        ns_put_be32(rk[i / 4] + 4 * (i % 4), w[i]);
+    }
+}
+
+static void ns_aes_encrypt_table(const uint8_t rk[11][16], const uint8_t in[16], uint8_t out[16])
+{
+    const uint32_t (*te)[256] = ns_aes_te;
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+    int r;
+
+    s0 = ns_be32(in) ^ ns_be32(rk[0]);
+    s1 = ns_be32(in + 4) ^ ns_be32(rk[0] + 4);
+    s2 = ns_be32(in + 8) ^ ns_be32(rk[0] + 8);
+    s3 = ns_be32(in + 12) ^ ns_be32(rk[0] + 12);
+    for (r = 1; r < 10; r++) {
+        t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff] ^ te[2][(s2 >> 8) & 0xff] ^ te[3][s3 & 0xff] ^ ns_be32(rk[r]);
+        t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff] ^ te[2][(s3 >> 8) & 0xff] ^ te[3][s0 & 0xff] ^ ns_be32(rk[r] + 4);
+        t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff] ^ te[2][(s0 >> 8) & 0xff] ^ te[3][s1 & 0xff] ^ ns_be32(rk[r] + 8);
+        t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff] ^ te[2][(s1 >> 8) & 0xff] ^ te[3][s2 & 0xff] ^ ns_be32(rk[r] + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+#define NS_AES_LAST(a, b, c, d) \
+    ((uint32_t)ns_aes_sbox[(a) >> 24] << 24 | (uint32_t)ns_aes_sbox[((b) >> 16) & 0xff] << 16 | \
+     (uint32_t)ns_aes_sbox[((c) >> 8) & 0xff] << 8 | ns_aes_sbox[(d) & 0xff])
+    ns_put_be32(out, NS_AES_LAST(s0, s1, s2, s3) ^ ns_be32(rk[10]));
+    ns_put_be32(out + 4, NS_AES_LAST(s1, s2, s3, s0) ^ ns_be32(rk[10] + 4));
+    ns_put_be32(out + 8, NS_AES_LAST(s2, s3, s0, s1) ^ ns_be32(rk[10] + 8));
+    ns_put_be32(out + 12, NS_AES_LAST(s3, s0, s1, s2) ^ ns_be32(rk[10] + 12));
+#undef NS_AES_LAST
+}
+
+/* The plaintext of ah(): 13 zero bytes, then prand most significant
+ * byte first. The hash is the ciphertext's last three bytes. */
+static void ns_rpa_block(const bdaddr_t *bdaddr, uint8_t block[16])
+{
+    memset(block, 0, 16);
+    block[13] = bdaddr->b[5];
+    block[14] = bdaddr->b[4];
+    block[15] = bdaddr->b[3];
+}
+
+static inline uint32_t ns_rpa_hash_of(const uint8_t out[16])
+{
+    return (uint32_t)out[13] << 16 | (uint32_t)out[14] << 8 | out[15];
+}
+
+typedef int (*ns_irk_search_fn)(const struct ns_irk *irks, uint32_t n, const uint8_t block[16], uint32_t hash);
+
+static int ns_irk_search_table(const struct ns_irk *irks, uint32_t n, const uint8_t block[16], uint32_t hash)
+{
+    uint8_t out[16];
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        ns_aes_encrypt_table(irks[i].rk, block, out);
+        if (ns_rpa_hash_of(out) == hash) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+#ifdef NS_RPA_X86
+/* NS_RPA_LANES keys per round: aesenc has a latency of several cycles
+ * but issues every cycle, independent blocks fill the gap. The lanes
+ * have to be unrolled to stay in registers. */
+__attribute__((target("aes,sse2")))
+static int ns_irk_search_aesni(const struct ns_irk *irks, uint32_t n, const uint8_t block[16], uint32_t hash)
+{
+    __m128i in = _mm_loadu_si128((const __m128i *)block);
+    __m128i s[NS_RPA_LANES];
+    uint8_t out[16];
+    uint32_t i, j, r;
+
+    for (i = 0; i + NS_RPA_LANES <= n; i += NS_RPA_LANES) {
+#pragma GCC unroll 8
+        for (j = 0; j < NS_RPA_LANES; j++) {
+            s[j] = _mm_xor_si128(in, _mm_load_si128((const __m128i *)irks[i + j].rk[0]));
+        }
+        for (r = 1; r < 10; r++) {
+#pragma GCC unroll 8
+            for (j = 0; j < NS_RPA_LANES; j++) {
+                s[j] = _mm_aesenc_si128(s[j], _mm_load_si128((const __m128i *)irks[i + j].rk[r]));
+            }
+        }
+#pragma GCC unroll 8
+        for (j = 0; j < NS_RPA_LANES; j++) {
+            s[j] = _mm_aesenclast_si128(s[j], _mm_load_si128((const __m128i *)irks[i + j].rk[10]));
+        }
+#pragma GCC unroll 8
+        for (j = 0; j < NS_RPA_LANES; j++) {
+            _mm_storeu_si128((__m128i *)out, s[j]);
+            if (ns_rpa_hash_of(out) == hash) {
+                return (int)(i + j);
+            }
+        }
+    }
+    for (; i < n; i++) {
+        s[0] = _mm_xor_si128(in, _mm_load_si128((const __m128i *)irks[i].rk[0]));
+        for (r = 1; r < 10; r++) {
+            s[0] = _mm_aesenc_si128(s[0], _mm_load_si128((const __m128i *)irks[i].rk[r]));
+        }
+        s[0] = _mm_aesenclast_si128(s[0], _mm_load_si128((const __m128i *)irks[i].rk[10]));
+        _mm_storeu_si128((__m128i *)out, s[0]);
+        if (ns_rpa_hash_of(out) == hash) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+#endif
+
+static ns_irk_search_fn ns_irk_search_impl = ns_irk_search_table;
+static const char *ns_irk_search_name = "table";
+#ifdef NS_RPA_X86
+static int ns_rpa_aesni;
+#endif
+
+__attribute__((constructor))
+static void ns_rpa_select(void)
+{
+    ns_aes_tables();
+#ifdef NS_RPA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2")) {
+        ns_rpa_aesni = 1;
+        ns_irk_search_impl = ns_irk_search_aesni;
+        ns_irk_search_name = "aesni";
+    }
+#endif
+}
+
+int ns_rpa_use(const char *impl)
+{
+    if (!strcmp(impl, "table")) {
+        ns_irk_search_impl = ns_irk_search_table;
+        ns_irk_search_name = "table";
+        return 0;
+    }
+#ifdef NS_RPA_X86
+    if (!strcmp(impl, "aesni") && ns_rpa_aesni) {
+        ns_irk_search_impl = ns_irk_search_aesni;
+        ns_irk_search_name = "aesni";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+const char *ns_rpa_impl(void)
+{
+    return ns_irk_search_name;
+}
+
+void ns_rpa_ah(const uint8_t key[16], const uint8_t prand[3], uint8_t hash[3])
+{
+    uint8_t rk[11][16], block[16], out[16];
+
+    ns_aes_expand(key, rk);
+    memset(block, 0, sizeof(block));
+    memcpy(block + 13, prand, 3);
+    ns_aes_encrypt_table(rk, block, out);
+    memcpy(hash, out + 13, 3);
+}
+
+int ns_irk_search(const struct ns_irk_list *l, const bdaddr_t *bdaddr)
+{
+    uint8_t block[16];
+    uint32_t hash = (uint32_t)bdaddr->b[2] << 16 | (uint32_t)bdaddr->b[1] << 8 | bdaddr->b[0];
+
+    if (!l->count) {
+        return -1;
+    }
+    ns_rpa_block(bdaddr, block);
+    return ns_irk_search_impl(l->irks, l->count, block, hash);
+}
+
+int ns_irk_add(struct ns_irk_list *l, const uint8_t key[16], const bdaddr_t *identity,
+               uint8_t identity_type, const char *label)
+{
+    struct ns_irk *irk;
+    uint32_t cap;
+
+    if (l->count == l->cap) {
+        cap = l->cap ? l->cap * 2 : 64;
+        /* aligned for the AES-NI loads, realloc would not keep that */
+        irk = aligned_alloc(64, cap * sizeof(*irk));
+        if (!irk) {
+            return -1;
+        }
+        if (l->count) {
+            memcpy(irk, l->irks, l->count * sizeof(*irk));
+        }
+        free(l->irks);
+        l->irks = irk;
+        l->cap = cap;
+    }
+
+    irk = &l->irks[l->count];
+    memset(irk, 0, sizeof(*irk));
+    ns_aes_expand(key, irk->rk);
+    irk->identity_type = NS_IRK_NO_IDENTITY;
+    if (identity) {
+        bacpy(&irk->identity, identity);
+        irk->identity_type = identity_type;
+    }
+    irk->index = l->count;
+    if (label) {
+        snprintf(irk->label, sizeof(irk->label), "%s", label);
+    } else {
+        snprintf(irk->label, sizeof(irk->label), "irk%u", irk->index);
+    }
+    l->count++;
+    return 0;
+}
+
+void ns_irk_free(struct ns_irk_list *l)
+{
+    free(l->irks);
+    memset(l, 0, sizeof(*l));
+}
+
+static int ns_irk_parse_key(const char *s, uint8_t key[16])
+{
+    int i, hi, lo;
+
+    if (strlen(s) != 32) {
+        return -1;
+    }
+    for (i = 0; i < 16; i++) {
+        if (!isxdigit((unsigned char)s[2 * i]) || !isxdigit((unsigned char)s[2 * i + 1])) {
+            return -1;
+        }
+        hi = isdigit((unsigned char)s[2 * i]) ? s[2 * i] - '0' : (tolower((unsigned char)s[2 * i]) - 'a' + 10);
+        lo = isdigit((unsigned char)s[2 * i + 1]) ? s[2 * i + 1] - '0' : (tolower((unsigned char)s[2 * i + 1]) - 'a' + 10);
+        key[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+/* "XX:XX:XX:XX:XX:XX[,type]", 0 if s is one */
+static int ns_irk_parse_identity(char *s, bdaddr_t *ba, uint8_t *type)
+{
+    char *comma = strchr(s, ',');
+
+    *type = 0;
+    if (comma) {
+        *comma = '\0';
+        if (strcmp(comma + 1, "0") && strcmp(comma + 1, "1")) {
+            *comma = ',';
+            return -1;
+        }
+        *type = (uint8_t)(comma[1] - '0');
+    }
+    if (strlen(s) != 17 || s[2] != ':' || str2ba(s, ba) < 0) {
+        if (comma) {
+            *comma = ',';
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int ns_irk_load(struct ns_irk_list *l, const char *path, char *err, size_t err_len)
+{
+    char line[256], *tok, *save, *hash;
+    const char *label;
+    uint8_t key[16], type = 0;
+    bdaddr_t ba;
+    int lineno = 0, added = 0, identity;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        snprintf(err, err_len, "%s: %m", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        tok = strtok_r(line, " \t\r\n", &save);
+        if (!tok) {
+            continue;
+        }
+        if (ns_irk_parse_key(tok, key) < 0) {
+            snprintf(err, err_len, "%s:%d: key must be 32 hex digits", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+        identity = 0;
+        label = NULL;
+        tok = strtok_r(NULL, " \t\r\n", &save);
+        if (tok && ns_irk_parse_identity(tok, &ba, &type) == 0) {
+            identity = 1;
+            tok = strtok_r(NULL, " \t\r\n", &save);
+        }
+        if (tok) {
+            label = tok;
+        }
+        if (ns_irk_add(l, key, identity ? &ba : NULL, type, label) < 0) {
+            snprintf(err, err_len, "out of memory");
+            fclose(fp);
+            return -1;
+        }
+        added++;
+    }
+    fclose(fp);
+    return added;
+}
+
+int ns_rpa_init(struct ns_rpa *r, const struct ns_irk_list *irks, uint32_t entries)
+{
+    uint32_t buckets = 1;
+
+    memset(r, 0, sizeof(*r));
+    while (buckets * NS_RPA_WAYS < entries) {
+        buckets <<= 1;
+    }
+    r->buckets = aligned_alloc(64, buckets * sizeof(*r->buckets));
+    if (!r->buckets) {
+        return -1;
+    }
+    memset(r->buckets, 0, buckets * sizeof(*r->buckets));
+    r->mask = buckets - 1;
+    r->irks = irks;
+    return 0;
+}
+
+void ns_rpa_free(struct ns_rpa *r)
+{
+    free(r->buckets);
+    memset(r, 0, sizeof(*r));
+}
+
+const struct ns_irk *ns_rpa_resolve(struct ns_rpa *r, const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+    const uint8_t *b = bdaddr->b;
+    struct ns_rpa_bucket *bucket;
+    struct ns_rpa_slot *slot, *victim;
+    uint64_t addr;
+    int w, idx;
+
+    if (!ns_rpa_is_resolvable(bdaddr, bdaddr_type) || !r->irks->count) {
+        return NULL;
+    }
+    addr = (uint64_t)b[0] | ((uint64_t)b[1] << 8) | ((uint64_t)b[2] << 16) | ((uint64_t)b[3] << 24) |
+           ((uint64_t)b[4] << 32) | ((uint64_t)b[5] << 40) | (1ULL << 63);
+    bucket = &r->buckets[ns_devtab_hash(addr) & r->mask];
+    r->tick++;
+
+    victim = &bucket->ways[0];
+    for (w = 0; w < NS_RPA_WAYS; w++) {
+        slot = &bucket->ways[w];
+        if (slot->addr == addr) {
+            slot->used = r->tick;
+            if (!slot->irk) {
+                r->negative_hits++;
+                return NULL;
+            }
+            r->hits++;
+            return &r->irks->irks[slot->irk - 1];
+        }
+        if (victim->addr && (!slot->addr || (int32_t)(slot->used - victim->used) < 0)) {
+            victim = slot;
+        }
+    }
+
+    idx = ns_irk_search(r->irks, bdaddr);
+    r->computed++;
+    if (victim->addr) {
+        r->evicted++;
+    }
+    victim->addr = addr;
+    victim->irk = idx < 0 ? 0 : (uint32_t)idx + 1;
+    victim->used = r->tick;
+    return idx < 0 ? NULL : &r->irks->irks[idx];
+}
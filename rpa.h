@@ -0,0 +1,113 @@
+#ifndef __NS_RPA_H__
+#define __NS_RPA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <bluetooth/bluetooth.h>
+
+/* Resolution of resolvable private addresses (RPAs) against a list of
+ * identity resolving keys.
+ *
+ * An RPA is prand (the top 24 bits, 0b01 in the two highest) followed by
+ * hash = ah(IRK, prand), the low 24 bits of AES-128(IRK, 0^104 || prand).
+ * Resolving one against n keys costs up to n AES blocks, and a device
+ * keeps its RPA for several minutes, so results are cached per thread:
+ * a set associative table of addresses, each with the key that resolved
+ * it or the fact that none did (the key list does not change while
+ * scanning, so negative entries stay valid until they are evicted).
+ * Only a cache miss runs AES, once per address and rotation.
+ *
+ * A miss runs the plaintext against every key. With AES-NI eight blocks
+ * are in flight at a time, each under its own key, so the pipeline of
+ * the AES unit stays full; otherwise a table based implementation does
+ * one block at a time. The variant is picked at startup.
+ *
+ * Key files have one key per line, '#' starts a comment:
+ *   <32 hex digits> [<identity address>[,<type>]] [<label>]
+ * The key is written most significant byte first, as in the Core
+ * specification's sample data. With an identity address (type 0 public,
+ * the default, or 1 random static) the scanner reports a resolved device
+ * under it, so it keeps one device table entry, one filter address and
+ * one line of history across rotations. */
+
+#define NS_IRK_LABEL_MAX            32
+#define NS_IRK_NO_IDENTITY          0xFF    /* identity_type of a key without one */
+#define NS_RPA_CACHE_DEFAULT        8192    /* cached addresses per thread */
+#define NS_RPA_WAYS                 4
+#define NS_RPA_LANES                8       /* AES blocks in flight on a miss */
+
+struct ns_irk {
+    uint8_t rk[11][16];             /* AES-128 round keys, FIPS-197 byte order */
+    bdaddr_t identity;
+    uint8_t identity_type;          /* NS_IRK_NO_IDENTITY without one */
+    uint32_t index;                 /* in the list */
+    char label[NS_IRK_LABEL_MAX];
+} __attribute__((aligned(16)));
+
+struct ns_irk_list {
+    struct ns_irk *irks;
+    uint32_t count;
+    uint32_t cap;
+};
+
+struct ns_rpa_slot {
+    uint64_t addr;                  /* 48 bit address | 1 << 63, 0 = empty */
+    uint32_t irk;                   /* 1 + key index, 0 = resolves with none */
+    uint32_t used;                  /* tick of the last lookup, the least recent way is replaced */
+};
+
+struct ns_rpa_bucket {
+    struct ns_rpa_slot ways[NS_RPA_WAYS];
+} __attribute__((aligned(64)));
+
+struct ns_rpa {
+    const struct ns_irk_list *irks;
+    struct ns_rpa_bucket *buckets;
+    uint32_t mask;                  /* buckets - 1 */
+    uint32_t tick;
+    uint64_t hits;                  /* cached, resolved */
+    uint64_t negative_hits;         /* cached, no key */
+    uint64_t computed;              /* misses that ran AES */
+    uint64_t evicted;
+};
+
+/* Key list, shared read-only by all threads once loaded */
+
+/* identity NULL for a key without one, label NULL for "irk<index>".
+ * Returns 0, or -1 if out of memory. */
+int ns_irk_add(struct ns_irk_list *l, const uint8_t key[16], const bdaddr_t *identity,
+               uint8_t identity_type, const char *label);
+
+/* Read a key file, see above. Returns the number of keys added, or -1
+ * with a message in err. */
+int ns_irk_load(struct ns_irk_list *l, const char *path, char *err, size_t err_len);
+void ns_irk_free(struct ns_irk_list *l);
+
+/* Index of the key that generated bdaddr, or -1. Always runs AES. */
+int ns_irk_search(const struct ns_irk_list *l, const bdaddr_t *bdaddr);
+
+/* ah(key, prand) of the specification, all values most significant byte first */
+void ns_rpa_ah(const uint8_t key[16], const uint8_t prand[3], uint8_t hash[3]);
+
+/* "aesni" or "table" */
+const char *ns_rpa_impl(void);
+
+/* Switch to "aesni" or "table", for checks and benchmarks, before any
+ * thread searches. Returns 0, or -1 if the CPU lacks it. */
+int ns_rpa_use(const char *impl);
+
+/* Per thread cache */
+
+static inline int ns_rpa_is_resolvable(const bdaddr_t *bdaddr, uint8_t bdaddr_type)
+{
+    return bdaddr_type == 0x01 && (bdaddr->b[5] & 0xC0) == 0x40;   /* random, 0b01 on top */
+}
+
+/* entries is rounded up to a power of two. Returns 0, or -1 if out of memory. */
+int ns_rpa_init(struct ns_rpa *r, const struct ns_irk_list *irks, uint32_t entries);
+void ns_rpa_free(struct ns_rpa *r);
+
+/* The key that generated the address, NULL if it is no RPA or none did */
+const struct ns_irk *ns_rpa_resolve(struct ns_rpa *r, const bdaddr_t *bdaddr, uint8_t bdaddr_type);
+
+#endif //__NS_RPA_H__
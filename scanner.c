@@ -1,18 +1,24 @@
 // LYJ: if show nothing try:
 //         sudo hciconfig hci0 down && sudo hciconfig hci0 up
+// The scanner now does this itself when an adapter stops answering commands, see -W.
 
 // To compile this program, you need to install:
 //   sudo apt-get install libbluetooth-dev
 // Then you can compile it with:
-//   cc scanner.c -lbluetooth -o scanner
+//   cc -pthread scanner.c bleapi.c devtab.c suppress.c output.c pipeline.c replay.c extadv.c filter.c accept.c sched.c metrics.c match.c decode.c sightlog.c devshm.c rpa.c hcicmd.c vhci.c -lbluetooth -ldl -lrt -o scanner
 // You can then run it with:
-//   ./scanner
+//   ./scanner [-i all|0,1,...] [-e auto|legacy|ext] [-m filter] [-a off|fit|rotate[,ms]] [-S] [-W stall_ms] [-P metrics.sock] [-X decoder.so] [-R irks.txt] [-L logdir[,MB[,n]]] [-G shm_name] [-b batch] [-l latency_ms]
+// or replay a capture (btmon -w / hcidump -w) without an adapter:
+//   ./scanner -r capture.btsnoop [-t rate]
+// or load test against virtual controllers:
+//   ./scanner -V devices=100000,rate=0,per=4,count=10000000 [-i 0,1]
 
 // Copyright (c) 2021 David G. Young
 // Copyright (c) 2015 Damian Kołakowski. All rights reserved.
 // License: BSD 3.  See: https://github.com/davidgyoung/ble-scanner
 
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -21,379 +27,1691 @@
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/signalfd.h>
 
 #include "bleapi.h"
+#include "replay.h"
+#include "devtab.h"
+#include "suppress.h"
+#include "output.h"
+#include "pipeline.h"
+#include "decode.h"
+#include "extadv.h"
+#include "filter.h"
+#include "accept.h"
+#include "sched.h"
+#include "metrics.h"
+#include "sightlog.h"
+#include "devshm.h"
+#include "rpa.h"
+#include "hcicmd.h"
+#include "vhci.h"
+
+#define NS_SCAN_BATCH_DEFAULT       64      /* events handed to handle_ble_scan_batch per call */
+#define NS_SCAN_BATCH_MAX           1024
+#define NS_SCAN_LATENCY_DEFAULT     0       /* ms a partial batch may wait for more events */
+#define NS_DEVTAB_DEVICES_DEFAULT   16384
+#define NS_SCAN_CMD_TIMEOUT_MS      250     /* controllers answer LE commands within a few ms */
+#define NS_SCAN_RESET_TIMEOUT_MS    2000
+#define NS_SCAN_BRINGUP_MS          5000    /* startup waits this long for the adapters */
+#define NS_SCAN_WATCH_MS            250     /* event counters checked for stalls */
+#define NS_SCAN_STALL_MS_DEFAULT    10000   /* no events this long while scanning is a stall */
+#define NS_SCAN_STALL_MS_MAX        300000  /* a quiet adapter's window backs off to this */
+#define NS_SCAN_RETRY_MS            1000    /* an adapter that failed every step rests, doubling */
+#define NS_SCAN_RETRY_MS_MAX        60000
+
+static struct ns_devtab devtab;
+static struct ns_out out;
+static struct ns_extadv_pool extadv;
+static struct ns_filter filter;
+static struct ns_sched scan_load;
+static struct ns_accept accept_list;
+static struct ns_log sight_log;
+static struct ns_shm dev_shm;
+static struct ns_irk_list irk_list;
+static struct ns_rpa rpa_cache;
+static struct ns_vhci vhci[NS_ADAPTERS_MAX];
+static int vhci_on;
+static enum ns_accept_policy accept_policy = NS_ACCEPT_FIT;
+static int accept_rotate_ms = NS_ACCEPT_ROTATE_MS_DEFAULT;
+static uint64_t scan_stall_ms = NS_SCAN_STALL_MS_DEFAULT;
+static struct ns_pipeline *pipeline;
+static volatile sig_atomic_t devtab_dump_requested;
+
+enum {
+	SCAN_ST_DOWN,           /* failed every recovery step, waits for retry_ms */
+	SCAN_ST_PROBE,          /* reading the features and the accept list size */
+	SCAN_ST_RESET,          /* HCI Reset and the event mask */
+	SCAN_ST_ARM,            /* scan off, accept list, parameters, LE event mask, scan on */
+	SCAN_ST_SCANNING,
+	SCAN_ST_OFF,            /* can not scan as asked, left alone */
+};
+
+/* Recovery steps, see scan_recover() */
+enum {
+	SCAN_STEP_REARM,
+	SCAN_STEP_RESET,
+	SCAN_STEP_CYCLE,
+	SCAN_STEPS,
+};
+
+/* Tags of the bring-up commands */
+enum {
+	SCAN_CMD_FEATURES = 1,
+	SCAN_CMD_ACCEPT_SIZE,
+	SCAN_CMD_RESET,
+	SCAN_CMD_EVENT_MASK,
+	SCAN_CMD_OFF,
+	SCAN_CMD_ACCEPT,
+	SCAN_CMD_PARAMS,
+	SCAN_CMD_LE_EVENT_MASK,
+	SCAN_CMD_ON,
+};
+
+/* Adapters being scanned, events are tagged with dev_id */
+struct scan_adapter {
+	int dev_id;
+	int fd;
+	int ctl;                /* command socket, read by the supervisor */
+	int ext;                /* scanning with the extended commands */
+	int accept_size;        /* entries the controller's accept list holds */
+	uint32_t accept_groups; /* groups of accept_list swapped in, 0 = not used */
+	uint32_t accept_group;  /* group in the controller */
+	int coded;              /* extended scanning on the Coded PHY too */
+	int filter_policy;      /* NS_SCAN_FILTER_* */
+	struct ns_sched_state sched; /* timing level and scan type, level 0 passive by default */
+	int state;              /* SCAN_ST_* */
+	int step;               /* next recovery step */
+	int probed;             /* features and accept list size known */
+	int announced;
+	uint64_t events;        /* NS_MC_EVENTS at the last watch */
+	uint64_t quiet_ms;      /* when events last moved, or scanning (re)started */
+	uint64_t stall_ms;      /* quiet time taken for a stall, doubles while quiet */
+	uint64_t failed_ms;     /* when the current recovery began, 0 when scanning */
+	uint64_t retry_ms;
+	uint64_t backoff_ms;
+	unsigned recoveries[SCAN_STEPS];
+	struct ns_hci_queue q;
+};
+
+enum {
+	SCAN_MODE_AUTO,         /* extended scanning where the controller has it */
+	SCAN_MODE_LEGACY,
+	SCAN_MODE_EXT,
+};
+
+static int scan_mode = SCAN_MODE_AUTO;
+
+static void on_sigusr1(int sig)
+{
+	(void)sig;
+	if ( pipeline ) {
+		ns_pipeline_request_dump(pipeline);
+	} else {
+		devtab_dump_requested = 1;
+	}
+}
 
-#define NS_STREAM_TO_UINT8(u8, p)   {u8 = (uint8_t)(*(p)); (p) += 1;}
-#define NS_BTM_BLE_CACHE_ADV_DATA_MAX      62
+static int replay_to_pipeline(int adapter, const char *buf, int len)
+{
+	return ns_pipeline_push(pipeline, adapter, buf, len, 1);
+}
 
-uint8_t *BTM_CheckAdvData( uint8_t *p_adv, uint8_t type, uint8_t *p_length)
+static void pipeline_finish(void)
 {
-    uint8_t *p = p_adv;
-    uint8_t length;
-    uint8_t adv_type;
+	struct ns_pipeline_stats ps;
+
+	ns_pipeline_stop(pipeline, &ps);
+	pipeline = NULL;
+	fprintf(stderr, "pipeline: %llu events, %llu dropped events, %llu records, "
+		"%llu dropped records, %llu suppressed, %llu bytes written\n",
+		(unsigned long long)ps.events, (unsigned long long)ps.dropped_events,
+		(unsigned long long)ps.records, (unsigned long long)ps.dropped_records,
+		(unsigned long long)ps.suppressed, (unsigned long long)ps.bytes);
+	if ( ps.rpa_hits || ps.rpa_computed ) {
+		fprintf(stderr, "rpa: %llu cached (%llu unresolved), %llu computed\n",
+			(unsigned long long)ps.rpa_hits, (unsigned long long)ps.rpa_negative,
+			(unsigned long long)ps.rpa_computed);
+	}
+	if ( ps.logged || ps.log_errors ) {
+		fprintf(stderr, "log: %llu records, %llu with a deduplicated payload, %llu lost\n",
+			(unsigned long long)ps.logged, (unsigned long long)ps.log_deduped,
+			(unsigned long long)ps.log_errors);
+	}
+}
 
-    NS_STREAM_TO_UINT8(length, p);
+static void log_finish(void)
+{
+	if ( sight_log.dedup ) {
+		fprintf(stderr, "log: %llu records, %llu with a deduplicated payload, %llu lost, %llu rotations\n",
+			(unsigned long long)sight_log.records, (unsigned long long)sight_log.deduped,
+			(unsigned long long)sight_log.errors, (unsigned long long)sight_log.rotations);
+		ns_log_close(&sight_log);
+	}
+}
 
-    while ( length && (p - p_adv < NS_BTM_BLE_CACHE_ADV_DATA_MAX)) {
-        NS_STREAM_TO_UINT8(adv_type, p);
+static void rpa_finish(void)
+{
+	if ( rpa_cache.buckets ) {
+		fprintf(stderr, "rpa: %llu cached (%llu unresolved), %llu computed, %llu evicted\n",
+			(unsigned long long)(rpa_cache.hits + rpa_cache.negative_hits),
+			(unsigned long long)rpa_cache.negative_hits, (unsigned long long)rpa_cache.computed,
+			(unsigned long long)rpa_cache.evicted);
+		ns_rpa_free(&rpa_cache);
+	}
+}
 
-        if ( adv_type == type ) {
-            /* length doesn't include itself */
-            *p_length = length - 1; /* minus the length of type */
-            return p;
-        }
+static void vhci_finish(void)
+{
+	struct ns_vhci_stats vs;
+	int i;
 
-        p += length - 1; /* skip the length of data */
+	for ( i = 0; i < NS_ADAPTERS_MAX; i++ ) {
+		if ( !vhci[i].devs ) {
+			continue;
+		}
+		ns_vhci_close(&vhci[i], &vs);
+		fprintf(stderr, "vhci hci%d: %llu reports in %llu events, %llu dropped, %llu commands, %.3f s (%.0f reports/s)\n",
+			i, (unsigned long long)vs.reports, (unsigned long long)vs.events,
+			(unsigned long long)vs.dropped, (unsigned long long)vs.commands, vs.elapsed_ns / 1e9,
+			vs.elapsed_ns ? vs.reports * 1e9 / vs.elapsed_ns : 0.0);
+	}
+}
 
-        /* Break loop if advertising data is in an incorrect format,
-           as it may lead to memory overflow */
-        if (p >= p_adv + NS_BTM_BLE_CACHE_ADV_DATA_MAX) {
-            break;
-        }
+static void devtab_dump_if_requested(void)
+{
+	if ( devtab_dump_requested ) {
+		devtab_dump_requested = 0;
+		if ( devtab.slots ) {
+			ns_devtab_dump(&devtab, stderr);
+		}
+	}
+}
+
+struct hci_request ble_hci_request(uint16_t ocf, int clen, void * status, void * cparam)
+{
+	struct hci_request rq;
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LE_CTL;
+	rq.ocf = ocf;
+	rq.cparam = cparam;
+	rq.clen = clen;
+	rq.rparam = status;
+	rq.rlen = 1;
+	return rq;
+}
 
-        NS_STREAM_TO_UINT8(length, p);
-    }
+static uint64_t ns_now_ms(void)
+{
+	struct timespec ts;
 
-    *p_length = 0;
-    return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-uint8_t *esp_ble_resolve_adv_data( uint8_t *adv_data, uint8_t type, uint8_t *length)
+/* Read loop over the HCI sockets of all adapters. Every wakeup drains
+ * the pending events of the ready sockets (up to batch_max), one event
+ * per socket and round so the merged stream keeps roughly the order the
+ * radios delivered in, and hands them over in one call. A partial batch
+ * is held back for at most latency_ms waiting for more events; with
+ * latency_ms == 0 it is dispatched as soon as the sockets are empty.
+ * SIGUSR1 prints the device table between batches. Only returns on a
+ * fatal socket error. */
+int scan_loop_epoll(const struct scan_adapter *adapters, int count, int batch_max, int latency_ms)
 {
-    if (((type < ESP_BLE_AD_TYPE_FLAG) || (type > ESP_BLE_AD_TYPE_128SERVICE_DATA)) &&
-            (type != ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE)) {
-        printf("the eir type not define, type = %x\n", type);
-        return NULL;
-    }
+	struct epoll_event evs[NS_ADAPTERS_MAX];
+	struct epoll_event ev;
+	uint8_t (*bufs)[HCI_MAX_EVENT_SIZE] = NULL;
+	uint8_t *ids = NULL;
+	uint64_t *read_ns = NULL;
+	int ready[NS_ADAPTERS_MAX];
+	int *lens = NULL;
+	uint64_t first_ms = 0;
+	uint64_t elapsed;
+	int out_timeout;
+	int epfd = -1;
+	int nready;
+	int flags;
+	int timeout;
+	int ret = -1;
+	int len;
+	int fd;
+	int n = 0;
+	int i;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if ( epfd < 0 ) {
+		perror("Failed to create epoll instance");
+		return -1;
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		fd = adapters[i].fd;
+		flags = fcntl(fd, F_GETFL, 0);
+		if ( flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ) {
+			perror("Failed to set HCI socket non-blocking");
+			goto out;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if ( epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+			perror("Failed to watch HCI socket");
+			goto out;
+		}
+	}
+
+	bufs = malloc(batch_max * sizeof(*bufs));
+	lens = malloc(batch_max * sizeof(*lens));
+	ids = malloc(batch_max * sizeof(*ids));
+	read_ns = malloc(batch_max * sizeof(*read_ns));
+	if ( !bufs || !lens || !ids || !read_ns ) {
+		perror("Failed to allocate event batch");
+		goto out;
+	}
+
+	while ( 1 ) {
+		timeout = -1;
+		if ( n ) {
+			elapsed = ns_now_ms() - first_ms;
+			timeout = elapsed >= (uint64_t)latency_ms ? 0 : latency_ms - (int)elapsed;
+		}
+		out_timeout = ns_out_poll(&out);
+		if ( out_timeout >= 0 && (timeout < 0 || out_timeout < timeout) ) {
+			timeout = out_timeout;
+		}
+
+		nready = epoll_wait(epfd, evs, count, timeout);
+		if ( nready < 0 ) {
+			if ( errno == EINTR ) {
+				devtab_dump_if_requested();
+				continue;
+			}
+			perror("epoll_wait failed");
+			break;
+		}
+		for ( i = 0; i < nready; i++ ) {
+			ready[i] = evs[i].data.u32;
+		}
+
+		/* Sockets leave the ready set once they are empty */
+		while ( nready && n < batch_max ) {
+			for ( i = 0; i < nready && n < batch_max; ) {
+				len = read(adapters[ready[i]].fd, bufs[n], HCI_MAX_EVENT_SIZE);
+				if ( len < 0 ) {
+					if ( errno == EINTR ) {
+						continue;
+					}
+					if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+						ready[i] = ready[--nready];
+						continue;
+					}
+					perror("Failed to read HCI event");
+					goto out;
+				}
+				if ( len == 0 ) {
+					fprintf(stderr, "HCI socket of hci%d closed\n", adapters[ready[i]].dev_id);
+					goto out;
+				}
+				if ( len >= HCI_EVENT_HDR_SIZE ) {
+					if ( !n ) {
+						first_ms = ns_now_ms();
+					}
+					ids[n] = (uint8_t)adapters[ready[i]].dev_id;
+					read_ns[n] = ns_metrics_now_ns();
+					lens[n++] = len;
+				}
+				i++;
+			}
+		}
+
+		if ( n && (n == batch_max || ns_now_ms() - first_ms >= (uint64_t)latency_ms) ) {
+			handle_ble_scan_batch(bufs, lens, ids, read_ns, n);
+			n = 0;
+		}
+	}
 
-    if (adv_data == NULL) {
-        printf("Invalid p_eir data.\n");
-        return NULL;
-    }
+out:
+	if ( n ) {
+		handle_ble_scan_batch(bufs, lens, ids, read_ns, n);
+	}
+	free(bufs);
+	free(lens);
+	free(ids);
+	free(read_ns);
+	close(epfd);
+	return ret;
+}
 
-    return (BTM_CheckAdvData( adv_data, type, length));
+/* HCI socket of an adapter, or a connection to its virtual controller */
+static int scan_open_dev(int dev_id)
+{
+	if ( vhci_on ) {
+		return ns_vhci_connect(&vhci[dev_id]);
+	}
+	return hci_open_dev(dev_id);
 }
 
-void __dump_data(const unsigned char *ptr, int len, const char *func, int line)
+/* Bring-up and recovery.
+ *
+ * Every adapter has a second HCI socket for commands, so the read loops
+ * never see a command event, with a command queue on it (see hcicmd.h).
+ * Each stage issues all of its commands at once and the next one starts
+ * when the last of them completed:
+ *
+ *   PROBE     LE features and the accept list size
+ *   RESET     HCI Reset and the event mask, recovery only
+ *   ARM       scan off, accept list group, scan parameters, LE event
+ *             mask, scan on
+ *
+ * One supervisor drives all adapters, first from main, then from the
+ * control thread. An adapter whose command fails or times out, that
+ * reports a Hardware Error or whose scanning another host turned off is
+ * recovered in steps, each taken when the one before did not help:
+ * re-arm, HCI Reset and re-arm, and taking the adapter down and up as
+ * hciconfig would. Events arriving again start over at re-arm. One that
+ * read no events for stall_ms while scanning is only re-armed: silence
+ * is normal behind an accept list or in an empty room, and a Reset or a
+ * power cycle would drop the adapter's connections on no evidence. A
+ * controller that is really stuck fails the re-arm's commands, and that
+ * escalates. The window doubles while an adapter stays quiet. An adapter
+ * that failed all steps is retried after a back-off. */
+
+static void scan_arm(struct scan_adapter *sa, uint64_t now);
+static void scan_recover(struct scan_adapter *sa, int step, const char *why, uint64_t now);
+
+static const char *scan_step_names[SCAN_STEPS] = { "re-arming", "resetting", "power cycling" };
+
+static int scan_send(struct scan_adapter *sa, uint16_t ogf, uint16_t ocf, const void *params,
+		     uint8_t plen, uint8_t tag, uint64_t now)
 {
-    int i;
-    int _b_len = 0;
-    char _buf[1024 * 4];
+	return ns_hci_queue_send(&sa->q, ogf, ocf, params, plen, tag,
+				 tag == SCAN_CMD_RESET ? NS_SCAN_RESET_TIMEOUT_MS : NS_SCAN_CMD_TIMEOUT_MS, now);
+}
+
+/* A command could not be written, an adapter that is down needs to come up */
+static void scan_send_failed(struct scan_adapter *sa, uint64_t now)
+{
+	char why[80];
 
-#define __PRINTF2BUF(fmt, ...) \
-    _b_len += snprintf(((char *)_buf) + _b_len, sizeof(_buf) -_b_len, fmt, ##__VA_ARGS__)
+	snprintf(why, sizeof(why), "can not send commands (%s)", strerror(errno));
+	scan_recover(sa, errno == ENETDOWN ? SCAN_STEP_CYCLE : sa->step, why, now);
+}
 
-    __PRINTF2BUF("\n=============================================\n");
-    __PRINTF2BUF("[%s][%d]", func, line);
+static int scan_set_params(struct scan_adapter *sa, uint64_t now)
+{
+	const struct ns_scan_timing *timing = &ns_sched_levels[sa->sched.level];
 
-    for (i = 0; i < len; i++) {
-        if (!(i%16)) {
-            __PRINTF2BUF("\n %04x", i);
-        }
-        __PRINTF2BUF(" %02x", ptr[i]);
-    }
-    __PRINTF2BUF("\n=============================================\n");
+	// Set BLE scan parameters.
 
-    printf("%s\n", _buf);
+	le_set_scan_parameters_cp scan_params_cp;
+	memset(&scan_params_cp, 0, sizeof(scan_params_cp));
+	scan_params_cp.type 			= sa->sched.active; // Passive, active during bursts.
+	scan_params_cp.interval 		= htobs(timing->interval);
+	scan_params_cp.window 			= htobs(timing->window);
+	scan_params_cp.own_bdaddr_type 	= 0x00; // Public Device Address (default).
+	//scan_params_cp.own_bdaddr_type 	= LE_RANDOM_ADDRESS; // RANDOM 
+	scan_params_cp.filter 			= sa->filter_policy; // Accept all, or the accept list.
 
-    return;
+	return scan_send(sa, OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS, &scan_params_cp,
+			 LE_SET_SCAN_PARAMETERS_CP_SIZE, SCAN_CMD_PARAMS, now);
 }
 
-#define NS_dump_data(ptr, len) __dump_data((unsigned char *)ptr, len, __func__, __LINE__)
+/* Same timing as the legacy parameters, on 1M and, if the controller has
+ * it, the Coded PHY for long range advertisers */
+static int scan_set_ext_params(struct scan_adapter *sa, uint64_t now)
+{
+	int nphys = 1;
+	const struct ns_scan_timing *timing = &ns_sched_levels[sa->sched.level];
+
+	ns_le_set_ext_scan_parameters_cp ext_params_cp;
+	memset(&ext_params_cp, 0, sizeof(ext_params_cp));
+	ext_params_cp.own_bdaddr_type 	= 0x00; // Public Device Address (default).
+	ext_params_cp.filter 		= sa->filter_policy; // Accept all, or the accept list.
+	ext_params_cp.phys 		= NS_LE_SCAN_PHY_1M;
+	ext_params_cp.phy[0].type 	= sa->sched.active; // Passive, active during bursts.
+	ext_params_cp.phy[0].interval 	= htobs(timing->interval);
+	ext_params_cp.phy[0].window 	= htobs(timing->window);
+	if ( sa->coded ) {
+		ext_params_cp.phys |= NS_LE_SCAN_PHY_CODED;
+		ext_params_cp.phy[1] = ext_params_cp.phy[0];
+		nphys = 2;
+	}
 
-void bt_dump_all_ext_type(uint8_t *p_adv)
+	return scan_send(sa, OGF_LE_CTL, NS_OCF_LE_SET_EXT_SCAN_PARAMETERS, &ext_params_cp,
+			 NS_LE_SET_EXT_SCAN_PARAMETERS_CP_SIZE(nphys), SCAN_CMD_PARAMS, now);
+}
+
+static int scan_set_enable(struct scan_adapter *sa, int enable, uint8_t tag, uint64_t now)
 {
-    uint8_t *p = p_adv;
-    uint8_t length;
-    uint8_t adv_type;
+	le_set_scan_enable_cp scan_cp;
+	ns_le_set_ext_scan_enable_cp ext_scan_cp;
+
+	if ( sa->ext ) {
+		memset(&ext_scan_cp, 0, sizeof(ext_scan_cp));
+		ext_scan_cp.enable 	= enable;
+		ext_scan_cp.filter_dup 	= 0x00; // Filtering disabled.
+		return scan_send(sa, OGF_LE_CTL, NS_OCF_LE_SET_EXT_SCAN_ENABLE, &ext_scan_cp,
+				 NS_LE_SET_EXT_SCAN_ENABLE_CP_SIZE, tag, now);
+	}
+	memset(&scan_cp, 0, sizeof(scan_cp));
+	scan_cp.enable 		= enable;
+	scan_cp.filter_dup 	= 0x00; // Filtering disabled.
+	return scan_send(sa, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE, &scan_cp, LE_SET_SCAN_ENABLE_CP_SIZE, tag, now);
+}
 
-    NS_STREAM_TO_UINT8(length, p);
+/* Blocking scan enable, for the way out when the supervisor has stopped */
+static int scan_enable(int device, int ext, int enable)
+{
+	int status;
+	struct hci_request rq;
+	le_set_scan_enable_cp scan_cp;
+	ns_le_set_ext_scan_enable_cp ext_scan_cp;
+
+	if ( ext ) {
+		memset(&ext_scan_cp, 0, sizeof(ext_scan_cp));
+		ext_scan_cp.enable 	= enable;
+		ext_scan_cp.filter_dup 	= 0x00; // Filtering disabled.
+		rq = ble_hci_request(NS_OCF_LE_SET_EXT_SCAN_ENABLE, NS_LE_SET_EXT_SCAN_ENABLE_CP_SIZE, &status, &ext_scan_cp);
+	} else {
+		memset(&scan_cp, 0, sizeof(scan_cp));
+		scan_cp.enable 		= enable;
+		scan_cp.filter_dup 	= 0x00; // Filtering disabled.
+		rq = ble_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &scan_cp);
+	}
 
-    while ( length && (p - p_adv < NS_BTM_BLE_CACHE_ADV_DATA_MAX)) {
-        NS_STREAM_TO_UINT8(adv_type, p);
+	return ns_hci_send_req(device, &rq, 1000);
+}
 
-        // if ( adv_type == type ) {
-        //     /* length doesn't include itself */
-        //     *p_length = length - 1; /* minus the length of type */
-        //     return p;
-        // }
+static void scan_stop(int device, int ext)
+{
+	if ( scan_enable(device, ext, 0x00) < 0 ) {
+		perror("Failed to disable scan.");
+	}
+}
 
-        printf("[%s][%d] LYJ@NS --------> adv_type:%d\n", __func__, __LINE__, adv_type);
-        NS_dump_data(p, length - 1);
+/* Decide how the watch list goes into the controller once the size of
+ * its accept list is known. When the list is not used scanning accepts
+ * everything and the host filter does the work. */
+static void scan_accept_plan(struct scan_adapter *sa)
+{
+	uint32_t groups;
 
-        p += length - 1; /* skip the length of data */
+	sa->accept_groups = 0;
+	sa->accept_group = 0;
+	sa->filter_policy = NS_SCAN_FILTER_ACCEPT_ALL;
+	if ( !accept_list.count || accept_policy == NS_ACCEPT_OFF ) {
+		return;
+	}
 
-        /* Break loop if advertising data is in an incorrect format,
-           as it may lead to memory overflow */
-        if (p >= p_adv + NS_BTM_BLE_CACHE_ADV_DATA_MAX) {
-            break;
-        }
+	if ( sa->accept_size <= 0 ) {
+		fprintf(stderr, "hci%d has no accept list, filtering on the host\n", sa->dev_id);
+		return;
+	}
 
-        NS_STREAM_TO_UINT8(length, p);
-    }
+	groups = (accept_list.count + sa->accept_size - 1) / sa->accept_size;
+	if ( groups > 1 && accept_policy == NS_ACCEPT_FIT ) {
+		fprintf(stderr, "hci%d accept list holds %d of %u entries, filtering on the host (see -a rotate)\n",
+			sa->dev_id, sa->accept_size, accept_list.count);
+		return;
+	}
 
-    return;
+	fprintf(stderr, "hci%d accept list: %u entries in %u group(s) of up to %d\n",
+		sa->dev_id, accept_list.count, groups, sa->accept_size);
+	sa->accept_groups = groups;
+	sa->filter_policy = NS_SCAN_FILTER_ACCEPT_LIST;
 }
 
-void parse_ext_pdu(uint8_t *data, int length) {
-    uint8_t pdu_type = data[0] & 0x0F;
-    uint8_t pdu_length = (data[0] & 0x10) ? data[1] : 0;
-    printf("PDU Type: %d\n", pdu_type);
-    printf("Length: %d\n", pdu_length);
-    printf("Data: ");
-    for (int i = 2; i < length; i++) {
-        printf("%02X ", data[i]);
-    }
-    printf("\n");
+/* Ask for the LE features and the accept list size. Extended scanning
+ * is used when the mode allows it and the controller supports it. */
+static void scan_probe(struct scan_adapter *sa, uint64_t now)
+{
+	sa->state = SCAN_ST_PROBE;
+	sa->probed = 0;
+	sa->ext = 0;
+	sa->coded = 0;
+	sa->accept_size = -1;
+	if ( scan_mode != SCAN_MODE_LEGACY &&
+	     scan_send(sa, OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES, NULL, 0, SCAN_CMD_FEATURES, now) < 0 ) {
+		scan_send_failed(sa, now);
+		return;
+	}
+	if ( accept_list.count && accept_policy != NS_ACCEPT_OFF &&
+	     scan_send(sa, OGF_LE_CTL, OCF_LE_READ_WHITE_LIST_SIZE, NULL, 0, SCAN_CMD_ACCEPT_SIZE, now) < 0 ) {
+		scan_send_failed(sa, now);
+		return;
+	}
+	if ( !sa->q.busy ) {
+		sa->probed = 1;
+		scan_accept_plan(sa);
+		scan_arm(sa, now);
+	}
 }
 
+/* HCI Reset, which also drops the LE Meta event from the host event
+ * mask, so the default mask goes back with bit 61 set */
+static void scan_reset(struct scan_adapter *sa, uint64_t now)
+{
+	set_event_mask_cp mask_cp;
+
+	ns_hci_queue_flush(&sa->q);
+	sa->state = SCAN_ST_RESET;
+	memset(&mask_cp, 0, sizeof(mask_cp));
+	memset(mask_cp.mask, 0xFF, 5);
+	mask_cp.mask[5] = 0x1F;
+	mask_cp.mask[7] = 0x20;
+	if ( scan_send(sa, OGF_HOST_CTL, OCF_RESET, NULL, 0, SCAN_CMD_RESET, now) < 0 ||
+	     scan_send(sa, OGF_HOST_CTL, OCF_SET_EVENT_MASK, &mask_cp, SET_EVENT_MASK_CP_SIZE, SCAN_CMD_EVENT_MASK, now) < 0 ) {
+		scan_send_failed(sa, now);
+	}
+}
 
-struct hci_request ble_hci_request(uint16_t ocf, int clen, void * status, void * cparam)
+/* Take the adapter down and up, the kernel initializes the controller
+ * on the way up and both sockets stay bound. A virtual controller has
+ * no adapter, a Reset is all it gets. */
+static void scan_cycle(struct scan_adapter *sa, uint64_t now)
 {
-	struct hci_request rq;
-	memset(&rq, 0, sizeof(rq));
-	rq.ogf = OGF_LE_CTL;
-	rq.ocf = ocf;
-	rq.cparam = cparam;
-	rq.clen = clen;
-	rq.rparam = status;
-	rq.rlen = 1;
-	return rq;
+	char why[80];
+
+	ns_hci_queue_flush(&sa->q);
+	if ( !ns_hci_is_raw(sa->ctl) ) {
+		scan_reset(sa, now);
+		return;
+	}
+	if ( ioctl(sa->ctl, HCIDEVDOWN, sa->dev_id) < 0 ||
+	     (ioctl(sa->ctl, HCIDEVUP, sa->dev_id) < 0 && errno != EALREADY) ) {
+		snprintf(why, sizeof(why), "can not be power cycled (%s)", strerror(errno));
+		scan_recover(sa, SCAN_STEPS, why, now);
+		return;
+	}
+	scan_probe(sa, ns_now_ms());
 }
 
-int handle_ble_adv_rpt_0(evt_le_meta_event * meta_event)
+/* Stop scanning, load the accept list group and the parameters and
+ * start again, all in one go. Stopping fails harmlessly when the
+ * controller was not scanning. The read loops see no gap but the few
+ * milliseconds the controller takes. */
+static void scan_arm(struct scan_adapter *sa, uint64_t now)
 {
-    le_advertising_info *info = (void *) (meta_event->data + 1);
-    uint8_t *data = info->data;
-    int data_length = info->length;
+	le_set_event_mask_cp event_mask_cp;
 
-    //printf("evt_type:%d\n", info->evt_type);
-    //bt_dump_all_ext_type(info->data);
-    uint8_t *adv_name = NULL;
-    uint8_t adv_name_len = 0;
-    char data_buf[256] = {0};
-    adv_name = esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_NAME_CMPL, &adv_name_len);
-    if (adv_name_len + 1 > sizeof(data_buf)) {
-        return -1;
-    }
+	sa->state = SCAN_ST_ARM;
+	if ( scan_set_enable(sa, 0x00, SCAN_CMD_OFF, now) < 0 ) {
+		goto fail;
+	}
+	if ( sa->accept_groups &&
+	     ns_accept_queue(&accept_list, &sa->q, sa->accept_group * sa->accept_size, sa->accept_size,
+			     SCAN_CMD_ACCEPT, NS_SCAN_CMD_TIMEOUT_MS, now) < 0 ) {
+		goto fail;
+	}
+	if ( (sa->ext ? scan_set_ext_params(sa, now) : scan_set_params(sa, now)) < 0 ) {
+		goto fail;
+	}
 
-    memcpy(data_buf, adv_name, adv_name_len);
+	// Set BLE events report mask.
 
-    if (adv_name_len <= 3) {
-        return -1;
-    }
+	memset(&event_mask_cp, 0xFF, sizeof(event_mask_cp));
+	if ( scan_send(sa, OGF_LE_CTL, OCF_LE_SET_EVENT_MASK, &event_mask_cp, LE_SET_EVENT_MASK_CP_SIZE,
+		       SCAN_CMD_LE_EVENT_MASK, now) < 0 ) {
+		goto fail;
+	}
 
-    #if 0
-    if (strncmp(data_buf, "MI 6", 4) != 0) {
-        return -1;
-    }
-    #endif
+	// Enable scanning.
 
-    printf("[%s][%d] LYJ@NS -------->adv_name:%s, event_type:%08X\n", __func__, __LINE__, data_buf, info->evt_type);
-    // bt_dump_all_ext_type(info->data);
+	if ( scan_set_enable(sa, 0x01, SCAN_CMD_ON, now) < 0 ) {
+		goto fail;
+	}
+	return;
 
-    uint8_t *uuid = NULL;
-    uint8_t uuid_len = 0;
-    uuid = esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_128SRV_CMPL, &uuid_len);
-    if (uuid && uuid_len) {
-        memset(data_buf, 0, sizeof(data_buf));
-        if (uuid_len + 1 < sizeof(data_buf)) {
-            memcpy(data_buf, uuid, uuid_len);
-            NS_dump_data(data_buf, uuid_len);
-        }
-    }
+fail:
+	scan_send_failed(sa, now);
+}
 
-    return 0;
+static void scan_armed(struct scan_adapter *sa, uint64_t now)
+{
+	const struct ns_scan_timing *timing = &ns_sched_levels[sa->sched.level];
+
+	sa->state = SCAN_ST_SCANNING;
+	sa->quiet_ms = now;
+	sa->events = ns_metrics_total(sa->dev_id, NS_MC_EVENTS);
+	sa->backoff_ms = NS_SCAN_RETRY_MS;
+	if ( sa->failed_ms ) {
+		fprintf(stderr, "hci%d scanning again after %llu ms\n", sa->dev_id,
+			(unsigned long long)(now - sa->failed_ms));
+		sa->failed_ms = 0;
+	} else if ( !sa->announced ) {
+		fprintf(stderr, "hci%d scanning: %s, %d%% duty cycle, %s\n", sa->dev_id,
+			!sa->ext ? "legacy" : sa->coded ? "extended on 1M and Coded" : "extended on 1M",
+			100 * timing->window / timing->interval, sa->sched.active ? "active" : "passive");
+		sa->announced = 1;
+	}
 }
 
-int handle_ble_adv_rpt_i(le_advertising_info *info)
+/* Take recovery step (or the adapter's next one, if further along).
+ * Past the last step the adapter rests for a back-off and starts over
+ * with a Reset. */
+static void scan_recover(struct scan_adapter *sa, int step, const char *why, uint64_t now)
 {
-    uint8_t *adv_name = NULL;
-    uint8_t adv_name_len = 0;
-    char data_buf[256] = {0};
-    adv_name = esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_NAME_CMPL, &adv_name_len);
-    if (adv_name_len + 1 > sizeof(data_buf)) {
-        return -1;
-    }
+	if ( step < sa->step ) {
+		step = sa->step;
+	}
+	if ( !sa->failed_ms ) {
+		sa->failed_ms = now;
+	}
 
-    memcpy(data_buf, adv_name, adv_name_len);
+	if ( step >= SCAN_STEPS ) {
+		ns_hci_queue_flush(&sa->q);
+		fprintf(stderr, "hci%d %s, retrying in %llu ms\n", sa->dev_id, why,
+			(unsigned long long)sa->backoff_ms);
+		sa->state = SCAN_ST_DOWN;
+		sa->retry_ms = now + sa->backoff_ms;
+		sa->step = SCAN_STEP_RESET;
+		sa->backoff_ms = sa->backoff_ms * 2 < NS_SCAN_RETRY_MS_MAX ? sa->backoff_ms * 2 : NS_SCAN_RETRY_MS_MAX;
+		return;
+	}
 
-    if (adv_name_len <= 3) {
-        return -1;
-    }
+	fprintf(stderr, "hci%d %s, %s\n", sa->dev_id, why, scan_step_names[step]);
+	sa->step = step + 1;
+	sa->recoveries[step]++;
+	ns_metrics_count(sa->dev_id, NS_MC_RECOVERIES);
+	switch ( step ) {
+	case SCAN_STEP_REARM:
+		ns_hci_queue_abandon(&sa->q);
+		if ( sa->probed ) {
+			scan_arm(sa, now);
+		} else {
+			scan_probe(sa, now);
+		}
+		break;
+	case SCAN_STEP_RESET:
+		scan_reset(sa, now);
+		break;
+	default:
+		scan_cycle(sa, now);
+		break;
+	}
+}
 
-    #if 0
-    if (strncmp(data_buf, "MI 6", 4) != 0) {
-        return -1;
-    }
-    #endif
+/* Result of a tagged command. Errors of the probe leave the feature at
+ * its default, a failed accept list leaves filtering to the host; any
+ * other failure or a timeout is recovered from. */
+static void scan_result(struct scan_adapter *sa, const struct ns_hci_result *r, uint64_t now)
+{
+	char why[80];
 
-    printf("[%s][%d] LYJ@NS -------->adv_name:%s, event_type:%08X\n", __func__, __LINE__, data_buf, info->evt_type);
-    // bt_dump_all_ext_type(info->data);
+	if ( r->status == NS_HCI_STATUS_TIMEOUT ) {
+		snprintf(why, sizeof(why), "command 0x%04x timed out", r->opcode);
+		scan_recover(sa, sa->step, why, now);
+		return;
+	}
 
-    uint8_t *uuid = NULL;
-    uint8_t uuid_len = 0;
-    uuid = esp_ble_resolve_adv_data(info->data, ESP_BLE_AD_TYPE_128SRV_CMPL, &uuid_len);
-    if (uuid && uuid_len) {
-        memset(data_buf, 0, sizeof(data_buf));
-        if (uuid_len + 1 < sizeof(data_buf)) {
-            memcpy(data_buf, uuid, uuid_len);
-            NS_dump_data(data_buf, uuid_len);
-        }
-    }
+	switch ( r->tag ) {
+	case SCAN_CMD_FEATURES:
+		if ( !r->status && r->len >= 8 ) {
+			sa->ext = ns_le_feature(r->ret, NS_LE_FEATURE_EXT_ADV);
+			sa->coded = ns_le_feature(r->ret, NS_LE_FEATURE_CODED_PHY);
+		}
+		break;
+	case SCAN_CMD_ACCEPT_SIZE:
+		sa->accept_size = !r->status && r->len >= 1 ? r->ret[0] : -1;
+		break;
+	case SCAN_CMD_OFF:
+		break;
+	case SCAN_CMD_ACCEPT:
+		if ( r->status ) {
+			fprintf(stderr, "hci%d failed to write the accept list (0x%02x), filtering on the host\n",
+				sa->dev_id, r->status);
+			sa->accept_groups = 0;
+			sa->filter_policy = NS_SCAN_FILTER_ACCEPT_ALL;
+			ns_hci_queue_abandon(&sa->q);
+			scan_arm(sa, now);
+			return;
+		}
+		break;
+	default:
+		if ( r->status ) {
+			snprintf(why, sizeof(why), "command 0x%04x failed (0x%02x)", r->opcode, r->status);
+			scan_recover(sa, sa->step, why, now);
+			return;
+		}
+		break;
+	}
 
-    return 0;
+	if ( sa->q.busy ) {
+		return;
+	}
+	switch ( sa->state ) {
+	case SCAN_ST_PROBE:
+		sa->probed = 1;
+		if ( !sa->ext && scan_mode == SCAN_MODE_EXT ) {
+			fprintf(stderr, "hci%d does not support extended advertising\n", sa->dev_id);
+			sa->state = SCAN_ST_OFF;
+			break;
+		}
+		scan_accept_plan(sa);
+		scan_arm(sa, now);
+		break;
+	case SCAN_ST_RESET:
+		if ( sa->probed ) {
+			scan_arm(sa, now);
+		} else {
+			scan_probe(sa, now);
+		}
+		break;
+	case SCAN_ST_ARM:
+		scan_armed(sa, now);
+		break;
+	}
 }
 
-int handle_ble_adv_rpt(evt_le_meta_event * meta_event)
+/* Events arriving keep an adapter healthy, none for its stall window
+ * re-arm it and double the window. Silence alone never goes further,
+ * the re-arm's commands failing or timing out do. */
+static void scan_watch(struct scan_adapter *sa, uint64_t now)
 {
-    uint8_t reports_count = meta_event->data[0];
-    void * offset = meta_event->data + 1;
-    le_advertising_info * info = NULL;
+	uint64_t events = ns_metrics_total(sa->dev_id, NS_MC_EVENTS);
+	char why[80];
+
+	if ( events != sa->events ) {
+		sa->events = events;
+		sa->quiet_ms = now;
+		sa->stall_ms = scan_stall_ms;
+		sa->step = SCAN_STEP_REARM;
+		return;
+	}
+	if ( !scan_stall_ms || now - sa->quiet_ms < sa->stall_ms ) {
+		return;
+	}
 
-    while ( reports_count-- ) {
-        info = (le_advertising_info *)offset;
-        char addr[18];
-        ba2str(&(info->bdaddr), addr);
-        //printf("%s - RSSI %d\n", addr, (char)info->data[info->length]);
-        offset = info->data + info->length + 2;
-        handle_ble_adv_rpt_i(info);
-    }
+	snprintf(why, sizeof(why), "no events for %llu ms", (unsigned long long)(now - sa->quiet_ms));
+	sa->stall_ms = sa->stall_ms * 2 < NS_SCAN_STALL_MS_MAX ? sa->stall_ms * 2 : NS_SCAN_STALL_MS_MAX;
+	sa->step = SCAN_STEP_REARM;
+	scan_recover(sa, SCAN_STEP_REARM, why, now);
+}
 
-    return 0;
+/* Sockets of an adapter: fd reads the advertising reports, ctl carries
+ * the commands. Returns 0, or -1 with errno set. */
+static int scan_open(struct scan_adapter *sa, int dev_id)
+{
+	struct hci_filter nf;
+	int flags;
+	int err;
+
+	memset(sa, 0, sizeof(*sa));
+	sa->dev_id = dev_id;
+	sa->ctl = -1;
+	sa->fd = scan_open_dev(dev_id);
+	if ( sa->fd < 0 ) {
+		return -1;
+	}
+
+	// Get Results.
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+	if ( ns_hci_set_filter(sa->fd, &nf) < 0 ) {
+		goto fail;
+	}
+
+	sa->ctl = scan_open_dev(dev_id);
+	if ( sa->ctl < 0 ) {
+		goto fail;
+	}
+	flags = fcntl(sa->ctl, F_GETFL, 0);
+	if ( flags < 0 || fcntl(sa->ctl, F_SETFL, flags | O_NONBLOCK) < 0 ||
+	     ns_hci_queue_init(&sa->q, sa->ctl) < 0 ) {
+		goto fail;
+	}
+
+	sa->accept_size = -1;
+	sa->stall_ms = scan_stall_ms;
+	sa->backoff_ms = NS_SCAN_RETRY_MS;
+	return 0;
+
+fail:
+	err = errno;
+	hci_close_dev(sa->fd);
+	if ( sa->ctl >= 0 ) {
+		hci_close_dev(sa->ctl);
+	}
+	errno = err;
+	return -1;
 }
 
-int handle_ble_scan(const char *buf, int len)
+static void scan_close(struct scan_adapter *sa)
 {
-	evt_le_meta_event * meta_event;
-	le_advertising_info * info;
+	hci_close_dev(sa->fd);
+	hci_close_dev(sa->ctl);
+}
+
+struct scan_control {
+	struct scan_adapter *adapters;
+	int count;
+	int sched;              /* adaptive scan schedule on */
+	atomic_int stop;
+	uint64_t next_watch;
+	uint64_t next_rotate;
+	uint64_t next_epoch;
+};
+
+/* Commands of an adapter completed, or not */
+static void scan_commands(struct scan_adapter *sa, uint64_t now)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	struct ns_hci_result r;
+	char why[80];
+	int len;
 
-    if ( len >= HCI_EVENT_HDR_SIZE ) {
-        meta_event = (evt_le_meta_event*)(buf + HCI_EVENT_HDR_SIZE+1);
-        // printf("[%s][%d] LYJ@NS -------->event_type:%08X\n", __func__, __LINE__, meta_event->subevent);
-        if ( meta_event->subevent == EVT_LE_ADVERTISING_REPORT ) {
-            handle_ble_adv_rpt(meta_event);
-        }
-    }
-    return 0;
+	while ( (len = read(sa->ctl, buf, sizeof(buf))) > 0 ) {
+		switch ( ns_hci_queue_event(&sa->q, buf, len, now, &r) ) {
+		case NS_HCI_EV_DONE:
+			scan_result(sa, &r, now);
+			break;
+		case NS_HCI_EV_HW_ERROR:
+			snprintf(why, sizeof(why), "hardware error 0x%02x", r.status);
+			scan_recover(sa, SCAN_STEP_RESET, why, now);
+			break;
+		case NS_HCI_EV_OTHER:
+			if ( sa->state == SCAN_ST_SCANNING &&
+			     (r.opcode == cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE) ||
+			      r.opcode == cmd_opcode_pack(OGF_LE_CTL, NS_OCF_LE_SET_EXT_SCAN_ENABLE)) ) {
+				scan_recover(sa, SCAN_STEP_REARM, "scanning changed by another host", now);
+			}
+			break;
+		}
+		if ( sa->state == SCAN_ST_OFF ) {
+			return;
+		}
+	}
+	if ( len == 0 || (errno != EAGAIN && errno != EINTR) ) {
+		fprintf(stderr, "hci%d control socket closed, no more recovery\n", sa->dev_id);
+		sa->state = SCAN_ST_OFF;
+		return;
+	}
+
+	while ( ns_hci_queue_expire(&sa->q, now, &r) ) {
+		if ( r.tag != NS_HCI_TAG_NONE ) {
+			scan_result(sa, &r, now);
+		}
+	}
 }
 
-int main()
+/* One round of the supervisor: wait up to wait_ms for command events or
+ * the nearest deadline, then handle results, timeouts, stalls, retries,
+ * accept list rotation and the scan schedule. */
+static void scan_supervise(struct scan_control *sc, int wait_ms)
 {
-	int ret, status;
+	struct pollfd pfds[NS_ADAPTERS_MAX];
+	struct scan_adapter *sa;
+	uint64_t now, wake;
+	int rotate, epoch, swap, params;
+	int i;
+
+	now = ns_now_ms();
+	wake = now + wait_ms;
+	if ( sc->next_watch < wake ) {
+		wake = sc->next_watch;
+	}
+	if ( accept_policy == NS_ACCEPT_ROTATE && sc->next_rotate < wake ) {
+		wake = sc->next_rotate;
+	}
+	if ( sc->sched && sc->next_epoch < wake ) {
+		wake = sc->next_epoch;
+	}
+	for ( i = 0; i < sc->count; i++ ) {
+		sa = &sc->adapters[i];
+		pfds[i].fd = sa->state == SCAN_ST_OFF ? -1 : sa->ctl;
+		pfds[i].events = POLLIN;
+		pfds[i].revents = 0;
+		if ( ns_hci_queue_deadline(&sa->q) && ns_hci_queue_deadline(&sa->q) < wake ) {
+			wake = ns_hci_queue_deadline(&sa->q);
+		}
+		if ( sa->state == SCAN_ST_DOWN && sa->retry_ms < wake ) {
+			wake = sa->retry_ms;
+		}
+	}
+	poll(pfds, sc->count, wake > now ? (int)(wake - now) : 0);
+	now = ns_now_ms();
 
-	int device = hci_open_dev(1);
-	if ( device < 0 ) {
-		device = hci_open_dev(0);
-		if (device >= 0) {
-			printf("Using hci0\n");
+	for ( i = 0; i < sc->count; i++ ) {
+		sa = &sc->adapters[i];
+		if ( sa->state == SCAN_ST_OFF ) {
+			continue;
+		}
+		scan_commands(sa, now);
+		if ( sa->state == SCAN_ST_DOWN && now >= sa->retry_ms ) {
+			scan_recover(sa, SCAN_STEP_RESET, "was down", now);
 		}
 	}
-	else {
-		printf("Using hci1\n");
+
+	if ( now >= sc->next_watch ) {
+		sc->next_watch = now + NS_SCAN_WATCH_MS;
+		for ( i = 0; i < sc->count; i++ ) {
+			if ( sc->adapters[i].state == SCAN_ST_SCANNING ) {
+				scan_watch(&sc->adapters[i], now);
+			}
+		}
 	}
 
-	if ( device < 0 ) {
-		perror("Failed to open HCI device.");
-		return 0;
+	rotate = accept_policy == NS_ACCEPT_ROTATE && now >= sc->next_rotate;
+	if ( rotate ) {
+		sc->next_rotate = now + accept_rotate_ms;
+	}
+	epoch = sc->sched && now >= sc->next_epoch;
+	if ( epoch ) {
+		sc->next_epoch = now + NS_SCHED_EPOCH_MS;
+	}
+	if ( !rotate && !epoch ) {
+		return;
 	}
 
-	// Set BLE scan parameters.
+	/* The list and the parameters can only change while scanning is off */
+	for ( i = 0; i < sc->count; i++ ) {
+		sa = &sc->adapters[i];
+		if ( sa->state != SCAN_ST_SCANNING ) {
+			continue;
+		}
+		swap = rotate && sa->accept_groups > 1;
+		params = epoch && ns_sched_step(&sa->sched, &scan_load.adapters[sa->dev_id], now);
+		if ( params ) {
+			fprintf(stderr, "hci%d scan schedule: %d%% duty cycle, %s\n", sa->dev_id,
+				100 * ns_sched_levels[sa->sched.level].window / ns_sched_levels[sa->sched.level].interval,
+				sa->sched.active ? "active" : "passive");
+		}
+		if ( swap ) {
+			sa->accept_group = (sa->accept_group + 1) % sa->accept_groups;
+		}
+		if ( swap || params ) {
+			scan_arm(sa, now);
+		}
+	}
+}
 
-	le_set_scan_parameters_cp scan_params_cp;
-	memset(&scan_params_cp, 0, sizeof(scan_params_cp));
-	scan_params_cp.type 			= 0x00;
-	scan_params_cp.interval 		= htobs(0x0010);
-	scan_params_cp.window 			= htobs(0x0010);
-	scan_params_cp.own_bdaddr_type 	= 0x00; // Public Device Address (default).
-	//scan_params_cp.own_bdaddr_type 	= LE_RANDOM_ADDRESS; // RANDOM 
-	scan_params_cp.filter 			= 0x00; // Accept all.
+/* Bring all adapters up at once, until each one scans, was given up on
+ * or NS_SCAN_BRINGUP_MS passed */
+static void scan_bringup(struct scan_control *sc)
+{
+	uint64_t now = ns_now_ms();
+	uint64_t end = now + NS_SCAN_BRINGUP_MS;
+	int pending;
+	int i;
+
+	sc->next_watch = now + NS_SCAN_WATCH_MS;
+	sc->next_rotate = now + accept_rotate_ms;
+	sc->next_epoch = now + NS_SCHED_EPOCH_MS;
+	for ( i = 0; i < sc->count; i++ ) {
+		scan_probe(&sc->adapters[i], now);
+	}
+
+	while ( now < end ) {
+		pending = 0;
+		for ( i = 0; i < sc->count; i++ ) {
+			pending |= sc->adapters[i].state == SCAN_ST_PROBE || sc->adapters[i].state == SCAN_ST_RESET ||
+				   sc->adapters[i].state == SCAN_ST_ARM;
+		}
+		if ( !pending ) {
+			break;
+		}
+		scan_supervise(sc, (int)(end - now));
+		now = ns_now_ms();
+	}
+}
 
-	struct hci_request scan_params_rq = ble_hci_request(OCF_LE_SET_SCAN_PARAMETERS, LE_SET_SCAN_PARAMETERS_CP_SIZE, &status, &scan_params_cp);
+/* Keeps the adapters scanning, see scan_supervise(). Runs on their
+ * control sockets, the read loops never see the command events. */
+static void *scan_control_thread(void *arg)
+{
+	struct scan_control *sc = arg;
 
-	ret = hci_send_req(device, &scan_params_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to set scan parameters data.");
-		return 0;
+	while ( !atomic_load(&sc->stop) ) {
+		scan_supervise(sc, NS_SCAN_WATCH_MS);
 	}
+	return NULL;
+}
 
-    printf("OCF_LE_SET_SCAN_PARAMETERS status:%d\n", status);
+struct adapter_list {
+	int ids[NS_ADAPTERS_MAX];
+	int count;
+};
 
+static int collect_adapter(int dd, int dev_id, long arg)
+{
+	struct adapter_list *list = (struct adapter_list *)arg;
 
-	// Set BLE events report mask.
+	(void)dd;
+	if ( dev_id >= NS_ADAPTERS_MAX ) {
+		fprintf(stderr, "Skipping hci%d, only hci0..hci%d are supported\n", dev_id, NS_ADAPTERS_MAX - 1);
+	} else if ( list->count < NS_ADAPTERS_MAX ) {
+		list->ids[list->count++] = dev_id;
+	}
+	return 0;
+}
 
-	le_set_event_mask_cp event_mask_cp;
-	memset(&event_mask_cp, 0, sizeof(le_set_event_mask_cp));
-	int i = 0;
-	for ( i = 0 ; i < 8 ; i++ ) event_mask_cp.mask[i] = 0xFF;
+/* "all" or a comma separated list of hci dev_ids */
+static int parse_adapters(const char *arg, struct adapter_list *list)
+{
+	char *end;
+	long id;
+	int i;
+
+	memset(list, 0, sizeof(*list));
+	if ( !strcmp(arg, "all") ) {
+		hci_for_each_dev(HCI_UP, collect_adapter, (long)list);
+		return list->count ? 0 : -1;
+	}
 
-	struct hci_request set_mask_rq = ble_hci_request(OCF_LE_SET_EVENT_MASK, LE_SET_EVENT_MASK_CP_SIZE, &status, &event_mask_cp);
-	ret = hci_send_req(device, &set_mask_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to set event mask.");
-		return 0;
+	while ( *arg ) {
+		id = strtol(arg, &end, 10);
+		if ( end == arg || id < 0 || id >= NS_ADAPTERS_MAX || list->count == NS_ADAPTERS_MAX ) {
+			return -1;
+		}
+		for ( i = 0; i < list->count && list->ids[i] != id; i++ )
+			;
+		if ( i == list->count ) {
+			list->ids[list->count++] = (int)id;
+		}
+		if ( *end == ',' ) {
+			end++;
+		} else if ( *end ) {
+			return -1;
+		}
+		arg = end;
 	}
 
-    printf("OCF_LE_SET_EVENT_MASK status:%d\n", status);
+	return list->count ? 0 : -1;
+}
 
-	// Enable scanning.
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -i <list>     adapters to scan on: all (every adapter that is up) or dev_ids\n");
+	printf("                like 0,1 (default hci1, falling back to hci0)\n");
+	printf("  -e <mode>     auto (default) scans for extended advertising where the\n");
+	printf("                controller supports it, legacy never does, ext requires it\n");
+	printf("  -m <expr>     only report devices matching expr, e.g.\n");
+	printf("                'name^=\"MI \" | mfr=004c:0215 & rssi>=-80' (see filter.h)\n");
+	printf("  -M <file>     read the filter from file, one expression per line, OR-ed\n");
+	printf("  -a <policy>   when the filter only accepts known addresses, let the controller\n");
+	printf("                drop the others with its accept list: fit (default) if the list\n");
+	printf("                holds them all, rotate[,<ms>] swaps groups of a longer list every\n");
+	printf("                ms (default %d), off leaves all filtering to the host\n", NS_ACCEPT_ROTATE_MS_DEFAULT);
+	printf("  -S            adapt scan interval, window and active scanning to the load:\n");
+	printf("                lower duty cycle while quiet, full when devices arrive, short\n");
+	printf("                active bursts for watched devices missing a scan response\n");
+	printf("  -W <ms>       re-arm scanning on an adapter that read no events for ms\n");
+	printf("                (default %d, doubling while it stays quiet up to %d; 0 never).\n",
+	       NS_SCAN_STALL_MS_DEFAULT, NS_SCAN_STALL_MS_MAX);
+	printf("                A quiet adapter is only re-armed, never reset or power cycled:\n");
+	printf("                that takes failed or timed out commands, a hardware error or\n");
+	printf("                scanning turned off, with or without -W\n");
+	printf("  -b <events>   max HCI events handled per batch (default %d, max %d)\n",
+	       NS_SCAN_BATCH_DEFAULT, NS_SCAN_BATCH_MAX);
+	printf("  -l <ms>       max time a partial batch waits for more events (default %d)\n",
+	       NS_SCAN_LATENCY_DEFAULT);
+	printf("  -r <file>     replay a btsnoop or raw HCI capture instead of scanning\n");
+	printf("  -t <rate>     replay timing: 0 as fast as possible (default), 1 original,\n");
+	printf("                2 twice as fast, ...\n");
+	printf("  -D <devices>|<MB>M[,<s>]  devices tracked in the device table (default %d,\n",
+	       NS_DEVTAB_DEVICES_DEFAULT);
+	printf("                0 disables) or as many as fit MB; when full the coldest devices\n");
+	printf("                make room, with s those not heard for s seconds leave\n");
+	printf("  -d            print the device table to stderr on exit, SIGUSR1 prints it any time\n");
+	printf("  -s <dB>,<ms>  only print a device again when its payload changes, its smoothed\n");
+	printf("                RSSI moves by dB or ms passed since it was last printed\n");
+	printf("                (e.g. -s %d,%d, 0 turns a condition off)\n",
+	       NS_SUPPRESS_RSSI_DELTA_DEFAULT, NS_SUPPRESS_HEARTBEAT_DEFAULT);
+	printf("  -f <format>   output format: text (default), json or binary\n");
+	printf("  -F <bytes>,<ms>  flush output once bytes are pending or the oldest record\n");
+	printf("                is ms old (default %d,%d)\n", NS_OUT_FLUSH_BYTES_DEFAULT, NS_OUT_FLUSH_MS_DEFAULT);
+	printf("  -w <workers>  run the threaded pipeline with this many parse workers (max %d)\n",
+	       NS_PIPE_WORKERS_MAX);
+	printf("  -q <slots>    pipeline event ring size (default %d)\n", NS_PIPE_SLOTS_DEFAULT);
+	printf("  -p <policy>   pipeline backpressure when the output stalls: drop (default)\n");
+	printf("                drops records, block makes the reader drop events\n");
+	printf("  -P <path>     serve metrics in the Prometheus text format on a Unix socket,\n");
+	printf("                e.g. socat - UNIX-CONNECT:<path>; SIGUSR2 prints them to stderr\n");
+	printf("  -L <dir>[,<MB>[,<n>]]  append every printed sighting to a memory-mapped log in\n");
+	printf("                dir, a ring of n segments of MB each per writer (default %d,%d),\n",
+	       NS_LOG_SEG_SIZE_DEFAULT >> 20, NS_LOG_SEGMENTS_DEFAULT);
+	printf("                read it back with logread\n");
+	printf("  -G <name>     publish the device table in POSIX shared memory (e.g. %s)\n",
+	       NS_SHM_NAME_DEFAULT);
+	printf("                for other processes, read it with shmread\n");
+	printf("  -X <file.so>  load a payload decoder plugin (exports %s), may repeat\n",
+	       NS_DECODE_PLUGIN_INIT);
+	printf("  -R <file>     resolve private addresses with the IRKs in file, one\n");
+	printf("                <32 hex digits> [<identity addr>[,<type>]] [<label>] per line\n");
+	printf("  -V <spec>     scan virtual controllers instead of adapters (hci0 or those of -i),\n");
+	printf("                spec is key=value,...: devices=<n> (default %d), rate=<reports/s>\n",
+	       NS_VHCI_DEVICES_DEFAULT);
+	printf("                (default %d, 0 as fast as they are read), per=<reports per event>,\n",
+	       NS_VHCI_RATE_DEFAULT);
+	printf("                count=<reports>, time=<s>, ext=1, seed=<n> and\n");
+	printf("                mix=<kind>:<weight>/... of flags, name, uuid128, ibeacon, eddystone,\n");
+	printf("                mfg and long (see vhci.h); stall=<ms> and wedge=<ms> inject faults\n");
+	printf("  -h            show this help\n");
+}
 
-	le_set_scan_enable_cp scan_cp;
-	memset(&scan_cp, 0, sizeof(scan_cp));
-	scan_cp.enable 		= 0x01;	// Enable flag.
-	scan_cp.filter_dup 	= 0x00; // Filtering disabled.
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	int i;
+	struct adapter_list selected;
+	struct scan_adapter adapters[NS_ADAPTERS_MAX];
+	int count = 0;
+	int adaptive = 0;
+	const char *metrics_path = NULL;
+	const char *log_dir = NULL;
+	const char *shm_name = NULL;
+	uint64_t log_seg_size = NS_LOG_SEG_SIZE_DEFAULT;
+	int log_segments = NS_LOG_SEGMENTS_DEFAULT;
+	sigset_t metrics_signals;
+	int metrics_fd;
+	const char *filter_expr = NULL;
+	const char *filter_path = NULL;
+	char filter_err[256];
+	int batch_max = NS_SCAN_BATCH_DEFAULT;
+	int latency_ms = NS_SCAN_LATENCY_DEFAULT;
+	const char *replay_path = NULL;
+	double replay_rate = 0;
+	long max_devices = NS_DEVTAB_DEVICES_DEFAULT;
+	uint64_t devtab_budget = 0;
+	long devtab_age_s = 0;
+	int devtab_shards;
+	int dump_on_exit = 0;
+	struct ns_suppress suppress;
+	int suppress_on = 0;
+	enum ns_out_format out_format = NS_OUT_TEXT;
+	unsigned long flush_bytes = NS_OUT_FLUSH_BYTES_DEFAULT;
+	unsigned int flush_ms = NS_OUT_FLUSH_MS_DEFAULT;
+	struct ns_pipeline_cfg pipe_cfg;
+	struct ns_vhci_cfg vhci_cfg;
+
+	memset(&selected, 0, sizeof(selected));
+	memset(&pipe_cfg, 0, sizeof(pipe_cfg));
+	pipe_cfg.slots = NS_PIPE_SLOTS_DEFAULT;
+	pipe_cfg.policy = NS_BP_DROP;
+
+	while ( (opt = getopt(argc, argv, "i:e:m:M:a:SW:P:X:R:L:G:V:b:l:r:t:D:ds:f:F:w:q:p:h")) != -1 ) {
+		switch (opt) {
+		case 'i':
+			if ( parse_adapters(optarg, &selected) < 0 ) {
+				fprintf(stderr, "No usable adapter in %s, give all or dev_ids 0..%d\n",
+					optarg, NS_ADAPTERS_MAX - 1);
+				return 1;
+			}
+			break;
+		case 'e':
+			if ( !strcmp(optarg, "auto") ) {
+				scan_mode = SCAN_MODE_AUTO;
+			} else if ( !strcmp(optarg, "legacy") ) {
+				scan_mode = SCAN_MODE_LEGACY;
+			} else if ( !strcmp(optarg, "ext") ) {
+				scan_mode = SCAN_MODE_EXT;
+			} else {
+				fprintf(stderr, "Scan mode must be auto, legacy or ext\n");
+				return 1;
+			}
+			break;
+		case 'm':
+			filter_expr = optarg;
+			break;
+		case 'M':
+			filter_path = optarg;
+			break;
+		case 'a':
+			if ( !strcmp(optarg, "off") ) {
+				accept_policy = NS_ACCEPT_OFF;
+			} else if ( !strcmp(optarg, "fit") ) {
+				accept_policy = NS_ACCEPT_FIT;
+			} else if ( !strncmp(optarg, "rotate", 6) && (!optarg[6] ||
+				    (optarg[6] == ',' && (accept_rotate_ms = atoi(optarg + 7)) > 0)) ) {
+				accept_policy = NS_ACCEPT_ROTATE;
+			} else {
+				fprintf(stderr, "Accept list policy must be off, fit or rotate[,<ms>]\n");
+				return 1;
+			}
+			break;
+		case 'S':
+			adaptive = 1;
+			break;
+		case 'W':
+			if ( atoi(optarg) < 0 ) {
+				fprintf(stderr, "Stall time must be >= 0\n");
+				return 1;
+			}
+			scan_stall_ms = atoi(optarg);
+			break;
+		case 'P':
+			metrics_path = optarg;
+			break;
+		case 'L': {
+			char *opt_mb = strchr(optarg, ',');
+			char *opt_n = NULL;
+			log_dir = optarg;
+			if ( opt_mb ) {
+				*opt_mb++ = '\0';
+				opt_n = strchr(opt_mb, ',');
+				if ( opt_n ) {
+					*opt_n++ = '\0';
+				}
+				log_seg_size = (uint64_t)atoi(opt_mb) << 20;
+			}
+			if ( opt_n ) {
+				log_segments = atoi(opt_n);
+			}
+			if ( !*log_dir || log_seg_size < NS_LOG_SEG_SIZE_MIN || log_seg_size > UINT32_MAX ||
+			     log_segments < 1 ) {
+				fprintf(stderr, "Sighting log must be <dir>[,<MB 1..4095>[,<segments >= 1>]]\n");
+				return 1;
+			}
+			break;
+		}
+		case 'G':
+			shm_name = optarg;
+			break;
+		case 'X':
+			if ( ns_decode_load(optarg) < 0 ) {
+				return 1;
+			}
+			break;
+		case 'R':
+			if ( ns_irk_load(&irk_list, optarg, filter_err, sizeof(filter_err)) < 0 ) {
+				fprintf(stderr, "Bad IRK file: %s\n", filter_err);
+				return 1;
+			}
+			break;
+		case 'V':
+			if ( ns_vhci_parse(&vhci_cfg, optarg, filter_err, sizeof(filter_err)) < 0 ) {
+				fprintf(stderr, "Bad virtual controller: %s\n", filter_err);
+				return 1;
+			}
+			vhci_on = 1;
+			break;
+		case 'b':
+			batch_max = atoi(optarg);
+			if ( batch_max < 1 || batch_max > NS_SCAN_BATCH_MAX ) {
+				fprintf(stderr, "Batch size must be 1..%d\n", NS_SCAN_BATCH_MAX);
+				return 1;
+			}
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			if ( latency_ms < 0 ) {
+				fprintf(stderr, "Latency bound must be >= 0\n");
+				return 1;
+			}
+			break;
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 't':
+			replay_rate = atof(optarg);
+			if ( replay_rate < 0 ) {
+				fprintf(stderr, "Replay rate must be >= 0\n");
+				return 1;
+			}
+			break;
+		case 'D': {
+			char *end;
+			max_devices = strtol(optarg, &end, 10);
+			if ( *end == 'M' ) {
+				devtab_budget = (uint64_t)max_devices << 20;
+				end++;
+			}
+			if ( *end == ',' ) {
+				devtab_age_s = strtol(end + 1, &end, 10);
+			}
+			if ( *end || end == optarg || max_devices < 0 || devtab_age_s < 0 ) {
+				fprintf(stderr, "Device table must be given as <devices>|<MB>M[,<max age s>]\n");
+				return 1;
+			}
+			break;
+		}
+		case 'd':
+			dump_on_exit = 1;
+			break;
+		case 's':
+			memset(&suppress, 0, sizeof(suppress));
+			if ( sscanf(optarg, "%d,%u", &suppress.rssi_delta, &suppress.heartbeat_ms) != 2 ||
+			     suppress.rssi_delta < 0 ) {
+				fprintf(stderr, "Suppression must be given as <dB>,<ms>\n");
+				return 1;
+			}
+			suppress_on = 1;
+			break;
+		case 'f':
+			if ( ns_out_parse_format(optarg, &out_format) < 0 ) {
+				fprintf(stderr, "Unknown output format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'F':
+			if ( sscanf(optarg, "%lu,%u", &flush_bytes, &flush_ms) != 2 ) {
+				fprintf(stderr, "Flush thresholds must be given as <bytes>,<ms>\n");
+				return 1;
+			}
+			break;
+		case 'w':
+			pipe_cfg.workers = atoi(optarg);
+			if ( pipe_cfg.workers < 1 || pipe_cfg.workers > NS_PIPE_WORKERS_MAX ) {
+				fprintf(stderr, "Workers must be 1..%d\n", NS_PIPE_WORKERS_MAX);
+				return 1;
+			}
+			break;
+		case 'q':
+			pipe_cfg.slots = atoi(optarg);
+			break;
+		case 'p':
+			if ( !strcmp(optarg, "drop") ) {
+				pipe_cfg.policy = NS_BP_DROP;
+			} else if ( !strcmp(optarg, "block") ) {
+				pipe_cfg.policy = NS_BP_BLOCK;
+			} else {
+				fprintf(stderr, "Backpressure policy must be drop or block\n");
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
-	struct hci_request enable_adv_rq = ble_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &scan_cp);
+	if ( ns_out_init(&out, STDOUT_FILENO, out_format) < 0 ) {
+		fprintf(stderr, "Failed to allocate output buffers\n");
+		return 1;
+	}
+	out.flush_bytes = flush_bytes;
+	out.flush_ms = flush_ms;
+	handle_ble_set_output(&out);
 
-	ret = hci_send_req(device, &enable_adv_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to enable scan.");
-		return 0;
+	if ( filter_expr && filter_path ) {
+		fprintf(stderr, "Give the filter with -m or -M, not both\n");
+		return 1;
 	}
+	if ( filter_expr || filter_path ) {
+		ret = filter_expr ? ns_filter_compile(&filter, filter_expr, filter_err, sizeof(filter_err)) :
+				    ns_filter_load(&filter, filter_path, filter_err, sizeof(filter_err));
+		if ( ret < 0 ) {
+			fprintf(stderr, "Bad filter: %s\n", filter_err);
+			return 1;
+		}
+		fprintf(stderr, "Filter: %u instructions, %s matching\n", filter.len, ns_match_impl());
+		handle_ble_set_filter(&filter);
 
-	// Get Results.
+		if ( ns_accept_init(&accept_list, &filter) < 0 ) {
+			fprintf(stderr, "Failed to allocate the accept list\n");
+			return 1;
+		}
+	}
 
-	struct hci_filter nf;
-	hci_filter_clear(&nf);
-	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
-	if ( setsockopt(device, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0 ) {
-		hci_close_dev(device);
-		perror("Could not set socket options\n");
-		return 0;
+	/* SIGUSR2 is taken by the metrics thread, block it before any thread starts */
+	sigemptyset(&metrics_signals);
+	sigaddset(&metrics_signals, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &metrics_signals, NULL);
+	metrics_fd = signalfd(-1, &metrics_signals, SFD_CLOEXEC);
+	if ( ns_metrics_start(metrics_path, metrics_fd) < 0 ) {
+		fprintf(stderr, "Failed to serve metrics on %s: %s\n", metrics_path ? metrics_path : "SIGUSR2", strerror(errno));
+		return 1;
 	}
 
+	if ( irk_list.count ) {
+		fprintf(stderr, "IRKs: %u keys, %s AES\n", irk_list.count, ns_rpa_impl());
+		pipe_cfg.irks = &irk_list;
+		/* Watched identities advertise under RPAs the controller can not match */
+		if ( accept_list.count && accept_policy != NS_ACCEPT_OFF ) {
+			fprintf(stderr, "Private addresses resolve on the host, accept list off\n");
+			accept_policy = NS_ACCEPT_OFF;
+		}
+		if ( !pipe_cfg.workers ) {
+			if ( ns_rpa_init(&rpa_cache, &irk_list, NS_RPA_CACHE_DEFAULT) < 0 ) {
+				fprintf(stderr, "Failed to allocate the private address cache\n");
+				return 1;
+			}
+			handle_ble_set_rpa(&rpa_cache);
+		}
+	}
 
-	uint8_t buf[HCI_MAX_EVENT_SIZE];
-	int len;
+	if ( adaptive ) {
+		handle_ble_set_sched(&scan_load);
+		pipe_cfg.sched = &scan_load;
+	}
 
-	while (1) {
-		len = read(device, buf, sizeof(buf));
-		if ( len >= HCI_EVENT_HDR_SIZE ) {
-            hci_event_hdr *hdr = (hci_event_hdr *) buf;
-            // byte order
-            // printf("[%s][%d] LYJ@NS -------->hci hdr type:%02X==%02X, plen:%d\n", __func__, __LINE__, hdr->plen, EVT_LE_META_EVENT, hdr->evt);
-            handle_ble_scan(buf, len);
+	if ( !pipe_cfg.workers ) {
+		if ( ns_extadv_init(&extadv, NS_EXTADV_CHAINS_DEFAULT) < 0 ) {
+			fprintf(stderr, "Failed to allocate extended advertising buffers\n");
+			return 1;
 		}
+		handle_ble_set_extadv(&extadv);
 	}
 
-	memset(&scan_cp, 0, sizeof(scan_cp));
-	scan_cp.enable = 0x00;	// Disable flag.
+	if ( log_dir && !pipe_cfg.workers ) {
+		if ( ns_log_open(&sight_log, log_dir, 0, log_seg_size, log_segments) < 0 ) {
+			fprintf(stderr, "Failed to open the sighting log in %s: %s\n", log_dir, strerror(errno));
+			return 1;
+		}
+		handle_ble_set_log(&sight_log);
+	}
 
-	struct hci_request disable_adv_rq = ble_hci_request(OCF_LE_SET_SCAN_ENABLE, LE_SET_SCAN_ENABLE_CP_SIZE, &status, &scan_cp);
-	ret = hci_send_req(device, &disable_adv_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to disable scan.");
-		return 0;
+	/* A budget is split evenly, every shard gets what fits its part */
+	devtab_shards = pipe_cfg.workers ? pipe_cfg.workers : 1;
+	if ( devtab_budget && max_devices ) {
+		max_devices = (long)ns_devtab_fit(devtab_budget / devtab_shards) * devtab_shards;
+		if ( !max_devices ) {
+			fprintf(stderr, "A device table needs at least %llu KB per shard\n",
+				(unsigned long long)(ns_devtab_size(1) >> 10));
+			return 1;
+		}
+	}
+	if ( max_devices ) {
+		fprintf(stderr, "Device table: %ld devices in %.1f MB", max_devices,
+			ns_devtab_size((max_devices + devtab_shards - 1) / devtab_shards) * devtab_shards / 1048576.0);
+		if ( devtab_age_s ) {
+			fprintf(stderr, ", age-out after %ld s", devtab_age_s);
+		}
+		fputc('\n', stderr);
+	}
+	pipe_cfg.max_age_ms = (uint64_t)devtab_age_s * 1000;
+
+	/* Pipeline workers keep their own shards */
+	if ( max_devices && !pipe_cfg.workers ) {
+		if ( ns_devtab_init(&devtab, max_devices) < 0 ) {
+			fprintf(stderr, "Failed to allocate device table for %ld devices (at most %u)\n",
+				max_devices, NS_DEVTAB_DEVICES_MAX);
+			return 1;
+		}
+		devtab.max_age_ms = (uint64_t)devtab_age_s * 1000;
+		handle_ble_set_devtab(&devtab);
+		if ( shm_name ) {
+			if ( ns_shm_create(&dev_shm, shm_name, 1, devtab.mask + 1) < 0 ) {
+				fprintf(stderr, "Failed to create shared memory %s: %s\n", shm_name, strerror(errno));
+				return 1;
+			}
+			handle_ble_set_shm(&dev_shm);
+		}
+	}
+
+	if ( shm_name && !max_devices ) {
+		fprintf(stderr, "Publishing device state needs the device table, drop -D 0\n");
+		return 1;
 	}
 
-	hci_close_dev(device);
+	if ( suppress_on ) {
+		if ( !max_devices ) {
+			fprintf(stderr, "Suppression needs the device table, drop -D 0\n");
+			return 1;
+		}
+		handle_ble_set_suppress(&suppress);
+	}
+
+	if ( pipe_cfg.workers ) {
+		pipe_cfg.max_devices = max_devices;
+		pipe_cfg.suppress = suppress_on ? &suppress : NULL;
+		pipe_cfg.filter = filter.prog ? &filter : NULL;
+		pipe_cfg.out_fd = STDOUT_FILENO;
+		pipe_cfg.format = out_format;
+		pipe_cfg.flush_bytes = flush_bytes;
+		pipe_cfg.flush_ms = flush_ms;
+		pipe_cfg.log_dir = log_dir;
+		pipe_cfg.log_seg_size = log_seg_size;
+		pipe_cfg.log_segments = log_segments;
+		pipe_cfg.shm_name = shm_name;
+		pipeline = ns_pipeline_start(&pipe_cfg);
+		if ( !pipeline ) {
+			fprintf(stderr, "Failed to start the pipeline\n");
+			return 1;
+		}
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if ( replay_path ) {
+		struct ns_replay_stats rs;
+
+		ret = ns_replay_file(replay_path, replay_rate,
+				     pipeline ? replay_to_pipeline : handle_ble_scan_from, &rs);
+		if ( pipeline ) {
+			pipeline_finish();
+		}
+		ns_out_flush(&out);
+		log_finish();
+		rpa_finish();
+		ns_shm_close(&dev_shm);
+		if ( dump_on_exit ) {
+			devtab_dump_requested = 1;
+		}
+		devtab_dump_if_requested();
+		fprintf(stderr, "replay: %llu records, %llu events, %llu bytes in %.3f ms (%.0f events/s)\n",
+			(unsigned long long)rs.records, (unsigned long long)rs.events,
+			(unsigned long long)rs.bytes, rs.elapsed_ns / 1e6,
+			rs.elapsed_ns ? rs.events * 1e9 / rs.elapsed_ns : 0.0);
+		return ret < 0 ? 1 : 0;
+	}
+
+	if ( vhci_on ) {
+		if ( !selected.count ) {
+			selected.ids[selected.count++] = 0;
+		}
+		for ( i = 0; i < selected.count; i++ ) {
+			if ( ns_vhci_open(&vhci[selected.ids[i]], &vhci_cfg, selected.ids[i]) < 0 ) {
+				fprintf(stderr, "Failed to set up virtual hci%d: %s\n", selected.ids[i], strerror(errno));
+				return 1;
+			}
+		}
+		fprintf(stderr, "Virtual controllers: %u devices, %u reports/s, up to %u per event\n",
+			vhci_cfg.devices, vhci_cfg.rate, vhci_cfg.per_event);
+	}
+
+	if ( selected.count ) {
+		for ( i = 0; i < selected.count; i++ ) {
+			if ( scan_open(&adapters[count], selected.ids[i]) < 0 ) {
+				fprintf(stderr, "Failed to open hci%d: %s\n", selected.ids[i], strerror(errno));
+				continue;
+			}
+			count++;
+		}
+	} else if ( scan_open(&adapters[0], 1) == 0 || scan_open(&adapters[0], 0) == 0 ) {
+		count = 1;
+	} else {
+		perror("Failed to open HCI device.");
+		return 1;
+	}
+
+	/* An adapter that did not come up stays with the supervisor, which
+	 * retries it after a back-off; only one that can not scan as asked
+	 * is left out */
+	struct scan_control control;
+	pthread_t control_tid;
+	int controlling;
+	memset(&control, 0, sizeof(control));
+	control.adapters = adapters;
+	control.count = count;
+	control.sched = adaptive;
+	scan_bringup(&control);
+	count = 0;
+	for ( i = 0; i < control.count; i++ ) {
+		if ( adapters[i].state == SCAN_ST_OFF ) {
+			fprintf(stderr, "hci%d could not be set up\n", adapters[i].dev_id);
+			scan_close(&adapters[i]);
+			continue;
+		}
+		if ( adapters[i].state != SCAN_ST_SCANNING && adapters[i].state != SCAN_ST_DOWN ) {
+			scan_recover(&adapters[i], SCAN_STEPS, "did not come up in time", ns_now_ms());
+		}
+		if ( i != count ) {
+			adapters[count] = adapters[i];
+		}
+		fprintf(stderr, "Using hci%d\n", adapters[count].dev_id);
+		ns_metrics_watch_socket(adapters[count].dev_id, adapters[count].fd);
+		count++;
+	}
+	if ( !count ) {
+		fprintf(stderr, "No adapter could be set up.\n");
+		return 1;
+	}
+	control.count = count;
+	controlling = pthread_create(&control_tid, NULL, scan_control_thread, &control) == 0;
+	if ( !controlling ) {
+		fprintf(stderr, "Failed to start the scan control thread, adapters will not be recovered\n");
+	}
+
+	if ( pipeline ) {
+		int fds[NS_ADAPTERS_MAX], ids[NS_ADAPTERS_MAX];
+		for ( i = 0; i < count; i++ ) {
+			fds[i] = adapters[i].fd;
+			ids[i] = adapters[i].dev_id;
+		}
+		ns_pipeline_read_loop(pipeline, fds, ids, count);
+		pipeline_finish();
+	} else {
+		scan_loop_epoll(adapters, count, batch_max, latency_ms);
+	}
+	ns_out_flush(&out);
+	log_finish();
+	rpa_finish();
+	ns_shm_close(&dev_shm);
+
+	if ( dump_on_exit ) {
+		devtab_dump_requested = 1;
+	}
+	devtab_dump_if_requested();
+
+	if ( controlling ) {
+		atomic_store(&control.stop, 1);
+		pthread_join(control_tid, NULL);
+	}
+	/* A virtual controller has hung up or stops with its thread */
+	for ( i = 0; i < count; i++ ) {
+		if ( !vhci_on ) {
+			scan_stop(adapters[i].ctl, adapters[i].ext);
+		}
+		if ( adapters[i].recoveries[SCAN_STEP_REARM] || adapters[i].recoveries[SCAN_STEP_RESET] ||
+		     adapters[i].recoveries[SCAN_STEP_CYCLE] ) {
+			fprintf(stderr, "hci%d recoveries: %u re-armed, %u reset, %u power cycled\n", adapters[i].dev_id,
+				adapters[i].recoveries[SCAN_STEP_REARM], adapters[i].recoveries[SCAN_STEP_RESET],
+				adapters[i].recoveries[SCAN_STEP_CYCLE]);
+		}
+		scan_close(&adapters[i]);
+	}
+	vhci_finish();
 
 	return 0;
 }
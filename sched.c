@@ -0,0 +1,69 @@
+// Adaptive scan schedule, see sched.h.
+
+#include "sched.h"
+
+/* Windows of 30 ms cover an advertising event on all three channels */
+const struct ns_scan_timing ns_sched_levels[NS_SCHED_LEVELS] = {
+    { 0x0010, 0x0010 },             /* 10 ms / 10 ms, 100% */
+    { 0x0060, 0x0030 },             /* 60 ms / 30 ms, 50% */
+    { 0x00C0, 0x0030 },             /* 120 ms / 30 ms, 25% */
+    { 0x0180, 0x0030 },             /* 240 ms / 30 ms, 12.5% */
+};
+
+static int ns_sched_steady(uint64_t rate, uint64_t avg)
+{
+    uint64_t diff = rate > avg ? rate - avg : avg - rate;
+
+    return diff * NS_SCHED_RATE_TOLERANCE <= avg;
+}
+
+int ns_sched_step(struct ns_sched_state *st, struct ns_sched_counters *c, uint64_t now_ms)
+{
+    const struct ns_scan_timing *t = &ns_sched_levels[st->level];
+    uint64_t reports = atomic_load_explicit(&c->reports, memory_order_relaxed);
+    uint64_t new_devices = atomic_load_explicit(&c->new_devices, memory_order_relaxed);
+    uint64_t rsp_wanted = atomic_load_explicit(&c->rsp_wanted, memory_order_relaxed);
+    uint64_t rate = (reports - st->reports) * t->interval / t->window;
+    uint64_t arrivals = new_devices - st->new_devices;
+    uint64_t wanted = rsp_wanted - st->rsp_wanted;
+    uint8_t level = st->level;
+    uint8_t active = st->active;
+
+    st->reports = reports;
+    st->new_devices = new_devices;
+    st->rsp_wanted = rsp_wanted;
+
+    if (!st->rate_avg) {
+        st->rate_avg = rate;
+    }
+    if (arrivals >= NS_SCHED_NEW_DEVICES) {
+        level = 0;
+        st->stable = 0;
+    } else if (rate <= NS_SCHED_QUIET_REPORTS || ns_sched_steady(rate, st->rate_avg)) {
+        if (++st->stable >= NS_SCHED_STABLE_EPOCHS && level < NS_SCHED_LEVELS - 1) {
+            level++;
+            st->stable = 0;
+        }
+    } else {
+        st->stable = 0;
+        if (level > 0) {
+            level--;
+        }
+    }
+    st->rate_avg = (st->rate_avg * 3 + rate) / 4;
+
+    if (active && now_ms >= st->active_until_ms) {
+        active = 0;
+    } else if (!active && wanted && now_ms >= st->next_active_ms) {
+        active = 1;
+        st->active_until_ms = now_ms + NS_SCHED_ACTIVE_MS;
+        st->next_active_ms = now_ms + NS_SCHED_ACTIVE_GAP_MS;
+    }
+
+    if (level == st->level && active == st->active) {
+        return 0;
+    }
+    st->level = level;
+    st->active = active;
+    return 1;
+}
@@ -0,0 +1,80 @@
+#ifndef __NS_SCHED_H__
+#define __NS_SCHED_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "bleapi.h"
+
+/* Adaptive scan schedule.
+ *
+ * The report path counts, per adapter, the reports it sees, the devices
+ * new to the device table and the reports of watched devices (those
+ * passing the filter) that could be answered with a scan response that
+ * was never received. Once per epoch the scanner's control thread turns
+ * the counters into scan parameters:
+ *
+ *   - new devices appearing open the window to the widest level, so
+ *     arrivals are picked up at full duty cycle;
+ *   - a report rate that stays steady for NS_SCHED_STABLE_EPOCHS with no
+ *     arrivals lowers the duty cycle by one level, a rate that jumps
+ *     raises it by one. Rates are scaled by interval / window so they
+ *     compare across levels;
+ *   - a watched device missing its scan response switches the adapter
+ *     to active scanning for NS_SCHED_ACTIVE_MS, at most once every
+ *     NS_SCHED_ACTIVE_GAP_MS, and back to passive afterwards.
+ *
+ * The counters are shared by the pipeline workers and only ever added
+ * to; the control thread keeps the previous values to take differences. */
+
+#define NS_SCHED_LEVELS             4
+#define NS_SCHED_EPOCH_MS           1000
+#define NS_SCHED_STABLE_EPOCHS      5
+#define NS_SCHED_NEW_DEVICES        2       /* arrivals per epoch that widen the window */
+#define NS_SCHED_QUIET_REPORTS      8       /* scaled reports per epoch that count as quiet */
+#define NS_SCHED_RATE_TOLERANCE     4       /* steady: within 1/4 of the average */
+#define NS_SCHED_ACTIVE_MS          2000
+#define NS_SCHED_ACTIVE_GAP_MS      30000
+
+/* Scan interval and window in units of 0.625 ms */
+struct ns_scan_timing {
+    uint16_t interval;
+    uint16_t window;
+};
+
+/* Level 0 is the fixed 100% duty cycle the scanner always used */
+extern const struct ns_scan_timing ns_sched_levels[NS_SCHED_LEVELS];
+
+struct ns_sched_counters {
+    _Atomic uint64_t reports;
+    _Atomic uint64_t new_devices;
+    _Atomic uint64_t rsp_wanted;
+} __attribute__((aligned(64)));
+
+struct ns_sched {
+    struct ns_sched_counters adapters[NS_ADAPTERS_MAX];
+};
+
+/* Per adapter, owned by the control thread */
+struct ns_sched_state {
+    uint8_t level;
+    uint8_t active;                 /* scan type 0x01 */
+    uint32_t stable;                /* epochs the rate held steady */
+    uint64_t rate_avg;              /* scaled reports per epoch */
+    uint64_t reports;               /* counter values at the previous step */
+    uint64_t new_devices;
+    uint64_t rsp_wanted;
+    uint64_t active_until_ms;
+    uint64_t next_active_ms;
+};
+
+static inline void ns_sched_add(_Atomic uint64_t *counter)
+{
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+/* Called once per epoch. Returns 1 if level or active changed and the
+ * adapter must be reconfigured. */
+int ns_sched_step(struct ns_sched_state *st, struct ns_sched_counters *c, uint64_t now_ms);
+
+#endif //__NS_SCHED_H__
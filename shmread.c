@@ -0,0 +1,143 @@
+// Reader for the device state the scanner publishes with -G.
+//
+// Compile with:
+//   cc -O2 shmread.c devshm.c -lbluetooth -lrt -o shmread
+// Run with:
+//   ./shmread [-a addr[,type]] [-c] [name]
+//
+// Prints a snapshot of every device, or of the one given with -a, in the
+// layout of the scanner's device table dump plus the latest payload. -c
+// only prints the number of devices. name defaults to the scanner's
+// /ble-scanner. Each entry is copied consistently, the snapshot as a
+// whole is not: devices may be updated while it is taken.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <bluetooth/bluetooth.h>
+
+#include "devshm.h"
+
+static void shmread_print(const struct ns_shm_dev *e)
+{
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type;
+    char addr[18];
+    int i;
+
+    ns_devtab_key_addr(e->key, &bdaddr, &bdaddr_type);
+    ba2str(&bdaddr, addr);
+    printf("%s type:%u count:%u rssi:%d avg:%d min:%d max:%d last_seen:%llu payload_len:%u hci:%u",
+           addr, bdaddr_type, e->count, e->rssi_last, e->rssi_avg, e->rssi_min, e->rssi_max,
+           (unsigned long long)e->last_seen_ms, e->payload_len, e->adapter);
+    for (i = 0; i < NS_ADAPTERS_MAX; i++) {
+        if (e->adapter_mask & (1U << i)) {
+            printf(" hci%d:%d", i, e->adapter_rssi[i]);
+        }
+    }
+    printf(" data:");
+    for (i = 0; i < e->payload_len && i < NS_DEVTAB_PAYLOAD_MAX; i++) {
+        printf("%02x", e->payload[i]);
+    }
+    putchar('\n');
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] [name]\n", prog);
+    printf("  -a <addr>[,<type>]  only this device (address type default 0, public)\n");
+    printf("  -c            only print the number of devices\n");
+    printf("  -h            show this help\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = NS_SHM_NAME_DEFAULT;
+    const char *addr = NULL;
+    struct ns_shm shm;
+    struct ns_shm_dev e;
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type = 0;
+    int count_only = 0;
+    uint32_t s, i;
+    uint64_t n = 0;
+    uint64_t torn = 0;
+    char *comma;
+    int r;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:ch")) != -1) {
+        switch (opt) {
+        case 'a':
+            comma = strchr(optarg, ',');
+            if (comma) {
+                *comma++ = '\0';
+                bdaddr_type = (uint8_t)atoi(comma);
+            }
+            addr = optarg;
+            if (strlen(addr) != 17 || str2ba(addr, &bdaddr) < 0) {
+                fprintf(stderr, "Address must be XX:XX:XX:XX:XX:XX[,<type>]\n");
+                return 1;
+            }
+            break;
+        case 'c':
+            count_only = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        name = argv[optind];
+    }
+
+    if (ns_shm_attach(&shm, name) < 0) {
+        fprintf(stderr, "Can not attach %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    if (atomic_load(&shm.hdr->state) != NS_SHM_LIVE) {
+        fprintf(stderr, "%s: the scanner has exited\n", name);
+    } else if (kill(shm.hdr->pid, 0) < 0 && errno == ESRCH) {
+        fprintf(stderr, "%s: scanner pid %d is gone\n", name, shm.hdr->pid);
+    }
+
+    if (addr) {
+        if (!ns_shm_find(&shm, &bdaddr, bdaddr_type, &e)) {
+            fprintf(stderr, "%s,%u not seen\n", addr, bdaddr_type);
+            ns_shm_detach(&shm);
+            return 1;
+        }
+        shmread_print(&e);
+        ns_shm_detach(&shm);
+        return 0;
+    }
+
+    for (s = 0; s < shm.hdr->shards; s++) {
+        for (i = 0; i < shm.hdr->slots; i++) {
+            r = ns_shm_read(ns_shm_entry(&shm, s, i), &e);
+            if (r < 0) {
+                torn++;
+            } else if (r) {
+                n++;
+                if (!count_only) {
+                    shmread_print(&e);
+                }
+            }
+        }
+    }
+    if (count_only) {
+        printf("%llu\n", (unsigned long long)n);
+    }
+    if (torn) {
+        fprintf(stderr, "%s: %llu entries left half written\n", name, (unsigned long long)torn);
+    }
+    ns_shm_detach(&shm);
+    return 0;
+}
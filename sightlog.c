@@ -0,0 +1,462 @@
+// Memory-mapped sighting log, see sightlog.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sightlog.h"
+#include "suppress.h"
+
+#define NS_LOG_RECORDS_OFF      sizeof(struct ns_log_seg_hdr)
+
+static void ns_log_path(char *path, size_t size, const char *dir, int writer, uint64_t seq)
+{
+    snprintf(path, size, "%s/sight-%d-%010llu.nsl", dir, writer, (unsigned long long)seq);
+}
+
+/* writer and seq of a segment file name, -1 if it is not one */
+static int ns_log_parse_name(const char *name, int *writer, uint64_t *seq)
+{
+    unsigned long long s;
+    int w, n = 0;
+
+    if (sscanf(name, "sight-%d-%llu.nsl%n", &w, &s, &n) != 2 || !n || name[n] || w < 0) {
+        return -1;
+    }
+    *writer = w;
+    *seq = s;
+    return 0;
+}
+
+static void ns_log_seg_end(struct ns_log *l)
+{
+    if (l->base) {
+        munmap(l->base, l->seg_size);
+        close(l->fd);
+        l->base = NULL;
+        l->hdr = NULL;
+    }
+}
+
+/* The segment's blocks are allocated up front: a store to a page of a
+ * sparse file the disk has no room for raises SIGBUS. A segment that
+ * cannot be allocated stops the log. */
+static int ns_log_seg_start(struct ns_log *l)
+{
+    char path[320];
+    int fd;
+    int err;
+
+    /* Out of the ring now, its space goes to the new segment */
+    if (l->seq >= l->segments) {
+        ns_log_path(path, sizeof(path), l->dir, l->writer, l->seq - l->segments);
+        unlink(path);
+    }
+
+    ns_log_path(path, sizeof(path), l->dir, l->writer, l->seq);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    err = posix_fallocate(fd, 0, l->seg_size);
+    if (err) {
+        close(fd);
+        unlink(path);
+        l->stopped = 1;
+        errno = err;
+        return -1;
+    }
+    l->base = mmap(NULL, l->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (l->base == MAP_FAILED) {
+        l->base = NULL;
+        close(fd);
+        return -1;
+    }
+    l->fd = fd;
+    l->hdr = (struct ns_log_seg_hdr *)l->base;
+    memcpy(l->hdr->magic, NS_LOG_MAGIC, sizeof(l->hdr->magic));
+    l->hdr->version = NS_LOG_VERSION;
+    l->hdr->writer = l->writer;
+    l->hdr->seq = l->seq;
+    l->hdr->size = l->seg_size;
+    l->hdr->payload_start = l->seg_size;
+    atomic_store_explicit(&l->hdr->records, 0, memory_order_release);
+
+    memset(l->dedup, 0, NS_LOG_DEDUP_SLOTS * sizeof(*l->dedup));
+    l->dedup_used = 0;
+    return 0;
+}
+
+int ns_log_open(struct ns_log *l, const char *dir, int writer, uint64_t seg_size, uint32_t segments)
+{
+    char path[320];
+    struct dirent *de;
+    uint64_t seq;
+    int has = 0;
+    DIR *d;
+    int w;
+
+    memset(l, 0, sizeof(*l));
+    if (strlen(dir) >= sizeof(l->dir) || seg_size < NS_LOG_SEG_SIZE_MIN || seg_size > UINT32_MAX || !segments) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(l->dir, dir);
+    l->writer = writer;
+    l->seg_size = seg_size;
+    l->segments = segments;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+    while ((de = readdir(d))) {
+        if (!ns_log_parse_name(de->d_name, &w, &seq) && w == writer && (!has || seq >= l->seq)) {
+            l->seq = seq + 1;
+            has = 1;
+        }
+    }
+    /* Segments a smaller ring of an earlier run left behind */
+    rewinddir(d);
+    while ((de = readdir(d))) {
+        if (!ns_log_parse_name(de->d_name, &w, &seq) && w == writer && seq + segments <= l->seq) {
+            ns_log_path(path, sizeof(path), dir, writer, seq);
+            unlink(path);
+        }
+    }
+    closedir(d);
+
+    l->dedup = malloc(NS_LOG_DEDUP_SLOTS * sizeof(*l->dedup));
+    if (!l->dedup) {
+        return -1;
+    }
+    if (ns_log_seg_start(l) < 0) {
+        free(l->dedup);
+        l->dedup = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void ns_log_close(struct ns_log *l)
+{
+    ns_log_seg_end(l);
+    free(l->dedup);
+    l->dedup = NULL;
+}
+
+/* Offset of an earlier copy of the payload in the open segment, 0 if
+ * there is none. *slot is where to remember a new copy, -1 once the
+ * table is 3/4 full. */
+static uint32_t ns_log_dedup_find(struct ns_log *l, uint32_t hash, const uint8_t *data, uint16_t len, int *slot)
+{
+    uint32_t mask = NS_LOG_DEDUP_SLOTS - 1;
+    uint32_t i = hash & mask;
+    uint32_t off;
+
+    while (l->dedup[i]) {
+        off = (uint32_t)l->dedup[i];
+        if ((uint32_t)(l->dedup[i] >> 32) == hash && off + len <= l->seg_size &&
+            !memcmp(l->base + off, data, len)) {
+            return off;
+        }
+        i = (i + 1) & mask;
+    }
+    *slot = l->dedup_used < NS_LOG_DEDUP_SLOTS / 4 * 3 ? (int)i : -1;
+    return 0;
+}
+
+int ns_log_append(struct ns_log *l, const ns_adv_report_t *rpt, uint64_t ts_ms)
+{
+    struct ns_log_seg_hdr *h;
+    struct ns_log_record *r;
+    uint16_t len = rpt->length;
+    uint32_t hash = len ? ns_payload_hash(rpt->data, len) : 0;
+    uint32_t off = 0;
+    uint64_t n, addr;
+    int slot = -1;
+
+    while (1) {
+        if (!l->base) {
+            if (l->stopped || ns_log_seg_start(l) < 0) {
+                l->errors++;
+                return -1;
+            }
+        }
+        h = l->hdr;
+        n = atomic_load_explicit(&h->records, memory_order_relaxed);
+        off = len ? ns_log_dedup_find(l, hash, rpt->data, len, &slot) : 0;
+        if (NS_LOG_RECORDS_OFF + (n + 1) * sizeof(*r) + (len && !off ? len : 0) <= h->payload_start) {
+            break;
+        }
+        if (!n) {
+            /* Does not fit an empty segment */
+            l->errors++;
+            return -1;
+        }
+        ns_log_seg_end(l);
+        l->seq++;
+        l->rotations++;
+    }
+
+    if (len && !off) {
+        h->payload_start -= len;
+        off = (uint32_t)h->payload_start;
+        memcpy(l->base + off, rpt->data, len);
+        if (slot >= 0) {
+            l->dedup[slot] = (uint64_t)hash << 32 | off;
+            l->dedup_used++;
+        }
+    } else if (len) {
+        l->deduped++;
+    }
+
+    r = (struct ns_log_record *)(l->base + NS_LOG_RECORDS_OFF) + n;
+    r->ts_ms = ts_ms;
+    memcpy(r->bdaddr, rpt->bdaddr.b, sizeof(r->bdaddr));
+    r->bdaddr_type = rpt->bdaddr_type;
+    r->evt_type = rpt->evt_type;
+    r->rssi = rpt->rssi;
+    r->adapter = rpt->adapter;
+    r->tx_power = rpt->tx_power;
+    r->sid = rpt->sid;
+    r->phy = (rpt->primary_phy << 4) | (rpt->secondary_phy & 0x0f);
+    r->truncated = rpt->truncated;
+    r->payload_len = len;
+    r->payload_off = off;
+    memset(r->reserved, 0, sizeof(r->reserved));
+
+    addr = ns_log_addr_key(r->bdaddr);
+    if (!n) {
+        h->first_ts_ms = ts_ms;
+        h->addr_min = addr;
+        h->addr_max = addr;
+    }
+    h->last_ts_ms = ts_ms;
+    if (addr < h->addr_min) {
+        h->addr_min = addr;
+    }
+    if (addr > h->addr_max) {
+        h->addr_max = addr;
+    }
+    h->payload_bytes += len;
+    atomic_store_explicit(&h->records, n + 1, memory_order_release);
+    l->records++;
+    return 0;
+}
+
+/* Reading */
+
+struct ns_log_seg_ref {
+    int writer;
+    uint64_t seq;
+};
+
+/* The segments of one writer, walked in seq order */
+struct ns_log_cursor {
+    const struct ns_log_seg_ref *segs;
+    int nsegs;
+    int next;                       /* index of the next segment to map */
+    uint8_t *base;
+    size_t size;
+    const struct ns_log_record *recs;
+    uint64_t nrecs;
+    uint64_t pos;
+};
+
+static int ns_log_seg_ref_cmp(const void *a, const void *b)
+{
+    const struct ns_log_seg_ref *x = a, *y = b;
+
+    if (x->writer != y->writer) {
+        return x->writer < y->writer ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void ns_log_cursor_unmap(struct ns_log_cursor *c)
+{
+    if (c->base) {
+        munmap(c->base, c->size);
+        c->base = NULL;
+    }
+}
+
+/* Map segments until one may hold matching records. Returns 0, or -1
+ * when the writer has none left. */
+static int ns_log_cursor_advance(struct ns_log_cursor *c, const char *dir, const struct ns_log_query *q)
+{
+    const struct ns_log_seg_hdr *h;
+    char path[320];
+    struct stat st;
+    uint64_t lo, hi, mid, n;
+    int fd;
+
+    ns_log_cursor_unmap(c);
+    while (c->next < c->nsegs) {
+        ns_log_path(path, sizeof(path), dir, c->segs[c->next].writer, c->segs[c->next].seq);
+        c->next++;
+
+        /* Gone since the directory was read, the writer rotated it out */
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < NS_LOG_RECORDS_OFF) {
+            close(fd);
+            continue;
+        }
+        c->size = st.st_size;
+        c->base = mmap(NULL, c->size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (c->base == MAP_FAILED) {
+            c->base = NULL;
+            continue;
+        }
+
+        h = (const struct ns_log_seg_hdr *)c->base;
+        /* The count first, the ranges then cover at least those records */
+        n = atomic_load_explicit(&((struct ns_log_seg_hdr *)h)->records, memory_order_acquire);
+        if (memcmp(h->magic, NS_LOG_MAGIC, sizeof(h->magic)) || h->version != NS_LOG_VERSION ||
+            h->size != c->size || NS_LOG_RECORDS_OFF + n * sizeof(*c->recs) > c->size || !n ||
+            h->first_ts_ms > q->to_ms || h->last_ts_ms < q->from_ms ||
+            h->addr_min > q->addr_hi || h->addr_max < q->addr_lo) {
+            ns_log_cursor_unmap(c);
+            continue;
+        }
+
+        c->recs = (const struct ns_log_record *)(c->base + NS_LOG_RECORDS_OFF);
+        c->nrecs = n;
+        for (lo = 0, hi = n; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+            if (c->recs[mid].ts_ms < q->from_ms) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        c->pos = lo;
+        return 0;
+    }
+    return -1;
+}
+
+/* Next matching record of the writer, NULL when there is none */
+static const struct ns_log_record *ns_log_cursor_peek(struct ns_log_cursor *c, const char *dir,
+                                                      const struct ns_log_query *q)
+{
+    const struct ns_log_record *r;
+    uint64_t addr;
+
+    while (c->base) {
+        for (; c->pos < c->nrecs; c->pos++) {
+            r = &c->recs[c->pos];
+            if (r->ts_ms > q->to_ms) {
+                break;
+            }
+            addr = ns_log_addr_key(r->bdaddr);
+            if (addr >= q->addr_lo && addr <= q->addr_hi &&
+                (uint64_t)r->payload_off + r->payload_len <= c->size) {
+                return r;
+            }
+        }
+        if (ns_log_cursor_advance(c, dir, q) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+long ns_log_scan(const char *dir, const struct ns_log_query *q, ns_log_cb cb, void *ctx)
+{
+    struct ns_log_seg_ref *segs = NULL, *grown;
+    struct ns_log_cursor *cursors = NULL;
+    const struct ns_log_record *r, *best;
+    struct dirent *de;
+    int nsegs = 0, cap = 0, ncursors = 0;
+    int i, bi, w;
+    uint64_t seq;
+    long count = 0;
+    DIR *d;
+
+    d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+    while ((de = readdir(d))) {
+        if (ns_log_parse_name(de->d_name, &w, &seq) < 0) {
+            continue;
+        }
+        if (nsegs == cap) {
+            cap = cap ? cap * 2 : 64;
+            grown = realloc(segs, cap * sizeof(*segs));
+            if (!grown) {
+                free(segs);
+                closedir(d);
+                return -1;
+            }
+            segs = grown;
+        }
+        segs[nsegs].writer = w;
+        segs[nsegs].seq = seq;
+        nsegs++;
+    }
+    closedir(d);
+    if (!nsegs) {
+        return 0;
+    }
+    qsort(segs, nsegs, sizeof(*segs), ns_log_seg_ref_cmp);
+
+    cursors = calloc(nsegs, sizeof(*cursors));
+    if (!cursors) {
+        free(segs);
+        return -1;
+    }
+    for (i = 0; i < nsegs; i++) {
+        if (!i || segs[i].writer != segs[i - 1].writer) {
+            cursors[ncursors].segs = &segs[i];
+            ncursors++;
+        }
+        cursors[ncursors - 1].nsegs++;
+    }
+    for (i = 0; i < ncursors; i++) {
+        ns_log_cursor_advance(&cursors[i], dir, q);
+    }
+
+    /* Merge the writers by timestamp */
+    while (1) {
+        best = NULL;
+        bi = -1;
+        for (i = 0; i < ncursors; i++) {
+            r = ns_log_cursor_peek(&cursors[i], dir, q);
+            if (r && (!best || r->ts_ms < best->ts_ms)) {
+                best = r;
+                bi = i;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        count++;
+        cursors[bi].pos++;
+        if (cb(best, cursors[bi].base + best->payload_off, ctx)) {
+            break;
+        }
+    }
+
+    for (i = 0; i < ncursors; i++) {
+        ns_log_cursor_unmap(&cursors[i]);
+    }
+    free(cursors);
+    free(segs);
+    return count;
+}
@@ -0,0 +1,130 @@
+#ifndef __NS_SIGHTLOG_H__
+#define __NS_SIGHTLOG_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <bluetooth/bluetooth.h>
+
+#include "bleapi.h"
+
+/* Append-only log of emitted sightings in memory-mapped segment files.
+ *
+ * A segment is a fixed-size file: a header, then 32 byte records growing
+ * up from it, while payloads fill the file from its end down. The segment
+ * is full when the two meet, the writer then starts the next one and
+ * deletes the oldest once more than segments files exist, so the log is
+ * a ring bounded by seg_size * segments per writer. A segment's blocks
+ * are allocated when it is created, so a full disk stops the log (every
+ * record after that counts as an error) rather than failing a store to
+ * the mapping with SIGBUS.
+ *
+ * Payloads are deduplicated per segment: a device repeating the same
+ * advertisement adds a record and no payload bytes. Segments stand alone,
+ * dropping one never leaves dangling payload references.
+ *
+ * Every writer has its own segments, named sight-<writer>-<seq>.nsl, so
+ * pipeline workers append without locking. A record is published by the
+ * release store of the header's record count, a reader mapping a live
+ * segment sees whole records only.
+ *
+ * The files are in host byte order, little endian on every target this
+ * builds for. */
+
+#define NS_LOG_MAGIC                "NSSIGHT"
+#define NS_LOG_VERSION              1
+#define NS_LOG_SEG_SIZE_DEFAULT     (16 * 1024 * 1024)
+#define NS_LOG_SEG_SIZE_MIN         (64 * 1024)
+#define NS_LOG_SEGMENTS_DEFAULT     8
+#define NS_LOG_DEDUP_SLOTS          (1 << 16)   /* payloads remembered per segment */
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "sighting log segments are little endian"
+#endif
+
+struct ns_log_record {
+    uint64_t ts_ms;                 /* CLOCK_REALTIME, as printed by the scanner */
+    uint8_t bdaddr[6];              /* bdaddr_t order, least significant byte first */
+    uint8_t bdaddr_type;
+    uint8_t evt_type;
+    int8_t rssi;
+    uint8_t adapter;
+    int8_t tx_power;                /* see ns_adv_report_t */
+    uint8_t sid;
+    uint8_t phy;                    /* primary << 4 | secondary */
+    uint8_t truncated;
+    uint16_t payload_len;
+    uint32_t payload_off;           /* from the start of the segment */
+    uint8_t reserved[4];
+} __attribute__((packed));
+
+struct ns_log_seg_hdr {
+    char magic[8];                  /* NS_LOG_MAGIC */
+    uint32_t version;
+    uint32_t writer;
+    uint64_t seq;
+    uint64_t size;                  /* of the segment file */
+    _Atomic uint64_t records;       /* published, they follow the header */
+    uint64_t payload_start;         /* payloads fill [payload_start, size) */
+    uint64_t first_ts_ms;           /* range of the published records */
+    uint64_t last_ts_ms;
+    uint64_t addr_min;              /* ns_log_addr_key() range of the published records */
+    uint64_t addr_max;
+    uint64_t payload_bytes;         /* before deduplication */
+    uint8_t reserved[40];
+};
+
+/* Byte order of the printed address, for range queries */
+static inline uint64_t ns_log_addr_key(const uint8_t *b)
+{
+    return (uint64_t)b[5] << 40 | (uint64_t)b[4] << 32 | (uint64_t)b[3] << 24 |
+           (uint64_t)b[2] << 16 | (uint64_t)b[1] << 8 | b[0];
+}
+
+struct ns_log {
+    char dir[256];
+    int writer;
+    uint64_t seg_size;
+    uint32_t segments;
+    uint64_t seq;                   /* of the open segment */
+    int fd;
+    uint8_t *base;                  /* mapping of the open segment */
+    struct ns_log_seg_hdr *hdr;
+    uint64_t *dedup;                /* hash << 32 | payload offset, 0 = empty */
+    uint32_t dedup_used;
+    uint64_t records;
+    uint64_t deduped;               /* records that reused a payload */
+    uint64_t rotations;
+    uint64_t errors;                /* records lost to a segment that failed to open */
+    int stopped;                    /* a segment could not be allocated, nothing is logged */
+};
+
+/* Start a new segment in dir after the ones writer left there, deleting
+ * what falls out of the ring. Returns 0, or -1 with errno set. */
+int ns_log_open(struct ns_log *l, const char *dir, int writer, uint64_t seg_size, uint32_t segments);
+
+/* Returns 0, or -1 if the record was lost (the next segment could not
+ * be created, or the log stopped) */
+int ns_log_append(struct ns_log *l, const ns_adv_report_t *rpt, uint64_t ts_ms);
+
+void ns_log_close(struct ns_log *l);
+
+/* Query over the segments of all writers in a directory */
+struct ns_log_query {
+    uint64_t from_ms;               /* inclusive */
+    uint64_t to_ms;
+    uint64_t addr_lo;               /* inclusive ns_log_addr_key() range */
+    uint64_t addr_hi;
+};
+
+/* Return non-zero to stop the scan */
+typedef int (*ns_log_cb)(const struct ns_log_record *r, const uint8_t *payload, void *ctx);
+
+/* Calls cb for each matching record, merged across writers in time
+ * order. Segments outside the time or address range are skipped by their
+ * header, the first record of a time range is found by bisection, which
+ * assumes the wall clock did not step back while the segment was written.
+ * Returns the number of records passed to cb, or -1 if dir can not be
+ * read. */
+long ns_log_scan(const char *dir, const struct ns_log_query *q, ns_log_cb cb, void *ctx);
+
+#endif //__NS_SIGHTLOG_H__
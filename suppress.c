@@ -0,0 +1,57 @@
+// Payload change detection, see suppress.h.
+
+#include <string.h>
+
+#include "suppress.h"
+
+static inline uint64_t ns_hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v * 0x9e3779b97f4a7c15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xff51afd7ed558ccdULL;
+}
+
+/* Eight bytes per round, payloads are at most a few dozen bytes */
+uint32_t ns_payload_hash(const uint8_t *p, int len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t)len;
+    uint64_t v;
+
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        h = ns_hash_mix(h, v);
+        p += 8;
+        len -= 8;
+    }
+    if (len) {
+        v = 0;
+        memcpy(&v, p, len);
+        h = ns_hash_mix(h, v);
+    }
+
+    h ^= h >> 29;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+int ns_suppress_check(struct ns_suppress *sup, struct ns_dev *dev,
+                      const ns_adv_report_t *rpt, uint64_t now_ms)
+{
+    int kind = ns_adv_is_scan_rsp(rpt->evt_type);
+    uint32_t hash = ns_payload_hash(rpt->data, rpt->length);
+    int rssi = ns_dev_rssi_avg(dev);
+    int diff = rssi - dev->emit_rssi;
+
+    if (dev->emit_ms &&
+        hash == dev->emit_hash[kind] &&
+        (!sup->rssi_delta || (diff < sup->rssi_delta && -diff < sup->rssi_delta)) &&
+        (!sup->heartbeat_ms || now_ms - dev->emit_ms < sup->heartbeat_ms)) {
+        sup->suppressed++;
+        return 0;
+    }
+
+    dev->emit_ms = now_ms;
+    dev->emit_rssi = rssi;
+    dev->emit_hash[kind] = hash;
+    sup->emitted++;
+    return 1;
+}
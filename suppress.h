@@ -0,0 +1,36 @@
+#ifndef __NS_SUPPRESS_H__
+#define __NS_SUPPRESS_H__
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "devtab.h"
+
+/* Software duplicate filtering.
+ *
+ * With controller duplicate filtering off every advertisement is reported,
+ * most of them identical. A report is only let through when the payload
+ * hash differs from the last emitted one, when the smoothed RSSI moved by
+ * rssi_delta dB or more, or when heartbeat_ms passed since the last emit.
+ * Advertising and scan response payloads are tracked separately so active
+ * scanning doesn't look like a payload change on every report. */
+
+#define NS_SUPPRESS_RSSI_DELTA_DEFAULT      6
+#define NS_SUPPRESS_HEARTBEAT_DEFAULT       10000
+
+struct ns_suppress {
+    int rssi_delta;                 /* 0 = RSSI changes never emit */
+    uint32_t heartbeat_ms;          /* 0 = no heartbeat */
+    uint64_t emitted;
+    uint64_t suppressed;
+};
+
+uint32_t ns_payload_hash(const uint8_t *p, int len);
+
+/* Returns 1 if the report should be emitted, 0 if it is redundant.
+ * dev must already be updated with this report (ns_devtab_update). */
+int ns_suppress_check(struct ns_suppress *sup, struct ns_dev *dev,
+                      const ns_adv_report_t *rpt, uint64_t now_ms);
+
+#endif //__NS_SUPPRESS_H__
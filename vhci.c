@@ -0,0 +1,796 @@
+// Virtual HCI controller for load tests, see vhci.h.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "vhci.h"
+#include "bleapi.h"
+#include "extadv.h"
+
+#define NS_VHCI_PER_EVENT_MAX       25      /* Num_Reports of one LE Meta event */
+#define NS_VHCI_IDLE_MS             10      /* poll timeout while not scanning */
+#define NS_VHCI_LONG_LEN            300
+#define NS_VHCI_LONG_FRAG           150
+
+#define NS_VHCI_OP(ogf, ocf)        ((uint16_t)(((ogf) << 10) | (ocf)))
+#define NS_VHCI_OP_RESET            NS_VHCI_OP(OGF_HOST_CTL, OCF_RESET)
+#define NS_VHCI_OP_SET_EVENT_MASK   NS_VHCI_OP(OGF_HOST_CTL, 0x0001)
+
+#define NS_HCI_SUCCESS              0x00
+#define NS_HCI_UNKNOWN_COMMAND      0x01
+#define NS_HCI_MEMORY_FULL          0x07
+#define NS_HCI_COMMAND_DISALLOWED   0x0C
+
+static const char *ns_vhci_kind_names[NS_VHCI_KINDS] = {
+    "flags", "name", "uuid128", "ibeacon", "eddystone", "mfg", "long",
+};
+
+static const uint32_t ns_vhci_weights_default[NS_VHCI_KINDS] = { 2, 2, 1, 2, 1, 2, 0 };
+
+struct ns_vhci_event {
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    uint16_t len;
+    uint16_t reports;
+};
+
+static uint64_t ns_vhci_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t ns_vhci_mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t ns_vhci_rand(struct ns_vhci *v)
+{
+    v->rng ^= v->rng >> 12;
+    v->rng ^= v->rng << 25;
+    v->rng ^= v->rng >> 27;
+    return v->rng * 0x2545F4914F6CDD1DULL;
+}
+
+int ns_vhci_parse(struct ns_vhci_cfg *cfg, const char *spec, char *err, size_t err_len)
+{
+    char buf[512];
+    char *tok, *save = NULL, *val, *item, *isave, *w, *end;
+    uint32_t total = 0;
+    unsigned long long n;
+    int k;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->devices = NS_VHCI_DEVICES_DEFAULT;
+    cfg->rate = NS_VHCI_RATE_DEFAULT;
+    cfg->per_event = NS_VHCI_PER_EVENT_DEFAULT;
+    cfg->seed = 1;
+    memcpy(cfg->weights, ns_vhci_weights_default, sizeof(cfg->weights));
+
+    if (strlen(spec) >= sizeof(buf)) {
+        snprintf(err, err_len, "virtual controller spec too long");
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (!val) {
+            snprintf(err, err_len, "expected key=value at '%s'", tok);
+            return -1;
+        }
+        *val++ = '\0';
+
+        if (!strcmp(tok, "mix")) {
+            memset(cfg->weights, 0, sizeof(cfg->weights));
+            for (item = strtok_r(val, "/", &isave); item; item = strtok_r(NULL, "/", &isave)) {
+                w = strchr(item, ':');
+                if (w) {
+                    *w++ = '\0';
+                }
+                for (k = 0; k < NS_VHCI_KINDS && strcmp(item, ns_vhci_kind_names[k]); k++)
+                    ;
+                if (k == NS_VHCI_KINDS) {
+                    snprintf(err, err_len, "unknown payload kind '%s'", item);
+                    return -1;
+                }
+                cfg->weights[k] = w ? (uint32_t)strtoul(w, NULL, 10) : 1;
+            }
+            continue;
+        }
+
+        errno = 0;
+        n = strtoull(val, &end, 10);
+        if (errno || end == val || *end) {
+            snprintf(err, err_len, "bad number for %s", tok);
+            return -1;
+        }
+        if (!strcmp(tok, "devices")) {
+            if (n < 1 || n > NS_VHCI_DEVICES_MAX) {
+                snprintf(err, err_len, "devices must be 1..%d", NS_VHCI_DEVICES_MAX);
+                return -1;
+            }
+            cfg->devices = (uint32_t)n;
+        } else if (!strcmp(tok, "rate")) {
+            cfg->rate = n > UINT32_MAX ? UINT32_MAX : (uint32_t)n;
+        } else if (!strcmp(tok, "per")) {
+            if (n < 1 || n > NS_VHCI_PER_EVENT_MAX) {
+                snprintf(err, err_len, "per must be 1..%d", NS_VHCI_PER_EVENT_MAX);
+                return -1;
+            }
+            cfg->per_event = (uint32_t)n;
+        } else if (!strcmp(tok, "count")) {
+            cfg->count = n;
+        } else if (!strcmp(tok, "time")) {
+            cfg->seconds = (uint32_t)n;
+        } else if (!strcmp(tok, "ext")) {
+            cfg->ext = !!n;
+        } else if (!strcmp(tok, "seed")) {
+            cfg->seed = (uint32_t)n;
+        } else if (!strcmp(tok, "stall")) {
+            cfg->stall_ms = (uint32_t)n;
+        } else if (!strcmp(tok, "wedge")) {
+            cfg->wedge_ms = (uint32_t)n;
+        } else {
+            snprintf(err, err_len, "unknown key '%s'", tok);
+            return -1;
+        }
+    }
+
+    for (k = 0; k < NS_VHCI_KINDS; k++) {
+        total += cfg->weights[k];
+    }
+    if (!total) {
+        snprintf(err, err_len, "the payload mix is empty");
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t ns_vhci_ad(uint8_t *p, uint8_t type, const void *data, uint8_t len)
+{
+    p[0] = len + 1;
+    p[1] = type;
+    memcpy(p + 2, data, len);
+    return len + 2;
+}
+
+static void ns_vhci_build_dev(struct ns_vhci *v, uint32_t i, uint32_t total)
+{
+    static const uint8_t flags = 0x06;
+    struct ns_vhci_dev *d = &v->devs[i];
+    uint64_t h = ns_vhci_mix64(((uint64_t)v->cfg.seed << 32) | i);
+    uint64_t h2 = ns_vhci_mix64(h);
+    uint8_t buf[27];
+    char name[16];
+    uint32_t pick;
+    int len;
+
+    d->bdaddr.b[0] = i & 0xFF;
+    d->bdaddr.b[1] = (i >> 8) & 0xFF;
+    d->bdaddr.b[2] = (i >> 16) & 0xFF;
+    d->bdaddr.b[3] = h & 0xFF;
+    d->bdaddr.b[4] = (h >> 8) & 0xFF;
+    d->bdaddr.b[5] = (h >> 16) & 0xFF;
+    d->bdaddr_type = (h >> 24) % 3 ? LE_RANDOM_ADDRESS : LE_PUBLIC_ADDRESS;
+    if (d->bdaddr_type == LE_RANDOM_ADDRESS) {
+        d->bdaddr.b[5] |= 0xC0;     /* static */
+    }
+    d->rssi = (int8_t)(-95 + (int)((h >> 32) % 56));
+
+    pick = (uint32_t)((h >> 40) % total);
+    for (d->kind = 0; pick >= v->cfg.weights[d->kind]; d->kind++) {
+        pick -= v->cfg.weights[d->kind];
+    }
+
+    len = snprintf(name, sizeof(name), "vhci-%06x", i);
+    d->len = ns_vhci_ad(d->data, ESP_BLE_AD_TYPE_FLAG, &flags, 1);
+    d->rsp_len = 0;
+    switch (d->kind) {
+    case NS_VHCI_NAME:
+        d->len += ns_vhci_ad(d->data + d->len, ESP_BLE_AD_TYPE_NAME_CMPL, name, len);
+        buf[0] = (uint8_t)(int8_t)(-20 + (int)(h2 % 25));
+        d->rsp_len = ns_vhci_ad(d->rsp, ESP_BLE_AD_TYPE_TX_PWR, buf, 1);
+        break;
+    case NS_VHCI_UUID128:
+        memcpy(buf, &h2, 8);
+        memcpy(buf + 8, &h, 8);
+        d->len += ns_vhci_ad(d->data + d->len, ESP_BLE_AD_TYPE_128SRV_CMPL, buf, 16);
+        d->rsp_len = ns_vhci_ad(d->rsp, ESP_BLE_AD_TYPE_NAME_CMPL, name, len);
+        break;
+    case NS_VHCI_IBEACON:
+        buf[0] = 0x4C;              /* Apple */
+        buf[1] = 0x00;
+        buf[2] = 0x02;
+        buf[3] = 0x15;
+        memcpy(buf + 4, &v->cfg.seed, 4);   /* UUID, shared by the devices of one seed */
+        memset(buf + 8, 0xB5, 12);
+        buf[20] = (i >> 24) & 0xFF; /* major, minor */
+        buf[21] = (i >> 16) & 0xFF;
+        buf[22] = (i >> 8) & 0xFF;
+        buf[23] = i & 0xFF;
+        buf[24] = 0xC5;             /* measured power */
+        d->len += ns_vhci_ad(d->data + d->len, ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE, buf, 25);
+        break;
+    case NS_VHCI_EDDYSTONE:
+        buf[0] = 0xAA;
+        buf[1] = 0xFE;
+        d->len += ns_vhci_ad(d->data + d->len, ESP_BLE_AD_TYPE_16SRV_CMPL, buf, 2);
+        buf[2] = 0x00;              /* UID frame */
+        buf[3] = 0xEE;              /* tx power at 0 m */
+        memcpy(buf + 4, &h2, 8);    /* namespace */
+        buf[12] = (h >> 48) & 0xFF;
+        buf[13] = (h >> 56) & 0xFF;
+        memcpy(buf + 14, &i, 4);    /* instance */
+        buf[18] = buf[19] = 0;
+        buf[20] = buf[21] = 0;      /* reserved */
+        d->len += ns_vhci_ad(d->data + d->len, ESP_BLE_AD_TYPE_SERVICE_DATA, buf, 22);
+        break;
+    case NS_VHCI_MFG:
+        buf[0] = 0x59;              /* Nordic */
+        buf[1] = 0x00;
+        memcpy(buf + 2, &h2, 8);    /* the last byte changes with every report */
+        d->len += ns_vhci_ad(d->data + d->len, ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE, buf, 10);
+        d->rsp_len = ns_vhci_ad(d->rsp, ESP_BLE_AD_TYPE_NAME_CMPL, name, len);
+        break;
+    }
+}
+
+/* Devices the scan can hear now: all, or those on the accept list, and
+ * extended only advertisers only in extended scanning */
+static void ns_vhci_update_heard(struct ns_vhci *v)
+{
+    uint32_t i;
+
+    v->nheard = 0;
+    if (v->filter_policy) {
+        for (i = 0; i < v->naccept; i++) {
+            if (v->accept[i] < v->cfg.devices &&
+                (v->devs[v->accept[i]].kind != NS_VHCI_LONG || v->ext_scan)) {
+                v->heard[v->nheard++] = v->accept[i];
+            }
+        }
+        return;
+    }
+    for (i = 0; i < v->cfg.devices; i++) {
+        if (v->devs[i].kind != NS_VHCI_LONG || v->ext_scan) {
+            v->heard[v->nheard++] = i;
+        }
+    }
+}
+
+/* Device index of an accept list entry, UINT32_MAX if it is none of ours */
+static uint32_t ns_vhci_find(const struct ns_vhci *v, uint8_t bdaddr_type, const bdaddr_t *bdaddr)
+{
+    uint32_t i = bdaddr->b[0] | (bdaddr->b[1] << 8) | ((uint32_t)bdaddr->b[2] << 16);
+
+    if (i < v->cfg.devices && v->devs[i].bdaddr_type == bdaddr_type &&
+        !bacmp(&v->devs[i].bdaddr, bdaddr)) {
+        return i;
+    }
+    return UINT32_MAX;
+}
+
+static void ns_vhci_reply(struct ns_vhci *v, int fd, uint16_t opcode, const uint8_t *ret, int len)
+{
+    uint8_t buf[16];
+
+    buf[0] = HCI_EVENT_PKT;
+    buf[1] = EVT_CMD_COMPLETE;
+    buf[2] = EVT_CMD_COMPLETE_SIZE + len;
+    buf[3] = 1;                     /* Num_HCI_Command_Packets */
+    buf[4] = opcode & 0xFF;
+    buf[5] = opcode >> 8;
+    memcpy(buf + 6, ret, len);
+    while (send(fd, buf, 6 + len, MSG_NOSIGNAL) < 0 && errno == EINTR)
+        ;
+    v->stats.commands++;
+}
+
+/* Faults are timed from when scanning (re)starts */
+static void ns_vhci_arm_faults(struct ns_vhci *v, uint64_t now)
+{
+    v->stall_at = v->cfg.stall_ms ? now + v->cfg.stall_ms * 1000000ULL : 0;
+    v->wedge_at = v->cfg.wedge_ms ? now + v->cfg.wedge_ms * 1000000ULL : 0;
+}
+
+static void ns_vhci_scan_enable(struct ns_vhci *v, int enable, int ext)
+{
+    uint64_t now = ns_vhci_now_ns();
+
+    if (enable && !v->scanning) {
+        v->ext_scan = ext;
+        ns_vhci_update_heard(v);
+        if (!v->start_ns) {
+            v->start_ns = now;
+        }
+        v->pace_ns = now;
+        v->paced = 0;
+        v->stalled = 0;
+        ns_vhci_arm_faults(v, now);
+    }
+    v->scanning = enable;
+}
+
+static void ns_vhci_command(struct ns_vhci *v, int fd, const uint8_t *buf, int len)
+{
+    uint16_t opcode;
+    const uint8_t *p = buf + 1 + HCI_COMMAND_HDR_SIZE;
+    uint8_t ret[9];
+    int plen;
+
+    if (len < 1 + HCI_COMMAND_HDR_SIZE || buf[0] != HCI_COMMAND_PKT) {
+        return;
+    }
+    opcode = buf[1] | (buf[2] << 8);
+    plen = len - 1 - HCI_COMMAND_HDR_SIZE;
+    memset(ret, 0, sizeof(ret));
+
+    /* A wedged controller only listens to Reset */
+    if (v->wedged && opcode != NS_VHCI_OP_RESET) {
+        return;
+    }
+
+    switch (opcode) {
+    case NS_VHCI_OP_RESET:
+        v->scanning = 0;
+        v->ext_seen = 0;
+        v->active = 0;
+        v->filter_policy = 0;
+        v->naccept = 0;
+        v->stalled = 0;
+        v->wedged = 0;
+        break;
+    case NS_VHCI_OP_SET_EVENT_MASK:
+        break;
+    case NS_VHCI_OP(OGF_LE_CTL, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES):
+        if (v->cfg.ext) {
+            ret[1 + NS_LE_FEATURE_EXT_ADV / 8] |= 1 << (NS_LE_FEATURE_EXT_ADV % 8);
+            ret[1 + NS_LE_FEATURE_CODED_PHY / 8] |= 1 << (NS_LE_FEATURE_CODED_PHY % 8);
+        }
+        ns_vhci_reply(v, fd, opcode, ret, 9);
+        return;
+    case NS_VHCI_OP(OGF_LE_CTL, OCF_LE_SET_EVENT_MASK):
+        break;
+    case NS_VHCI_OP(OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS):
+        if (v->ext_seen) {
+            ret[0] = NS_HCI_COMMAND_DISALLOWED;
+        } else if (plen >= LE_SET_SCAN_PARAMETERS_CP_SIZE) {
+            v->active = p[0];
+            v->filter_policy = p[6];
+        }
+        break;
+    case NS_VHCI_OP(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE):
+        if (v->ext_seen) {
+            ret[0] = NS_HCI_COMMAND_DISALLOWED;
+        } else if (plen >= LE_SET_SCAN_ENABLE_CP_SIZE) {
+            ns_vhci_scan_enable(v, p[0], 0);
+        }
+        break;
+    case NS_VHCI_OP(OGF_LE_CTL, NS_OCF_LE_SET_EXT_SCAN_PARAMETERS):
+        if (!v->cfg.ext) {
+            ret[0] = NS_HCI_UNKNOWN_COMMAND;
+        } else if (plen >= NS_LE_SET_EXT_SCAN_PARAMETERS_CP_SIZE(1)) {
+            v->ext_seen = 1;
+            v->filter_policy = p[1];
+            v->active = p[3];
+        }
+        break;
+    case NS_VHCI_OP(OGF_LE_CTL, NS_OCF_LE_SET_EXT_SCAN_ENABLE):
+        if (!v->cfg.ext) {
+            ret[0] = NS_HCI_UNKNOWN_COMMAND;
+        } else if (plen >= NS_LE_SET_EXT_SCAN_ENABLE_CP_SIZE) {
+            v->ext_seen = 1;
+            ns_vhci_scan_enable(v, p[0], 1);
+        }
+        break;
+    case NS_VHCI_OP(OGF_LE_CTL, OCF_LE_READ_WHITE_LIST_SIZE):
+        ret[1] = NS_VHCI_ACCEPT_MAX;
+        ns_vhci_reply(v, fd, opcode, ret, 2);
+        return;
+    case NS_VHCI_OP(OGF_LE_CTL, OCF_LE_CLEAR_WHITE_LIST):
+        v->naccept = 0;
+        break;
+    case NS_VHCI_OP(OGF_LE_CTL, OCF_LE_ADD_DEVICE_TO_WHITE_LIST):
+        if (v->naccept == NS_VHCI_ACCEPT_MAX) {
+            ret[0] = NS_HCI_MEMORY_FULL;
+        } else if (plen >= LE_ADD_DEVICE_TO_WHITE_LIST_CP_SIZE) {
+            v->accept[v->naccept++] = ns_vhci_find(v, p[0], (const bdaddr_t *)(p + 1));
+        }
+        break;
+    default:
+        ret[0] = NS_HCI_UNKNOWN_COMMAND;
+        break;
+    }
+    ns_vhci_reply(v, fd, opcode, ret, 1);
+
+    /* The list only changes while scanning is off, but be safe */
+    if (v->scanning) {
+        ns_vhci_update_heard(v);
+    }
+}
+
+static struct ns_vhci_event *ns_vhci_begin(struct ns_vhci *v, uint8_t subevent)
+{
+    struct ns_vhci_event *e = &v->events[v->nevents++];
+
+    e->buf[0] = HCI_EVENT_PKT;
+    e->buf[1] = EVT_LE_META_EVENT;
+    e->buf[3] = subevent;
+    e->buf[4] = 0;
+    e->len = 5;
+    e->reports = 0;
+    return e;
+}
+
+static void ns_vhci_end(struct ns_vhci_event *e)
+{
+    e->buf[2] = e->len - 1 - HCI_EVENT_HDR_SIZE;
+    e->buf[4] = e->reports;
+}
+
+/* Append a report to the open event, or to a new one when it is full */
+static void ns_vhci_put(struct ns_vhci *v, struct ns_vhci_event **cur, const struct ns_vhci_dev *d,
+                        uint16_t ext_evt, uint8_t evt, const uint8_t *data, uint8_t len)
+{
+    int ext = v->ext_scan;
+    int need = (ext ? NS_LE_EXT_ADVERTISING_INFO_SIZE : LE_ADVERTISING_INFO_SIZE + 1) + len;
+    int8_t rssi = (int8_t)(d->rssi + (int)(ns_vhci_rand(v) % 9) - 4);
+    struct ns_vhci_event *e = *cur;
+    ns_le_ext_advertising_info *ei;
+    le_advertising_info *li;
+
+    if (e && (e->reports == v->cfg.per_event || e->len + need > 3 + 255)) {
+        ns_vhci_end(e);
+        e = NULL;
+    }
+    if (!e) {
+        e = ns_vhci_begin(v, ext ? NS_EVT_LE_EXT_ADVERTISING_REPORT : EVT_LE_ADVERTISING_REPORT);
+    }
+
+    if (ext) {
+        ei = (ns_le_ext_advertising_info *)(e->buf + e->len);
+        memset(ei, 0, NS_LE_EXT_ADVERTISING_INFO_SIZE);
+        ei->evt_type = htobs(ext_evt);
+        ei->bdaddr_type = d->bdaddr_type;
+        bacpy(&ei->bdaddr, &d->bdaddr);
+        ei->primary_phy = 0x01;
+        ei->secondary_phy = ext_evt & NS_EXT_EVT_LEGACY ? 0x00 : 0x01;
+        ei->sid = ext_evt & NS_EXT_EVT_LEGACY ? NS_ADV_SID_NONE : d->bdaddr.b[0] & 0x0F;
+        ei->tx_power = NS_ADV_TX_POWER_NONE;
+        ei->rssi = rssi;
+        ei->length = len;
+        memcpy(ei->data, data, len);
+    } else {
+        li = (le_advertising_info *)(e->buf + e->len);
+        li->evt_type = evt;
+        li->bdaddr_type = d->bdaddr_type;
+        bacpy(&li->bdaddr, &d->bdaddr);
+        li->length = len;
+        memcpy(li->data, data, len);
+        li->data[len] = (uint8_t)rssi;
+    }
+    e->len += need;
+    e->reports++;
+    v->generated++;
+    *cur = e;
+}
+
+/* Fill the free event slots with up to budget reports */
+static void ns_vhci_fill(struct ns_vhci *v, uint64_t budget)
+{
+    struct ns_vhci_event *cur = NULL;
+    const struct ns_vhci_dev *d;
+    uint8_t data[NS_VHCI_LONG_FRAG];
+    uint32_t i;
+    int connectable;
+
+    while (budget && v->nevents + 2 <= NS_VHCI_BURST) {
+        i = v->heard[ns_vhci_rand(v) % v->nheard];
+        d = &v->devs[i];
+
+        if (d->kind == NS_VHCI_LONG) {
+            /* Two fragments, each in an event of its own */
+            if (cur) {
+                ns_vhci_end(cur);
+                cur = NULL;
+            }
+            memcpy(data, v->long_data, NS_VHCI_LONG_FRAG);
+            memcpy(data + 4, &i, 3);
+            ns_vhci_put(v, &cur, d, NS_EXT_STATUS_MORE << 5, 0, data, NS_VHCI_LONG_FRAG);
+            ns_vhci_end(cur);
+            cur = NULL;
+            ns_vhci_put(v, &cur, d, NS_EXT_STATUS_COMPLETE << 5, 0,
+                        v->long_data + NS_VHCI_LONG_FRAG, NS_VHCI_LONG_LEN - NS_VHCI_LONG_FRAG);
+            ns_vhci_end(cur);
+            cur = NULL;
+            budget = budget > 2 ? budget - 2 : 0;
+            continue;
+        }
+
+        connectable = d->kind == NS_VHCI_NAME || d->kind == NS_VHCI_UUID128 || d->kind == NS_VHCI_MFG;
+        memcpy(data, d->data, d->len);
+        if (d->kind == NS_VHCI_MFG) {
+            data[d->len - 1] = (uint8_t)ns_vhci_rand(v);
+        }
+        ns_vhci_put(v, &cur, d,
+                    connectable ? NS_EXT_EVT_LEGACY | NS_ADV_PROP_CONNECTABLE | NS_ADV_PROP_SCANNABLE : NS_EXT_EVT_LEGACY,
+                    connectable ? 0x00 : 0x03, data, d->len);
+        budget--;
+        if (v->active && d->rsp_len) {
+            ns_vhci_put(v, &cur, d,
+                        NS_EXT_EVT_LEGACY | NS_ADV_PROP_SCAN_RSP | NS_ADV_PROP_CONNECTABLE | NS_ADV_PROP_SCANNABLE,
+                        NS_ADV_EVT_SCAN_RSP, d->rsp, d->rsp_len);
+            budget = budget ? budget - 1 : 0;
+        }
+        /* A new event may have been opened for the scan response */
+        if (v->nevents + 2 > NS_VHCI_BURST) {
+            break;
+        }
+    }
+    if (cur) {
+        ns_vhci_end(cur);
+    }
+}
+
+/* Hand the pending events to the host. Returns 0 once they are all out
+ * or dropped, 1 if the socket is full and they wait for it. */
+static int ns_vhci_flush(struct ns_vhci *v)
+{
+    struct mmsghdr msgs[NS_VHCI_BURST];
+    struct iovec iov[NS_VHCI_BURST];
+    uint32_t first = v->sent;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < v->nevents - first; i++) {
+        iov[i].iov_base = v->events[first + i].buf;
+        iov[i].iov_len = v->events[first + i].len;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (v->sent < v->nevents) {
+        ret = sendmmsg(v->fds[0], msgs + (v->sent - first), v->nevents - v->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                /* The host is gone */
+                v->hung_up = 1;
+            } else if (!v->cfg.rate) {
+                return 1;
+            }
+            for (i = v->sent; i < v->nevents; i++) {
+                v->stats.dropped += v->events[i].reports;
+            }
+            break;
+        }
+        for (i = v->sent; i < v->sent + (uint32_t)ret; i++) {
+            v->stats.events++;
+            v->stats.reports += v->events[i].reports;
+        }
+        v->sent += ret;
+    }
+    v->nevents = 0;
+    v->sent = 0;
+    return 0;
+}
+
+static void ns_vhci_hang_up(struct ns_vhci *v)
+{
+    shutdown(v->fds[0], SHUT_WR);
+    v->hung_up = 1;
+    v->scanning = 0;
+    v->stats.elapsed_ns = ns_vhci_now_ns() - v->start_ns;
+}
+
+static void *ns_vhci_thread(void *arg)
+{
+    struct ns_vhci *v = arg;
+    struct pollfd pfds[NS_VHCI_CONNS_MAX];
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    uint64_t now, due, budget, next;
+    int blocked = 0;
+    int timeout;
+    int n, i, len;
+
+    while (!atomic_load(&v->stop)) {
+        n = atomic_load(&v->nconns);
+        timeout = NS_VHCI_IDLE_MS;
+        budget = 0;
+        now = ns_vhci_now_ns();
+
+        if (v->scanning && !v->stalled && !v->wedged) {
+            if (v->stall_at && now >= v->stall_at) {
+                v->stalled = 1;
+                v->stats.faults++;
+            } else if (v->wedge_at && now >= v->wedge_at) {
+                v->wedged = 1;
+                v->stats.faults++;
+            }
+        }
+
+        /* Time runs out even with nothing to report */
+        if (v->scanning && !v->hung_up &&
+            ((v->cfg.count && v->generated >= v->cfg.count) ||
+             (v->cfg.seconds && now - v->start_ns >= v->cfg.seconds * 1000000000ULL))) {
+            ns_vhci_hang_up(v);
+            continue;
+        }
+
+        if (v->scanning && !v->stalled && !v->wedged && !v->hung_up && v->nheard && !blocked) {
+            if (!v->cfg.rate) {
+                budget = (uint64_t)NS_VHCI_BURST * v->cfg.per_event;
+            } else {
+                due = (now - v->pace_ns) * v->cfg.rate / 1000000000ULL;
+                if (due > v->paced) {
+                    budget = due - v->paced;
+                } else {
+                    next = v->pace_ns + (v->paced + 1) * 1000000000ULL / v->cfg.rate;
+                    timeout = (int)((next - now + 999999) / 1000000);
+                    if (timeout > NS_VHCI_IDLE_MS) {
+                        timeout = NS_VHCI_IDLE_MS;
+                    }
+                }
+            }
+            if (v->cfg.count && budget > v->cfg.count - v->generated) {
+                budget = v->cfg.count - v->generated;
+            }
+            if (budget) {
+                timeout = 0;
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            pfds[i].fd = v->fds[i];
+            pfds[i].events = POLLIN;
+        }
+        if (blocked) {
+            pfds[0].events |= POLLOUT;
+            timeout = NS_VHCI_IDLE_MS;
+        }
+        if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            len = recv(v->fds[i], buf, sizeof(buf), MSG_DONTWAIT);
+            if (len > 0) {
+                ns_vhci_command(v, v->fds[i], buf, len);
+            }
+        }
+
+        if (blocked) {
+            if (pfds[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                blocked = ns_vhci_flush(v);
+            }
+            continue;
+        }
+        if (budget && v->scanning && !v->hung_up) {
+            uint64_t before = v->generated;
+
+            ns_vhci_fill(v, budget);
+            v->paced += v->generated - before;
+            blocked = ns_vhci_flush(v);
+        }
+    }
+
+    if (v->start_ns && !v->stats.elapsed_ns) {
+        v->stats.elapsed_ns = ns_vhci_now_ns() - v->start_ns;
+    }
+    return NULL;
+}
+
+int ns_vhci_open(struct ns_vhci *v, const struct ns_vhci_cfg *cfg, int adapter)
+{
+    uint32_t total = 0;
+    uint32_t i;
+    int k;
+
+    memset(v, 0, sizeof(*v));
+    v->cfg = *cfg;
+    for (k = 0; k < NS_VHCI_KINDS; k++) {
+        total += cfg->weights[k];
+    }
+    v->devs = malloc((size_t)cfg->devices * sizeof(*v->devs));
+    v->heard = malloc((size_t)cfg->devices * sizeof(*v->heard));
+    v->events = malloc(NS_VHCI_BURST * sizeof(*v->events));
+    if (!v->devs || !v->heard || !v->events || !total) {
+        free(v->devs);
+        free(v->heard);
+        free(v->events);
+        errno = total ? ENOMEM : EINVAL;
+        return -1;
+    }
+    for (i = 0; i < cfg->devices; i++) {
+        ns_vhci_build_dev(v, i, total);
+    }
+
+    /* Two manufacturer data structures, 256 + 44 bytes */
+    v->long_data[0] = 0xFF;
+    v->long_data[1] = ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE;
+    v->long_data[256] = NS_VHCI_LONG_LEN - 256 - 1;
+    v->long_data[257] = ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE;
+    for (i = 2; i < NS_VHCI_LONG_LEN; i++) {
+        if (i != 256 && i != 257) {
+            v->long_data[i] = (uint8_t)(i * 7);
+        }
+    }
+    v->long_data[2] = v->long_data[258] = 0x59;
+    v->long_data[3] = v->long_data[259] = 0x00;
+
+    v->rng = ns_vhci_mix64(((uint64_t)cfg->seed << 8) | (uint64_t)adapter) | 1;
+    return 0;
+}
+
+int ns_vhci_connect(struct ns_vhci *v)
+{
+    int n = atomic_load(&v->nconns);
+    int sv[2];
+
+    if (n == NS_VHCI_CONNS_MAX) {
+        errno = EMFILE;
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        return -1;
+    }
+    v->fds[n] = sv[0];
+    atomic_store(&v->nconns, n + 1);
+
+    if (!v->running) {
+        if (pthread_create(&v->thread, NULL, ns_vhci_thread, v) != 0) {
+            close(sv[0]);
+            close(sv[1]);
+            atomic_store(&v->nconns, n);
+            errno = EAGAIN;
+            return -1;
+        }
+        v->running = 1;
+    }
+    return sv[1];
+}
+
+void ns_vhci_close(struct ns_vhci *v, struct ns_vhci_stats *stats)
+{
+    int i;
+
+    if (v->running) {
+        atomic_store(&v->stop, 1);
+        pthread_join(v->thread, NULL);
+        v->running = 0;
+    }
+    if (stats) {
+        *stats = v->stats;
+    }
+    for (i = 0; i < atomic_load(&v->nconns); i++) {
+        close(v->fds[i]);
+    }
+    atomic_store(&v->nconns, 0);
+    free(v->devs);
+    free(v->heard);
+    free(v->events);
+    v->devs = NULL;
+    v->heard = NULL;
+    v->events = NULL;
+}
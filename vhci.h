@@ -0,0 +1,153 @@
+#ifndef __NS_VHCI_H__
+#define __NS_VHCI_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+
+/* Virtual HCI controller for load tests without a radio.
+ *
+ * A thread plays the controller on one end of SOCK_SEQPACKET socket
+ * pairs; the scanner gets the other ends in place of raw HCI sockets,
+ * so every packet keeps its boundaries just as on hci_open_dev()'s
+ * socket and the whole path from setup through the read loops to the
+ * output runs unchanged. /dev/vhci would need root and a controller that
+ * survives the kernel's full initialization; this needs neither.
+ *
+ * The controller answers the commands the scanner sends with Command
+ * Complete: LE Read Local Supported Features (extended advertising and
+ * the Coded PHY with ext), the legacy and extended scan parameters and
+ * enables, LE Set Event Mask, Reset and an accept list of
+ * NS_VHCI_ACCEPT_MAX entries that the scan filter policy honors. Like a
+ * real controller it refuses the legacy scan commands once it saw the
+ * extended ones. Anything else completes with Unknown HCI Command.
+ *
+ * While scanning is enabled it injects LE Meta advertising reports from
+ * a population of devices, each with a fixed address and payload of
+ * one of the NS_VHCI_* kinds, picked by weight. Reports are packed into
+ * events of up to per_event reports, legacy or extended reports as the
+ * scan was enabled; in active scanning a scannable device's report is
+ * followed by its scan response. Reports go to the first connection,
+ * command responses to the connection that sent the command.
+ *
+ * With a rate, reports are spread evenly and those that do not fit the
+ * socket buffer are dropped, as the kernel drops for a host that falls
+ * behind. Rate 0 sends as fast as the host reads, which measures the
+ * scanner's throughput. After count reports or seconds the controller
+ * hangs up the first connection and the scanner's read loop ends.
+ *
+ * Two faults can be injected to exercise the scanner's recovery, timed
+ * from every (re)start of scanning: a stall silently stops the reports
+ * until scanning is enabled again, a wedged controller also ignores
+ * every command but Reset. */
+
+#define NS_VHCI_DEVICES_DEFAULT     1000
+#define NS_VHCI_DEVICES_MAX         (1 << 24)   /* index kept in the address */
+#define NS_VHCI_RATE_DEFAULT        10000       /* reports per second */
+#define NS_VHCI_PER_EVENT_DEFAULT   1
+#define NS_VHCI_ACCEPT_MAX          32
+#define NS_VHCI_CONNS_MAX           4
+#define NS_VHCI_BURST               32          /* events per sendmmsg */
+
+enum ns_vhci_kind {
+    NS_VHCI_FLAGS,          /* flags only, non-connectable */
+    NS_VHCI_NAME,           /* complete local name, scan response with tx power */
+    NS_VHCI_UUID128,        /* 128-bit service UUID, name in the scan response */
+    NS_VHCI_IBEACON,
+    NS_VHCI_EDDYSTONE,      /* Eddystone-UID */
+    NS_VHCI_MFG,            /* manufacturer data with a changing byte, name in the scan response */
+    NS_VHCI_LONG,           /* 300 bytes of manufacturer data in two fragments, extended scanning only */
+    NS_VHCI_KINDS,
+};
+
+struct ns_vhci_cfg {
+    uint32_t devices;
+    uint32_t rate;                      /* reports per second, 0 = as fast as the host reads */
+    uint32_t per_event;                 /* reports per LE Meta event, at most */
+    uint32_t weights[NS_VHCI_KINDS];    /* payload mix */
+    uint64_t count;                     /* reports before hanging up, 0 = no limit */
+    uint32_t seconds;                   /* scanning time before hanging up, 0 = no limit */
+    int ext;                            /* claim extended advertising */
+    uint32_t seed;
+    uint32_t stall_ms;                  /* reports stop this long after scanning starts, 0 = never */
+    uint32_t wedge_ms;                  /* commands and reports stop until a Reset, 0 = never */
+};
+
+struct ns_vhci_dev {
+    bdaddr_t bdaddr;
+    uint8_t bdaddr_type;
+    uint8_t kind;
+    int8_t rssi;                        /* average, reports scatter around it */
+    uint8_t len;
+    uint8_t rsp_len;                    /* scan response, 0 = not scannable */
+    uint8_t data[31];
+    uint8_t rsp[31];
+};
+
+struct ns_vhci_stats {
+    uint64_t commands;
+    uint64_t events;
+    uint64_t reports;                   /* including scan responses */
+    uint64_t dropped;                   /* reports that did not fit the socket */
+    uint64_t faults;                    /* stalls and wedges injected */
+    uint64_t elapsed_ns;                /* from the first scan enable */
+};
+
+struct ns_vhci_event;
+
+struct ns_vhci {
+    struct ns_vhci_cfg cfg;
+    struct ns_vhci_dev *devs;
+    uint32_t *heard;                    /* devices the scan can report */
+    uint32_t nheard;
+    uint8_t long_data[300];
+    int fds[NS_VHCI_CONNS_MAX];         /* controller ends */
+    _Atomic int nconns;
+    atomic_int stop;
+    int hung_up;
+    pthread_t thread;
+    int running;
+    /* controller state, owned by the thread */
+    int scanning;
+    int ext_scan;                       /* enabled with the extended command */
+    int ext_seen;
+    int active;
+    int stalled;                        /* until scanning is enabled again */
+    int wedged;                         /* until Reset */
+    uint64_t stall_at;
+    uint64_t wedge_at;
+    uint8_t filter_policy;
+    uint32_t accept[NS_VHCI_ACCEPT_MAX];
+    uint32_t naccept;
+    uint64_t rng;
+    uint64_t start_ns;
+    uint64_t pace_ns;                   /* rate counted from here, reset when scanning resumes */
+    uint64_t paced;                     /* reports since pace_ns */
+    uint64_t generated;
+    struct ns_vhci_event *events;       /* NS_VHCI_BURST, waiting for the socket */
+    uint32_t nevents;
+    uint32_t sent;
+    struct ns_vhci_stats stats;
+};
+
+/* Parse "key=value,..." with keys devices, rate, per, count, time, ext,
+ * seed, stall, wedge (ms) and mix=<kind>:<weight>/... (kinds flags,
+ * name, uuid128, ibeacon, eddystone, mfg, long) into cfg, which starts
+ * out with the defaults.
+ * Returns 0, or -1 with a message in err. */
+int ns_vhci_parse(struct ns_vhci_cfg *cfg, const char *spec, char *err, size_t err_len);
+
+/* Build the population and start the controller thread. adapter varies
+ * the report stream, the population only depends on the seed, so
+ * several controllers hear the same devices. Returns 0, or -1 with errno set. */
+int ns_vhci_open(struct ns_vhci *v, const struct ns_vhci_cfg *cfg, int adapter);
+
+/* A new host socket, the first one receives the reports. Returns the
+ * socket, or -1 with errno set. */
+int ns_vhci_connect(struct ns_vhci *v);
+
+/* Stop the thread and close the controller ends, stats may be NULL */
+void ns_vhci_close(struct ns_vhci *v, struct ns_vhci_stats *stats);
+
+#endif //__NS_VHCI_H__